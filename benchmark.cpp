@@ -1,7 +1,24 @@
+#include <chrono>
+#include <memory>
 #include <random>
 #include <ctime>
+#include <thread>
+#include <vector>
 
+#include "grid_evaluation.h"
+#include "large_exponent_array.h"
+#include "vandermonde_batch.h"
 #include "vandermonde_det.h"
+#include "vandermonde_det_small.h"
+#include "vandermonde_parallel.h"
+#include "metropolis.h"
+#include "mixed_ensemble.h"
+#include "one_body_weight.h"
+#include "pair_factor.h"
+#include "particle_set.h"
+#include "perf_counters.h"
+#include "random_proposals.h"
+#include "thread_pool.h"
 
 using namespace std;
 
@@ -15,6 +32,9 @@ void init_random_positions(const long int N, const double a, const double b, dou
   }
 }
 
+// set by the perf mode, the stopwatches then also count hardware events
+static bool count_events = false;
+
 class stopwatch {
 private:
     std::clock_t c_equil = std::clock();
@@ -23,9 +43,18 @@ private:
     double time_total=0;
     bool running=false;
     const double inv_cps=(double)1 / (double)CLOCKS_PER_SEC;
+    std::unique_ptr<PerfCounters> counters;
 public:
-    stopwatch() { reset(); }
+    stopwatch() {
+      if (count_events) {
+        counters.reset(new PerfCounters());
+      }
+      reset();
+    }
     void reset() {
+      if (counters) {
+        counters->reset();
+      }
       running=false;
       time_total=0;
       time_lap=0;
@@ -35,12 +64,18 @@ public:
       if (~running) {
         running=true;
         time_start=(double)std::clock();
+        if (counters) {
+          counters->start();
+        }
       }
       return;
     }
     void stop() {
       if (running) {
         running=false;
+        if (counters) {
+          counters->stop();
+        }
         double time_stop=(double)std::clock();
         time_total+=(time_stop-time_start)*inv_cps;
       }
@@ -61,24 +96,801 @@ public:
     double get_lap() {    // gives running time since last call of lap
       return get_time()-time_lap;
     }
+    std::string events(double elements) { // gives the hardware event rates per element in perf mode
+      return counters ? counters->report(elements) : "";
+    }
 };
 
+// Compares the per call latency of the generic and the compile time sized kernels for a small number of particles.
+template<long int N>
+void benchmark_small_kernels(const long int calls) {
+  constexpr int U_VALUES = 1024;
+  double* x = new_double_array(N);
+  double* y = new_double_array(N);
+  double u[U_VALUES];
+  init_random_positions(N,-1,1,x);
+  init_random_positions(N,-1,1,y);
+  init_random_positions(U_VALUES,-1,1,u);
+
+  stopwatch timing;
+  LargeExponentFloat prod(1.0);
+  LargeExponentFloat prod0(1.0);
+  timing.start();
+  for (long int i = 0; i < calls; i++) {
+    prod_diff_realrealvec(N, i % N, u[i % U_VALUES], u[(i + 1) % U_VALUES], x, prod, prod0);
+  }
+  timing.stop();
+  cout << "prod_diff_realrealvec(N=" << N << "): exponent=" << prod.exponent - prod0.exponent
+       << " time per call=" << timing.get_time() / calls * 1e9 << " ns" << timing.events(double(calls) * N) << "\n";
+
+  timing.reset();
+  prod = prod0 = LargeExponentFloat(1.0);
+  timing.start();
+  for (long int i = 0; i < calls; i++) {
+    prod_diff_realrealvec<N>(i % N, u[i % U_VALUES], u[(i + 1) % U_VALUES], x, prod, prod0);
+  }
+  timing.stop();
+  cout << "prod_diff_realrealvec<" << N << ">: exponent=" << prod.exponent - prod0.exponent
+       << " time per call=" << timing.get_time() / calls * 1e9 << " ns" << timing.events(double(calls) * N) << "\n";
+
+  timing.reset();
+  prod = prod0 = LargeExponentFloat(1.0);
+  timing.start();
+  for (long int i = 0; i < calls; i++) {
+    prod_dist2_complexcomplexvec(N, i % N, u[i % U_VALUES], u[(i + 1) % U_VALUES], u[(i + 2) % U_VALUES],
+                                 u[(i + 3) % U_VALUES], x, y, prod, prod0);
+  }
+  timing.stop();
+  cout << "prod_dist2_complexcomplexvec(N=" << N << "): exponent=" << prod.exponent - prod0.exponent
+       << " time per call=" << timing.get_time() / calls * 1e9 << " ns" << timing.events(double(calls) * N) << "\n";
+
+  timing.reset();
+  prod = prod0 = LargeExponentFloat(1.0);
+  timing.start();
+  for (long int i = 0; i < calls; i++) {
+    prod_dist2_complexcomplexvec<N>(i % N, u[i % U_VALUES], u[(i + 1) % U_VALUES], u[(i + 2) % U_VALUES],
+                                    u[(i + 3) % U_VALUES], x, y, prod, prod0);
+  }
+  timing.stop();
+  cout << "prod_dist2_complexcomplexvec<" << N << ">: exponent=" << prod.exponent - prod0.exponent
+       << " time per call=" << timing.get_time() / calls * 1e9 << " ns" << timing.events(double(calls) * N) << "\n";
+
+  _mm_free(x);
+  _mm_free(y);
+}
+
+// Compares the normalization with frexp/ldexp (normalize_exponent, save_mul) with the bit manipulation versions and
+// measures the other LargeExponentFloat operations.
+void benchmark_large_exponent_float(const long int calls) {
+  constexpr int VALUES = 1024;
+  std::vector<LargeExponentFloat> values;
+  for (int i = 0; i < VALUES; i++) {
+    values.emplace_back((distu(gen) * 2 - 1) * std::exp2(distu(gen) * 1000 - 500), long(distu(gen) * 1e6));
+  }
+
+  auto run = [&](const char* name, auto operation) {
+    double checksum = 0;
+    stopwatch timing;
+    timing.start();
+    for (long int i = 0; i < calls; i++) {
+      checksum += operation(values[i % VALUES], values[(i + 1) % VALUES]);
+    }
+    timing.stop();
+    cout << "LargeExponentFloat " << name << ": checksum=" << checksum << " time per call="
+         << timing.get_time() / calls * 1e9 << " ns" << timing.events(calls) << "\n";
+  };
+  run("normalize_exponent", [](const LargeExponentFloat& a, const LargeExponentFloat&) {
+    return a.normalized().exponent;
+  });
+  run("normalize_exponent_fast", [](const LargeExponentFloat& a, const LargeExponentFloat&) {
+    return a.normalized_fast().exponent;
+  });
+  run("save_mul", [](const LargeExponentFloat& a, const LargeExponentFloat& b) {
+    return save_mul(a, b).exponent;
+  });
+  run("operator*", [](const LargeExponentFloat& a, const LargeExponentFloat& b) {
+    return (a * b).exponent;
+  });
+  run("operator/", [](const LargeExponentFloat& a, const LargeExponentFloat& b) {
+    return (a / b).exponent;
+  });
+  run("log2", [](const LargeExponentFloat& a, const LargeExponentFloat&) {
+    return log2(a);
+  });
+  run("pow", [](const LargeExponentFloat& a, const LargeExponentFloat&) {
+    return pow(a, 1.7).exponent;
+  });
+  run("compare", [](const LargeExponentFloat& a, const LargeExponentFloat& b) {
+    return compare(a, b);
+  });
+
+  // log acceptance ratio of a conjugate pair move in the real Ginibre ensemble from the products of the kernel, with
+  // scalar libm calls and with the fused vector evaluation
+  const RealGinibreComplexWeight weight{30.0};
+  auto position = [](const LargeExponentFloat& a) { return (std::abs(a.exponent) % 1000) * 1e-4; };
+  run("log ratio with one-body weight (libm)", [&](const LargeExponentFloat& a, const LargeExponentFloat& b) {
+    const double u = position(a), v = position(b);
+    auto log_weight = [&](double x, double y) {
+      return weight.scale * weight.scale * (y * y - x * x) + std::log(std::erfc(M_SQRT2 * weight.scale * y));
+    };
+    return std::log(std::abs(a.significand)) - std::log(std::abs(b.significand)) + M_LN2 * (a.exponent - b.exponent)
+           + log_weight(u, v) - log_weight(v, u);
+  });
+  run("log ratio with one-body weight (fused)", [&](const LargeExponentFloat& a, const LargeExponentFloat& b) {
+    const double u = position(a), v = position(b);
+    return log_acceptance_ratio(a, b, 1.0, u, v, v, u, weight);
+  });
+}
+
+// Runs M sweeps of N single particle Metropolis moves (beta=2) with the full and the early rejection test on spatially
+// sorted particles. The trajectories are identical as both tests give the same decisions.
+void benchmark_metropolis(const long int M, const long int N, const double* x0, const double* y0, const bool complex) {
+  double* x = new_double_array(N);
+  double* y = new_double_array(N);
+  for (int early = 0; early < 2; early++) {
+    std::copy(x0, x0 + N, x);
+    std::copy(y0, y0 + N, y);
+    spatial_sort(N, x, complex ? y : nullptr);
+    BlockBounds bounds(N, x, complex ? y : nullptr);
+
+    std::mt19937_64 move_gen(1);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    // steps of the order of the particle spacing
+    std::normal_distribution<double> step(0.0, complex ? 1.0 / std::sqrt(N) : 1.0 / N);
+    long int accepted = 0;
+    long int elements_processed = 0;
+
+    stopwatch timing;
+    timing.start();
+    for (long int i = 0; i < M * N; i++) {
+      const long int k = move_gen() % N;
+      const double u = x[k] + step(move_gen);
+      const double v = complex ? y[k] + step(move_gen) : 0.0;
+      const double log_uniform = std::log(uniform(move_gen));
+      long int processed = N;
+      bool accept;
+      if (complex) {
+        accept = early ? metropolis_accept_early_complexvec(N, k, u, v, 2.0, log_uniform, x, y, bounds, processed)
+                       : metropolis_accept_complexvec(N, k, u, v, 2.0, log_uniform, x, y);
+      } else {
+        accept = early ? metropolis_accept_early_realvec(N, k, u, 2.0, log_uniform, x, bounds, processed)
+                       : metropolis_accept_realvec(N, k, u, 2.0, log_uniform, x);
+      }
+      elements_processed += processed;
+      if (accept) {
+        accepted++;
+        x[k] = u;
+        y[k] = v;
+        bounds.update(k, x, complex ? y : nullptr);
+      }
+    }
+    timing.stop();
+    cout << "metropolis_accept" << (early ? "_early" : "")
+         << (complex ? "_complexvec" : "_realvec") << ": acceptance=" << double(accepted) / (M * N)
+         << " elements touched=" << double(elements_processed) / (M * N) / N << " timing=" << timing.get_time()
+         << " seconds" << timing.events(elements_processed) << "\n";
+  }
+  _mm_free(x);
+  _mm_free(y);
+}
+
+// Runs M sweeps of N complex single particle Metropolis moves (beta=2) with the full test and the single precision
+// screening pass for two step sizes, and reports how often the screening pass could not decide.
+void benchmark_metropolis_cascade(const long int M, const long int N, const double* x0, const double* y0) {
+  double* x = new_double_array(N);
+  double* y = new_double_array(N);
+  for (double step_size : {0.5, 2.0}) {
+    for (int cascade = 0; cascade < 2; cascade++) {
+      std::copy(x0, x0 + N, x);
+      std::copy(y0, y0 + N, y);
+      FloatPositions float_positions(N, x, y);
+
+      std::mt19937_64 move_gen(1);
+      std::uniform_real_distribution<double> uniform(0.0, 1.0);
+      std::normal_distribution<double> step(0.0, step_size / std::sqrt(N));
+      long int accepted = 0;
+      long int exact_evaluations = 0;
+
+      stopwatch timing;
+      timing.start();
+      for (long int i = 0; i < M * N; i++) {
+        const long int k = move_gen() % N;
+        const double u = x[k] + step(move_gen);
+        const double v = y[k] + step(move_gen);
+        const double log_uniform = std::log(uniform(move_gen));
+        bool exact_evaluation = true;
+        const bool accept = cascade
+                ? metropolis_accept_cascade_complexvec(N, k, u, v, 2.0, log_uniform, x, y, float_positions,
+                                                       exact_evaluation)
+                : metropolis_accept_complexvec(N, k, u, v, 2.0, log_uniform, x, y);
+        exact_evaluations += exact_evaluation;
+        if (accept) {
+          accepted++;
+          x[k] = u;
+          y[k] = v;
+          float_positions.update(k, x, y);
+        }
+      }
+      timing.stop();
+      cout << (cascade ? "metropolis_accept_cascade_complexvec" : "metropolis_accept_complexvec") << ": acceptance="
+           << double(accepted) / (M * N) << " exact evaluations=" << double(exact_evaluations) / (M * N)
+           << " timing=" << timing.get_time() << " seconds" << timing.events(double(M) * N * N) << "\n";
+    }
+  }
+  _mm_free(x);
+  _mm_free(y);
+}
+
+// Generates M*N complex single particle proposals with mt19937_64 and with ProposalPipeline (with and without the
+// background thread), and runs M sweeps of N complex Metropolis moves (beta=2) with both sources of proposals.
+void benchmark_proposals(const long int M, const long int N, const double* x0, const double* y0) {
+  const double step_size = 1.0 / std::sqrt(N);
+  for (int source = 0; source < 3; source++) {
+    double checksum = 0;
+    stopwatch timing;
+    timing.start();
+    if (source == 0) {
+      std::mt19937_64 move_gen(1);
+      std::uniform_real_distribution<double> uniform(0.0, 1.0);
+      std::uniform_real_distribution<double> step(-step_size, step_size);
+      for (long int i = 0; i < M * N; i++) {
+        const long int k = move_gen() % N;
+        const double du = step(move_gen);
+        const double dv = step(move_gen);
+        const double log_uniform = std::log(uniform(move_gen));
+        checksum += k + du + dv + log_uniform;
+      }
+    } else {
+      ProposalPipeline proposals(N, step_size, 1, 0, 4096, source == 2);
+      for (long int i = 0; i < M * N; ) {
+        const ProposalBlock& block = proposals.next();
+        for (long int j = 0; j < block.size && i < M * N; j++, i++) {
+          checksum += block.k[j] + block.du[j] + block.dv[j] + block.log_uniform[j];
+        }
+      }
+    }
+    timing.stop();
+    cout << (source == 0 ? "proposals mt19937_64" : source == 1 ? "proposals ProposalPipeline(synchronous)"
+                                                                : "proposals ProposalPipeline(background)")
+         << ": checksum=" << checksum / (M * N) << " timing=" << timing.get_time() << " seconds ("
+         << 1e9 * timing.get_time() / (M * N) << " ns/proposal)" << timing.events(M * N) << "\n";
+  }
+
+  double* x = new_double_array(N);
+  double* y = new_double_array(N);
+  for (int pipeline = 0; pipeline < 2; pipeline++) {
+    std::copy(x0, x0 + N, x);
+    std::copy(y0, y0 + N, y);
+    std::mt19937_64 move_gen(1);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    std::uniform_real_distribution<double> step(-step_size, step_size);
+    ProposalPipeline proposals(N, step_size, 1);
+    const ProposalBlock* block = nullptr;
+    long int j = 0;
+    long int accepted = 0;
+
+    auto wall_start = std::chrono::steady_clock::now();
+    for (long int i = 0; i < M * N; i++) {
+      long int k;
+      double u, v, log_uniform;
+      if (pipeline) {
+        if (block == nullptr || j == block->size) {
+          block = &proposals.next();
+          j = 0;
+        }
+        k = block->k[j];
+        u = x[k] + block->du[j];
+        v = y[k] + block->dv[j];
+        log_uniform = block->log_uniform[j];
+        j++;
+      } else {
+        k = move_gen() % N;
+        u = x[k] + step(move_gen);
+        v = y[k] + step(move_gen);
+        log_uniform = std::log(uniform(move_gen));
+      }
+      if (metropolis_accept_complexvec(N, k, u, v, 2.0, log_uniform, x, y)) {
+        accepted++;
+        x[k] = u;
+        y[k] = v;
+      }
+    }
+    std::chrono::duration<double> wall_time = std::chrono::steady_clock::now() - wall_start;
+    cout << "metropolis_accept_complexvec with " << (pipeline ? "ProposalPipeline" : "mt19937_64")
+         << ": acceptance=" << double(accepted) / (M * N) << " wall time=" << wall_time.count() << " seconds ("
+         << 1e9 * wall_time.count() / (M * N) << " ns/proposal)\n";
+  }
+  _mm_free(x);
+  _mm_free(y);
+}
+
+// Compares prod_dist2_conjpair_complexvec on N conjugate pair representatives with prod_dist2_complexcomplexvec on the
+// 2N points of the pairs, M*N calls each.
+void benchmark_conjpair(const long int M, const long int N, const double* x, const double* y) {
+  double* y_upper = new_double_array(N);
+  double* x2 = new_double_array(2 * N);
+  double* y2 = new_double_array(2 * N);
+  for (long int j = 0; j < N; j++) {
+    y_upper[j] = std::abs(y[j]);
+    x2[2 * j] = x[j];
+    y2[2 * j] = std::abs(y[j]);
+    x2[2 * j + 1] = x[j];
+    y2[2 * j + 1] = -std::abs(y[j]);
+  }
+  for (int conjpair = 0; conjpair < 2; conjpair++) {
+    std::mt19937_64 move_gen(1);
+    std::uniform_real_distribution<double> uniform(-1.0, 1.0);
+    LargeExponentFloat prod1(1.0);
+    LargeExponentFloat prod2(1.0);
+    stopwatch timing;
+    timing.start();
+    for (long int i = 0; i < M * N; i++) {
+      const long int k = move_gen() % N;
+      const double u = uniform(move_gen);
+      const double v = std::abs(uniform(move_gen));
+      if (conjpair) {
+        prod_dist2_conjpair_complexvec(N, k, u, x[k], v, y_upper[k], x, y_upper, prod1, prod2);
+      } else {
+        prod_dist2_complexcomplexvec(2 * N, 2 * k, u, x2[2 * k], v, y2[2 * k], x2, y2, prod1, prod2);
+      }
+    }
+    timing.stop();
+    cout << (conjpair ? "prod_dist2_conjpair_complexvec(N pairs)" : "prod_dist2_complexcomplexvec(2N points)")
+         << ": prod=" << prod1.significand / prod2.significand << " exponent=" << prod1.exponent - prod2.exponent
+         << " timing=" << timing.get_time() << " seconds" << timing.events(double(M) * N * N) << "\n";
+  }
+  _mm_free(y_upper);
+  _mm_free(x2);
+  _mm_free(y2);
+}
+
+// Compares the cluster kernel for moving 4 particles at once with 4 calls of the single particle kernel, which
+// do not account for the excluded particles and the factors between the moved particles.
+void benchmark_cluster(const long int M, const long int N, const double* x, const double* y) {
+  constexpr long int CLUSTER_SIZE = 4;
+  for (int cluster = 0; cluster < 2; cluster++) {
+    std::mt19937_64 move_gen(1);
+    std::uniform_real_distribution<double> uniform(-1.0, 1.0);
+    LargeExponentFloat prod_new(1.0);
+    LargeExponentFloat prod_old(1.0);
+    stopwatch timing;
+    timing.start();
+    for (long int i = 0; i < M * N / CLUSTER_SIZE; i++) {
+      long int k[CLUSTER_SIZE];
+      double u[CLUSTER_SIZE];
+      double v[CLUSTER_SIZE];
+      // a cluster of neighbouring indices
+      const long int k0 = move_gen() % (N - CLUSTER_SIZE);
+      for (long int m = 0; m < CLUSTER_SIZE; m++) {
+        k[m] = k0 + m;
+        u[m] = uniform(move_gen);
+        v[m] = uniform(move_gen);
+      }
+      if (cluster) {
+        prod_dist2_cluster_complexvec(N, CLUSTER_SIZE, k, u, v, x, y, prod_new, prod_old);
+      } else {
+        for (long int m = 0; m < CLUSTER_SIZE; m++) {
+          prod_dist2_complexcomplexvec(N, k[m], u[m], x[k[m]], v[m], y[k[m]], x, y, prod_new, prod_old);
+        }
+      }
+    }
+    timing.stop();
+    cout << (cluster ? "prod_dist2_cluster_complexvec(4)" : "4x prod_dist2_complexcomplexvec") << ": prod="
+         << prod_new.significand / prod_old.significand << " exponent=" << prod_new.exponent - prod_old.exponent
+         << " timing=" << timing.get_time() << " seconds" << timing.events(double(M) * N * N) << "\n";
+  }
+}
+
+// Runs M sweeps of the pair factor kernel with PairFactor for the particles, positions are taken from the particles.
+template<class PairFactor>
+void benchmark_pair_factor(const char* name, const long int M, const long int N, const double* const* particles) {
+  constexpr int C = PairFactor::COORDINATES;
+  LargeExponentFloat prod1(1.0);
+  LargeExponentFloat prod2(1.0);
+  stopwatch timing;
+  timing.start();
+  for (long int i = 0; i < M; i++) {
+    for (long int k = 0; k < N; k++) {
+      double position1[C];
+      double position2[C];
+      for (int c = 0; c < C; c++) {
+        position1[c] = particles[c][(k + 1) % N];
+        position2[c] = particles[c][k];
+      }
+      prod_pair_factor_vec<PairFactor>(N, k, position1, position2, particles, prod1, prod2);
+    }
+  }
+  timing.stop();
+  cout << "prod_pair_factor_vec<" << name << ">: prod=" << prod1.significand / prod2.significand << " exponent="
+       << prod1.exponent - prod2.exponent << " timing=" << timing.get_time() << " seconds"
+       << timing.events(double(M) * N * N) << "\n";
+}
+
+// Compares the elementwise product, the global product and log-sum-exp of size LargeExponentFloat values stored as
+// std::vector<LargeExponentFloat> (scalar operations) and as LargeExponentFloatArray, repeated M times.
+void benchmark_large_exponent_array(const long int M, const long int size) {
+  std::vector<LargeExponentFloat> a, b;
+  LargeExponentFloatArray array_a(size);
+  LargeExponentFloatArray array_b(size);
+  for (long int i = 0; i < size; i++) {
+    a.emplace_back(0.5 + distu(gen), long(distu(gen) * 2e5) - 100000);
+    b.emplace_back(0.5 + distu(gen), long(distu(gen) * 2e5) - 100000);
+    array_a.set(i, a[i]);
+    array_b.set(i, b[i]);
+  }
+
+  stopwatch timing;
+  double checksum = 0;
+  timing.start();
+  for (long int m = 0; m < M; m++) {
+    for (long int i = 0; i < size; i++) {
+      a[i] = a[i] * b[i];
+    }
+    LargeExponentFloat prod(1.0);
+    for (long int i = 0; i < size; i++) {
+      prod = prod * a[i];
+    }
+    LargeExponentFloat max(0.0);
+    for (long int i = 0; i < size; i++) {
+      max = a[i] > max ? a[i] : max;
+    }
+    double sum = 0;
+    for (long int i = 0; i < size; i++) {
+      sum += std::exp2(log2(a[i]) - log2(max));
+    }
+    checksum += log2(prod) + (std::log2(sum) + log2(max)) * M_LN2;
+  }
+  timing.stop();
+  cout << "std::vector<LargeExponentFloat> mul+product+max+log_sum_exp: checksum=" << checksum << " timing="
+       << timing.get_time() << " seconds" << timing.events(double(M) * size) << "\n";
+
+  timing.reset();
+  checksum = 0;
+  timing.start();
+  for (long int m = 0; m < M; m++) {
+    array_a.mul(array_b);
+    checksum += log2(array_a.product()) + array_a.log_sum_exp();
+  }
+  timing.stop();
+  cout << "LargeExponentFloatArray mul+product+max+log_sum_exp: checksum=" << checksum << " timing="
+       << timing.get_time() << " seconds" << timing.events(double(M) * size) << "\n";
+}
+
+// Latency of single prod_dist2_complexcomplexvec calls with size particles, called directly and split across thread
+// pools of increasing size (wall time, the pool is created once outside of the timing).
+void benchmark_kernel_parallel(const long int calls, const long int size) {
+  const int max_threads = std::max(1u, std::thread::hardware_concurrency());
+  for (int threads = 0; threads <= max_threads; threads = threads == 0 ? 1 : std::min(2 * threads, max_threads)) {
+    // opened before the pool, so that the counters inherit to its threads
+    stopwatch cpu_timing;
+    ThreadPool pool(std::max(threads, 1));
+    double* x = new_double_array_first_touch(pool, size);
+    double* y = new_double_array_first_touch(pool, size);
+    init_random_positions(size, -1, 1, x);
+    init_random_positions(size, -1, 1, y);
+
+    LargeExponentFloat prod1(1.0);
+    LargeExponentFloat prod2(1.0);
+    auto wall_start = std::chrono::steady_clock::now();
+    cpu_timing.start();
+    for (long int i = 0; i < calls; i++) {
+      const long int k = i % size;
+      if (threads == 0) {
+        prod_dist2_complexcomplexvec(size, k, distu(gen), x[k], distu(gen), y[k], x, y, prod1, prod2);
+      } else {
+        prod_dist2_complexcomplexvec_parallel(pool, size, k, distu(gen), x[k], distu(gen), y[k], x, y, prod1, prod2);
+      }
+    }
+    cpu_timing.stop();
+    std::chrono::duration<double> wall_time = std::chrono::steady_clock::now() - wall_start;
+    cout << "prod_dist2_complexcomplexvec" << (threads == 0 ? "" : "_parallel") << " N=" << size << " threads="
+         << std::max(threads, 1) << ": prod=" << prod1.significand / prod2.significand << " exponent="
+         << prod1.exponent - prod2.exponent << " latency=" << 1e6 * wall_time.count() / calls << " us/call"
+         << cpu_timing.events(double(calls) * size) << "\n";
+    _mm_free(x);
+    _mm_free(y);
+    if (threads == max_threads) {
+      break;
+    }
+  }
+}
+
+// Chained prod_diff_realrealvec calls over blocks of size particles (as in blocked sweeps or the triangular loops), with
+// the LargeExponentFloat interface (one reduction per call) and with LargeProduct accumulators (one reduction at the end).
+void benchmark_streaming(const long int calls, const long int size) {
+  double* x = new_double_array(size);
+  init_random_positions(size, -1, 1, x);
+  for (int streaming = 0; streaming < 2; streaming++) {
+    LargeExponentFloat prod1(1.0);
+    LargeExponentFloat prod2(1.0);
+    stopwatch timing;
+    timing.start();
+    if (streaming) {
+      LargeProduct vprod1;
+      LargeProduct vprod2;
+      for (long int i = 0; i < calls; i++) {
+        prod_diff_realrealvec(size, i % size, 0.5, -0.5, x, vprod1, vprod2);
+      }
+      prod1 = vprod1.get();
+      prod2 = vprod2.get();
+    } else {
+      for (long int i = 0; i < calls; i++) {
+        LargeExponentFloat call1(1.0);
+        LargeExponentFloat call2(1.0);
+        prod_diff_realrealvec(size, i % size, 0.5, -0.5, x, call1, call2);
+        prod1 = save_mul(prod1, call1);
+        prod2 = save_mul(prod2, call2);
+      }
+    }
+    timing.stop();
+    cout << "prod_diff_realrealvec chained N=" << size << (streaming ? " (LargeProduct)" : " (LargeExponentFloat)")
+         << ": prod=" << prod1.significand / prod2.significand << " exponent=" << prod1.exponent - prod2.exponent
+         << " timing=" << timing.get_time() << " seconds, " << 1e9 * timing.get_time() / calls << " ns/call"
+         << timing.events(double(calls) * size) << "\n";
+  }
+  _mm_free(x);
+}
+
+// Uniform particles against a cluster of width 1e-20, where the factors are below FACTOR_MIN and take the scaling path
+// of LargeProduct, and the same cluster pre-scaled into the normal range.
+void benchmark_clustered(const long int calls, const long int size) {
+  double* x = new_double_array(size);
+  double* scaled = new_double_array(size);
+  for (int clustered = 0; clustered < 3; clustered++) {
+    const double width = clustered ? 1e-20 : 1.0;
+    init_random_positions(size, -width, width, x);
+    const int e = clustered == 2 ? prescale_exponent(size, x) : 0;
+    prescale_positions(size, e, x, scaled);
+    const double u1 = std::ldexp(0.5 * width, e), u2 = std::ldexp(-0.5 * width, e);
+    LargeProduct prod1;
+    LargeProduct prod2;
+    stopwatch timing;
+    timing.start();
+    for (long int i = 0; i < calls; i++) {
+      prod_diff_realrealvec(size, i % size, u1, u2, scaled, prod1, prod2);
+    }
+    timing.stop();
+    // the product of the original positions, size-1 factors per call
+    const double log2_prod = log2(prod1.get()) - double(e) * (size - 1) * calls;
+    cout << "prod_diff_realrealvec N=" << size
+         << (clustered == 0 ? " uniform" : clustered == 1 ? " clustered" : " clustered (pre-scaled)")
+         << ": zero order=" << prod1.zero_order() << " log2(prod)=" << log2_prod << " timing=" << timing.get_time()
+         << " seconds, " << 1e9 * timing.get_time() / calls / size << " ns/element"
+         << timing.events(double(calls) * size) << "\n";
+  }
+  _mm_free(x);
+  _mm_free(scaled);
+}
+
+// Conditional density of one real particle on a grid of G points: one prod_diff_realrealvec call per pair of grid
+// points, the grid kernel and the tree code.
+void benchmark_grid(const long int N, const long int G, const double* x) {
+  double* u = new_double_array(G);
+  for (long int g = 0; g < G; g++) {
+    u[g] = -1.5 + 3.0 * (g + 0.5) / G;
+  }
+  const long int k = N / 2;
+  LargeExponentFloatArray prod(G);
+  for (int method = 0; method < 3; method++) {
+    stopwatch timing;
+    timing.start();
+    if (method == 0) {
+      for (long int g = 0; g + 1 < G; g += 2) {
+        LargeExponentFloat prod1(1.0), prod2(1.0);
+        prod_diff_realrealvec(N, k, u[g], u[g + 1], x, prod1, prod2);
+        prod.set(g, prod1);
+        prod.set(g + 1, prod2);
+      }
+    } else if (method == 1) {
+      prod_diff_grid_realvec(N, k, G, u, x, prod);
+    } else {
+      ProductTree tree(N, k, x);
+      tree.evaluate(G, u, prod);
+    }
+    timing.stop();
+    const char* names[3] = {"prod_diff_realrealvec pairs", "prod_diff_grid_realvec", "ProductTree"};
+    cout << names[method] << " N=" << N << " G=" << G << ": log2(prod[G/2])=" << log2(prod.get(G / 2))
+         << " timing=" << timing.get_time() << " seconds" << timing.events(double(N) * G) << "\n";
+  }
+  _mm_free(u);
+}
+
 // **************************************************************************
 
 constexpr const int REPETITIONS = 5;
 
+// Many small independent systems: one vandermonde_real / vandermonde_abs2_complex call per system, and the batch
+// functions with systems in lanes (single thread, so that the timings compare).
+void benchmark_batch(const long int N, const long int S) {
+  double* x = new_double_array(N * S);
+  double* y = new_double_array(N * S);
+  init_random_positions(N * S, -1, 1, x);
+  init_random_positions(N * S, -1, 1, y);
+  LargeExponentFloatArray prod(S);
+  for (int complex = 0; complex < 2; complex++) {
+    for (int batch = 0; batch < 2; batch++) {
+      stopwatch timing;
+      timing.start();
+      if (batch) {
+        if (complex) {
+          vandermonde_abs2_complex_batch(N, S, N, x, y, prod);
+        } else {
+          vandermonde_real_batch(N, S, N, x, prod);
+        }
+      } else {
+        double* xs = new_double_array(N);
+        double* ys = new_double_array(N);
+        for (long int s = 0; s < S; s++) {
+          std::copy(x + s * N, x + (s + 1) * N, xs);
+          std::copy(y + s * N, y + (s + 1) * N, ys);
+          LargeExponentFloat system_prod(1.0);
+          if (complex) {
+            vandermonde_abs2_complex(N, xs, ys, system_prod);
+          } else {
+            vandermonde_real(N, xs, system_prod);
+          }
+          prod.set(s, system_prod);
+        }
+        _mm_free(xs);
+        _mm_free(ys);
+      }
+      timing.stop();
+      cout << (complex ? "vandermonde_abs2_complex" : "vandermonde_real") << (batch ? "_batch" : " per system")
+           << " N=" << N << " systems=" << S << ": log2(prod[0])=" << log2(prod.get(0))
+           << " timing=" << timing.get_time() << " seconds, " << 1e9 * timing.get_time() / S << " ns/system"
+           << timing.events(double(S) * N * (N - 1) / 2) << "\n";
+    }
+  }
+  _mm_free(x);
+  _mm_free(y);
+}
+
+// Species-change proposals of the real Ginibre ensemble: the cached O(N) ratio (with the update of the caches for every
+// accepted move) against recomputing |det| of the proposed configuration.
+void benchmark_species_change(const long int Nreal, const long int Ncomplex, const long int moves) {
+  double* lambda = new_double_array(Nreal + 2 * Ncomplex);
+  double* x = new_double_array(Nreal + 2 * Ncomplex);
+  double* y = new_double_array(Nreal + 2 * Ncomplex);
+  init_random_positions(Nreal, -1, 1, lambda);
+  init_random_positions(Ncomplex, -1, 1, x);
+  init_random_positions(Ncomplex, 0.1, 1, y);
+  MixedEnsembleState state(Nreal, Ncomplex, lambda, x, y);
+  for (int cached = 0; cached < 2; cached++) {
+    double sum = 0;
+    stopwatch timing;
+    timing.start();
+    for (long int i = 0; i < moves; i++) {
+      const bool merge = i % 2 == 0;
+      const long int a = i % (state.Nreal - 1);
+      const double u = merge ? 0.5 * (state.lambda[a] + state.lambda[a + 1]) : state.x[0] - 0.1;
+      const double v = merge ? 0.05 : state.x[0] + 0.1;
+      if (cached) {
+        sum += merge ? state.log_ratio_merge(a, a + 1, u, v) : state.log_ratio_split(0, u, v);
+        if (merge) {
+          state.accept_merge(a, a + 1, u, v);
+        } else {
+          state.accept_split(0, u, v);
+        }
+      } else {
+        // the proposed configuration, from scratch
+        long int n = 0;
+        for (long int j = 0; j < state.Nreal; j++) {
+          if (!merge || (j != a && j != a + 1)) {
+            lambda[n++] = state.lambda[j];
+          }
+        }
+        long int m = 0;
+        for (long int q = merge ? 0 : 1; q < state.Ncomplex; q++) {
+          x[m] = state.x[q];
+          y[m++] = state.y[q];
+        }
+        if (merge) {
+          x[m] = u;
+          y[m++] = v;
+        } else {
+          lambda[n++] = u;
+          lambda[n++] = v;
+        }
+        LargeExponentFloat prod(1.0);
+        vandermonde_abs_real_ginibre(n, m, lambda, x, y, prod);
+        sum += log2(prod);
+      }
+    }
+    timing.stop();
+    cout << "species change Nreal=" << Nreal << " Ncomplex=" << Ncomplex
+         << (cached ? " (MixedEnsembleState)" : " (vandermonde_abs_real_ginibre)") << ": sum=" << sum
+         << " timing=" << timing.get_time() << " seconds, " << 1e9 * timing.get_time() / moves << " ns/move"
+         << timing.events(moves) << "\n";
+  }
+  _mm_free(lambda);
+  _mm_free(x);
+  _mm_free(y);
+}
+
+// Birth-death moves of complex particles around N: ParticleSet against reallocating and copying a new_double_array
+// buffer for every change of the size. Both compute the insertion or deletion factor of every move.
+void benchmark_birth_death(const long int N, const long int moves) {
+  std::uniform_real_distribution<double> uniform(-1, 1);
+  for (int reallocating = 0; reallocating < 2; reallocating++) {
+    std::mt19937_64 moves_gen(N);
+    ParticleSet set(true, N);
+    for (long int i = 0; i < N; i++) {
+      set.insert(uniform(moves_gen), uniform(moves_gen));
+    }
+    long int n = N;
+    double* x = new_double_array(n);
+    double* y = new_double_array(n);
+    std::copy(set.x, set.x + n, x);
+    std::copy(set.y, set.y + n, y);
+    double sum = 0;
+    stopwatch timing;
+    timing.start();
+    for (long int m = 0; m < moves; m++) {
+      LargeExponentFloat factor(1.0);
+      const bool birth = n <= 1 || uniform(moves_gen) < 0.5;
+      const double u = uniform(moves_gen), v = uniform(moves_gen);
+      const long int i = long((uniform(moves_gen) + 1) / 2 * (n - 1));
+      if (!reallocating) {
+        if (birth) {
+          set.insertion_factor(u, v, factor);
+          set.insert(u, v);
+        } else {
+          set.deletion_factor(i, factor);
+          set.remove(i);
+        }
+        n = set.N;
+      } else {
+        if (birth) {
+          prod_dist2_complexvec(n, n, u, v, x, y, factor);
+        } else {
+          prod_dist2_complexvec(n, i, x[i], y[i], x, y, factor);
+        }
+        const long int new_n = birth ? n + 1 : n - 1;
+        double* new_x = new_double_array(new_n);
+        double* new_y = new_double_array(new_n);
+        std::copy(x, x + std::min(n, new_n), new_x);
+        std::copy(y, y + std::min(n, new_n), new_y);
+        if (birth) {
+          new_x[n] = u;
+          new_y[n] = v;
+        } else if (i < new_n) {
+          new_x[i] = x[n - 1];
+          new_y[i] = y[n - 1];
+        }
+        _mm_free(x);
+        _mm_free(y);
+        x = new_x;
+        y = new_y;
+        n = new_n;
+      }
+      sum += log2(factor);
+    }
+    timing.stop();
+    cout << "birth-death N=" << N << (reallocating ? " (reallocating arrays)" : " (ParticleSet)") << ": sum=" << sum
+         << " timing=" << timing.get_time() << " seconds, " << 1e9 * timing.get_time() / moves << " ns/move"
+         << timing.events(moves) << "\n";
+    _mm_free(x);
+    _mm_free(y);
+  }
+}
+
 int main(int argc, char *argv[]) {
   gen = std::mt19937_64();
 
-  if (argc!=3) {
-    cout << argv[0] << "M N\n";
+  if ((argc != 3 && argc != 4) || (argc == 4 && std::string(argv[3]) != "perf")) {
+    cout << argv[0] << " M N [perf]\n";
     cout << "M number of runs, N number of particles\n";
+    cout << "perf adds hardware event counts per element (Linux perf_event_open)\n";
     cout << "example: " << argv[0] << " 10 10000\n";
     return 1;
   }
 
   long int M = atoi(argv[1]);
   long int N = atoi(argv[2]);
+  count_events = argc == 4;
+  // number of factors of each product in the kernel loops and of the pairs in the determinants
+  const double kernel_elements = double(M) * N * N;
+  const double pair_elements = double(M) * N * (N - 1) / 2;
 
   double * x = new_double_array(N);
   double * y = new_double_array(N);
@@ -100,7 +912,7 @@ int main(int argc, char *argv[]) {
         prod_diff_realrealvec(N, k, u, u0, x, prod, prod0);
       }
     timing.stop();
-    cout << "prod_diff_realrealvec: prod=" << prod.significand/prod0.significand << " exponent=" << prod.exponent-prod0.exponent << " timing=" << timing.get_time() << " seconds\n";
+    cout << "prod_diff_realrealvec: prod=" << prod.significand/prod0.significand << " exponent=" << prod.exponent-prod0.exponent << " timing=" << timing.get_time() << " seconds" << timing.events(kernel_elements) << "\n";
     timing.reset();
   }
 
@@ -119,7 +931,29 @@ int main(int argc, char *argv[]) {
       }
     timing.stop();
     cout << "prod_dist2_complexcomplexvec: prod=" << prod.significand / prod0.significand << " exponent="
-         << prod.exponent - prod0.exponent << " timing=" << timing.get_time() << " seconds\n";
+         << prod.exponent - prod0.exponent << " timing=" << timing.get_time() << " seconds" << timing.events(kernel_elements) << "\n";
+    timing.reset();
+  }
+
+  for(int rep = 0; rep < REPETITIONS; ++rep) {
+    LargeExponentFloat prod(1.0);
+    LargeExponentFloat prod0(1.0);
+    double phase = 0;
+    double phase0 = 0;
+
+    timing.start();
+    for (long int i = 0; i < M; i++)
+      for (long int k = 0; k < N; k++) {
+        double u = distu(gen) * 2 - 1;
+        double v = distu(gen) * 2 - 1;
+        double u0 = distu(gen) * 2 - 1;
+        double v0 = distu(gen) * 2 - 1;
+        prod_diff_complexcomplexvec(N, k, u, u0, v, v0, x, y, prod, phase, prod0, phase0);
+      }
+    timing.stop();
+    cout << "prod_diff_complexcomplexvec: prod=" << prod.significand / prod0.significand << " exponent="
+         << prod.exponent - prod0.exponent << " phase=" << phase - phase0 << " timing=" << timing.get_time()
+         << " seconds" << timing.events(kernel_elements) << "\n";
     timing.reset();
   }
 
@@ -136,7 +970,7 @@ int main(int argc, char *argv[]) {
       }
     timing.stop();
     cout << "prod_dist2_realcomplexvec: prod=" << prod.significand / prod0.significand << " exponent="
-         << prod.exponent - prod0.exponent << " timing=" << timing.get_time() << " seconds\n";
+         << prod.exponent - prod0.exponent << " timing=" << timing.get_time() << " seconds" << timing.events(kernel_elements) << "\n";
     timing.reset();
   }
 
@@ -155,10 +989,134 @@ int main(int argc, char *argv[]) {
       }
     timing.stop();
     cout << "prod_dist2_complexrealvec: prod=" << prod.significand / prod0.significand << " exponent="
-         << prod.exponent - prod0.exponent << " timing=" << timing.get_time() << " seconds\n";
+         << prod.exponent - prod0.exponent << " timing=" << timing.get_time() << " seconds" << timing.events(kernel_elements) << "\n";
     timing.reset();
   }
 
+  {
+    double* force_x = new_double_array(N);
+    double* force_y = new_double_array(N);
+
+    for (int rep = 0; rep < REPETITIONS; ++rep) {
+      LargeExponentFloat prod(1.0);
+      LargeExponentFloat prod_forces(1.0);
+      timing.start();
+      for (long int i = 0; i < M; i++) {
+        vandermonde_real(N, x, prod);
+      }
+      timing.stop();
+      double time_det = timing.get_time();
+      std::string events_det = timing.events(pair_elements);
+      timing.reset();
+
+      timing.start();
+      for (long int i = 0; i < M; i++) {
+        vandermonde_real_forces(N, x, prod_forces, force_x);
+      }
+      timing.stop();
+      cout << "vandermonde_real: timing=" << time_det << " seconds" << events_det
+           << ", vandermonde_real_forces: force[0]=" << force_x[0] << " timing=" << timing.get_time() << " seconds"
+           << timing.events(pair_elements) << "\n";
+      timing.reset();
+    }
+
+    for (int rep = 0; rep < REPETITIONS; ++rep) {
+      LargeExponentFloat prod(1.0);
+      LargeExponentFloat prod_forces(1.0);
+      timing.start();
+      for (long int i = 0; i < M; i++) {
+        vandermonde_abs2_complex(N, x, y, prod);
+      }
+      timing.stop();
+      double time_det = timing.get_time();
+      std::string events_det = timing.events(pair_elements);
+      timing.reset();
+
+      timing.start();
+      for (long int i = 0; i < M; i++) {
+        vandermonde_abs2_complex_forces(N, x, y, prod_forces, force_x, force_y);
+      }
+      timing.stop();
+      cout << "vandermonde_abs2_complex: timing=" << time_det << " seconds" << events_det
+           << ", vandermonde_abs2_complex_forces: force[0]=(" << force_x[0] << "," << force_y[0] << ") timing="
+           << timing.get_time() << " seconds" << timing.events(pair_elements) << "\n";
+      timing.reset();
+    }
+
+    _mm_free(force_x);
+    _mm_free(force_y);
+  }
+
+  const long int small_calls = M * 1000000;
+  benchmark_small_kernels<8>(small_calls);
+  benchmark_small_kernels<16>(small_calls);
+  benchmark_small_kernels<32>(small_calls);
+  benchmark_small_kernels<64>(small_calls);
+  benchmark_large_exponent_float(small_calls);
+  benchmark_streaming(small_calls, 64);
+  benchmark_clustered(small_calls / 10, 1024);
+  benchmark_large_exponent_array(M, 1 << 20);
+  benchmark_kernel_parallel(10 * M, 1 << 20);
+
+  // std::clock measures the cpu time of all threads, so the parallel versions are timed with the wall clock
+  for (int threads : {1, 0}) {
+    for (int rep = 0; rep < REPETITIONS; ++rep) {
+      LargeExponentFloat prod(1.0);
+      stopwatch cpu_timing;
+
+      auto start = std::chrono::steady_clock::now();
+      cpu_timing.start();
+      for (long int i = 0; i < M; i++) {
+        vandermonde_abs2_complex_parallel(N, x, y, prod, threads);
+      }
+      cpu_timing.stop();
+      std::chrono::duration<double> wall_time = std::chrono::steady_clock::now() - start;
+      prod.normalize_exponent();
+      cout << "vandermonde_abs2_complex_parallel(threads=" << (threads == 0 ? std::thread::hardware_concurrency() : 1)
+           << "): prod=" << prod.significand << " exponent=" << prod.exponent << " wall time=" << wall_time.count()
+           << " seconds" << cpu_timing.events(pair_elements) << "\n";
+    }
+  }
+
+  benchmark_metropolis(M, N, x, y, false);
+  benchmark_metropolis(M, N, x, y, true);
+  benchmark_metropolis_cascade(M, N, x, y);
+  benchmark_proposals(M, N, x, y);
+  benchmark_cluster(M, N, x, y);
+  benchmark_conjpair(M, N, x, y);
+  benchmark_grid(N, 1000, x);
+  benchmark_grid(N, 10000, x);
+  benchmark_batch(10, 100000);
+  benchmark_batch(50, 20000);
+  benchmark_batch(200, 2000);
+  benchmark_species_change(400, 300, 1000);
+  benchmark_birth_death(1000, 20000);
+  benchmark_birth_death(100000, 2000);
+
+  {
+    double* c0 = new_double_array(N);
+    double* c1 = new_double_array(N);
+    double* c2 = new_double_array(N);
+    const double* complex_plane[2] = {x, y};
+    benchmark_pair_factor<ComplexPlane>("ComplexPlane", M, N, complex_plane);
+    for (long int j = 0; j < N; j++) {
+      ChordalCircle::coordinates(M_PI * x[j], c0[j], c1[j]);
+    }
+    const double* circle[2] = {c0, c1};
+    benchmark_pair_factor<ChordalCircle>("ChordalCircle", M, N, circle);
+    for (long int j = 0; j < N; j++) {
+      StereographicSphere::coordinates(x[j], y[j], c0[j], c1[j], c2[j]);
+    }
+    const double* sphere[3] = {c0, c1, c2};
+    benchmark_pair_factor<StereographicSphere>("StereographicSphere", M, N, sphere);
+    init_random_positions(N, -1, 1, c2);
+    const double* space[3] = {x, y, c2};
+    benchmark_pair_factor<SquaredDistance<3>>("SquaredDistance<3>", M, N, space);
+    _mm_free(c0);
+    _mm_free(c1);
+    _mm_free(c2);
+  }
+
   delete[] x;
   delete[] y;
   return 0;
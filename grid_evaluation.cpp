@@ -0,0 +1,299 @@
+#include "grid_evaluation.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include "lane_products.h"
+#include "simd_math.h"
+#include "vandermonde_det.h"
+
+namespace {
+
+// u vectors (of 4 grid points) per tile
+constexpr long int TILE_VECTORS = 8;
+
+// Loads the u vectors of the tile at g. Vectors beyond the (padded) grid repeat the last one.
+template<long int VECTORS = TILE_VECTORS>
+inline void load_tile(const long int g, const long int G, const double* u, __m256d* ug) {
+  const long int last = (G - 1) & ~3L;
+  for (long int t = 0; t < VECTORS; t++) {
+    ug[t] = _mm256_load_pd(&u[std::min(g + 4 * t, last)]);
+  }
+}
+
+// Multiplies the tile with the factors row(j) for all j != k, two rows per mul, normalizing the tile every
+// MULS_PER_EXPONENT_EXTRACTION muls.
+template<class Row>
+inline void for_rows(const long int N, const long int k, LaneProducts<TILE_VECTORS>& tile, const Row& row) {
+  const long int k_excluded = (k >= 0 && k < N) ? k : N;
+  for (long int begin : {0L, k_excluded + 1}) {
+    const long int end = begin == 0 ? k_excluded : N;
+    for (long int j = begin; j < end; j += 2 * MULS_PER_EXPONENT_EXTRACTION) {
+      const long int last = std::min(j + 2 * MULS_PER_EXPONENT_EXTRACTION, end);
+      long int i = j;
+      for (; i + 1 < last; i += 2) {
+        tile.mul(row(i), row(i + 1));
+      }
+      if (i < last) {
+        tile.mul(row(i));
+      }
+      tile.normalize();
+    }
+  }
+}
+
+}
+
+void prod_diff_grid_realvec(
+        const long int N,
+        const long int k,
+        const long int G,
+        const double* u,
+        const double* x,
+        LargeExponentFloatArray& prod
+) {
+  assert(prod.size == G);
+  assert(reinterpret_cast<uintptr_t>(u) % 32 == 0);
+
+  for (long int g = 0; g < G; g += 4 * TILE_VECTORS) {
+    __m256d ug[TILE_VECTORS];
+    load_tile(g, G, u, ug);
+    LaneProducts<TILE_VECTORS> tile;
+    for_rows(N, k, tile, [&](const long int j) {
+      const __m256d xj = _mm256_broadcast_sd(&x[j]);
+      LaneProducts<TILE_VECTORS>::Factors diff;
+      for (long int t = 0; t < TILE_VECTORS; t++) {
+        diff.factor[t] = _mm256_sub_pd(ug[t], xj);
+      }
+      return diff;
+    });
+    tile.store(g, G, prod, true);
+  }
+}
+
+void prod_dist2_grid_complexvec(
+        const long int N,
+        const long int k,
+        const long int G,
+        const double* u,
+        const double* v,
+        const double* x,
+        const double* y,
+        LargeExponentFloatArray& prod
+) {
+  assert(prod.size == G);
+  assert(reinterpret_cast<uintptr_t>(u) % 32 == 0);
+  assert(reinterpret_cast<uintptr_t>(v) % 32 == 0);
+
+  for (long int g = 0; g < G; g += 4 * TILE_VECTORS) {
+    __m256d ug[TILE_VECTORS];
+    __m256d vg[TILE_VECTORS];
+    load_tile(g, G, u, ug);
+    load_tile(g, G, v, vg);
+    LaneProducts<TILE_VECTORS> tile;
+    for_rows(N, k, tile, [&](const long int j) {
+      const __m256d xj = _mm256_broadcast_sd(&x[j]);
+      const __m256d yj = _mm256_broadcast_sd(&y[j]);
+      LaneProducts<TILE_VECTORS>::Factors dist2;
+      for (long int t = 0; t < TILE_VECTORS; t++) {
+        const __m256d dx = _mm256_sub_pd(ug[t], xj);
+        const __m256d dy = _mm256_sub_pd(vg[t], yj);
+        dist2.factor[t] = _mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy));
+      }
+      return dist2;
+    });
+    tile.store(g, G, prod, true);
+  }
+}
+
+// A node is expanded if its radius is below this fraction of the distance to u (strictly, so that a node of radius 0
+// at distance 0 is refined down to its particles). The truncation error of a node with
+// n particles is below n * ratio^(ORDER+1) / ((ORDER+1) * (1-ratio)).
+constexpr double EXPANSION_RATIO = 0.4;
+
+ProductTree::ProductTree(const long int N, const long int k, const double* x) {
+  size = (k >= 0 && k < N) ? N - 1 : N;
+  this->x = new_double_array(std::max(size, 1L));
+  long int i = 0;
+  for (long int j = 0; j < N; j++) {
+    if (j != k) {
+      this->x[i++] = x[j];
+    }
+  }
+  std::sort(this->x, this->x + size);
+  if (size > 0) {
+    build(0, size);
+  }
+  // the expansion divides the p-th moment by p
+  for (size_t node = 0; node < nodes.size(); node++) {
+    for (int p = 0; p < ORDER; p++) {
+      moments[node * ORDER + p] /= p + 1;
+    }
+  }
+}
+
+ProductTree::~ProductTree() {
+  _mm_free(x);
+}
+
+long int ProductTree::build(const long int begin, const long int end) {
+  const long int index = nodes.size();
+  const double center = 0.5 * (x[begin] + x[end - 1]);
+  const double radius = 0.5 * (x[end - 1] - x[begin]);
+  const double inverse_radius = radius > 0 ? 1 / radius : 0;
+  nodes.push_back(Node{begin, end, center, radius, -1, -1});
+  moments.resize(moments.size() + ORDER, 0.0);
+
+  if (end - begin <= LEAF_SIZE) {
+    // moments of the scaled positions t in [-1, 1], 4 particles per vector
+    __m256d sums[ORDER];
+    for (int p = 0; p < ORDER; p++) {
+      sums[p] = _mm256_setzero_pd();
+    }
+    const __m256d vcenter = _mm256_set1_pd(center);
+    const __m256d vinverse_radius = _mm256_set1_pd(inverse_radius);
+    long int j = begin;
+    for (; j + 4 <= end; j += 4) {
+      const __m256d t = _mm256_mul_pd(_mm256_sub_pd(_mm256_loadu_pd(&x[j]), vcenter), vinverse_radius);
+      __m256d power = t;
+      for (int p = 0; p < ORDER; p++) {
+        sums[p] = _mm256_add_pd(sums[p], power);
+        power = _mm256_mul_pd(power, t);
+      }
+    }
+    double* m = &moments[index * ORDER];
+    for (int p = 0; p < ORDER; p++) {
+      m[p] = horizontal_sum(sums[p]);
+    }
+    for (; j < end; j++) {
+      const double t = (x[j] - center) * inverse_radius;
+      double power = t;
+      for (int p = 0; p < ORDER; p++) {
+        m[p] += power;
+        power *= t;
+      }
+    }
+    return index;
+  }
+
+  const long int middle = begin + (end - begin) / 2;
+  const long int left = build(begin, middle);
+  const long int right = build(middle, end);
+  nodes[index].left = left;
+  nodes[index].right = right;
+
+  // Moments from the moments of the children: with t = a t_child + b (|a| + |b| <= 1, as the children are within the
+  // node), sum t^q = sum_i binomial(q, i) a^i b^(q-i) sum t_child^i. All terms are bounded by the number of particles.
+  double binomial[ORDER + 1][ORDER + 1];
+  for (int q = 0; q <= ORDER; q++) {
+    binomial[q][0] = binomial[q][q] = 1;
+    for (int i = 1; i < q; i++) {
+      binomial[q][i] = binomial[q - 1][i - 1] + binomial[q - 1][i];
+    }
+  }
+  for (const long int child : {left, right}) {
+    const Node& c = nodes[child];
+    const double a = c.radius * inverse_radius;
+    const double b = (c.center - center) * inverse_radius;
+    double child_moments[ORDER + 1];
+    child_moments[0] = double(c.end - c.begin);
+    std::copy(&moments[child * ORDER], &moments[child * ORDER] + ORDER, child_moments + 1);
+    double a_powers[ORDER + 1];
+    double b_powers[ORDER + 1];
+    a_powers[0] = b_powers[0] = 1;
+    for (int q = 1; q <= ORDER; q++) {
+      a_powers[q] = a_powers[q - 1] * a;
+      b_powers[q] = b_powers[q - 1] * b;
+    }
+    double* m = &moments[index * ORDER];
+    for (int q = 1; q <= ORDER; q++) {
+      double sum = 0;
+      for (int i = 0; i <= q; i++) {
+        sum += binomial[q][i] * a_powers[i] * b_powers[q - i] * child_moments[i];
+      }
+      m[q - 1] += sum;
+    }
+  }
+  return index;
+}
+
+void ProductTree::evaluate4(const long int g, const long int G, const double* u, LargeExponentFloatArray& prod) const {
+  __m256d ug;
+  load_tile<1>(g, G, u, &ug);
+  LaneProducts<1> near;
+  // natural log of the products of the expanded nodes
+  __m256d far = _mm256_setzero_pd();
+
+  long int stack[128];
+  int stack_size = 0;
+  if (size > 0) {
+    stack[stack_size++] = 0;
+  }
+  while (stack_size > 0) {
+    const long int index = stack[--stack_size];
+    const Node& node = nodes[index];
+    const __m256d distance = _mm256_sub_pd(ug, _mm256_set1_pd(node.center));
+    const __m256d near_lanes = _mm256_cmp_pd(_mm256_set1_pd(node.radius),
+                                             _mm256_mul_pd(_mm256_set1_pd(EXPANSION_RATIO), abs(distance)), _CMP_GE_OQ);
+    if (_mm256_movemask_pd(near_lanes) == 0) {
+      // sum_j log|1 - (x[j]-c)/(u-c)| = -sum_p M_p t^p with t = radius/(u-c) and the scaled moments (Horner scheme)
+      const double* m = &moments[index * ORDER];
+      const __m256d t = _mm256_div_pd(_mm256_set1_pd(node.radius), distance);
+      __m256d series = _mm256_set1_pd(m[ORDER - 1]);
+      for (int p = ORDER - 2; p >= 0; p--) {
+        series = _mm256_add_pd(_mm256_mul_pd(series, t), _mm256_set1_pd(m[p]));
+      }
+      series = _mm256_mul_pd(series, t);
+      const __m256d n = _mm256_set1_pd(double(node.end - node.begin));
+      far = _mm256_add_pd(far, _mm256_sub_pd(_mm256_mul_pd(n, log_pd(abs(distance))), series));
+    } else if (node.left < 0) {
+      for (long int j = node.begin; j < node.end; j += MULS_PER_EXPONENT_EXTRACTION) {
+        const long int last = std::min(j + MULS_PER_EXPONENT_EXTRACTION, node.end);
+        long int i = j;
+        for (; i + 1 < last; i += 2) {
+          near.mul({_mm256_sub_pd(ug, _mm256_broadcast_sd(&x[i]))},
+                   {_mm256_sub_pd(ug, _mm256_broadcast_sd(&x[i + 1]))});
+        }
+        if (i < last) {
+          near.mul({_mm256_sub_pd(ug, _mm256_broadcast_sd(&x[i]))});
+        }
+        near.normalize();
+      }
+    } else {
+      assert(stack_size + 2 <= 128);
+      stack[stack_size++] = node.left;
+      stack[stack_size++] = node.right;
+    }
+  }
+
+  near.store(g, G, prod, true);
+  alignas(32) double far_log2[4];
+  _mm256_store_pd(far_log2, _mm256_mul_pd(far, _mm256_set1_pd(M_LOG2E)));
+  for (long int lane = 0; lane < 4 && g + lane < G; lane++) {
+    const double far_exponent = std::floor(far_log2[lane]);
+    prod.set(g + lane, prod.get(g + lane) * LargeExponentFloat(std::exp2(far_log2[lane] - far_exponent),
+                                                               static_cast<int64_t>(far_exponent)));
+  }
+}
+
+void ProductTree::evaluate(const long int G, const double* u, LargeExponentFloatArray& prod) const {
+  assert(prod.size == G);
+  assert(reinterpret_cast<uintptr_t>(u) % 32 == 0);
+  for (long int g = 0; g < G; g += 4) {
+    evaluate4(g, G, u, prod);
+  }
+}
+
+long int sample_inverse_cdf(const LargeExponentFloatArray& weights, const double uniform, double* cdf) {
+  weights.normalized_weights(cdf);
+  double sum = 0;
+  for (long int g = 0; g < weights.size; g++) {
+    sum += cdf[g];
+    cdf[g] = sum;
+  }
+  if (sum == 0) {
+    return -1;
+  }
+  const long int g = std::upper_bound(cdf, cdf + weights.size, uniform * sum) - cdf;
+  return std::min(g, weights.size - 1);
+}
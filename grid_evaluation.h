@@ -0,0 +1,87 @@
+#ifndef GRID_EVALUATION_H
+#define GRID_EVALUATION_H
+
+#include <vector>
+#include "large_exponent_array.h"
+
+/**
+ * Evaluation of the conditional density of one particle on a grid of G positions u[g] (+i*v[g]), e.g. for heat-bath
+ * updates with inverse-CDF sampling:
+ *
+ *   prod[g] = prod_{j != k} |u[g] - x[j]|          (real particles)
+ *   prod[g] = prod_{j != k} |u[g] - z[j]|^2        (complex particles z[j] = x[j]+i*y[j])
+ *
+ * k >= N excludes nothing. The direct kernels vectorize across the grid: a tile of 32 grid points stays in registers
+ * while x is streamed once per tile, O(N*G). ProductTree evaluates the real product in O((N+G) log N) for large grids,
+ * with a relative error of the order of N * 1e-15. prod must have G elements, which are overwritten. u and v must be
+ * allocated with new_double_array(G).
+ */
+void prod_diff_grid_realvec(
+        const long int N,
+        const long int k,
+        const long int G,
+        const double* u,
+        const double* x,
+        LargeExponentFloatArray& prod
+);
+
+void prod_dist2_grid_complexvec(
+        const long int N,
+        const long int k,
+        const long int G,
+        const double* u,
+        const double* v,
+        const double* x,
+        const double* y,
+        LargeExponentFloatArray& prod
+);
+
+/**
+ * Tree code for prod_{j != k} |u - x[j]| of real particles. The sorted particles are split into leaves of LEAF_SIZE,
+ * and every node of the binary tree over the leaves stores the moments of its particles. A node whose radius is
+ * below 0.4 times its distance to u (EXPANSION_RATIO) contributes with the expansion
+ *
+ *   sum_j log|u - x[j]| = n log|u - c| - sum_p M_p / (p (u - c)^p),   M_p = sum_j (x[j] - c)^p,
+ *
+ * truncated after ORDER terms; the other nodes are refined down to the leaves, which are multiplied directly. Groups of
+ * 4 grid points traverse the tree together, so sorted grids (neighbours refine the same nodes) are the fastest.
+ */
+class ProductTree {
+  public:
+    static constexpr long int LEAF_SIZE = 64;
+    static constexpr int ORDER = 40;
+
+    ProductTree(const long int N, const long int k, const double* x);
+    ProductTree(const ProductTree&) = delete;
+    ProductTree& operator=(const ProductTree&) = delete;
+    ~ProductTree();
+
+    void evaluate(const long int G, const double* u, LargeExponentFloatArray& prod) const;
+
+  private:
+    struct Node {
+      long int begin;
+      long int end;
+      double center;
+      double radius;
+      // children, -1 for leaves
+      long int left;
+      long int right;
+    };
+
+    long int size;
+    double* x;
+    std::vector<Node> nodes;
+    // ORDER moments of every node, scaled by 1/(p radius^p)
+    std::vector<double> moments;
+
+    long int build(const long int begin, const long int end);
+    // the grid points g..g+3 (below G), which share the traversal of the tree
+    void evaluate4(const long int g, const long int G, const double* u, LargeExponentFloatArray& prod) const;
+};
+
+// Index g with probability weights[g] / sum of all weights (non-negative), for a uniform number in [0,1). cdf is scratch
+// space for weights.size doubles. Returns -1 if all weights are 0.
+long int sample_inverse_cdf(const LargeExponentFloatArray& weights, const double uniform, double* cdf);
+
+#endif
@@ -0,0 +1,144 @@
+#ifndef LANE_PRODUCTS_H
+#define LANE_PRODUCTS_H
+
+#include "large_exponent_array.h"
+
+/**
+ * 4*VECTORS independent products, one per lane, e.g. of the grid points of grid_evaluation.h or of the systems of
+ * vandermonde_batch.h. Unlike LargeProduct, the lanes are not multiplied together at the end, but written to the
+ * consecutive elements of a LargeExponentFloatArray. The caller multiplies with mul (one factor or a pair of factors
+ * per lane) and calls normalize() at least every 16 calls. Like for LargeProduct, factors outside [FACTOR_MIN, FACTOR_MAX] are split out of the hot
+ * path, so that clustered particles do not over- or underflow the lanes, and zero factors make the lane exactly 0.
+ */
+template<long int VECTORS>
+struct LaneProducts {
+  __m256d prod[VECTORS];
+  __m256d zero[VECTORS];
+  __exponent_t exponent[VECTORS];
+  int64_t normalizations = 0;
+
+  LaneProducts() {
+    for (long int t = 0; t < VECTORS; t++) {
+      prod[t] = M256D_ONE;
+      zero[t] = _mm256_setzero_pd();
+#ifdef __AVX2__
+      exponent[t] = _mm256_setzero_si256();
+#else // __AVX__
+      exponent[t] = _mm_setzero_si128();
+#endif
+    }
+  }
+
+  struct Factors {
+    __m256d factor[VECTORS];
+  };
+
+  struct ScaledFactors {
+    __m256d factor[VECTORS];
+    __m256d zero[VECTORS];
+    __exponent_t exponent[VECTORS];
+  };
+
+  // The products factors1.factor[t] * factors2.factor[t] split with split_lanes, from the split factors (so that zero
+  // factors are found). Static and by value, so that the products stay in registers.
+  __attribute__((noinline, cold)) static ScaledFactors scale_factors(const Factors factors1, const Factors factors2) {
+    ScaledFactors scaled;
+    for (long int t = 0; t < VECTORS; t++) {
+      const SplitLanes split1 = split_lanes(factors1.factor[t]);
+      const SplitLanes split2 = split_lanes(factors2.factor[t]);
+      // in [1,4), no zeros
+      const SplitLanes split = split_lanes(_mm256_mul_pd(split1.significand, split2.significand));
+      scaled.factor[t] = split.significand;
+      scaled.zero[t] = _mm256_or_pd(split1.zero, split2.zero);
+#ifdef __AVX2__
+      scaled.exponent[t] = _mm256_add_epi64(_mm256_add_epi64(split1.exponent, split2.exponent), split.exponent);
+#else // __AVX__
+      scaled.exponent[t] = _mm_add_epi32(_mm_add_epi32(split1.exponent, split2.exponent), split.exponent);
+#endif
+    }
+    return scaled;
+  }
+
+  // Multiplies prod[t] with factors1.factor[t] * factors2.factor[t] for all t. Like LargeProduct::mul_no_overflow1234,
+  // the pair products are checked against [FACTOR_MIN, FACTOR_MAX], with one check for all of them.
+  void mul(const Factors factors1, const Factors factors2) {
+    __m256d pair[VECTORS];
+    for (long int t = 0; t < VECTORS; t++) {
+      pair[t] = _mm256_mul_pd(factors1.factor[t], factors2.factor[t]);
+    }
+    __m256d min_abs = abs(pair[0]);
+    __m256d max_abs = min_abs;
+    for (long int t = 1; t < VECTORS; t++) {
+      min_abs = _mm256_min_pd(min_abs, abs(pair[t]));
+      max_abs = _mm256_max_pd(max_abs, abs(pair[t]));
+    }
+    if (__builtin_expect(factors_out_of_range(min_abs, max_abs), 0)) {
+      const ScaledFactors scaled = scale_factors(factors1, factors2);
+      for (long int t = 0; t < VECTORS; t++) {
+        pair[t] = scaled.factor[t];
+        zero[t] = _mm256_or_pd(zero[t], scaled.zero[t]);
+#ifdef __AVX2__
+        exponent[t] = _mm256_add_epi64(exponent[t], scaled.exponent[t]);
+#else // __AVX__
+        exponent[t] = _mm_add_epi32(exponent[t], scaled.exponent[t]);
+#endif
+      }
+    }
+    for (long int t = 0; t < VECTORS; t++) {
+      prod[t] = _mm256_mul_pd(prod[t], pair[t]);
+    }
+  }
+
+  void mul(const Factors factors) {
+    Factors ones;
+    for (long int t = 0; t < VECTORS; t++) {
+      ones.factor[t] = M256D_ONE;
+    }
+    mul(factors, ones);
+  }
+
+  void normalize() {
+    for (long int t = 0; t < VECTORS; t++) {
+      const __exponent_t delta_exponent = extract_and_clear_exponent(prod[t]);
+#ifdef __AVX2__
+      exponent[t] = _mm256_add_epi64(exponent[t], delta_exponent);
+#else // __AVX__
+      exponent[t] = _mm_add_epi32(exponent[t], delta_exponent);
+#endif
+    }
+    normalizations++;
+  }
+
+  // Writes the products (their absolute values with absolute) of the lanes to out[i], ..., for i < size.
+  void store(const long int i, const long int size, LargeExponentFloatArray& out, const bool absolute) {
+    normalize();
+    for (long int t = 0; t < VECTORS; t++) {
+      alignas(32) double significands[4];
+      alignas(32) double zeros[4];
+      _mm256_store_pd(significands, absolute ? abs(prod[t]) : prod[t]);
+      _mm256_store_pd(zeros, zero[t]);
+#ifdef __AVX2__
+      alignas(32) int64_t exponents[4];
+      _mm256_store_si256(reinterpret_cast<__m256i*>(exponents), exponent[t]);
+      const int64_t bias = normalizations * EXPONENT_BIAS;
+      const int lane_index[4] = {0, 1, 2, 3};
+#else // __AVX__
+      alignas(16) int32_t exponents[4];
+      _mm_store_si128(reinterpret_cast<__m128i*>(exponents), exponent[t]);
+      const int64_t bias = 0;
+      // lane order of extract_and_clear_exponent
+      const int lane_index[4] = {0, 2, 1, 3};
+#endif
+      for (int lane = 0; lane < 4; lane++) {
+        const long int element = i + 4 * t + lane;
+        if (element < size) {
+          const bool is_zero = zeros[lane] != 0;
+          out.set(element, LargeExponentFloat(is_zero ? 0.0 : significands[lane],
+                                              is_zero ? 0 : exponents[lane_index[lane]] - bias));
+        }
+      }
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,262 @@
+#include "large_exponent_array.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <mm_malloc.h>
+
+// 64 bit integer operations on 4 lanes, with AVX only on the two 128 bit halves.
+#ifdef __AVX2__
+
+inline __m256i add_epi64(__m256i a, __m256i b) {
+  return _mm256_add_epi64(a, b);
+}
+
+inline __m256i sub_epi64(__m256i a, __m256i b) {
+  return _mm256_sub_epi64(a, b);
+}
+
+inline __m256i cmpgt_epi64(__m256i a, __m256i b) {
+  return _mm256_cmpgt_epi64(a, b);
+}
+
+inline __m256i cmpeq_epi64(__m256i a, __m256i b) {
+  return _mm256_cmpeq_epi64(a, b);
+}
+
+inline __m256i slli52_epi64(__m256i a) {
+  return _mm256_slli_epi64(a, 52);
+}
+
+// The exponents returned by extract_and_clear_exponent as int64 without bias.
+inline __m256i exponent_epi64(__m256i extracted) {
+  return _mm256_sub_epi64(extracted, _mm256_set1_epi64x(EXPONENT_BIAS));
+}
+
+#else // __AVX__
+
+inline __m256i combine(__m128i low, __m128i high) {
+  return _mm256_insertf128_si256(_mm256_castsi128_si256(low), high, 1);
+}
+
+inline __m256i add_epi64(__m256i a, __m256i b) {
+  return combine(_mm_add_epi64(_mm256_castsi256_si128(a), _mm256_castsi256_si128(b)),
+                 _mm_add_epi64(_mm256_extractf128_si256(a, 1), _mm256_extractf128_si256(b, 1)));
+}
+
+inline __m256i sub_epi64(__m256i a, __m256i b) {
+  return combine(_mm_sub_epi64(_mm256_castsi256_si128(a), _mm256_castsi256_si128(b)),
+                 _mm_sub_epi64(_mm256_extractf128_si256(a, 1), _mm256_extractf128_si256(b, 1)));
+}
+
+inline __m256i cmpgt_epi64(__m256i a, __m256i b) {
+  return combine(_mm_cmpgt_epi64(_mm256_castsi256_si128(a), _mm256_castsi256_si128(b)),
+                 _mm_cmpgt_epi64(_mm256_extractf128_si256(a, 1), _mm256_extractf128_si256(b, 1)));
+}
+
+inline __m256i cmpeq_epi64(__m256i a, __m256i b) {
+  return combine(_mm_cmpeq_epi64(_mm256_castsi256_si128(a), _mm256_castsi256_si128(b)),
+                 _mm_cmpeq_epi64(_mm256_extractf128_si256(a, 1), _mm256_extractf128_si256(b, 1)));
+}
+
+inline __m256i slli52_epi64(__m256i a) {
+  return combine(_mm_slli_epi64(_mm256_castsi256_si128(a), 52), _mm_slli_epi64(_mm256_extractf128_si256(a, 1), 52));
+}
+
+// The exponents returned by extract_and_clear_exponent (int32 without bias, in the lane order 0, 2, 1, 3) as int64.
+inline __m256i exponent_epi64(__m128i extracted) {
+  const __m128i ordered = _mm_shuffle_epi32(extracted, _MM_SHUFFLE(3, 1, 2, 0));
+  return combine(_mm_cvtepi32_epi64(ordered), _mm_cvtepi32_epi64(_mm_srli_si128(ordered, 8)));
+}
+
+#endif
+
+inline __m256i blendv_epi64(__m256i a, __m256i b, __m256i mask) {
+  return _mm256_castpd_si256(_mm256_blendv_pd(_mm256_castsi256_pd(a), _mm256_castsi256_pd(b),
+                                              _mm256_castsi256_pd(mask)));
+}
+
+// Lanes of the 4 elements starting at i that are beyond size.
+inline __m256d beyond_size_mask(const long int i, const long int size) {
+  const __m256d vi = _mm256_add_pd(_mm256_set1_pd(i), _mm256_set_pd(3, 2, 1, 0));
+  return _mm256_cmp_pd(vi, _mm256_set1_pd(size), _CMP_GE_OQ);
+}
+
+// Normalizes significand (the values at 4 elements) and adds the extracted exponents to exponent. Zeros stay zero.
+inline void normalize4(__m256d significand, __m256i exponent, double* significand_out, int64_t* exponent_out) {
+  const __m256d zero = _mm256_cmp_pd(significand, _mm256_setzero_pd(), _CMP_EQ_OQ);
+  const __m256i delta_exponent = exponent_epi64(extract_and_clear_exponent(significand));
+  exponent = blendv_epi64(add_epi64(exponent, delta_exponent), _mm256_setzero_si256(), _mm256_castpd_si256(zero));
+  _mm256_store_pd(significand_out, _mm256_blendv_pd(significand, _mm256_setzero_pd(), zero));
+  _mm256_store_si256(reinterpret_cast<__m256i*>(exponent_out), exponent);
+}
+
+// 2^(exponent - max_exponent), 0 if the difference is below -1022 or above 0 (only possible for zeros, which can have
+// any exponent).
+inline __m256d scale4(const int64_t* exponent, const __m256i max_exponent) {
+  const __m256i delta = sub_epi64(_mm256_load_si256(reinterpret_cast<const __m256i*>(exponent)), max_exponent);
+  const __m256i out_of_range = _mm256_castpd_si256(_mm256_or_pd(
+          _mm256_castsi256_pd(cmpgt_epi64(_mm256_set1_epi64x(-1022), delta)),
+          _mm256_castsi256_pd(cmpgt_epi64(delta, _mm256_setzero_si256()))));
+  const __m256i bits = slli52_epi64(add_epi64(delta, _mm256_set1_epi64x(EXPONENT_BIAS)));
+  return _mm256_castsi256_pd(blendv_epi64(bits, _mm256_setzero_si256(), out_of_range));
+}
+
+LargeExponentFloatArray::LargeExponentFloatArray(const long int size):
+  size(size)
+{
+  const long int padded_size = (size + 3) & ~3;
+  significand = static_cast<double*>(_mm_malloc(padded_size * sizeof(double), 64));
+  exponent = static_cast<int64_t*>(_mm_malloc(padded_size * sizeof(int64_t), 64));
+  std::fill(significand, significand + padded_size, 1.0);
+  std::fill(exponent, exponent + padded_size, 0);
+}
+
+LargeExponentFloatArray::~LargeExponentFloatArray() {
+  _mm_free(significand);
+  _mm_free(exponent);
+}
+
+void LargeExponentFloatArray::mul(const LargeExponentFloatArray& other) {
+  assert(other.size == size);
+  for (long int i = 0; i < size; i += 4) {
+    const __m256d s = _mm256_mul_pd(_mm256_load_pd(&significand[i]), _mm256_load_pd(&other.significand[i]));
+    const __m256i e = add_epi64(_mm256_load_si256(reinterpret_cast<const __m256i*>(&exponent[i])),
+                                _mm256_load_si256(reinterpret_cast<const __m256i*>(&other.exponent[i])));
+    normalize4(s, e, &significand[i], &exponent[i]);
+  }
+}
+
+void LargeExponentFloatArray::div(const LargeExponentFloatArray& other) {
+  assert(other.size == size);
+  for (long int i = 0; i < size; i += 4) {
+    const __m256d s = _mm256_div_pd(_mm256_load_pd(&significand[i]), _mm256_load_pd(&other.significand[i]));
+    const __m256i e = sub_epi64(_mm256_load_si256(reinterpret_cast<const __m256i*>(&exponent[i])),
+                                _mm256_load_si256(reinterpret_cast<const __m256i*>(&other.exponent[i])));
+    normalize4(s, e, &significand[i], &exponent[i]);
+  }
+}
+
+LargeExponentFloat LargeExponentFloatArray::product() const {
+  constexpr long int ELEMENTS_PER_LOOP = 4 * 4;
+  // the significands are in [1,2), so a lane can take up to 1023 of them without overflow
+  constexpr long int LOOPS_PER_NORMALIZATION = 256;
+  const long int lastj = size & (-ELEMENTS_PER_LOOP);
+
+  LargeProduct vprod;
+  __m256d zero = _mm256_setzero_pd();
+  __m256i exponent_sum = _mm256_setzero_si256();
+  const __m256d vzero = _mm256_setzero_pd();
+  auto load = [&](const long int j) {
+    const __m256d s = _mm256_load_pd(&significand[j]);
+    zero = _mm256_or_pd(zero, _mm256_cmp_pd(s, vzero, _CMP_EQ_OQ));
+    exponent_sum = add_epi64(exponent_sum, _mm256_load_si256(reinterpret_cast<const __m256i*>(&exponent[j])));
+    return s;
+  };
+
+  for (long int j = 0; j < lastj; j += ELEMENTS_PER_LOOP) {
+    const __m256d s0 = load(j);
+    const __m256d s1 = load(j + 4);
+    const __m256d s2 = load(j + 8);
+    const __m256d s3 = load(j + 12);
+    vprod.mul_no_overflow1234(s0, s1, s2, s3);
+    if ((j / ELEMENTS_PER_LOOP) % LOOPS_PER_NORMALIZATION == LOOPS_PER_NORMALIZATION - 1) {
+      vprod.normalize_exponent1234();
+    }
+  }
+  vprod.normalize_exponent1234();
+  // the padding is 1 with exponent 0
+  for (long int j = lastj; j < size; j += 4) {
+    vprod.mul_mask_no_overflow(load(j), vzero);
+  }
+
+  if (_mm256_movemask_pd(zero) != 0) {
+    return LargeExponentFloat(0.0);
+  }
+  alignas(32) int64_t exponents[4];
+  _mm256_store_si256(reinterpret_cast<__m256i*>(exponents), exponent_sum);
+  const LargeExponentFloat prod = vprod.get();
+  return LargeExponentFloat(prod.significand,
+                            prod.exponent + exponents[0] + exponents[1] + exponents[2] + exponents[3]);
+}
+
+int64_t LargeExponentFloatArray::max_exponent() const {
+  const __m256i min = _mm256_set1_epi64x(INT64_MIN);
+  __m256i max = min;
+  for (long int i = 0; i < size; i += 4) {
+    const __m256d ignore = _mm256_or_pd(_mm256_cmp_pd(_mm256_load_pd(&significand[i]), _mm256_setzero_pd(), _CMP_EQ_OQ),
+                                        beyond_size_mask(i, size));
+    const __m256i e = blendv_epi64(_mm256_load_si256(reinterpret_cast<const __m256i*>(&exponent[i])), min,
+                                   _mm256_castpd_si256(ignore));
+    max = blendv_epi64(max, e, cmpgt_epi64(e, max));
+  }
+  alignas(32) int64_t lanes[4];
+  _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), max);
+  return *std::max_element(lanes, lanes + 4);
+}
+
+LargeExponentFloat LargeExponentFloatArray::max() const {
+  const int64_t e_max = max_exponent();
+  if (e_max == INT64_MIN) {
+    return LargeExponentFloat(0.0);
+  }
+  const __m256i max_exponent = _mm256_set1_epi64x(e_max);
+  __m256d max = _mm256_setzero_pd();
+  for (long int i = 0; i < size; i += 4) {
+    const __m256i same_exponent = cmpeq_epi64(_mm256_load_si256(reinterpret_cast<const __m256i*>(&exponent[i])),
+                                              max_exponent);
+    const __m256d candidate = _mm256_and_pd(_mm256_load_pd(&significand[i]),
+                                            _mm256_andnot_pd(beyond_size_mask(i, size),
+                                                             _mm256_castsi256_pd(same_exponent)));
+    max = _mm256_max_pd(max, candidate);
+  }
+  alignas(32) double lanes[4];
+  _mm256_store_pd(lanes, max);
+  return LargeExponentFloat(*std::max_element(lanes, lanes + 4), e_max);
+}
+
+LargeExponentFloat LargeExponentFloatArray::sum() const {
+  const int64_t e_max = max_exponent();
+  if (e_max == INT64_MIN) {
+    return LargeExponentFloat(0.0);
+  }
+  const __m256i max_exponent = _mm256_set1_epi64x(e_max);
+  __m256d sum0 = _mm256_setzero_pd();
+  __m256d sum1 = _mm256_setzero_pd();
+  long int i = 0;
+  for (; i + 8 <= size; i += 8) {
+    sum0 = _mm256_add_pd(sum0, _mm256_mul_pd(_mm256_load_pd(&significand[i]), scale4(&exponent[i], max_exponent)));
+    sum1 = _mm256_add_pd(sum1, _mm256_mul_pd(_mm256_load_pd(&significand[i + 4]),
+                                             scale4(&exponent[i + 4], max_exponent)));
+  }
+  for (; i < size; i += 4) {
+    const __m256d term = _mm256_mul_pd(_mm256_load_pd(&significand[i]), scale4(&exponent[i], max_exponent));
+    sum0 = _mm256_add_pd(sum0, _mm256_andnot_pd(beyond_size_mask(i, size), term));
+  }
+  return LargeExponentFloat(horizontal_sum(_mm256_add_pd(sum0, sum1)), e_max);
+}
+
+double LargeExponentFloatArray::log_sum_exp() const {
+  const LargeExponentFloat s = sum();
+  return std::log(s.significand) + s.exponent * M_LN2;
+}
+
+void LargeExponentFloatArray::normalized_weights(double* weights) const {
+  const LargeExponentFloat s = sum();
+  if (s.significand == 0) {
+    std::fill(weights, weights + size, 0.0);
+    return;
+  }
+  const __m256i max_exponent = _mm256_set1_epi64x(s.exponent);
+  const __m256d inverse_sum = _mm256_set1_pd(1 / s.significand);
+  const long int last = size & ~3;
+  for (long int i = 0; i < last; i += 4) {
+    _mm256_storeu_pd(&weights[i], _mm256_mul_pd(_mm256_mul_pd(_mm256_load_pd(&significand[i]),
+                                                              scale4(&exponent[i], max_exponent)), inverse_sum));
+  }
+  for (long int i = last; i < size; i++) {
+    const int64_t delta = exponent[i] - s.exponent;
+    const double scale = delta < -1022 || delta > 0 ? 0.0 : std::ldexp(1.0, delta);
+    weights[i] = significand[i] * scale / s.significand;
+  }
+}
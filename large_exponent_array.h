@@ -0,0 +1,62 @@
+#ifndef LARGE_EXPONENT_ARRAY_H
+#define LARGE_EXPONENT_ARRAY_H
+
+#include "large_product.h"
+
+/**
+ * Many LargeExponentFloat values (e.g. importance sampling weights) as structure of arrays: significands and int64
+ * exponents, both aligned to 64 bytes and padded to a multiple of 4 elements with the value 1.
+ *
+ * The values are always stored normalized, |significand| in [1,2) or 0, so elementwise products and quotients cannot
+ * overflow before they are normalized again with the exponent extraction of large_product.h.
+ */
+class LargeExponentFloatArray {
+  public:
+    const long int size;
+    double* significand;
+    int64_t* exponent;
+
+    // All values are initialized to 1.
+    explicit LargeExponentFloatArray(const long int size);
+    ~LargeExponentFloatArray();
+    LargeExponentFloatArray(const LargeExponentFloatArray&) = delete;
+    LargeExponentFloatArray& operator=(const LargeExponentFloatArray&) = delete;
+
+    void set(const long int i, const LargeExponentFloat& f) {
+      const LargeExponentFloat normalized = f.normalized_fast();
+      significand[i] = normalized.significand;
+      exponent[i] = normalized.significand == 0 ? 0 : normalized.exponent;
+    }
+
+    LargeExponentFloat get(const long int i) const {
+      return LargeExponentFloat(significand[i], exponent[i]);
+    }
+
+    // Elementwise product and quotient with the values of other (of the same size).
+    void mul(const LargeExponentFloatArray& other);
+    void div(const LargeExponentFloatArray& other);
+
+    // Product of all values.
+    LargeExponentFloat product() const;
+
+    // The following reductions are only for non-negative values (weights).
+
+    // Largest value, 0 for an empty array.
+    LargeExponentFloat max() const;
+
+    // Sum of all values. Values smaller than 2^-1022 times the largest value are neglected.
+    LargeExponentFloat sum() const;
+
+    // Natural log of the sum of all values, -inf if all are 0.
+    double log_sum_exp() const;
+
+    // Writes the values divided by their sum as doubles to weights (which has size elements). All weights are 0 if all
+    // values are 0.
+    void normalized_weights(double* weights) const;
+
+  private:
+    // Largest exponent of the non-zero values, INT64_MIN if all values are 0.
+    int64_t max_exponent() const;
+};
+
+#endif
@@ -1,6 +1,10 @@
 #ifndef LARGE_PRODUCT_H
 #define LARGE_PRODUCT_H
 
+#include <cassert>
+#include <cfloat>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
 #include <immintrin.h>
 #include <math.h>
@@ -113,12 +117,22 @@ inline double horizontal_product(__m256d vec) {
   return _mm_cvtsd_f64(result);
 }
 
+inline double horizontal_sum(__m256d vec) {
+  __m128d hi = _mm256_extractf128_pd(vec, 1);
+  __m128d lo = _mm256_castpd256_pd128(vec);
+
+  __m128d sum_lo = _mm_add_pd(lo, hi);
+  __m128d sum_hi = _mm_unpackhi_pd(sum_lo, sum_lo);
+  return _mm_cvtsd_f64(_mm_add_sd(sum_lo, sum_hi));
+}
+
 static const __m256d M256D_ONE = _mm256_set1_pd(1);
 
 /**
  * Floating point with 52-bit significant and 64bit exponent.
  *
- * Note: This class is not optimized for speed. It is used as input/output for LargeProduct.
+ * Note: This class is mainly used as input/output for LargeProduct. normalize_exponent and save_mul are not optimized
+ * for speed, normalize_exponent_fast and the operators below avoid frexp/ldexp.
  */
 class LargeExponentFloat {
   private:
@@ -160,6 +174,34 @@ class LargeExponentFloat {
     return f;
   }
 
+  // Like normalize_exponent, but with |significand| in [1,2) (or 0) and without libm calls: the exponent bits are
+  // moved to the exponent and replaced by the bias, zero is handled with masks. The only branch is for subnormal
+  // significands, which are scaled up first; it can be left out with SUBNORMAL=false if the significand is known to be
+  // normal or 0. Only for finite significands.
+  template<bool SUBNORMAL = true>
+  void normalize_exponent_fast() {
+    uint64_t bits;
+    std::memcpy(&bits, &significand, sizeof(bits));
+    int64_t subnormal_exponent = 0;
+    if (SUBNORMAL && (bits & 0x7ff0000000000000ULL) == 0) [[unlikely]] {
+      const double scaled = significand * 0x1p64;
+      std::memcpy(&bits, &scaled, sizeof(bits));
+      subnormal_exponent = 64;
+    }
+    // zero (mask all ones) stays unchanged
+    const uint64_t zero_mask = -static_cast<uint64_t>((bits << 1) == 0);
+    const int64_t delta_exponent = static_cast<int64_t>((bits >> 52) & 0x7ff) - 1023 - subnormal_exponent;
+    bits = (bits & zero_mask) | (((bits & 0x800fffffffffffffULL) | 0x3ff0000000000000ULL) & ~zero_mask);
+    std::memcpy(&significand, &bits, sizeof(bits));
+    exponent += delta_exponent & ~static_cast<int64_t>(zero_mask);
+  }
+
+  LargeExponentFloat normalized_fast() const {
+    LargeExponentFloat f(*this);
+    f.normalize_exponent_fast();
+    return f;
+  }
+
   bool operator==(const LargeExponentFloat& other) const {
     LargeExponentFloat f1 = this->normalized();
     LargeExponentFloat f2 = other.normalized();
@@ -173,7 +215,7 @@ inline std::ostream& operator<<(std::ostream& os, const LargeExponentFloat& v_ra
   return os << v.significand << " * 2^ " << v.exponent;
 }
 
-// Note: This is very slow!
+// Note: This is very slow! operator* is faster.
 inline LargeExponentFloat save_mul(const LargeExponentFloat& a, const LargeExponentFloat& b) {
   LargeExponentFloat a_normalized = a;
   a_normalized.normalize_exponent();
@@ -186,6 +228,126 @@ inline LargeExponentFloat save_mul(const LargeExponentFloat& a, const LargeExpon
   return LargeExponentFloat(prod, exponent);
 }
 
+/*
+ * Fast arithmetic for LargeExponentFloat without frexp/ldexp. The results are normalized with
+ * normalize_exponent_fast. The arguments need not be normalized. The significands of the normalized arguments are in
+ * [1,2), so the intermediate results are never subnormal.
+ */
+
+inline LargeExponentFloat operator*(const LargeExponentFloat& a, const LargeExponentFloat& b) {
+  const LargeExponentFloat a_normalized = a.normalized_fast();
+  const LargeExponentFloat b_normalized = b.normalized_fast();
+  LargeExponentFloat prod(a_normalized.significand * b_normalized.significand,
+                          a_normalized.exponent + b_normalized.exponent);
+  prod.normalize_exponent_fast<false>();
+  return prod;
+}
+
+inline LargeExponentFloat operator/(const LargeExponentFloat& a, const LargeExponentFloat& b) {
+  const LargeExponentFloat a_normalized = a.normalized_fast();
+  const LargeExponentFloat b_normalized = b.normalized_fast();
+  LargeExponentFloat quotient(a_normalized.significand / b_normalized.significand,
+                              a_normalized.exponent - b_normalized.exponent);
+  quotient.normalize_exponent_fast<false>();
+  return quotient;
+}
+
+// log2|f|, -inf for 0.
+inline double log2(const LargeExponentFloat& f) {
+  const LargeExponentFloat normalized = f.normalized_fast();
+  return std::log2(std::abs(normalized.significand)) + static_cast<double>(normalized.exponent);
+}
+
+// |f|^beta for beta >= 0. The integer part of beta * exponent goes to the exponent of the result, so the relative error
+// does not grow with the exponent of f.
+inline LargeExponentFloat pow(const LargeExponentFloat& f, const double beta) {
+  const LargeExponentFloat normalized = f.normalized_fast();
+  const double exponent = static_cast<double>(normalized.exponent);
+  const double t = beta * exponent;
+  // beta * exponent = t + t_error exactly
+  const double t_error = std::fma(beta, exponent, -t);
+  const double t_integer = std::floor(t);
+  const double fraction = (t - t_integer) + t_error + beta * std::log2(std::abs(normalized.significand));
+  const bool zero = normalized.significand == 0;
+  LargeExponentFloat result(zero ? (beta == 0 ? 1.0 : 0.0) : std::exp2(fraction),
+                            zero ? 0 : static_cast<int64_t>(t_integer));
+  result.normalize_exponent_fast<false>();
+  return result;
+}
+
+// -1, 0 or 1 if a is smaller, equal or larger than b.
+inline int compare(const LargeExponentFloat& a, const LargeExponentFloat& b) {
+  const LargeExponentFloat x = a.normalized_fast();
+  const LargeExponentFloat y = b.normalized_fast();
+  const int sign_x = (x.significand > 0) - (x.significand < 0);
+  const int sign_y = (y.significand > 0) - (y.significand < 0);
+  // zero has the smallest magnitude
+  const int64_t zero_x = -static_cast<int64_t>(sign_x == 0);
+  const int64_t zero_y = -static_cast<int64_t>(sign_y == 0);
+  const int64_t exponent_x = (x.exponent & ~zero_x) | (INT64_MIN & zero_x);
+  const int64_t exponent_y = (y.exponent & ~zero_y) | (INT64_MIN & zero_y);
+  const double abs_x = std::abs(x.significand);
+  const double abs_y = std::abs(y.significand);
+  // the significands only decide for equal exponents, the magnitudes only for equal signs
+  const int compare_exponents = (exponent_x > exponent_y) - (exponent_x < exponent_y);
+  const int compare_significands = (abs_x > abs_y) - (abs_x < abs_y);
+  const int magnitude = compare_exponents + (compare_exponents == 0) * compare_significands;
+  const int compare_signs = (sign_x > sign_y) - (sign_x < sign_y);
+  return compare_signs + (compare_signs == 0) * sign_x * magnitude;
+}
+
+inline bool operator<(const LargeExponentFloat& a, const LargeExponentFloat& b) {
+  return compare(a, b) < 0;
+}
+
+inline bool operator>(const LargeExponentFloat& a, const LargeExponentFloat& b) {
+  return compare(a, b) > 0;
+}
+
+// Number of multiplications of a product lane between two exponent extractions. Factors up to 2^63 in absolute value
+// (and down to 2^-63) cannot over- or underflow the lane.
+constexpr const int64_t MULS_PER_EXPONENT_EXTRACTION = 16;
+
+// The range of the factors that are multiplied into a lane directly, the others are split with split_lanes first.
+constexpr const double FACTOR_MIN = 0x1p-63;
+constexpr const double FACTOR_MAX = 0x1p63;
+
+// True if a lane of min_abs is below FACTOR_MIN or a lane of max_abs above FACTOR_MAX.
+inline bool factors_out_of_range(const __m256d min_abs, const __m256d max_abs) {
+  const __m256d out = _mm256_or_pd(_mm256_cmp_pd(min_abs, _mm256_set1_pd(FACTOR_MIN), _CMP_LT_OQ),
+                                   _mm256_cmp_pd(max_abs, _mm256_set1_pd(FACTOR_MAX), _CMP_GT_OQ));
+  return !_mm256_testz_pd(out, out);
+}
+
+struct SplitLanes {
+  __m256d significand;
+  __exponent_t exponent;
+  __m256d zero;
+};
+
+// The significands in [1,2) of the lanes of v and their exponents (unbiased, in the lane order of
+// extract_and_clear_exponent). Zero lanes are set in zero and give 1, infinities and NaN stay unchanged; both with
+// exponent 0.
+inline SplitLanes split_lanes(const __m256d v) {
+  const __m256d abs_v = abs(v);
+  const __m256d zero = _mm256_cmp_pd(v, _mm256_setzero_pd(), _CMP_EQ_OQ);
+  const __m256d finite = _mm256_cmp_pd(abs_v, _mm256_set1_pd(DBL_MAX), _CMP_LE_OQ);
+  const __m256d denormal = _mm256_andnot_pd(zero, _mm256_cmp_pd(abs_v, _mm256_set1_pd(DBL_MIN), _CMP_LT_OQ));
+  __m256d significand = _mm256_blendv_pd(M256D_ONE, v, _mm256_andnot_pd(zero, finite));
+  significand = _mm256_blendv_pd(significand, _mm256_mul_pd(significand, _mm256_set1_pd(0x1p64)), denormal);
+  // 2^-64 in the denormal lanes, its exponent corrects the one of the significand in the same lane order
+  __m256d correction = _mm256_blendv_pd(M256D_ONE, _mm256_set1_pd(0x1p-64), denormal);
+  const __exponent_t exponent = extract_and_clear_exponent(significand);
+  const __exponent_t correction_exponent = extract_and_clear_exponent(correction);
+#ifdef __AVX2__
+  return {_mm256_blendv_pd(v, significand, finite),
+          _mm256_sub_epi64(_mm256_add_epi64(exponent, correction_exponent), _mm256_set1_epi64x(2 * EXPONENT_BIAS)),
+          zero};
+#else // __AVX__
+  return {_mm256_blendv_pd(v, significand, finite), _mm_add_epi32(exponent, correction_exponent), zero};
+#endif
+}
+
 /**
  * Class for computing large products built from many multiplicands.
  *
@@ -194,6 +356,13 @@ inline LargeExponentFloat save_mul(const LargeExponentFloat& a, const LargeExpon
  * Note:
  * - if AVX2 is supported, the exponent is stored as 64bit integer but for each normalization a bias of 1023 is added
  * - if AVX2 is not supported, the exponent is stored as 32bit integer without bias
+ * - the multiplications check what they multiply into a lane (a factor, or the product of a pair of factors) against
+ *   [FACTOR_MIN, FACTOR_MAX]: zero factors are counted and replaced by 1, so get() is exactly 0 and zero_order() is
+ *   the number of zero factors, and the other values outside the range are scaled into it with their exponent kept
+ *   separately. So a lane cannot over- or underflow between two normalizations (e.g. for tightly clustered
+ *   particles); only the values outside the range take a separate, slower path.
+ * - an initial value of 0 counts as a zero factor, lanes that are denormal after mul are scaled into the normal range
+ *   when normalizing.
  */
 class LargeProduct {
   private:
@@ -208,22 +377,136 @@ class LargeProduct {
 #ifdef __AVX2__
     int64_t exponent_bias_count;
 #endif
+    // Number of zero factors of all lanes.
+    int64_t zeros;
+    // Exponent taken out of the factors outside [FACTOR_MIN, FACTOR_MAX].
+    int64_t scaled_exponent;
+
+    struct ScaledPairs {
+      __m256d prod12;
+      __m256d prod34;
+      int64_t exponent;
+      int64_t zeros;
+    };
+
+    // The significands of the lanes of v (see split_lanes), the sum of their exponents is added to exponent and the
+    // number of zero lanes to zeros.
+    __attribute__((always_inline)) static __m256d split_factors(const __m256d v, int64_t& exponent, int64_t& zeros) {
+      const SplitLanes split = split_lanes(v);
+      exponent += horizontal_sum(split.exponent);
+      zeros += __builtin_popcount(_mm256_movemask_pd(split.zero));
+      return split.significand;
+    }
 
-    static void normalize_exponent(__m256d &prod, __exponent_t& exponent) {
-      __exponent_t delta_exponent = extract_and_clear_exponent(prod);
+    // The products mul1 * mul2 and mul3 * mul4 of the lanes with the zero factors replaced by 1 and counted, scaled to
+    // [1,2) with the exponent returned separately. Static and by value like normalize_tiny.
+    __attribute__((noinline, cold)) static ScaledPairs scale_pairs(const __m256d mul1, const __m256d mul2,
+                                                                   const __m256d mul3, const __m256d mul4) {
+      int64_t exponent = 0;
+      int64_t zeros = 0;
+      __m256d prod12 = _mm256_mul_pd(mul1, mul2);
+      __m256d prod34 = _mm256_mul_pd(mul3, mul4);
+      // normal pair products (e.g. of clustered particles) only need the scaling, the others are recomputed from the
+      // scaled factors
+      const __m256d abs12 = abs(prod12), abs34 = abs(prod34);
+      const __m256d normal = _mm256_and_pd(
+              _mm256_cmp_pd(_mm256_min_pd(abs12, abs34), _mm256_set1_pd(DBL_MIN), _CMP_GE_OQ),
+              _mm256_cmp_pd(_mm256_max_pd(abs12, abs34), _mm256_set1_pd(DBL_MAX), _CMP_LE_OQ));
+      if (_mm256_movemask_pd(normal) != 0xf) {
+        prod12 = _mm256_mul_pd(split_factors(mul1, exponent, zeros), split_factors(mul2, exponent, zeros));
+        prod34 = _mm256_mul_pd(split_factors(mul3, exponent, zeros), split_factors(mul4, exponent, zeros));
+      }
+      return {split_factors(prod12, exponent, zeros), split_factors(prod34, exponent, zeros), exponent, zeros};
+    }
+
+    struct TinyLanes {
+      __m256d prod;
+      __exponent_t delta_exponent;
+      int64_t zeros;
+    };
+
+    // Fixes the lanes of tiny (mask) after the extraction, which were zero or denormal: their exponent bits were 0, so
+    // prod holds +-1 for a zero and +-(1 + m/2^52) for the denormal m*2^-1074. Zeros (only from the initial value) are
+    // counted and continue with 1, denormals get their exponent. Static and by value, so that the accumulators of the kernels stay in registers.
+    __attribute__((noinline, cold)) static TinyLanes normalize_tiny(const __m256d tiny, const __m256d prod,
+                                                                    const __exponent_t delta_exponent) {
+      alignas(32) double normalized[4];
 #ifdef __AVX2__
+      alignas(32) int64_t delta[4];
+      _mm256_store_si256(reinterpret_cast<__m256i*>(delta), delta_exponent);
+      const int64_t bias = EXPONENT_BIAS;
+#else // __AVX__
+      alignas(16) int32_t delta[4];
+      _mm_store_si128(reinterpret_cast<__m128i*>(delta), delta_exponent);
+      const int64_t bias = 0;
+#endif
+      _mm256_store_pd(normalized, prod);
+      int64_t zeros = 0;
+      const int lanes = _mm256_movemask_pd(tiny);
+      for (int lane = 0; lane < 4; lane++) {
+        if ((lanes >> lane) & 1) {
+          const double fraction = std::abs(normalized[lane]) - 1;
+          int exponent = 0;
+          if (fraction == 0) {
+            zeros++;
+            normalized[lane] = 1.0;
+          } else {
+            normalized[lane] = std::copysign(2 * std::frexp(fraction, &exponent), normalized[lane]);
+            exponent -= 1023;
+          }
+          delta[lane] = exponent + bias;
+        }
+      }
+#ifdef __AVX2__
+      return {_mm256_load_pd(normalized), _mm256_load_si256(reinterpret_cast<const __m256i*>(delta)), zeros};
+#else // __AVX__
+      return {_mm256_load_pd(normalized), _mm_load_si128(reinterpret_cast<const __m128i*>(delta)), zeros};
+#endif
+    }
+
+#ifdef __AVX2__
+    void normalize_exponent(__m256d &prod, __exponent_t& exponent) {
+      __exponent_t delta_exponent = extract_and_clear_exponent(prod);
+      // Zero and denormal lanes are the ones with exponent 0, the integer compare keeps the FP ports free for the
+      // kernels.
+      const __m256i tiny = _mm256_cmpeq_epi64(delta_exponent, _mm256_setzero_si256());
+      if (__builtin_expect(!_mm256_testz_si256(tiny, tiny), 0)) {
+        const TinyLanes fixed = normalize_tiny(_mm256_castsi256_pd(tiny), prod, delta_exponent);
+        prod = fixed.prod;
+        delta_exponent = fixed.delta_exponent;
+        zeros += fixed.zeros;
+      }
       exponent = _mm256_add_epi64(exponent, delta_exponent);
+    }
 #else // __AVX__
+    void normalize_exponent(__m256d &prod, __exponent_t& exponent) {
+      const __m256d tiny = _mm256_cmp_pd(abs(prod), _mm256_set1_pd(DBL_MIN), _CMP_LT_OQ);
+      __exponent_t delta_exponent = extract_and_clear_exponent(prod);
+      if (__builtin_expect(!_mm256_testz_pd(tiny, tiny), 0)) {
+        const TinyLanes fixed = normalize_tiny(tiny, prod, delta_exponent);
+        prod = fixed.prod;
+        delta_exponent = fixed.delta_exponent;
+        zeros += fixed.zeros;
+      }
       exponent = _mm_add_epi32(exponent, delta_exponent);
-#endif
     }
+#endif
 
-    static __m256d save_mul(__m256d prod1, __m256d prod2, __exponent_t& exponents) {
+    __m256d save_mul(__m256d prod1, __m256d prod2, __exponent_t& exponents) {
       __m256d prod = _mm256_mul_pd(prod1, prod2);
       normalize_exponent(prod, exponents);
       return prod;
     }
 
+    // Actual exponent of a normalized product.
+    int64_t actual_exponent() const {
+      int64_t combined = horizontal_sum(exponent) + scaled_exponent;
+#ifdef __AVX2__
+      combined -= EXPONENT_BIAS * exponent_bias_count;
+#endif
+      return combined;
+    }
+
     void mul_no_overflow1(__m256d mul1) {
       prod1 = _mm256_mul_pd(prod1, mul1);
     }
@@ -241,37 +524,90 @@ class LargeProduct {
     }
 
 public:
+    // the factors of 4 particles, see mul_pair_factors
+    typedef __m256d Factor;
+
     LargeProduct(const LargeExponentFloat& initial_value):
       LargeProduct(initial_value.significand, initial_value.exponent) {}
 
     LargeProduct(double significand = 1.0, int64_t exponent = 0):
-      prod1(_mm256_set_pd(1, 1, 1, significand)),
       prod2(M256D_ONE),
       prod3(M256D_ONE),
       prod4(M256D_ONE),
 #ifdef __AVX2__
-      exponent(_mm256_set_epi64x(0, 0, 0, exponent)),
-      exponent_bias_count(0)
-#else
-      exponent(_mm_set_epi32(0, 0, 0, exponent))
+      exponent_bias_count(0),
 #endif
+      zeros(0),
+      scaled_exponent(0)
     {
+      // an initial value outside [FACTOR_MIN, FACTOR_MAX] is normalized, so that the first multiplications cannot over-
+      // or underflow (a branch, which keeps the normalization out of the dependency chain of repeated kernel calls)
+      LargeExponentFloat initial(significand, exponent);
+      if (!(std::abs(significand) >= FACTOR_MIN && std::abs(significand) <= FACTOR_MAX)) [[unlikely]] {
+        initial.normalize_exponent_fast();
+      }
+      prod1 = _mm256_set_pd(1, 1, 1, initial.significand);
+#ifdef __AVX2__
+      this->exponent = _mm256_set_epi64x(0, 0, 0, initial.exponent);
+#else
+      this->exponent = _mm_set_epi32(0, 0, 0, initial.exponent);
+#endif
     }
 
+    // Multiplies prod1 with mul1 * mul2.
     void mul_no_overflow12(__m256d mul1, __m256d mul2) {
-      mul_no_overflow1(mul1);
-      mul_no_overflow2(mul2);
+      __m256d prod12 = _mm256_mul_pd(mul1, mul2);
+      const __m256d abs12 = abs(prod12);
+      if (__builtin_expect(factors_out_of_range(abs12, abs12), 0)) {
+        const ScaledPairs scaled = scale_pairs(mul1, mul2, M256D_ONE, M256D_ONE);
+        prod12 = scaled.prod12;
+        scaled_exponent += scaled.exponent;
+        zeros += scaled.zeros;
+      }
+      mul_no_overflow1(prod12);
     }
 
+    // Multiplies prod1 with mul1 * mul2 and prod2 with mul3 * mul4: the pair products are what is checked, which
+    // halves the cost of the check and the dependent multiplications of the accumulators.
     void mul_no_overflow1234(__m256d mul1, __m256d mul2, __m256d mul3, __m256d mul4) {
-      mul_no_overflow1(mul1);
-      mul_no_overflow2(mul2);
-      mul_no_overflow3(mul3);
-      mul_no_overflow4(mul4);
+      __m256d prod12 = _mm256_mul_pd(mul1, mul2);
+      __m256d prod34 = _mm256_mul_pd(mul3, mul4);
+      const __m256d abs12 = abs(prod12);
+      const __m256d abs34 = abs(prod34);
+      if (__builtin_expect(factors_out_of_range(_mm256_min_pd(abs12, abs34), _mm256_max_pd(abs12, abs34)), 0)) {
+        const ScaledPairs scaled = scale_pairs(mul1, mul2, mul3, mul4);
+        prod12 = scaled.prod12;
+        prod34 = scaled.prod34;
+        scaled_exponent += scaled.exponent;
+        zeros += scaled.zeros;
+      }
+      mul_no_overflow1(prod12);
+      mul_no_overflow2(prod34);
     }
 
+    // Multiplies the lanes of prod1 not set in mask. The factors of the masked lanes are not checked (e.g. padding).
     void mul_mask_no_overflow(__m256d mul, __m256d mask) {
-      prod1 = _mm256_blendv_pd(_mm256_mul_pd(prod1, mul), prod1, mask);
+      __m256d factor = _mm256_blendv_pd(mul, M256D_ONE, mask);
+      const __m256d abs_factor = abs(factor);
+      if (__builtin_expect(factors_out_of_range(abs_factor, abs_factor), 0)) {
+        const ScaledPairs scaled = scale_pairs(factor, M256D_ONE, M256D_ONE, M256D_ONE);
+        factor = scaled.prod12;
+        scaled_exponent += scaled.exponent;
+        zeros += scaled.zeros;
+      }
+      mul_no_overflow1(factor);
+    }
+
+    // Multiplies the first lane of prod1 with a single factor. Counts as a multiplication of prod1 between two
+    // normalizations, like the vector multiplications.
+    void mul_no_overflow(double mul) {
+      if (__builtin_expect(std::abs(mul) < FACTOR_MIN || std::abs(mul) > FACTOR_MAX, 0)) {
+        const ScaledPairs scaled = scale_pairs(_mm256_set_pd(1, 1, 1, mul), M256D_ONE, M256D_ONE, M256D_ONE);
+        mul = _mm256_cvtsd_f64(scaled.prod12);
+        scaled_exponent += scaled.exponent;
+        zeros += scaled.zeros;
+      }
+      prod1 = _mm256_mul_pd(prod1, _mm256_set_pd(1, 1, 1, mul));
     }
 
     void normalize_exponent1234() {
@@ -304,37 +640,352 @@ public:
       prod2 = save_mul(prod2, other.prod2, exponent);
       prod3 = save_mul(prod3, other.prod3, exponent);
       prod4 = save_mul(prod4, other.prod4, exponent);
-      exponent += other.exponent;
 #ifdef __AVX2__
+      exponent = _mm256_add_epi64(exponent, other.exponent);
       exponent_bias_count += 16;
       exponent_bias_count += other.exponent_bias_count;
+#else // __AVX__
+      // 32bit lanes, the vector += of __m128i would add 64bit lanes
+      exponent = _mm_add_epi32(exponent, other.exponent);
 #endif
+      zeros += other.zeros;
+      scaled_exponent += other.scaled_exponent;
+    }
+
+    // Number of zero factors (see the note above).
+    int64_t zero_order() const {
+      LargeProduct normalized(*this);
+      normalized.normalize_exponent1234();
+      return normalized.zeros;
     }
 
     LargeExponentFloat get() const {
       // Make sure the individual products are normalized. Then, we do not have to normalize
       // when calculating the horizontal product as there is guaranteed no over-/underflow.
-      __m256d prod1 = this->prod1;
-      __m256d prod2 = this->prod2;
-      __m256d prod3 = this->prod3;
-      __m256d prod4 = this->prod4;
-      __exponent_t exponent = this->exponent;
+      LargeProduct normalized(*this);
+      normalized.normalize_exponent1234();
+      if (normalized.zeros != 0) {
+        return LargeExponentFloat(0.0);
+      }
+      const int64_t combined_exponent = normalized.actual_exponent();
+
+      __m256d prod12 = _mm256_mul_pd(normalized.prod1, normalized.prod2);
+      __m256d prod34 = _mm256_mul_pd(normalized.prod3, normalized.prod4);
+      __m256d prod = _mm256_mul_pd(prod12, prod34);
 
-      normalize_exponent(prod1, exponent);
-      normalize_exponent(prod2, exponent);
-      normalize_exponent(prod3, exponent);
-      normalize_exponent(prod4, exponent);
+      double significand = horizontal_product(prod);
+      return LargeExponentFloat(significand, combined_exponent);
+    }
 
-      __m256d prod12 = _mm256_mul_pd(prod1, prod2);
-      __m256d prod34 = _mm256_mul_pd(prod3, prod4);
-      __m256d prod = _mm256_mul_pd(prod12, prod34);
+};
+
+/**
+ * The loop of the kernels that multiply the pair factors of all particles j != k into two products (e.g.
+ * prod_dist2_complexcomplexvec, prod_diff_complexcomplexvec and prod_pair_factor_vec). Product is LargeProduct or
+ * LargeComplexProduct. factors(j, factor1, factor2) computes the factors (Product::Factor) of the particles j, ..., j+3
+ * for both products and may read the padding up to the next multiple of 4. The particles are processed in blocks of 16
+ * with four independent accumulators, the exponents are extracted every MULS_PER_EXPONENT_EXTRACTION blocks.
+ */
+template<class Product, class Factors>
+inline void mul_pair_factors(
+        const int64_t N,
+        const int64_t k,
+        Product& vprod1,
+        Product& vprod2,
+        Factors factors
+) {
+  typedef typename Product::Factor Factor;
+  const int64_t ELEMENTS_PER_LOOP = 4 * 4;
+  assert(k >= 0);
+
+  const int64_t skipj = k & (-ELEMENTS_PER_LOOP);
+  const int64_t lastj = N & (-ELEMENTS_PER_LOOP);
+
+  for (int64_t j=0; j<lastj; j += ELEMENTS_PER_LOOP) [[likely]] {
+    if (j != skipj) [[likely]] {
+      Factor f1[4], f2[4];
+      factors(j +  0, f1[0], f2[0]);
+      factors(j +  4, f1[1], f2[1]);
+      factors(j +  8, f1[2], f2[2]);
+      factors(j + 12, f1[3], f2[3]);
+      vprod1.mul_no_overflow1234(f1[0], f1[1], f1[2], f1[3]);
+      vprod2.mul_no_overflow1234(f2[0], f2[1], f2[2], f2[3]);
+    }
+
+    if ((j / ELEMENTS_PER_LOOP) % MULS_PER_EXPONENT_EXTRACTION == 0) {
+      vprod1.normalize_exponent1234();
+      vprod2.normalize_exponent1234();
+    }
+  }
+
+  const __m256d vk = _mm256_set1_pd(k);
+  const __m256d four = _mm256_set1_pd(4);
+
+  // Process the skipped block
+  if (skipj < lastj) [[likely]] {
+    vprod1.normalize_exponent1();
+    vprod2.normalize_exponent1();
+
+    __m256d vj = _mm256_set1_pd(skipj);
+    vj = _mm256_add_pd(vj, _mm256_set_pd(3, 2, 1, 0));
+    for (int64_t j = skipj; j < skipj + ELEMENTS_PER_LOOP; j += 4) {
+      Factor f1, f2;
+      factors(j, f1, f2);
+      __m256d mask = _mm256_cmp_pd(vj, vk, _CMP_EQ_OQ);
+      vprod1.mul_mask_no_overflow(f1, mask);
+      vprod2.mul_mask_no_overflow(f2, mask);
+      vj = _mm256_add_pd(vj, four);
+    }
+  }
+
+  vprod1.normalize_exponent1();
+  vprod2.normalize_exponent1();
+
+  // Process the remaining elements
+  __m256d vn = _mm256_set1_pd(N);
+  __m256d vj = _mm256_set1_pd(lastj);
+  vj = _mm256_add_pd(vj, _mm256_set_pd(3,2,1,0));
+  for (int64_t j=lastj; j<N; j += 4) {
+    Factor f1, f2;
+    factors(j, f1, f2);
+    __m256d mask = _mm256_or_pd(_mm256_cmp_pd(vj, vn, _CMP_GE_OQ), _mm256_cmp_pd(vj, vk, _CMP_EQ_OQ));
+    vprod1.mul_mask_no_overflow(f1, mask);
+    vprod2.mul_mask_no_overflow(f2, mask);
+    vj = _mm256_add_pd(vj, four);
+  }
+}
+
+/**
+ * mul_pair_factors for a single product (e.g. prod_diff_realvec and prod_dist2_complexvec), factors(j) returns the
+ * factors (Product::Factor) of the particles j, ..., j+3.
+ */
+template<class Product, class Factors>
+inline void mul_factors(
+        const int64_t N,
+        const int64_t k,
+        Product& vprod,
+        Factors factors
+) {
+  const int64_t ELEMENTS_PER_LOOP = 4 * 4;
+  assert(k >= 0);
+
+  const int64_t skipj = k & (-ELEMENTS_PER_LOOP);
+  const int64_t lastj = N & (-ELEMENTS_PER_LOOP);
+
+  for (int64_t j=0; j<lastj; j += ELEMENTS_PER_LOOP) [[likely]] {
+    if (j != skipj) [[likely]] {
+      vprod.mul_no_overflow1234(factors(j + 0), factors(j + 4), factors(j + 8), factors(j + 12));
+    }
+
+    if ((j / ELEMENTS_PER_LOOP) % MULS_PER_EXPONENT_EXTRACTION == 0) {
+      vprod.normalize_exponent1234();
+    }
+  }
+
+  const __m256d vk = _mm256_set1_pd(k);
+  const __m256d four = _mm256_set1_pd(4);
+
+  // Process the skipped block
+  if (skipj < lastj) [[likely]] {
+    vprod.normalize_exponent1();
+
+    __m256d vj = _mm256_set1_pd(skipj);
+    vj = _mm256_add_pd(vj, _mm256_set_pd(3, 2, 1, 0));
+    for (int64_t j = skipj; j < skipj + ELEMENTS_PER_LOOP; j += 4) {
+      __m256d mask = _mm256_cmp_pd(vj, vk, _CMP_EQ_OQ);
+      vprod.mul_mask_no_overflow(factors(j), mask);
+      vj = _mm256_add_pd(vj, four);
+    }
+  }
+
+  vprod.normalize_exponent1();
+
+  // Process the remaining elements
+  __m256d vn = _mm256_set1_pd(N);
+  __m256d vj = _mm256_set1_pd(lastj);
+  vj = _mm256_add_pd(vj, _mm256_set_pd(3,2,1,0));
+  for (int64_t j=lastj; j<N; j += 4) {
+    __m256d mask = _mm256_or_pd(_mm256_cmp_pd(vj, vn, _CMP_GE_OQ), _mm256_cmp_pd(vj, vk, _CMP_EQ_OQ));
+    vprod.mul_mask_no_overflow(factors(j), mask);
+    vj = _mm256_add_pd(vj, four);
+  }
+}
+
+/**
+ * Class for computing large products built from many complex multiplicands.
+ *
+ * Works like LargeProduct, but each lane holds a complex (sub)product whose real and imaginary parts are kept in
+ * separate registers. Both parts of a lane share one exponent, which is taken from the larger of the two absolute
+ * values when normalizing. The result is returned as magnitude (with large exponent) and phase.
+ *
+ * Note: the exponents are stored the same way as for LargeProduct (biased 64bit with AVX2, unbiased 32bit otherwise).
+ */
+class LargeComplexProduct {
+  private:
+    __m256d re1;
+    __m256d im1;
+    __m256d re2;
+    __m256d im2;
+    __m256d re3;
+    __m256d im3;
+    __m256d re4;
+    __m256d im4;
+
+    __exponent_t exponent;
+#ifdef __AVX2__
+    int64_t exponent_bias_count;
+#endif
+
+    static void normalize_exponent(__m256d& re, __m256d& im, __exponent_t& exponent) {
+      const __m256i exponent_mask = _mm256_set1_epi64x(0x7ff0000000000000ULL);
+      // Clamped below 2^1023, where 2^-e would be 0: lanes in [2^1023, DBL_MAX] are scaled by 2^-1022 to [2, 4) with
+      // the same exponent. NaN lanes are not clamped (the second operand of min).
+      __m256d max_abs = _mm256_min_pd(_mm256_set1_pd(0x1.fffffffffffffp+1022), _mm256_max_pd(abs(re), abs(im)));
+
+      // 2^-e as double is (2 * EXPONENT_BIAS - biased e) << 52, which is computed without shifting
+      __m256i max_exponent_bits = _mm256_castpd_si256(_mm256_and_pd(max_abs, _mm256_castsi256_pd(exponent_mask)));
+#ifdef __AVX2__
+      __m256i scale_bits = _mm256_sub_epi64(_mm256_set1_epi64x(2046ULL << 52), max_exponent_bits);
+#else // __AVX__
+      const __m128i two_bias = _mm_set1_epi64x(2046ULL << 52);
+      __m128i scale_low = _mm_sub_epi64(two_bias, _mm256_castsi256_si128(max_exponent_bits));
+      __m128i scale_high = _mm_sub_epi64(two_bias, _mm256_extractf128_si256(max_exponent_bits, 1));
+      __m256i scale_bits = _mm256_insertf128_si256(_mm256_castsi128_si256(scale_low), scale_high, 1);
+#endif
+      __m256d scale = _mm256_castsi256_pd(scale_bits);
+      re = _mm256_mul_pd(re, scale);
+      im = _mm256_mul_pd(im, scale);
+
+      __exponent_t delta_exponent = extract_and_clear_exponent(max_abs);
+#ifdef __AVX2__
+      exponent = _mm256_add_epi64(exponent, delta_exponent);
+#else // __AVX__
+      exponent = _mm_add_epi32(exponent, delta_exponent);
+#endif
+    }
+
+    static void mul_no_overflow(__m256d& re, __m256d& im, __m256d mul_re, __m256d mul_im) {
+      __m256d new_re = _mm256_sub_pd(_mm256_mul_pd(re, mul_re), _mm256_mul_pd(im, mul_im));
+      __m256d new_im = _mm256_add_pd(_mm256_mul_pd(re, mul_im), _mm256_mul_pd(im, mul_re));
+      re = new_re;
+      im = new_im;
+    }
+
+  public:
+    LargeComplexProduct(const LargeExponentFloat& magnitude = LargeExponentFloat(1.0), double phase = 0.0):
+      re1(_mm256_set_pd(1, 1, 1, magnitude.significand * std::cos(phase))),
+      im1(_mm256_set_pd(0, 0, 0, magnitude.significand * std::sin(phase))),
+      re2(M256D_ONE),
+      im2(_mm256_setzero_pd()),
+      re3(M256D_ONE),
+      im3(_mm256_setzero_pd()),
+      re4(M256D_ONE),
+      im4(_mm256_setzero_pd()),
+#ifdef __AVX2__
+      exponent(_mm256_set_epi64x(0, 0, 0, magnitude.exponent)),
+      exponent_bias_count(0)
+#else
+      exponent(_mm_set_epi32(0, 0, 0, magnitude.exponent))
+#endif
+    {
+    }
+
+    void mul_no_overflow12(__m256d mul_re1, __m256d mul_im1, __m256d mul_re2, __m256d mul_im2) {
+      mul_no_overflow(re1, im1, mul_re1, mul_im1);
+      mul_no_overflow(re2, im2, mul_re2, mul_im2);
+    }
+
+    void mul_no_overflow1234(__m256d mul_re1, __m256d mul_im1, __m256d mul_re2, __m256d mul_im2,
+                             __m256d mul_re3, __m256d mul_im3, __m256d mul_re4, __m256d mul_im4) {
+      mul_no_overflow(re1, im1, mul_re1, mul_im1);
+      mul_no_overflow(re2, im2, mul_re2, mul_im2);
+      mul_no_overflow(re3, im3, mul_re3, mul_im3);
+      mul_no_overflow(re4, im4, mul_re4, mul_im4);
+    }
+
+    // the real and imaginary parts of the factors of 4 particles, see mul_pair_factors
+    struct Factor {
+      __m256d re, im;
+    };
+
+    void mul_no_overflow1234(const Factor mul1, const Factor mul2, const Factor mul3, const Factor mul4) {
+      mul_no_overflow1234(mul1.re, mul1.im, mul2.re, mul2.im, mul3.re, mul3.im, mul4.re, mul4.im);
+    }
+
+    void mul_mask_no_overflow(const Factor mul, const __m256d mask) {
+      mul_mask_no_overflow(mul.re, mul.im, mask);
+    }
+
+    void mul_mask_no_overflow(__m256d mul_re, __m256d mul_im, __m256d mask) {
+      __m256d new_re = re1;
+      __m256d new_im = im1;
+      mul_no_overflow(new_re, new_im, mul_re, mul_im);
+      re1 = _mm256_blendv_pd(new_re, re1, mask);
+      im1 = _mm256_blendv_pd(new_im, im1, mask);
+    }
+
+    void normalize_exponent1234() {
+      normalize_exponent(re1, im1, exponent);
+      normalize_exponent(re2, im2, exponent);
+      normalize_exponent(re3, im3, exponent);
+      normalize_exponent(re4, im4, exponent);
+#ifdef __AVX2__
+      exponent_bias_count += 16;
+#endif
+    }
+
+    void normalize_exponent1() {
+      normalize_exponent(re1, im1, exponent);
+#ifdef __AVX2__
+      exponent_bias_count += 4;
+#endif
+    }
+
+    void normalize_exponent12() {
+      normalize_exponent(re1, im1, exponent);
+      normalize_exponent(re2, im2, exponent);
+#ifdef __AVX2__
+      exponent_bias_count += 8;
+#endif
+    }
+
+    // Returns the magnitude of the product and stores its phase (in (-pi, pi]) in phase.
+    LargeExponentFloat get(double& phase) const {
+      __m256d re1 = this->re1, im1 = this->im1;
+      __m256d re2 = this->re2, im2 = this->im2;
+      __m256d re3 = this->re3, im3 = this->im3;
+      __m256d re4 = this->re4, im4 = this->im4;
+      __exponent_t exponent = this->exponent;
+
+      // After normalization each lane has an absolute value in [1, 4*sqrt(2)), so the remaining products cannot
+      // over- or underflow.
+      normalize_exponent(re1, im1, exponent);
+      normalize_exponent(re2, im2, exponent);
+      normalize_exponent(re3, im3, exponent);
+      normalize_exponent(re4, im4, exponent);
+
+      mul_no_overflow(re1, im1, re2, im2);
+      mul_no_overflow(re3, im3, re4, im4);
+      mul_no_overflow(re1, im1, re3, im3);
+
+      double re[4];
+      double im[4];
+      _mm256_storeu_pd(re, re1);
+      _mm256_storeu_pd(im, im1);
+      double prod_re = re[0];
+      double prod_im = im[0];
+      for (int i = 1; i < 4; i++) {
+        double new_re = prod_re * re[i] - prod_im * im[i];
+        prod_im = prod_re * im[i] + prod_im * re[i];
+        prod_re = new_re;
+      }
 
       int64_t combined_exponent = horizontal_sum(exponent);
 #ifdef __AVX2__
       combined_exponent -= EXPONENT_BIAS * (exponent_bias_count + 16);
 #endif
-      double significand = horizontal_product(prod);
-      return LargeExponentFloat(significand, combined_exponent);
+      phase = std::atan2(prod_im, prod_re);
+      return LargeExponentFloat(std::hypot(prod_re, prod_im), combined_exponent);
     }
 
 };
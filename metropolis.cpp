@@ -0,0 +1,874 @@
+#include "metropolis.h"
+#include "vandermonde_det.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cfloat>
+#include <cmath>
+#include <limits>
+#include <numeric>
+
+namespace {
+  // Upper bound of the error of log2_approx. The truncation error of the series is below 1e-9.
+  constexpr double LOG2_APPROX_ERROR = 1e-8;
+
+  // Upper bound of the rounding error per particle of the log ratio, both for the full and the blocked evaluation
+  // (generous, the actual error is about 4 ulp per particle).
+  constexpr double LOG_RATIO_ERROR_PER_PARTICLE = 1e-14;
+
+  // Relative safety factors for the bounds of ratios of distances that were rounded.
+  constexpr double ROUND_DOWN = 1 - 0x1p-44;
+  constexpr double ROUND_UP = 1 + 0x1p-44;
+
+  constexpr double INF = std::numeric_limits<double>::infinity();
+
+  // The screening pass of the cascade is limited to 2^22 particles, so that the particle indices and the sums of the
+  // exponents per lane are exact in float.
+  constexpr long int MAX_CASCADE_N = 1L << 22;
+
+  // Range of the squared distances in the screening pass. With 4 factors per lane between two normalizations, the
+  // products stay in the range of normal floats.
+  constexpr double MAX_CASCADE_DIST2 = 0x1p30;
+  constexpr double MIN_CASCADE_DIST2 = 0x1p-30;
+
+  // Bounds of the relative error in log2 of one factor of the screening pass (4 roundings for the squared distance and
+  // one for the multiplication) and of the final combination of the 8 lanes (7 roundings).
+  constexpr double CASCADE_FACTOR_ERROR = 8 * 0x1p-24;
+  constexpr double CASCADE_LANE_ERROR = 11 * 0x1p-24;
+}
+
+// Returns the unbiased exponent of each lane as double (only valid for normal numbers).
+inline __m256d exponent_as_double(__m256d v) {
+  const __m256d exponent_mask = _mm256_castsi256_pd(_mm256_set1_epi64x(0x7ff0000000000000ULL));
+  // 2^52 as double, or-ing an integer < 2^52 into its significand gives 2^52 + integer
+  const __m256d two_pow_52 = _mm256_castsi256_pd(_mm256_set1_epi64x(0x4330000000000000ULL));
+
+  __m256i exponent_bits = _mm256_castpd_si256(_mm256_and_pd(v, exponent_mask));
+#ifdef __AVX2__
+  __m256i exponent = _mm256_srli_epi64(exponent_bits, 52);
+#else // __AVX__
+  __m128i exponent_low = _mm_srli_epi64(_mm256_castsi256_si128(exponent_bits), 52);
+  __m128i exponent_high = _mm_srli_epi64(_mm256_extractf128_si256(exponent_bits, 1), 52);
+  __m256i exponent = _mm256_insertf128_si256(_mm256_castsi128_si256(exponent_low), exponent_high, 1);
+#endif
+  __m256d exponent_pd = _mm256_sub_pd(_mm256_or_pd(_mm256_castsi256_pd(exponent), two_pow_52), two_pow_52);
+  return _mm256_sub_pd(exponent_pd, _mm256_set1_pd(EXPONENT_BIAS));
+}
+
+// Approximate log2 for positive normal numbers with an absolute error below LOG2_APPROX_ERROR.
+// Uses log(m) = 2*atanh((m-1)/(m+1)) for the significand m in [sqrt(1/2), sqrt(2)).
+inline __m256d log2_approx(__m256d v) {
+  const __m256d significand_mask = _mm256_castsi256_pd(_mm256_set1_epi64x(0x000fffffffffffffULL));
+
+  __m256d exponent = exponent_as_double(v);
+  __m256d m = _mm256_or_pd(_mm256_and_pd(v, significand_mask), M256D_ONE);
+  __m256d large = _mm256_cmp_pd(m, _mm256_set1_pd(M_SQRT2), _CMP_GT_OQ);
+  m = _mm256_blendv_pd(m, _mm256_mul_pd(m, _mm256_set1_pd(0.5)), large);
+  exponent = _mm256_add_pd(exponent, _mm256_and_pd(large, M256D_ONE));
+
+  __m256d t = _mm256_div_pd(_mm256_sub_pd(m, M256D_ONE), _mm256_add_pd(m, M256D_ONE));
+  __m256d t2 = _mm256_mul_pd(t, t);
+  __m256d series = _mm256_add_pd(_mm256_set1_pd(1.0 / 7), _mm256_mul_pd(t2, _mm256_set1_pd(1.0 / 9)));
+  series = _mm256_add_pd(_mm256_set1_pd(1.0 / 5), _mm256_mul_pd(t2, series));
+  series = _mm256_add_pd(_mm256_set1_pd(1.0 / 3), _mm256_mul_pd(t2, series));
+  series = _mm256_add_pd(M256D_ONE, _mm256_mul_pd(t2, series));
+  __m256d log_m = _mm256_mul_pd(_mm256_mul_pd(t, series), _mm256_set1_pd(2 / M_LN2));
+  return _mm256_add_pd(exponent, log_m);
+}
+
+// Lower bound of log2(v) for v >= 0, -inf for v == 0 (and for denormals).
+inline __m256d log2_lower_bound(__m256d v) {
+  __m256d is_tiny = _mm256_cmp_pd(v, _mm256_set1_pd(DBL_MIN), _CMP_LT_OQ);
+  __m256d log2_v = _mm256_sub_pd(log2_approx(_mm256_max_pd(v, _mm256_set1_pd(DBL_MIN))),
+                                 _mm256_set1_pd(LOG2_APPROX_ERROR));
+  return _mm256_blendv_pd(log2_v, _mm256_set1_pd(-INF), is_tiny);
+}
+
+// Upper bound of log2(v) for v >= 0, +inf for v > DBL_MAX.
+inline __m256d log2_upper_bound(__m256d v) {
+  __m256d is_huge = _mm256_cmp_pd(v, _mm256_set1_pd(DBL_MAX), _CMP_GT_OQ);
+  __m256d log2_v = _mm256_add_pd(log2_approx(_mm256_max_pd(v, _mm256_set1_pd(DBL_MIN))),
+                                 _mm256_set1_pd(LOG2_APPROX_ERROR));
+  return _mm256_blendv_pd(log2_v, _mm256_set1_pd(INF), is_huge);
+}
+
+// Same as extract_and_clear_exponent for 8 float lanes, the biased exponents are returned as float.
+inline __m256 extract_and_clear_exponent_ps(__m256& v) {
+  const __m256 exponent_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7f800000));
+  const __m256 exponent_reset_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x3f800000));
+
+  __m256 exponent_bits = _mm256_and_ps(exponent_mask, v);
+  v = _mm256_or_ps(_mm256_andnot_ps(exponent_mask, v), exponent_reset_mask);
+  // the exponent bits as integer are exponent * 2^23, which is exact as float (and needs no AVX2 shift)
+  return _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_castps_si256(exponent_bits)), _mm256_set1_ps(0x1p-23f));
+}
+
+inline double horizontal_sum(__m256 v) {
+  return horizontal_sum(_mm256_cvtps_pd(_mm256_castps256_ps128(v)))
+         + horizontal_sum(_mm256_cvtps_pd(_mm256_extractf128_ps(v, 1)));
+}
+
+// Bound of the rounding error of metropolis_accept_realvec and metropolis_accept_complexvec, given a bound of the
+// absolute value of the log2 ratio of the products and the factor that scales it to the log acceptance ratio. The
+// conversion of the exponent difference rounds relative to its size, the rest per particle.
+inline double full_evaluation_margin(const long int N, const double beta, const double scale,
+                                     const double abs_log2_ratio) {
+  return beta * LOG_RATIO_ERROR_PER_PARTICLE * (N + BOUNDS_BLOCK_SIZE) + scale * (abs_log2_ratio + 4) * 0x1p-50;
+}
+
+// log(|f_new / f_old|). The exponents are subtracted before the conversion, so the rounding error does not grow with
+// the size of the products (about 2^-53 * N * 1000 for coordinates around 2^1000 otherwise).
+inline double log_abs_ratio(const LargeExponentFloat& f_new, const LargeExponentFloat& f_old) {
+  return std::log(std::abs(f_new.significand)) - std::log(std::abs(f_old.significand))
+         + static_cast<double>(f_new.exponent - f_old.exponent) * M_LN2;
+}
+
+BlockBounds::BlockBounds(const long int N, const double* x, const double* y):
+  N(N),
+  blocks((N + BOUNDS_BLOCK_SIZE - 1) / BOUNDS_BLOCK_SIZE)
+{
+  const long int padded_blocks = (blocks + 3) & ~3;
+  count.assign(padded_blocks, 0);
+  x_min.assign(padded_blocks, 0);
+  x_max.assign(padded_blocks, 0);
+  if (y != nullptr) {
+    y_min.assign(padded_blocks, 0);
+    y_max.assign(padded_blocks, 0);
+  }
+  for (long int b = 0; b < blocks; b++) {
+    update(b * BOUNDS_BLOCK_SIZE, x, y);
+  }
+}
+
+void BlockBounds::update(const long int k, const double* x, const double* y) {
+  const long int b = k / BOUNDS_BLOCK_SIZE;
+  const long int begin = b * BOUNDS_BLOCK_SIZE;
+  const long int end = std::min<long int>(begin + BOUNDS_BLOCK_SIZE, N);
+  count[b] = end - begin;
+  x_min[b] = *std::min_element(x + begin, x + end);
+  x_max[b] = *std::max_element(x + begin, x + end);
+  if (y != nullptr) {
+    y_min[b] = *std::min_element(y + begin, y + end);
+    y_max[b] = *std::max_element(y + begin, y + end);
+  }
+}
+
+FloatPositions::FloatPositions(const long int N, const double* x, const double* y):
+  N(N),
+  max_abs(0)
+{
+  const long int padded = (N + 31) & ~31;
+  this->x = static_cast<float*>(_mm_malloc(std::max<long int>(padded, 32) * sizeof(float), 64));
+  this->y = static_cast<float*>(_mm_malloc(std::max<long int>(padded, 32) * sizeof(float), 64));
+  std::fill(this->x, this->x + padded, 0.0f);
+  std::fill(this->y, this->y + padded, 0.0f);
+  for (long int j = 0; j < N; j++) {
+    update(j, x, y);
+  }
+}
+
+FloatPositions::~FloatPositions() {
+  _mm_free(x);
+  _mm_free(y);
+}
+
+void FloatPositions::update(const long int k, const double* x, const double* y) {
+  this->x[k] = static_cast<float>(x[k]);
+  this->y[k] = static_cast<float>(y[k]);
+  max_abs = std::max({max_abs, std::abs(x[k]), std::abs(y[k])});
+}
+
+// Interleaves the lower 16 bits of a and b.
+static uint32_t morton_code(uint32_t a, uint32_t b) {
+  auto spread = [](uint32_t v) {
+    v = (v | (v << 8)) & 0x00ff00ffu;
+    v = (v | (v << 4)) & 0x0f0f0f0fu;
+    v = (v | (v << 2)) & 0x33333333u;
+    v = (v | (v << 1)) & 0x55555555u;
+    return v;
+  };
+  return spread(a) | (spread(b) << 1);
+}
+
+void spatial_sort(const long int N, double* x, double* y) {
+  if (y == nullptr) {
+    std::sort(x, x + N);
+    return;
+  }
+  if (N == 0) {
+    return;
+  }
+
+  const auto x_range = std::minmax_element(x, x + N);
+  const auto y_range = std::minmax_element(y, y + N);
+  const double x_scale = 65535 / std::max(*x_range.second - *x_range.first, DBL_MIN);
+  const double y_scale = 65535 / std::max(*y_range.second - *y_range.first, DBL_MIN);
+
+  std::vector<uint32_t> codes(N);
+  for (long int j = 0; j < N; j++) {
+    codes[j] = morton_code(static_cast<uint32_t>((x[j] - *x_range.first) * x_scale),
+                           static_cast<uint32_t>((y[j] - *y_range.first) * y_scale));
+  }
+  std::vector<long int> order(N);
+  std::iota(order.begin(), order.end(), 0);
+  std::sort(order.begin(), order.end(), [&](long int a, long int b) { return codes[a] < codes[b]; });
+
+  std::vector<double> sorted_x(N), sorted_y(N);
+  for (long int j = 0; j < N; j++) {
+    sorted_x[j] = x[order[j]];
+    sorted_y[j] = y[order[j]];
+  }
+  std::copy(sorted_x.begin(), sorted_x.end(), x);
+  std::copy(sorted_y.begin(), sorted_y.end(), y);
+}
+
+bool metropolis_accept_realvec(
+        const long int N,
+        const long int k,
+        const double u,
+        const double beta,
+        const double log_uniform,
+        const double* x
+) {
+  LargeExponentFloat prod_new(1.0);
+  LargeExponentFloat prod_old(1.0);
+  prod_diff_realrealvec(N, k, u, x[k], x, prod_new, prod_old);
+  return log_uniform < beta * log_abs_ratio(prod_new, prod_old);
+}
+
+bool metropolis_accept_complexvec(
+        const long int N,
+        const long int k,
+        const double u,
+        const double v,
+        const double beta,
+        const double log_uniform,
+        const double* x,
+        const double* y
+) {
+  LargeExponentFloat prod_new(1.0);
+  LargeExponentFloat prod_old(1.0);
+  prod_dist2_complexcomplexvec(N, k, u, x[k], v, y[k], x, y, prod_new, prod_old);
+  return log_uniform < beta * 0.5 * log_abs_ratio(prod_new, prod_old);
+}
+
+bool metropolis_accept_mixed_realvec(
+        const long int Nreal,
+        const long int Ncomplex,
+        const long int k,
+        const double u,
+        const double beta,
+        const double log_uniform,
+        const double* lambda,
+        const double* x,
+        const double* y
+) {
+  LargeExponentFloat prod_new(1.0);
+  LargeExponentFloat prod_old(1.0);
+  prod_diff_realrealvec(Nreal, k, u, lambda[k], lambda, prod_new, prod_old);
+  LargeExponentFloat dist2_new(1.0);
+  LargeExponentFloat dist2_old(1.0);
+  prod_dist2_realcomplexvec(Ncomplex, u, lambda[k], x, y, dist2_new, dist2_old);
+  return log_uniform < beta * (log_abs_ratio(prod_new, prod_old) + 0.5 * log_abs_ratio(dist2_new, dist2_old));
+}
+
+bool metropolis_accept_mixed_complexvec(
+        const long int Nreal,
+        const long int Ncomplex,
+        const long int k,
+        const double u,
+        const double v,
+        const double beta,
+        const double log_uniform,
+        const double* lambda,
+        const double* x,
+        const double* y
+) {
+  // both kernels multiply squared distances, so they can share the products
+  LargeExponentFloat prod_new(1.0);
+  LargeExponentFloat prod_old(1.0);
+  prod_dist2_complexcomplexvec(Ncomplex, k, u, x[k], v, y[k], x, y, prod_new, prod_old);
+  prod_dist2_complexrealvec(Nreal, u, x[k], v, y[k], lambda, prod_new, prod_old);
+  return log_uniform < beta * 0.5 * log_abs_ratio(prod_new, prod_old);
+}
+
+bool metropolis_accept_cluster_realvec(
+        const long int N,
+        const long int M,
+        const long int* k,
+        const double* u,
+        const double beta,
+        const double log_uniform,
+        const double* x
+) {
+  LargeExponentFloat prod_new(1.0);
+  LargeExponentFloat prod_old(1.0);
+  prod_diff_cluster_realvec(N, M, k, u, x, prod_new, prod_old);
+  return log_uniform < beta * log_abs_ratio(prod_new, prod_old);
+}
+
+bool metropolis_accept_cluster_complexvec(
+        const long int N,
+        const long int M,
+        const long int* k,
+        const double* u,
+        const double* v,
+        const double beta,
+        const double log_uniform,
+        const double* x,
+        const double* y
+) {
+  LargeExponentFloat prod_new(1.0);
+  LargeExponentFloat prod_old(1.0);
+  prod_dist2_cluster_complexvec(N, M, k, u, v, x, y, prod_new, prod_old);
+  return log_uniform < beta * 0.5 * log_abs_ratio(prod_new, prod_old);
+}
+
+static_assert(BOUNDS_BLOCK_SIZE / 16 <= MULS_PER_EXPONENT_EXTRACTION,
+              "metropolis_accept_early multiplies BOUNDS_BLOCK_SIZE/16 factors per lane between two extractions");
+
+// True if a lane of one of the products is 0, denormal, infinite or NaN, where extract_and_clear_exponent fails.
+inline bool any_not_normal(const __m256d p0, const __m256d p1, const __m256d p2, const __m256d p3) {
+  const __m256d dbl_min = _mm256_set1_pd(DBL_MIN);
+  const __m256d dbl_max = _mm256_set1_pd(DBL_MAX);
+  const __m256d min_abs = _mm256_min_pd(_mm256_min_pd(abs(p0), abs(p1)), _mm256_min_pd(abs(p2), abs(p3)));
+  const __m256d max_abs = _mm256_max_pd(_mm256_max_pd(abs(p0), abs(p1)), _mm256_max_pd(abs(p2), abs(p3)));
+  // min and max return the second operand for NaN, so NaN lanes are caught by the unordered comparisons
+  const __m256d nan = _mm256_or_pd(_mm256_cmp_pd(p0, p1, _CMP_UNORD_Q), _mm256_cmp_pd(p2, p3, _CMP_UNORD_Q));
+  return _mm256_movemask_pd(_mm256_or_pd(_mm256_or_pd(_mm256_cmp_pd(min_abs, dbl_min, _CMP_LT_OQ),
+                                                      _mm256_cmp_pd(max_abs, dbl_max, _CMP_GT_OQ)), nan)) != 0;
+}
+
+// Multiplies the normal products p0, ..., p3 into the normalized product prod and extracts the exponents into
+// exponent. The exponents are extracted 5 times per call, with the same bias for both products of a ratio.
+inline void normalize_block_product(__m256d& prod, __exponent_t& exponent,
+                                    __m256d p0, __m256d p1, __m256d p2, __m256d p3) {
+#ifdef __AVX2__
+  exponent = _mm256_add_epi64(exponent, _mm256_add_epi64(
+          _mm256_add_epi64(extract_and_clear_exponent(p0), extract_and_clear_exponent(p1)),
+          _mm256_add_epi64(extract_and_clear_exponent(p2), extract_and_clear_exponent(p3))));
+  prod = _mm256_mul_pd(prod, _mm256_mul_pd(_mm256_mul_pd(p0, p1), _mm256_mul_pd(p2, p3)));
+  exponent = _mm256_add_epi64(exponent, extract_and_clear_exponent(prod));
+#else // __AVX__
+  exponent = _mm_add_epi32(exponent, _mm_add_epi32(
+          _mm_add_epi32(extract_and_clear_exponent(p0), extract_and_clear_exponent(p1)),
+          _mm_add_epi32(extract_and_clear_exponent(p2), extract_and_clear_exponent(p3))));
+  prod = _mm256_mul_pd(prod, _mm256_mul_pd(_mm256_mul_pd(p0, p1), _mm256_mul_pd(p2, p3)));
+  exponent = _mm_add_epi32(exponent, extract_and_clear_exponent(prod));
+#endif
+}
+
+// Factors of the new and the old position for 4 particles: u-x and x[k]-x for real particles, the squared distances
+// for complex particles.
+template<bool COMPLEX>
+inline void early_factors(
+        const __m256d x0, const __m256d y0,
+        const __m256d u, const __m256d v, const __m256d xk, const __m256d yk,
+        __m256d& factor_new, __m256d& factor_old
+) {
+  if (COMPLEX) {
+    const __m256d dx_new = _mm256_sub_pd(u, x0);
+    const __m256d dy_new = _mm256_sub_pd(v, y0);
+    const __m256d dx_old = _mm256_sub_pd(xk, x0);
+    const __m256d dy_old = _mm256_sub_pd(yk, y0);
+    factor_new = _mm256_add_pd(_mm256_mul_pd(dx_new, dx_new), _mm256_mul_pd(dy_new, dy_new));
+    factor_old = _mm256_add_pd(_mm256_mul_pd(dx_old, dx_old), _mm256_mul_pd(dy_old, dy_old));
+  } else {
+    factor_new = _mm256_sub_pd(u, x0);
+    factor_old = _mm256_sub_pd(xk, x0);
+  }
+}
+
+// Computes the bounds of sum_{j in block} log2|u-x[j]| - log2|x[k]-x[j]| for all blocks (for complex particles the
+// bounds of the squared distances, i.e. twice the value).
+//
+// The bounds are computed from the range of |u-x[j]|/|x[k]-x[j]| = |1 + (u-x[k])/(x[k]-x[j])| over the box, which
+// is tight for the blocks far away from the particle when the step u-x[k] is small. The bounds of the block that
+// contains x[k] are infinite.
+template<bool COMPLEX>
+static void block_log2_bounds(
+        const BlockBounds& bounds,
+        const double u, const double v, const double xk, const double yk,
+        double* lower, double* upper
+) {
+  const __m256d zero = _mm256_setzero_pd();
+  const __m256d dbl_min = _mm256_set1_pd(DBL_MIN);
+  const __m256d plus_inf = _mm256_set1_pd(INF);
+  const __m256d xk_vec = _mm256_set1_pd(xk);
+  const __m256d yk_vec = _mm256_set1_pd(yk);
+  const __m256d step_x = _mm256_set1_pd(u - xk);
+  const __m256d step_y = _mm256_set1_pd(v - yk);
+  const __m256d round_down = _mm256_set1_pd(ROUND_DOWN);
+  const __m256d round_up = _mm256_set1_pd(ROUND_UP);
+  // absolute error bound of the interval arithmetic below relative to 1+|t|
+  const __m256d interval_error = _mm256_set1_pd(0x1p-40);
+
+  // distance between p and the interval [lo, hi]
+  auto min_distance = [&](__m256d p, __m256d lo, __m256d hi) {
+    return _mm256_max_pd(_mm256_max_pd(_mm256_sub_pd(lo, p), _mm256_sub_pd(p, hi)), zero);
+  };
+  auto max_distance = [&](__m256d p, __m256d lo, __m256d hi) {
+    return _mm256_max_pd(abs(_mm256_sub_pd(p, lo)), abs(_mm256_sub_pd(p, hi)));
+  };
+  // the product of the intervals [a0, a1] and [b0, b1]
+  auto interval_mul = [](__m256d a0, __m256d a1, __m256d b0, __m256d b1, __m256d& r0, __m256d& r1) {
+    const __m256d p00 = _mm256_mul_pd(a0, b0);
+    const __m256d p01 = _mm256_mul_pd(a0, b1);
+    const __m256d p10 = _mm256_mul_pd(a1, b0);
+    const __m256d p11 = _mm256_mul_pd(a1, b1);
+    r0 = _mm256_min_pd(_mm256_min_pd(p00, p01), _mm256_min_pd(p10, p11));
+    r1 = _mm256_max_pd(_mm256_max_pd(p00, p01), _mm256_max_pd(p10, p11));
+  };
+  // widens the interval [1+t0, 1+t1] to account for rounding errors
+  auto one_plus_interval = [&](__m256d t0, __m256d t1, __m256d& r0, __m256d& r1) {
+    r0 = _mm256_sub_pd(_mm256_add_pd(M256D_ONE, t0),
+                       _mm256_mul_pd(interval_error, _mm256_add_pd(M256D_ONE, abs(t0))));
+    r1 = _mm256_add_pd(_mm256_add_pd(M256D_ONE, t1),
+                       _mm256_mul_pd(interval_error, _mm256_add_pd(M256D_ONE, abs(t1))));
+  };
+  // the range of r^2 for r in [r0, r1]
+  auto interval_sqr = [&](__m256d r0, __m256d r1, __m256d& s0, __m256d& s1) {
+    const __m256d r0_sqr = _mm256_mul_pd(r0, r0);
+    const __m256d r1_sqr = _mm256_mul_pd(r1, r1);
+    const __m256d contains_zero = _mm256_and_pd(_mm256_cmp_pd(r0, zero, _CMP_LE_OQ),
+                                                _mm256_cmp_pd(r1, zero, _CMP_GE_OQ));
+    s0 = _mm256_blendv_pd(_mm256_min_pd(r0_sqr, r1_sqr), zero, contains_zero);
+    s1 = _mm256_max_pd(r0_sqr, r1_sqr);
+  };
+
+  for (size_t b = 0; b < bounds.count.size(); b += 4) {
+    const __m256d count = _mm256_loadu_pd(&bounds.count[b]);
+    const __m256d x_lo = _mm256_loadu_pd(&bounds.x_min[b]);
+    const __m256d x_hi = _mm256_loadu_pd(&bounds.x_max[b]);
+
+    // squared distance between x[k] and the box
+    __m256d min_old = min_distance(xk_vec, x_lo, x_hi);
+    __m256d max_old = max_distance(xk_vec, x_lo, x_hi);
+    __m256d y_lo, y_hi;
+    if (COMPLEX) {
+      y_lo = _mm256_loadu_pd(&bounds.y_min[b]);
+      y_hi = _mm256_loadu_pd(&bounds.y_max[b]);
+      const __m256d min_old_y = min_distance(yk_vec, y_lo, y_hi);
+      const __m256d max_old_y = max_distance(yk_vec, y_lo, y_hi);
+      min_old = _mm256_add_pd(_mm256_mul_pd(min_old, min_old), _mm256_mul_pd(min_old_y, min_old_y));
+      max_old = _mm256_add_pd(_mm256_mul_pd(max_old, max_old), _mm256_mul_pd(max_old_y, max_old_y));
+    } else {
+      min_old = _mm256_mul_pd(min_old, min_old);
+    }
+    // the bounds are only valid if the box does not contain x[k]
+    const __m256d valid = _mm256_cmp_pd(min_old, dbl_min, _CMP_GT_OQ);
+
+    // ratio bounds, t = (u-x[k])/w with w = x[k]-x[j]
+    const __m256d w_x0 = _mm256_sub_pd(xk_vec, x_hi);
+    const __m256d w_x1 = _mm256_sub_pd(xk_vec, x_lo);
+    __m256d ratio_sqr0, ratio_sqr1;
+    if (COMPLEX) {
+      // 1/w = conj(w)/|w|^2 with interval arithmetic, min_old and max_old are the range of |w|^2
+      const __m256d inv_norm0 = _mm256_div_pd(M256D_ONE, max_old);
+      const __m256d inv_norm1 = _mm256_div_pd(M256D_ONE, min_old);
+      __m256d p0, p1, q0, q1;
+      interval_mul(w_x0, w_x1, inv_norm0, inv_norm1, p0, p1);
+      interval_mul(_mm256_sub_pd(y_lo, yk_vec), _mm256_sub_pd(y_hi, yk_vec), inv_norm0, inv_norm1, q0, q1);
+      // t = (step_x + i*step_y) * (p + i*q)
+      const __m256d step_x_p0 = _mm256_mul_pd(step_x, p0), step_x_p1 = _mm256_mul_pd(step_x, p1);
+      const __m256d step_x_q0 = _mm256_mul_pd(step_x, q0), step_x_q1 = _mm256_mul_pd(step_x, q1);
+      const __m256d step_y_p0 = _mm256_mul_pd(step_y, p0), step_y_p1 = _mm256_mul_pd(step_y, p1);
+      const __m256d step_y_q0 = _mm256_mul_pd(step_y, q0), step_y_q1 = _mm256_mul_pd(step_y, q1);
+      const __m256d re_t0 = _mm256_sub_pd(_mm256_min_pd(step_x_p0, step_x_p1), _mm256_max_pd(step_y_q0, step_y_q1));
+      const __m256d re_t1 = _mm256_sub_pd(_mm256_max_pd(step_x_p0, step_x_p1), _mm256_min_pd(step_y_q0, step_y_q1));
+      const __m256d im_t0 = _mm256_add_pd(_mm256_min_pd(step_x_q0, step_x_q1), _mm256_min_pd(step_y_p0, step_y_p1));
+      const __m256d im_t1 = _mm256_add_pd(_mm256_max_pd(step_x_q0, step_x_q1), _mm256_max_pd(step_y_p0, step_y_p1));
+      __m256d re0, re1, im0, im1, re_sqr0, re_sqr1, im_sqr0, im_sqr1;
+      one_plus_interval(re_t0, re_t1, re0, re1);
+      im0 = _mm256_sub_pd(im_t0, _mm256_mul_pd(interval_error, _mm256_add_pd(M256D_ONE, abs(im_t0))));
+      im1 = _mm256_add_pd(im_t1, _mm256_mul_pd(interval_error, _mm256_add_pd(M256D_ONE, abs(im_t1))));
+      interval_sqr(re0, re1, re_sqr0, re_sqr1);
+      interval_sqr(im0, im1, im_sqr0, im_sqr1);
+      ratio_sqr0 = _mm256_add_pd(re_sqr0, im_sqr0);
+      ratio_sqr1 = _mm256_add_pd(re_sqr1, im_sqr1);
+      // |t| <= |u-x[k]|/|w| is tighter for blocks close to the particle
+      const __m256d t_max = _mm256_sqrt_pd(_mm256_mul_pd(_mm256_set1_pd((u - xk) * (u - xk) + (v - yk) * (v - yk)),
+                                                         inv_norm1));
+      __m256d abs0, abs1, abs_sqr0, abs_sqr1;
+      one_plus_interval(_mm256_sub_pd(zero, t_max), t_max, abs0, abs1);
+      interval_sqr(abs0, abs1, abs_sqr0, abs_sqr1);
+      ratio_sqr0 = _mm256_max_pd(ratio_sqr0, abs_sqr0);
+      ratio_sqr1 = _mm256_min_pd(ratio_sqr1, abs_sqr1);
+    } else {
+      // 1/w is monotonic if the interval of w does not contain 0
+      const __m256d t_a = _mm256_div_pd(step_x, w_x0);
+      const __m256d t_b = _mm256_div_pd(step_x, w_x1);
+      __m256d r0, r1;
+      one_plus_interval(_mm256_min_pd(t_a, t_b), _mm256_max_pd(t_a, t_b), r0, r1);
+      interval_sqr(r0, r1, ratio_sqr0, ratio_sqr1);
+    }
+    ratio_sqr0 = _mm256_and_pd(valid, ratio_sqr0);
+    ratio_sqr1 = _mm256_blendv_pd(plus_inf, ratio_sqr1, valid);
+    __m256d log_lower = log2_lower_bound(_mm256_mul_pd(ratio_sqr0, round_down));
+    __m256d log_upper = log2_upper_bound(_mm256_mul_pd(ratio_sqr1, round_up));
+    if (!COMPLEX) {
+      log_lower = _mm256_mul_pd(log_lower, _mm256_set1_pd(0.5));
+      log_upper = _mm256_mul_pd(log_upper, _mm256_set1_pd(0.5));
+    }
+
+    const __m256d empty = _mm256_cmp_pd(count, zero, _CMP_EQ_OQ);
+    _mm256_storeu_pd(&lower[b], _mm256_blendv_pd(_mm256_mul_pd(count, log_lower), zero, empty));
+    _mm256_storeu_pd(&upper[b], _mm256_blendv_pd(_mm256_mul_pd(count, log_upper), zero, empty));
+  }
+}
+
+template<bool COMPLEX>
+static bool metropolis_accept_early(
+        const long int N,
+        const long int k,
+        const double u,
+        const double v,
+        const double beta,
+        const double log_uniform,
+        const double* x,
+        const double* y,
+        const BlockBounds& bounds,
+        long int& elements_processed
+) {
+  assert(beta > 0);
+  assert(bounds.N == N);
+  assert(reinterpret_cast<uintptr_t>(x) % 32 == 0);
+
+  auto full_evaluation = [&]() {
+    elements_processed += N;
+    return COMPLEX ? metropolis_accept_complexvec(N, k, u, v, beta, log_uniform, x, y)
+                   : metropolis_accept_realvec(N, k, u, beta, log_uniform, x);
+  };
+
+  elements_processed = 0;
+  const long int blocks = bounds.blocks;
+  if (blocks <= 1) {
+    return full_evaluation();
+  }
+
+  const double xk = x[k];
+  const double yk = COMPLEX ? y[k] : 0;
+  const long int block_k = k / BOUNDS_BLOCK_SIZE;
+
+  // per thread, so that the hot path does not allocate once the arrays have grown to the number of blocks
+  thread_local std::vector<double> lower;
+  thread_local std::vector<double> upper;
+  lower.resize(bounds.count.size());
+  upper.resize(bounds.count.size());
+  block_log2_bounds<COMPLEX>(bounds, u, v, xk, yk, lower.data(), upper.data());
+
+  // particle k is not part of the product
+  const double count_k = bounds.count[block_k];
+  lower[block_k] = count_k > 1 ? lower[block_k] * ((count_k - 1) / count_k) * ROUND_UP : 0;
+  upper[block_k] = count_k > 1 ? upper[block_k] : 0;
+
+  // The sums of the bounds of the remaining blocks are kept as finite sum plus the number of infinite bounds.
+  double remaining_lower = 0;
+  double remaining_upper = 0;
+  long int infinite_lower = 0;
+  long int infinite_upper = 0;
+  double abs_bounds = 0;
+  for (long int b = 0; b < blocks; b++) {
+    if (std::isinf(lower[b])) {
+      infinite_lower++;
+    } else {
+      remaining_lower += lower[b];
+      abs_bounds += std::abs(lower[b]);
+    }
+    if (std::isinf(upper[b])) {
+      infinite_upper++;
+    } else {
+      remaining_upper += upper[b];
+      abs_bounds += std::abs(upper[b]);
+    }
+  }
+
+  // Bound of the rounding errors of the full evaluation, the blocked evaluation and the sums of the bounds.
+  // The products of squared distances are halved at the end, so the same margin can be used in both cases.
+  const double log2_scale = COMPLEX ? 0.5 : 1.0;
+  const double scale = beta * M_LN2 * log2_scale;
+  const double margin = full_evaluation_margin(N, beta, scale, abs_bounds) + scale * abs_bounds * blocks * 0x1p-51;
+
+  const __m256d zero = _mm256_setzero_pd();
+  const __m256d four = _mm256_set1_pd(4);
+  const __m256d u_vec = _mm256_set1_pd(u);
+  const __m256d v_vec = _mm256_set1_pd(v);
+  const __m256d xk_vec = _mm256_set1_pd(xk);
+  const __m256d yk_vec = _mm256_set1_pd(yk);
+  const __m256d vk = _mm256_set1_pd(k);
+  const __m256d vn = _mm256_set1_pd(N);
+
+  // products of the processed blocks, normalized after each block
+  __m256d prod_new = M256D_ONE;
+  __m256d prod_old = M256D_ONE;
+#ifdef __AVX2__
+  __m256i exponent_new = _mm256_setzero_si256();
+  __m256i exponent_old = _mm256_setzero_si256();
+#else // __AVX__
+  __m128i exponent_new = _mm_setzero_si128();
+  __m128i exponent_old = _mm_setzero_si128();
+#endif
+
+  // The blocks with the widest bounds are processed first. Instead of sorting, the blocks with more than the average
+  // width (including the ones with infinite bounds) are processed in the first pass and the others in the second.
+  const double average_width = (remaining_upper - remaining_lower) / blocks;
+  for (int pass = 0; pass < 2; pass++) for (long int b = 0; b < blocks; b++) {
+    const bool wide = !(upper[b] - lower[b] <= average_width);
+    if (wide != (pass == 0)) {
+      continue;
+    }
+
+
+    const long int begin = b * BOUNDS_BLOCK_SIZE;
+    const long int end = std::min<long int>(begin + BOUNDS_BLOCK_SIZE, N);
+    __m256d new0 = M256D_ONE, new1 = M256D_ONE, new2 = M256D_ONE, new3 = M256D_ONE;
+    __m256d old0 = M256D_ONE, old1 = M256D_ONE, old2 = M256D_ONE, old3 = M256D_ONE;
+    if (b != block_k && end - begin == BOUNDS_BLOCK_SIZE) [[likely]] {
+      for (long int j = begin; j < end; j += 16) {
+        __m256d f_new, f_old;
+        early_factors<COMPLEX>(_mm256_load_pd(&x[j + 0]), COMPLEX ? _mm256_load_pd(&y[j + 0]) : zero,
+                               u_vec, v_vec, xk_vec, yk_vec, f_new, f_old);
+        new0 = _mm256_mul_pd(new0, f_new);
+        old0 = _mm256_mul_pd(old0, f_old);
+        early_factors<COMPLEX>(_mm256_load_pd(&x[j + 4]), COMPLEX ? _mm256_load_pd(&y[j + 4]) : zero,
+                               u_vec, v_vec, xk_vec, yk_vec, f_new, f_old);
+        new1 = _mm256_mul_pd(new1, f_new);
+        old1 = _mm256_mul_pd(old1, f_old);
+        early_factors<COMPLEX>(_mm256_load_pd(&x[j + 8]), COMPLEX ? _mm256_load_pd(&y[j + 8]) : zero,
+                               u_vec, v_vec, xk_vec, yk_vec, f_new, f_old);
+        new2 = _mm256_mul_pd(new2, f_new);
+        old2 = _mm256_mul_pd(old2, f_old);
+        early_factors<COMPLEX>(_mm256_load_pd(&x[j + 12]), COMPLEX ? _mm256_load_pd(&y[j + 12]) : zero,
+                               u_vec, v_vec, xk_vec, yk_vec, f_new, f_old);
+        new3 = _mm256_mul_pd(new3, f_new);
+        old3 = _mm256_mul_pd(old3, f_old);
+      }
+    } else {
+      // block with particle k or last block, the accumulators are rotated so that each gets at most
+      // BOUNDS_BLOCK_SIZE/16 factors as above
+      __m256d vj = _mm256_add_pd(_mm256_set1_pd(begin), _mm256_set_pd(3, 2, 1, 0));
+      for (long int j = begin; j < end; j += 4) {
+        __m256d f_new, f_old;
+        early_factors<COMPLEX>(_mm256_load_pd(&x[j]), COMPLEX ? _mm256_load_pd(&y[j]) : zero,
+                               u_vec, v_vec, xk_vec, yk_vec, f_new, f_old);
+        __m256d mask = _mm256_or_pd(_mm256_cmp_pd(vj, vn, _CMP_GE_OQ), _mm256_cmp_pd(vj, vk, _CMP_EQ_OQ));
+        const __m256d next_new = _mm256_mul_pd(new0, _mm256_blendv_pd(f_new, M256D_ONE, mask));
+        const __m256d next_old = _mm256_mul_pd(old0, _mm256_blendv_pd(f_old, M256D_ONE, mask));
+        new0 = new1; new1 = new2; new2 = new3; new3 = next_new;
+        old0 = old1; old1 = old2; old2 = old3; old3 = next_old;
+        vj = _mm256_add_pd(vj, four);
+      }
+    }
+    elements_processed += end - begin;
+
+    // Each lane is a product of up to BOUNDS_BLOCK_SIZE/16 raw factors, as between two exponent extractions of the
+    // kernels. If one of them left the normal range (a 0 factor, clustered or very distant particles), the exponent
+    // extraction would be wrong; this is rare enough to leave it to the full evaluation.
+    if (any_not_normal(new0, new1, new2, new3) || any_not_normal(old0, old1, old2, old3)) [[unlikely]] {
+      return full_evaluation();
+    }
+    // The significands are in [1,2), so their product with the previous one is below 32 and cannot overflow.
+    normalize_block_product(prod_new, exponent_new, new0, new1, new2, new3);
+    normalize_block_product(prod_old, exponent_old, old0, old1, old2, old3);
+
+    if (std::isinf(lower[b])) infinite_lower--; else remaining_lower -= lower[b];
+    if (std::isinf(upper[b])) infinite_upper--; else remaining_upper -= upper[b];
+
+    if (infinite_lower > 0 && infinite_upper > 0) {
+      continue;
+    }
+    // The exponents of both products were extracted equally often, so the bias cancels. The significands are in
+    // [1,2), so the log2 of their ratio is in (-4, 4). The exact ratio is only computed if it can decide the test.
+    const double log2_ratio_exponents =
+            static_cast<double>(horizontal_sum(exponent_new) - horizontal_sum(exponent_old));
+    const double lower_bound = infinite_lower > 0 ? -INF : log2_ratio_exponents + remaining_lower;
+    const double upper_bound = infinite_upper > 0 ? INF : log2_ratio_exponents + remaining_upper;
+    if (scale * (lower_bound + 4) - margin <= log_uniform && scale * (upper_bound - 4) + margin > log_uniform) {
+      continue;
+    }
+    if (scale * (lower_bound - 4) - margin > log_uniform) {
+      return true;
+    }
+    if (scale * (upper_bound + 4) + margin <= log_uniform) {
+      return false;
+    }
+
+    const double log2_ratio_significands = horizontal_sum(log2_approx(abs(_mm256_div_pd(prod_new, prod_old))));
+    if (scale * (lower_bound + log2_ratio_significands - 4 * LOG2_APPROX_ERROR) - margin > log_uniform) {
+      return true;
+    }
+    if (scale * (upper_bound + log2_ratio_significands + 4 * LOG2_APPROX_ERROR) + margin <= log_uniform) {
+      return false;
+    }
+  }
+
+  // all blocks processed but too close to the threshold
+  return full_evaluation();
+}
+
+bool metropolis_accept_early_realvec(
+        const long int N,
+        const long int k,
+        const double u,
+        const double beta,
+        const double log_uniform,
+        const double* x,
+        const BlockBounds& bounds,
+        long int& elements_processed
+) {
+  return metropolis_accept_early<false>(N, k, u, 0, beta, log_uniform, x, nullptr, bounds, elements_processed);
+}
+
+bool metropolis_accept_early_complexvec(
+        const long int N,
+        const long int k,
+        const double u,
+        const double v,
+        const double beta,
+        const double log_uniform,
+        const double* x,
+        const double* y,
+        const BlockBounds& bounds,
+        long int& elements_processed
+) {
+  return metropolis_accept_early<true>(N, k, u, v, beta, log_uniform, x, y, bounds, elements_processed);
+}
+
+bool metropolis_accept_cascade_complexvec(
+        const long int N,
+        const long int k,
+        const double u,
+        const double v,
+        const double beta,
+        const double log_uniform,
+        const double* x,
+        const double* y,
+        const FloatPositions& float_positions,
+        bool& exact_evaluation
+) {
+  assert(beta > 0);
+  assert(float_positions.N == N);
+
+  auto exact = [&]() {
+    exact_evaluation = true;
+    return metropolis_accept_complexvec(N, k, u, v, beta, log_uniform, x, y);
+  };
+
+  exact_evaluation = false;
+  const double max_abs = std::max({float_positions.max_abs, std::abs(u), std::abs(v)});
+  if (N < 2 || N > MAX_CASCADE_N || !(8 * max_abs * max_abs <= MAX_CASCADE_DIST2)) {
+    return exact();
+  }
+
+  const __m256 one = _mm256_set1_ps(1.0f);
+  const __m256 u_vec = _mm256_set1_ps(static_cast<float>(u));
+  const __m256 v_vec = _mm256_set1_ps(static_cast<float>(v));
+  const __m256 xk_vec = _mm256_set1_ps(float_positions.x[k]);
+  const __m256 yk_vec = _mm256_set1_ps(float_positions.y[k]);
+  const __m256 vk = _mm256_set1_ps(k);
+  const __m256 vn = _mm256_set1_ps(N);
+  const float* fx = float_positions.x;
+  const float* fy = float_positions.y;
+
+  auto factors = [&](const long int j, __m256& factor_new, __m256& factor_old) {
+    const __m256 x0 = _mm256_load_ps(&fx[j]);
+    const __m256 y0 = _mm256_load_ps(&fy[j]);
+    const __m256 dx_new = _mm256_sub_ps(u_vec, x0);
+    const __m256 dy_new = _mm256_sub_ps(v_vec, y0);
+    const __m256 dx_old = _mm256_sub_ps(xk_vec, x0);
+    const __m256 dy_old = _mm256_sub_ps(yk_vec, y0);
+    factor_new = _mm256_add_ps(_mm256_mul_ps(dx_new, dx_new), _mm256_mul_ps(dy_new, dy_new));
+    factor_old = _mm256_add_ps(_mm256_mul_ps(dx_old, dx_old), _mm256_mul_ps(dy_old, dy_old));
+  };
+  auto mask_factors = [&](const long int j, __m256& factor_new, __m256& factor_old) {
+    const __m256 vj = _mm256_add_ps(_mm256_set1_ps(j), _mm256_set_ps(7, 6, 5, 4, 3, 2, 1, 0));
+    const __m256 mask = _mm256_or_ps(_mm256_cmp_ps(vj, vn, _CMP_GE_OQ), _mm256_cmp_ps(vj, vk, _CMP_EQ_OQ));
+    factor_new = _mm256_blendv_ps(factor_new, one, mask);
+    factor_old = _mm256_blendv_ps(factor_old, one, mask);
+  };
+
+  __m256 new0 = one, new1 = one, new2 = one, new3 = one;
+  __m256 old0 = one, old1 = one, old2 = one, old3 = one;
+  __m256 min_new = _mm256_set1_ps(FLT_MAX);
+  __m256 min_old = _mm256_set1_ps(FLT_MAX);
+  // the biases of the exponents of the new and the old products cancel
+  __m256 exponent_diff = _mm256_setzero_ps();
+  auto normalize = [&]() {
+    const __m256 exponent_new = _mm256_add_ps(
+            _mm256_add_ps(extract_and_clear_exponent_ps(new0), extract_and_clear_exponent_ps(new1)),
+            _mm256_add_ps(extract_and_clear_exponent_ps(new2), extract_and_clear_exponent_ps(new3)));
+    const __m256 exponent_old = _mm256_add_ps(
+            _mm256_add_ps(extract_and_clear_exponent_ps(old0), extract_and_clear_exponent_ps(old1)),
+            _mm256_add_ps(extract_and_clear_exponent_ps(old2), extract_and_clear_exponent_ps(old3)));
+    exponent_diff = _mm256_add_ps(exponent_diff, _mm256_sub_ps(exponent_new, exponent_old));
+  };
+
+  const long int skipj = k & -32;
+  const long int lastj = N & -32;
+  const long int padded = (N + 31) & -32;
+  long int iterations = 0;
+  for (long int j = 0; j < padded; j += 32) {
+    __m256 new_f0, new_f1, new_f2, new_f3, old_f0, old_f1, old_f2, old_f3;
+    factors(j, new_f0, old_f0);
+    factors(j + 8, new_f1, old_f1);
+    factors(j + 16, new_f2, old_f2);
+    factors(j + 24, new_f3, old_f3);
+    if (j == skipj || j >= lastj) [[unlikely]] {
+      mask_factors(j, new_f0, old_f0);
+      mask_factors(j + 8, new_f1, old_f1);
+      mask_factors(j + 16, new_f2, old_f2);
+      mask_factors(j + 24, new_f3, old_f3);
+    }
+    min_new = _mm256_min_ps(min_new, _mm256_min_ps(_mm256_min_ps(new_f0, new_f1), _mm256_min_ps(new_f2, new_f3)));
+    min_old = _mm256_min_ps(min_old, _mm256_min_ps(_mm256_min_ps(old_f0, old_f1), _mm256_min_ps(old_f2, old_f3)));
+    new0 = _mm256_mul_ps(new0, new_f0);
+    new1 = _mm256_mul_ps(new1, new_f1);
+    new2 = _mm256_mul_ps(new2, new_f2);
+    new3 = _mm256_mul_ps(new3, new_f3);
+    old0 = _mm256_mul_ps(old0, old_f0);
+    old1 = _mm256_mul_ps(old1, old_f1);
+    old2 = _mm256_mul_ps(old2, old_f2);
+    old3 = _mm256_mul_ps(old3, old_f3);
+    if (++iterations % 4 == 0) {
+      normalize();
+    }
+  }
+  normalize();
+
+  // Range check, the products may have left the range of normal floats otherwise.
+  float min_lanes[8];
+  _mm256_storeu_ps(min_lanes, _mm256_min_ps(min_new, min_old));
+  const double min_dist2 = *std::min_element(min_lanes, min_lanes + 8);
+  if (!(min_dist2 >= MIN_CASCADE_DIST2)) {
+    return exact();
+  }
+
+  // the significands of the products of the 4 accumulators are in [1,16)
+  const __m256 ratio = _mm256_div_ps(_mm256_mul_ps(_mm256_mul_ps(new0, new1), _mm256_mul_ps(new2, new3)),
+                                     _mm256_mul_ps(_mm256_mul_ps(old0, old1), _mm256_mul_ps(old2, old3)));
+  const double log2_ratio = horizontal_sum(exponent_diff)
+          + horizontal_sum(log2_approx(_mm256_cvtps_pd(_mm256_castps256_ps128(ratio))))
+          + horizontal_sum(log2_approx(_mm256_cvtps_pd(_mm256_extractf128_ps(ratio, 1))));
+
+  // Rounding the positions to float changes each coordinate difference by at most position_error, and the distance d
+  // by at most sqrt(2)*position_error. The resulting error of log2(d^2) is bounded with the smallest computed
+  // squared distance (relative error of the squared distances below 2^-20).
+  const double position_error = M_SQRT2 * 2 * max_abs * 0x1p-24;
+  const double min_dist = std::sqrt(min_dist2 * (1 - 0x1p-20));
+  if (!(min_dist > 4 * position_error)) {
+    return exact();
+  }
+  const double position_error_per_factor = 2 * position_error / ((min_dist - 2 * position_error) * M_LN2);
+  const double error = 2 * N * (CASCADE_FACTOR_ERROR + position_error_per_factor)
+                       + 8 * (CASCADE_LANE_ERROR + LOG2_APPROX_ERROR);
+
+  const double scale = beta * 0.5 * M_LN2;
+  const double margin = full_evaluation_margin(N, beta, scale, std::abs(log2_ratio) + error);
+  if (scale * (log2_ratio - error) - margin > log_uniform) {
+    return true;
+  }
+  if (scale * (log2_ratio + error) + margin <= log_uniform) {
+    return false;
+  }
+  return exact();
+}
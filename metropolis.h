@@ -0,0 +1,193 @@
+#ifndef METROPOLIS_H
+#define METROPOLIS_H
+
+#include <vector>
+#include "large_product.h"
+
+/**
+ * Metropolis acceptance tests for moving particle k to a new position.
+ *
+ * The log acceptance ratio of the move is beta * L with
+ *   L = sum_{j!=k} log|u-x[j]| - log|x[k]-x[j]|               (real particles)
+ *   L = sum_{j!=k} log|z-z[j]| - log|z[k]-z[j]|               (complex particles, z=u+i*v, z[j]=x[j]+i*y[j])
+ * and the move is accepted if log_uniform < beta * L, where log_uniform is the log of a uniform random number in (0,1).
+ * beta must be positive.
+ */
+
+// Number of particles per block of BlockBounds, multiple of 16.
+constexpr const int64_t BOUNDS_BLOCK_SIZE = 256;
+
+/**
+ * Bounding boxes of consecutive blocks of BOUNDS_BLOCK_SIZE particles.
+ *
+ * The bounds are only useful if nearby particles are stored in the same block, e.g. after spatial_sort. The arrays are
+ * padded to a multiple of 4 blocks, padded blocks have count 0.
+ */
+class BlockBounds {
+  public:
+    long int N;
+    long int blocks;
+    std::vector<double> count;
+    std::vector<double> x_min;
+    std::vector<double> x_max;
+    std::vector<double> y_min;
+    std::vector<double> y_max;
+
+    // y may be nullptr for real particles
+    BlockBounds(const long int N, const double* x, const double* y = nullptr);
+
+    // Recomputes the bounding box of the block of particle k after it was moved.
+    void update(const long int k, const double* x, const double* y = nullptr);
+};
+
+/**
+ * Single precision copies of the positions of complex particles for metropolis_accept_cascade_complexvec. The arrays
+ * are padded with zeros to a multiple of 32 floats. max_abs is an upper bound of the absolute values of all
+ * coordinates.
+ */
+class FloatPositions {
+  public:
+    long int N;
+    float* x;
+    float* y;
+    double max_abs;
+
+    FloatPositions(const long int N, const double* x, const double* y);
+    ~FloatPositions();
+    FloatPositions(const FloatPositions&) = delete;
+    FloatPositions& operator=(const FloatPositions&) = delete;
+
+    // Copies the position of particle k after it was moved.
+    void update(const long int k, const double* x, const double* y);
+};
+
+// Sorts real particles (y == nullptr) by position or complex particles along a Z-order curve, so that blocks of
+// consecutive particles are spatially compact. The absolute value of the Vandermonde determinant does not change.
+void spatial_sort(const long int N, double* x, double* y = nullptr);
+
+// Acceptance test with a full evaluation of the products.
+bool metropolis_accept_realvec(
+        const long int N,
+        const long int k,
+        const double u,
+        const double beta,
+        const double log_uniform,
+        const double* x
+);
+
+bool metropolis_accept_complexvec(
+        const long int N,
+        const long int k,
+        const double u,
+        const double v,
+        const double beta,
+        const double log_uniform,
+        const double* x,
+        const double* y
+);
+
+/*
+ * Acceptance tests for the mixed ensemble of vandermonde_abs2_mixed with Nreal real particles lambda and Ncomplex
+ * complex particles x+i*y. L is the sum of the log distances between the moved particle and all other particles of both
+ * species, so that beta=2 samples |det|^2 as computed by vandermonde_abs2_mixed.
+ */
+
+// Moves real particle k (0 <= k < Nreal) to u.
+bool metropolis_accept_mixed_realvec(
+        const long int Nreal,
+        const long int Ncomplex,
+        const long int k,
+        const double u,
+        const double beta,
+        const double log_uniform,
+        const double* lambda,
+        const double* x,
+        const double* y
+);
+
+// Moves complex particle k (0 <= k < Ncomplex) to u+i*v.
+bool metropolis_accept_mixed_complexvec(
+        const long int Nreal,
+        const long int Ncomplex,
+        const long int k,
+        const double u,
+        const double v,
+        const double beta,
+        const double log_uniform,
+        const double* lambda,
+        const double* x,
+        const double* y
+);
+
+// Acceptance test for moving the M particles k[0] < k[1] < ... < k[M-1] at once to u[m] (+i*v[m]), including the
+// changed factors between the moved particles. The log ratio is the sum over all moved particles.
+bool metropolis_accept_cluster_realvec(
+        const long int N,
+        const long int M,
+        const long int* k,
+        const double* u,
+        const double beta,
+        const double log_uniform,
+        const double* x
+);
+
+bool metropolis_accept_cluster_complexvec(
+        const long int N,
+        const long int M,
+        const long int* k,
+        const double* u,
+        const double* v,
+        const double beta,
+        const double log_uniform,
+        const double* x,
+        const double* y
+);
+
+// Acceptance test that processes the particles block by block and stops as soon as the partial log ratio together
+// with the bounds of the remaining blocks decides the test. The blocks with the widest bounds, usually the ones around
+// the new and the old position, are processed first. The decision is always the same as for metropolis_accept_realvec;
+// if the bounds cannot decide or a partial product leaves the range of normal numbers, the full evaluation is used.
+// elements_processed returns the number of particles that were visited.
+bool metropolis_accept_early_realvec(
+        const long int N,
+        const long int k,
+        const double u,
+        const double beta,
+        const double log_uniform,
+        const double* x,
+        const BlockBounds& bounds,
+        long int& elements_processed
+);
+
+bool metropolis_accept_early_complexvec(
+        const long int N,
+        const long int k,
+        const double u,
+        const double v,
+        const double beta,
+        const double log_uniform,
+        const double* x,
+        const double* y,
+        const BlockBounds& bounds,
+        long int& elements_processed
+);
+
+// Acceptance test that first evaluates the log ratio with products of squared distances in single precision (8 lanes)
+// together with a rigorous bound of the rounding errors, including the errors from rounding the positions to float.
+// Only if the bound does not decide the test, or if the squared distances are out of the range of the screening pass,
+// metropolis_accept_complexvec is used and exact_evaluation is set. The decision is always the same as for
+// metropolis_accept_complexvec.
+bool metropolis_accept_cascade_complexvec(
+        const long int N,
+        const long int k,
+        const double u,
+        const double v,
+        const double beta,
+        const double log_uniform,
+        const double* x,
+        const double* y,
+        const FloatPositions& float_positions,
+        bool& exact_evaluation
+);
+
+#endif
@@ -0,0 +1,473 @@
+#include "mixed_ensemble.h"
+#include "simd_math.h"
+#include "vandermonde_det.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cfloat>
+#include <cmath>
+#include <limits>
+#include <thread>
+#include <vector>
+
+namespace {
+
+inline double log_abs(const LargeExponentFloat& f) {
+  return std::log(std::abs(f.significand)) + f.exponent * M_LN2;
+}
+
+inline __m256d sqr(const __m256d a) {
+  return _mm256_mul_pd(a, a);
+}
+
+// |a - b|^2 of the complex numbers ax+i*ay and bx+i*by
+inline __m256d dist2(const __m256d ax, const __m256d ay, const __m256d bx, const __m256d by) {
+  return _mm256_add_pd(sqr(_mm256_sub_pd(ax, bx)), sqr(_mm256_sub_pd(ay, by)));
+}
+
+// Adds delta to the 4 values of array at i and returns the new values. The padding of the arrays absorbs the lanes
+// beyond the end.
+inline __m256d add_to(double* array, const long int i, const __m256d delta) {
+  const __m256d sum = _mm256_add_pd(_mm256_load_pd(&array[i]), delta);
+  _mm256_store_pd(&array[i], sum);
+  return sum;
+}
+
+inline double horizontal_max(const __m256d a) {
+  const __m128d max = _mm_max_pd(_mm256_castpd256_pd128(a), _mm256_extractf128_pd(a, 1));
+  return std::max(_mm_cvtsd_f64(max), _mm_cvtsd_f64(_mm_unpackhi_pd(max, max)));
+}
+
+// Error bounds in units of DBL_EPSILON, rounded up: the relative error of the argument of a log (at most a product of
+// two squared distances, or one kernel factor), and the error of a log relative to max(1, |log|).
+constexpr double ARGUMENT_ERROR = 5;
+constexpr double LOG_ERROR = 4;
+
+// Error added to a cache entry by adding nlogs logs with the absolute sum log_sum and rounding the new value.
+inline __m256d update_error(const double nlogs, const __m256d log_sum, const __m256d value) {
+  const __m256d terms = _mm256_add_pd(_mm256_set1_pd(nlogs * (ARGUMENT_ERROR + LOG_ERROR)),
+                                      _mm256_mul_pd(_mm256_set1_pd(LOG_ERROR + 0.5), log_sum));
+  const __m256d rounding = _mm256_mul_pd(_mm256_set1_pd(0.5), abs(value));
+  return _mm256_mul_pd(_mm256_set1_pd(DBL_EPSILON), _mm256_add_pd(terms, rounding));
+}
+
+// Error of a new cache entry, the sum of count logs with the absolute sum log_sum (in 4 lanes).
+inline double sum_error(const long int count, const double log_sum) {
+  return DBL_EPSILON * (count * (ARGUMENT_ERROR + LOG_ERROR) + (LOG_ERROR + 0.5 * (count / 4 + 2)) * log_sum);
+}
+
+// Calls body(i, valid) for the vectors of 4 elements starting at i < n, valid masks the lanes below n.
+template<class Body>
+inline void for_vectors(const long int n, const Body& body) {
+  for (long int i = 0; i < n; i += 4) {
+    const __m256d lanes = _mm256_add_pd(_mm256_set1_pd(i), _mm256_set_pd(3, 2, 1, 0));
+    body(i, _mm256_cmp_pd(lanes, _mm256_set1_pd(n), _CMP_LT_OQ));
+  }
+}
+
+// Computes the caches and their error bounds from the positions, returns the largest bound.
+double compute_caches(const long int Nreal, const long int Ncomplex, const double* lambda, const double* x,
+                      const double* y, double* real_real, double* real_complex, double* complex_real,
+                      double* complex_complex, double* real_error, double* complex_error) {
+  // every kernel factor and the final log
+  const double factors = (Nreal + Ncomplex) * ARGUMENT_ERROR + 2 * LOG_ERROR;
+  double max_error = 0;
+  for (long int i = 0; i < Nreal; i++) {
+    LargeExponentFloat real1(1.0), real2(1.0), complex1(1.0), complex2(1.0);
+    prod_diff_realrealvec(Nreal, i, lambda[i], lambda[i], lambda, real1, real2);
+    prod_dist2_realcomplexvec(Ncomplex, lambda[i], lambda[i], x, y, complex1, complex2);
+    real_real[i] = log_abs(real1);
+    real_complex[i] = log_abs(complex1);
+    real_error[i] = DBL_EPSILON * (factors + LOG_ERROR * (std::abs(real_real[i]) + std::abs(real_complex[i])));
+    max_error = std::max(max_error, real_error[i]);
+  }
+  for (long int p = 0; p < Ncomplex; p++) {
+    LargeExponentFloat real1(1.0), real2(1.0), complex1(1.0), complex2(1.0);
+    prod_dist2_complexrealvec(Nreal, x[p], x[p], y[p], y[p], lambda, real1, real2);
+    prod_dist2_conjpair_complexvec(Ncomplex, p, x[p], x[p], y[p], y[p], x, y, complex1, complex2);
+    complex_real[p] = log_abs(real1);
+    complex_complex[p] = log_abs(complex1);
+    complex_error[p] = DBL_EPSILON * (factors + LOG_ERROR * (std::abs(complex_real[p]) + std::abs(complex_complex[p])));
+    max_error = std::max(max_error, complex_error[p]);
+  }
+  return max_error;
+}
+
+}
+
+// A recompute in a background thread, on its own copy of the positions.
+struct MixedEnsembleState::Recomputation {
+  struct Move {
+    bool merge;
+    long int a, b;
+    double u, v;
+  };
+
+  long int Nreal, Ncomplex;
+  double* lambda;
+  double* x;
+  double* y;
+  double* real_real;
+  double* real_complex;
+  double* complex_real;
+  double* complex_complex;
+  double* real_error;
+  double* complex_error;
+  double max_error = 0;
+  std::vector<Move> moves;
+  std::atomic<bool> done{false};
+  std::thread thread;
+
+  Recomputation(const MixedEnsembleState& state):
+    Nreal(state.Nreal),
+    Ncomplex(state.Ncomplex)
+  {
+    const long int padded = (std::max(state.size, 1L) + 3) & ~3L;
+    lambda = new_double_array(padded);
+    x = new_double_array(padded);
+    y = new_double_array(padded);
+    real_real = new_double_array(padded);
+    real_complex = new_double_array(padded);
+    complex_real = new_double_array(padded);
+    complex_complex = new_double_array(padded);
+    real_error = new_double_array(padded);
+    complex_error = new_double_array(padded);
+    // including the padding, so that the replayed positions are the same as the ones of the state
+    std::copy(state.lambda, state.lambda + padded, lambda);
+    std::copy(state.x, state.x + padded, x);
+    std::copy(state.y, state.y + padded, y);
+    thread = std::thread([this]() {
+      max_error = compute_caches(Nreal, Ncomplex, lambda, x, y, real_real, real_complex, complex_real, complex_complex,
+                                 real_error, complex_error);
+      done.store(true, std::memory_order_release);
+    });
+  }
+
+  ~Recomputation() {
+    if (thread.joinable()) {
+      thread.join();
+    }
+    _mm_free(lambda);
+    _mm_free(x);
+    _mm_free(y);
+    _mm_free(real_real);
+    _mm_free(real_complex);
+    _mm_free(complex_real);
+    _mm_free(complex_complex);
+    _mm_free(real_error);
+    _mm_free(complex_error);
+  }
+};
+
+MixedEnsembleState::MixedEnsembleState(
+        const long int Nreal,
+        const long int Ncomplex,
+        const double* lambda,
+        const double* x,
+        const double* y
+):
+  Nreal(Nreal),
+  Ncomplex(Ncomplex),
+  size(Nreal + 2 * Ncomplex),
+  recompute_threshold(std::numeric_limits<double>::infinity())
+{
+  // either species can take all particles (as reals) or half of them (as pairs), plus the padding for the kernels
+  const long int capacity = std::max(size, 1L);
+  this->lambda = new_double_array(capacity);
+  this->x = new_double_array(capacity);
+  this->y = new_double_array(capacity);
+  real_real = new_double_array(capacity);
+  real_complex = new_double_array(capacity);
+  complex_real = new_double_array(capacity);
+  complex_complex = new_double_array(capacity);
+  real_error = new_double_array(capacity);
+  complex_error = new_double_array(capacity);
+  std::fill(this->lambda, this->lambda + ((capacity + 3) & ~3L), 0.0);
+  std::fill(this->x, this->x + ((capacity + 3) & ~3L), 0.0);
+  std::fill(this->y, this->y + ((capacity + 3) & ~3L), 0.0);
+  std::copy(lambda, lambda + Nreal, this->lambda);
+  std::copy(x, x + Ncomplex, this->x);
+  std::copy(y, y + Ncomplex, this->y);
+  recompute();
+}
+
+MixedEnsembleState::~MixedEnsembleState() {
+  discard_recompute();
+  _mm_free(lambda);
+  _mm_free(x);
+  _mm_free(y);
+  _mm_free(real_real);
+  _mm_free(real_complex);
+  _mm_free(complex_real);
+  _mm_free(complex_complex);
+  _mm_free(real_error);
+  _mm_free(complex_error);
+}
+
+void MixedEnsembleState::recompute() {
+  discard_recompute();
+  max_error = compute_caches(Nreal, Ncomplex, lambda, x, y, real_real, real_complex, complex_real, complex_complex,
+                             real_error, complex_error);
+}
+
+void MixedEnsembleState::discard_recompute() {
+  delete recomputation;
+  recomputation = nullptr;
+}
+
+void MixedEnsembleState::start_recompute() {
+  recomputation = new Recomputation(*this);
+}
+
+void MixedEnsembleState::install_recompute() {
+  Recomputation* fresh = recomputation;
+  recomputation = nullptr;
+  fresh->thread.join();
+  Nreal = fresh->Nreal;
+  Ncomplex = fresh->Ncomplex;
+  std::swap(lambda, fresh->lambda);
+  std::swap(x, fresh->x);
+  std::swap(y, fresh->y);
+  std::swap(real_real, fresh->real_real);
+  std::swap(real_complex, fresh->real_complex);
+  std::swap(complex_real, fresh->complex_real);
+  std::swap(complex_complex, fresh->complex_complex);
+  std::swap(real_error, fresh->real_error);
+  std::swap(complex_error, fresh->complex_error);
+  max_error = fresh->max_error;
+  const std::vector<Recomputation::Move> moves = std::move(fresh->moves);
+  delete fresh;
+  // the same updates as before on the new caches, so the positions end up the same (without starting another
+  // recompute, the next accept checks the threshold)
+  replaying = true;
+  for (const Recomputation::Move& move : moves) {
+    if (move.merge) {
+      accept_merge(move.a, move.b, move.u, move.v);
+    } else {
+      accept_split(move.a, move.u, move.v);
+    }
+  }
+  replaying = false;
+}
+
+void MixedEnsembleState::finish_recompute() {
+  if (recomputation != nullptr) {
+    install_recompute();
+  }
+}
+
+void MixedEnsembleState::before_accept(const bool merge, const long int a, const long int b, const double u,
+                                       const double v) {
+  if (recomputation != nullptr && recomputation->done.load(std::memory_order_acquire)) {
+    install_recompute();
+  }
+  if (recomputation != nullptr) {
+    recomputation->moves.push_back({merge, a, b, u, v});
+  }
+}
+
+double MixedEnsembleState::log_abs_det() const {
+  double real = 0, mixed = 0, complex = 0;
+  for (long int i = 0; i < Nreal; i++) {
+    real += real_real[i];
+    mixed += real_complex[i];
+  }
+  for (long int p = 0; p < Ncomplex; p++) {
+    // the factor |z - conj(z)| of each pair
+    complex += complex_complex[p] + 2 * std::log(2 * std::abs(y[p]));
+  }
+  return 0.5 * (real + complex) + mixed;
+}
+
+double MixedEnsembleState::log_ratio_merge(const long int a, const long int b, const double u, const double v) const {
+  assert(a != b && a >= 0 && b >= 0 && a < Nreal && b < Nreal);
+  assert(v > 0);
+  const double old_terms = real_real[a] + real_real[b] - std::log(std::abs(lambda[a] - lambda[b]))
+                           + real_complex[a] + real_complex[b];
+
+  LargeExponentFloat real1(1.0), real2(1.0), complex1(1.0), complex2(1.0);
+  prod_dist2_complexrealvec(Nreal, u, u, v, v, lambda, real1, real2);
+  prod_dist2_conjpair_complexvec(Ncomplex, Ncomplex, u, u, v, v, x, y, complex1, complex2);
+  // the kernel over the reals includes a and b
+  const double excluded = std::log(((u - lambda[a]) * (u - lambda[a]) + v * v)
+                                   * ((u - lambda[b]) * (u - lambda[b]) + v * v));
+  const double new_terms = log_abs(real1) - excluded + log_abs(complex1) + std::log(2 * v);
+  return new_terms - old_terms;
+}
+
+double MixedEnsembleState::log_ratio_split(const long int p, const double u1, const double u2) const {
+  assert(p >= 0 && p < Ncomplex);
+  const double old_terms = complex_real[p] + complex_complex[p] + std::log(2 * std::abs(y[p]));
+
+  LargeExponentFloat real1(1.0), real2(1.0), complex1(1.0), complex2(1.0);
+  prod_diff_realrealvec(Nreal, Nreal, u1, u2, lambda, real1, real2);
+  prod_dist2_realcomplexvec(Ncomplex, u1, u2, x, y, complex1, complex2);
+  // the kernel over the pairs includes p
+  const double y2 = y[p] * y[p];
+  const double excluded = std::log(((u1 - x[p]) * (u1 - x[p]) + y2) * ((u2 - x[p]) * (u2 - x[p]) + y2));
+  const double new_terms = log_abs(real1) + log_abs(real2) + std::log(std::abs(u1 - u2))
+                           + log_abs(complex1) + log_abs(complex2) - excluded;
+  return new_terms - old_terms;
+}
+
+double MixedEnsembleState::error_bound() const {
+  double bound = 0;
+  for (long int i = 0; i < Nreal; i++) {
+    bound += real_error[i];
+  }
+  for (long int p = 0; p < Ncomplex; p++) {
+    bound += complex_error[p];
+  }
+  return bound;
+}
+
+void MixedEnsembleState::remove_real(const long int i) {
+  const long int last = --Nreal;
+  lambda[i] = lambda[last];
+  real_real[i] = real_real[last];
+  real_complex[i] = real_complex[last];
+  real_error[i] = real_error[last];
+}
+
+void MixedEnsembleState::remove_complex(const long int p) {
+  const long int last = --Ncomplex;
+  x[p] = x[last];
+  y[p] = y[last];
+  complex_real[p] = complex_real[last];
+  complex_complex[p] = complex_complex[last];
+  complex_error[p] = complex_error[last];
+}
+
+void MixedEnsembleState::accept_merge(const long int a, const long int b, const double u, const double v) {
+  assert(a != b && a >= 0 && b >= 0 && a < Nreal && b < Nreal);
+  assert(v > 0);
+  before_accept(true, a, b, u, v);
+  const __m256d la = _mm256_set1_pd(lambda[a]);
+  const __m256d lb = _mm256_set1_pd(lambda[b]);
+  const __m256d vu = _mm256_set1_pd(u);
+  const __m256d vv = _mm256_set1_pd(v);
+  remove_real(std::max(a, b));
+  remove_real(std::min(a, b));
+
+  __m256d max_errors = _mm256_setzero_pd();
+  __m256d new_complex_real = _mm256_setzero_pd();
+  __m256d new_complex_real_abs = _mm256_setzero_pd();
+  for_vectors(Nreal, [&](const long int i, const __m256d valid) {
+    const __m256d l = _mm256_load_pd(&lambda[i]);
+    const __m256d removed = log_pd(abs(_mm256_mul_pd(_mm256_sub_pd(l, la), _mm256_sub_pd(l, lb))));
+    const __m256d added = log_pd(_mm256_add_pd(sqr(_mm256_sub_pd(l, vu)), sqr(vv)));
+    const __m256d rr = add_to(real_real, i, _mm256_sub_pd(_mm256_setzero_pd(), removed));
+    const __m256d rc = add_to(real_complex, i, added);
+    const __m256d error = add_to(real_error, i, _mm256_add_pd(update_error(1, abs(removed), rr),
+                                                              update_error(1, abs(added), rc)));
+    max_errors = _mm256_max_pd(max_errors, _mm256_and_pd(error, valid));
+    new_complex_real = _mm256_add_pd(new_complex_real, _mm256_and_pd(added, valid));
+    new_complex_real_abs = _mm256_add_pd(new_complex_real_abs, _mm256_and_pd(abs(added), valid));
+  });
+
+  __m256d new_complex_complex = _mm256_setzero_pd();
+  __m256d new_complex_complex_abs = _mm256_setzero_pd();
+  for_vectors(Ncomplex, [&](const long int q, const __m256d valid) {
+    const __m256d xq = _mm256_load_pd(&x[q]);
+    const __m256d yq = _mm256_load_pd(&y[q]);
+    const __m256d zero = _mm256_setzero_pd();
+    const __m256d removed = log_pd(_mm256_mul_pd(dist2(xq, yq, la, zero), dist2(xq, yq, lb, zero)));
+    const __m256d added = log_pd(_mm256_mul_pd(dist2(xq, yq, vu, vv), dist2(xq, yq, vu, _mm256_sub_pd(zero, vv))));
+    const __m256d cr = add_to(complex_real, q, _mm256_sub_pd(zero, removed));
+    const __m256d cc = add_to(complex_complex, q, added);
+    const __m256d error = add_to(complex_error, q, _mm256_add_pd(update_error(1, abs(removed), cr),
+                                                                 update_error(1, abs(added), cc)));
+    max_errors = _mm256_max_pd(max_errors, _mm256_and_pd(error, valid));
+    new_complex_complex = _mm256_add_pd(new_complex_complex, _mm256_and_pd(added, valid));
+    new_complex_complex_abs = _mm256_add_pd(new_complex_complex_abs, _mm256_and_pd(abs(added), valid));
+  });
+
+  x[Ncomplex] = u;
+  y[Ncomplex] = v;
+  complex_real[Ncomplex] = horizontal_sum(new_complex_real);
+  complex_complex[Ncomplex] = horizontal_sum(new_complex_complex);
+  complex_error[Ncomplex] = sum_error(Nreal, horizontal_sum(new_complex_real_abs))
+                            + sum_error(Ncomplex, horizontal_sum(new_complex_complex_abs));
+  max_error = std::max(horizontal_max(max_errors), complex_error[Ncomplex]);
+  Ncomplex++;
+  if (max_error > recompute_threshold && recomputation == nullptr && !replaying) {
+    start_recompute();
+  }
+}
+
+void MixedEnsembleState::accept_split(const long int p, const double u1, const double u2) {
+  assert(p >= 0 && p < Ncomplex);
+  before_accept(false, p, 0, u1, u2);
+  const __m256d xp = _mm256_set1_pd(x[p]);
+  const __m256d yp = _mm256_set1_pd(y[p]);
+  const __m256d vu1 = _mm256_set1_pd(u1);
+  const __m256d vu2 = _mm256_set1_pd(u2);
+  remove_complex(p);
+
+  __m256d max_errors = _mm256_setzero_pd();
+  __m256d new_real_real1 = _mm256_setzero_pd();
+  __m256d new_real_real2 = _mm256_setzero_pd();
+  __m256d new_real_real_abs1 = _mm256_setzero_pd();
+  __m256d new_real_real_abs2 = _mm256_setzero_pd();
+  for_vectors(Nreal, [&](const long int i, const __m256d valid) {
+    const __m256d l = _mm256_load_pd(&lambda[i]);
+    const __m256d added1 = log_pd(abs(_mm256_sub_pd(l, vu1)));
+    const __m256d added2 = log_pd(abs(_mm256_sub_pd(l, vu2)));
+    const __m256d removed = log_pd(dist2(l, _mm256_setzero_pd(), xp, yp));
+    const __m256d rr = add_to(real_real, i, _mm256_add_pd(added1, added2));
+    const __m256d rc = add_to(real_complex, i, _mm256_sub_pd(_mm256_setzero_pd(), removed));
+    const __m256d error = add_to(real_error, i,
+                                 _mm256_add_pd(update_error(2, _mm256_add_pd(abs(added1), abs(added2)), rr),
+                                               update_error(1, abs(removed), rc)));
+    max_errors = _mm256_max_pd(max_errors, _mm256_and_pd(error, valid));
+    new_real_real1 = _mm256_add_pd(new_real_real1, _mm256_and_pd(added1, valid));
+    new_real_real2 = _mm256_add_pd(new_real_real2, _mm256_and_pd(added2, valid));
+    new_real_real_abs1 = _mm256_add_pd(new_real_real_abs1, _mm256_and_pd(abs(added1), valid));
+    new_real_real_abs2 = _mm256_add_pd(new_real_real_abs2, _mm256_and_pd(abs(added2), valid));
+  });
+
+  __m256d new_real_complex1 = _mm256_setzero_pd();
+  __m256d new_real_complex2 = _mm256_setzero_pd();
+  __m256d new_real_complex_abs1 = _mm256_setzero_pd();
+  __m256d new_real_complex_abs2 = _mm256_setzero_pd();
+  for_vectors(Ncomplex, [&](const long int q, const __m256d valid) {
+    const __m256d xq = _mm256_load_pd(&x[q]);
+    const __m256d yq = _mm256_load_pd(&y[q]);
+    const __m256d zero = _mm256_setzero_pd();
+    const __m256d added1 = log_pd(dist2(xq, yq, vu1, zero));
+    const __m256d added2 = log_pd(dist2(xq, yq, vu2, zero));
+    const __m256d removed = log_pd(_mm256_mul_pd(dist2(xq, yq, xp, yp), dist2(xq, yq, xp, _mm256_sub_pd(zero, yp))));
+    const __m256d cr = add_to(complex_real, q, _mm256_add_pd(added1, added2));
+    const __m256d cc = add_to(complex_complex, q, _mm256_sub_pd(zero, removed));
+    const __m256d error = add_to(complex_error, q,
+                                 _mm256_add_pd(update_error(2, _mm256_add_pd(abs(added1), abs(added2)), cr),
+                                               update_error(1, abs(removed), cc)));
+    max_errors = _mm256_max_pd(max_errors, _mm256_and_pd(error, valid));
+    new_real_complex1 = _mm256_add_pd(new_real_complex1, _mm256_and_pd(added1, valid));
+    new_real_complex2 = _mm256_add_pd(new_real_complex2, _mm256_and_pd(added2, valid));
+    new_real_complex_abs1 = _mm256_add_pd(new_real_complex_abs1, _mm256_and_pd(abs(added1), valid));
+    new_real_complex_abs2 = _mm256_add_pd(new_real_complex_abs2, _mm256_and_pd(abs(added2), valid));
+  });
+
+  const double log_distance = std::log(std::abs(u1 - u2));
+  // the logs of the new particles, with log_distance
+  const long int count = Nreal + 1;
+  const long int complex_count = Ncomplex;
+  lambda[Nreal] = u1;
+  real_real[Nreal] = horizontal_sum(new_real_real1) + log_distance;
+  real_complex[Nreal] = horizontal_sum(new_real_complex1);
+  real_error[Nreal] = sum_error(count, horizontal_sum(new_real_real_abs1) + std::abs(log_distance))
+                      + sum_error(complex_count, horizontal_sum(new_real_complex_abs1));
+  Nreal++;
+  lambda[Nreal] = u2;
+  real_real[Nreal] = horizontal_sum(new_real_real2) + log_distance;
+  real_complex[Nreal] = horizontal_sum(new_real_complex2);
+  real_error[Nreal] = sum_error(count, horizontal_sum(new_real_real_abs2) + std::abs(log_distance))
+                      + sum_error(complex_count, horizontal_sum(new_real_complex_abs2));
+  Nreal++;
+  max_error = std::max({horizontal_max(max_errors), real_error[Nreal - 2], real_error[Nreal - 1]});
+  if (max_error > recompute_threshold && recomputation == nullptr && !replaying) {
+    start_recompute();
+  }
+}
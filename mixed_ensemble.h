@@ -0,0 +1,121 @@
+#ifndef MIXED_ENSEMBLE_H
+#define MIXED_ENSEMBLE_H
+
+/**
+ * State of the eigenvalues of a real Ginibre matrix for species-change moves: two real eigenvalues merge into a
+ * conjugate pair, or a pair splits into two real eigenvalues. |det| is the one of vandermonde_abs_real_ginibre, with
+ * Nreal real eigenvalues lambda and Ncomplex pairs given by their representatives x+i*y (y > 0); Nreal + 2*Ncomplex
+ * stays constant.
+ *
+ * The state caches the log of the products of each particle with all others, per term:
+ *   real_real[i]       = sum_{j!=i} log|lambda[i]-lambda[j]|
+ *   real_complex[i]    = sum_q log|lambda[i]-z[q]|^2
+ *   complex_real[p]    = sum_i log|lambda[i]-z[p]|^2
+ *   complex_complex[p] = sum_{q!=p} log(|z[p]-z[q]|^2 |z[p]-conj(z[q])|^2)
+ * so that the old side of a species change is O(1), and the new side is one O(N) kernel call per species. Accepting a
+ * move updates the caches in O(N) (vectorized logs of the changed factors). The caches accumulate rounding errors of a
+ * few ulp of the log terms per accepted move; recompute() rebuilds them in O(N^2).
+ *
+ * Every particle carries a bound of the absolute error of its cached log terms (the relative error of its products),
+ * from the ulp counts of the operations that built it: the rounding of the arguments of the logs, the error of log_pd
+ * (4 ulp relative to max(1, |log|)) and the rounding of the additions, to first order in DBL_EPSILON. When the largest
+ * bound exceeds the threshold of set_recompute_threshold after an accepted move, a background thread recomputes the
+ * caches from a copy of the positions while sampling continues. The moves accepted in the meantime are logged, and the
+ * next accept (or finish_recompute) installs the new caches and replays the logged moves on them.
+ *
+ * Removed particles are replaced by the last particle of their species, new particles are appended. The positions must
+ * be pairwise distinct (log(0) is not handled by the cache updates).
+ */
+class MixedEnsembleState {
+  public:
+    long int Nreal;
+    long int Ncomplex;
+    // Positions, padded for the kernels. Only changed by the accept functions.
+    double* lambda;
+    double* x;
+    double* y;
+
+    MixedEnsembleState(
+            const long int Nreal,
+            const long int Ncomplex,
+            const double* lambda,
+            const double* x,
+            const double* y
+    );
+    ~MixedEnsembleState();
+    MixedEnsembleState(const MixedEnsembleState&) = delete;
+    MixedEnsembleState& operator=(const MixedEnsembleState&) = delete;
+
+    // Natural log of |det| from the caches.
+    double log_abs_det() const;
+
+    // log|det_new| - log|det_old| for replacing the real particles a != b by the pair u+i*v (v > 0).
+    double log_ratio_merge(const long int a, const long int b, const double u, const double v) const;
+
+    // log|det_new| - log|det_old| for replacing the pair p by the real particles u1 and u2.
+    double log_ratio_split(const long int p, const double u1, const double u2) const;
+
+    void accept_merge(const long int a, const long int b, const double u, const double v);
+
+    void accept_split(const long int p, const double u1, const double u2);
+
+    // Recomputes all caches from the positions, discarding a background recompute.
+    void recompute();
+
+    // Bound of the absolute error of the cached log terms of real particle i, or of pair p. The cache part of the
+    // error of a log ratio is bounded by the bounds of the replaced particles.
+    double real_error_bound(const long int i) const {
+      return real_error[i];
+    }
+
+    double complex_error_bound(const long int p) const {
+      return complex_error[p];
+    }
+
+    // The largest bound of all particles, which is compared to the recompute threshold.
+    double max_error_bound() const {
+      return max_error;
+    }
+
+    // Bound of the error of log_abs_det() from the caches (the relative error of |det|), in O(N).
+    double error_bound() const;
+
+    // Starts a background recompute when the largest bound exceeds threshold (infinite by default). The threshold
+    // should be well above the bound right after a recompute, which grows with N.
+    void set_recompute_threshold(const double threshold) {
+      recompute_threshold = threshold;
+    }
+
+    bool recompute_pending() const {
+      return recomputation != nullptr;
+    }
+
+    // Waits for a background recompute and installs it.
+    void finish_recompute();
+
+  private:
+    struct Recomputation;
+
+    // Nreal + 2*Ncomplex, the capacity of the arrays of both species
+    long int size;
+    double* real_real;
+    double* real_complex;
+    double* complex_real;
+    double* complex_complex;
+    double* real_error;
+    double* complex_error;
+    double max_error = 0;
+    double recompute_threshold;
+    Recomputation* recomputation = nullptr;
+    bool replaying = false;
+
+    void remove_real(const long int i);
+    void remove_complex(const long int p);
+    // Installs a finished background recompute, logs the move if one is running.
+    void before_accept(const bool merge, const long int a, const long int b, const double u, const double v);
+    void start_recompute();
+    void install_recompute();
+    void discard_recompute();
+};
+
+#endif
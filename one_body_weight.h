@@ -0,0 +1,190 @@
+#ifndef ONE_BODY_WEIGHT_H
+#define ONE_BODY_WEIGHT_H
+
+#include <cmath>
+#include "large_product.h"
+#include "simd_math.h"
+#include "vandermonde_det.h"
+
+/**
+ * Log acceptance ratios of single particle moves with one-body weights w (external potentials), i.e. for the density
+ * |det|^beta * prod_j w(z[j]). The ratio is beta * L + log w(new) - log w(old) with L as in metropolis.h. The logs of
+ * the products and of the weights at the new and the old position are evaluated together in one vector, without
+ * scalar libm calls.
+ *
+ * A one-body weight functor computes the log weight of 4 positions (y is 0 for real particles):
+ *
+ *   struct OneBodyWeight {
+ *     __m256d log_weight(__m256d x, __m256d y) const;
+ *   };
+ */
+
+// exp(-strength * |z|^2)
+struct GaussianConfinement {
+  double strength;
+
+  inline __m256d log_weight(const __m256d x, const __m256d y) const {
+    const __m256d abs2 = _mm256_add_pd(_mm256_mul_pd(x, x), _mm256_mul_pd(y, y));
+    return _mm256_mul_pd(_mm256_set1_pd(-strength), abs2);
+  }
+};
+
+// Weight of a conjugate pair of complex eigenvalues of a real Ginibre matrix with entries of variance 1/scale^2,
+// exp(s^2 (y^2-x^2)) erfc(sqrt(2) s |y|) with s=scale (Edelman 1997, up to the constant factor). Use together with
+// GaussianConfinement{scale^2 / 2} for the real eigenvalues.
+struct RealGinibreComplexWeight {
+  double scale;
+
+  inline __m256d log_weight(const __m256d x, const __m256d y) const {
+    const __m256d abs_mask = _mm256_castsi256_pd(_mm256_set1_epi64x(0x7fffffffffffffffULL));
+    const __m256d s2 = _mm256_set1_pd(scale * scale);
+    const __m256d gaussian = _mm256_mul_pd(s2, _mm256_sub_pd(_mm256_mul_pd(y, y), _mm256_mul_pd(x, x)));
+    const __m256d erfc_argument = _mm256_mul_pd(_mm256_set1_pd(M_SQRT2 * scale), _mm256_and_pd(y, abs_mask));
+    return _mm256_add_pd(gaussian, log_erfc_pd(erfc_argument));
+  }
+};
+
+// log w(u+i*v) - log w(x_old+i*y_old), e.g. to shift the threshold of the early rejection tests of metropolis.h.
+template<class OneBodyWeight>
+inline double one_body_log_ratio(
+        const OneBodyWeight& weight,
+        const double u,
+        const double v,
+        const double x_old,
+        const double y_old
+) {
+  const __m256d log_weights = weight.log_weight(_mm256_set_pd(0.0, 0.0, x_old, u), _mm256_set_pd(0.0, 0.0, y_old, v));
+  const __m128d low = _mm256_castpd256_pd128(log_weights);
+  return _mm_cvtsd_f64(_mm_sub_sd(low, _mm_unpackhi_pd(low, low)));
+}
+
+/**
+ * beta * c * log|prod_new / prod_old| + log w(u+i*v) - log w(x_old+i*y_old) for the products of a kernel (c=1 for
+ * distances, c=0.5 for squared distances) and a one-body weight functor. Returns -inf if prod_new is 0.
+ */
+template<class OneBodyWeight>
+inline double log_acceptance_ratio(
+        const LargeExponentFloat& prod_new,
+        const LargeExponentFloat& prod_old,
+        const double beta_c,
+        const double u,
+        const double v,
+        const double x_old,
+        const double y_old,
+        const OneBodyWeight& weight
+) {
+  if (prod_new.significand == 0) [[unlikely]] {
+    return -INFINITY;
+  }
+  const __m256d significands = _mm256_set_pd(1.0, 1.0, std::abs(prod_old.significand),
+                                             std::abs(prod_new.significand));
+  const __m256d log_significands = log_pd(significands);
+  const __m256d log_weights = weight.log_weight(_mm256_set_pd(0.0, 0.0, x_old, u), _mm256_set_pd(0.0, 0.0, y_old, v));
+
+  // lane 0: new position, lane 1: old position
+  const __m256d log_terms = _mm256_add_pd(_mm256_mul_pd(_mm256_set1_pd(beta_c), log_significands), log_weights);
+  const __m128d low = _mm256_castpd256_pd128(log_terms);
+  const double exponents = beta_c * M_LN2 * double(prod_new.exponent - prod_old.exponent);
+  return _mm_cvtsd_f64(_mm_sub_sd(low, _mm_unpackhi_pd(low, low))) + exponents;
+}
+
+// Moving real particle k to u.
+template<class OneBodyWeight>
+inline double log_acceptance_ratio_realvec(
+        const long int N,
+        const long int k,
+        const double u,
+        const double beta,
+        const double* x,
+        const OneBodyWeight& weight
+) {
+  LargeExponentFloat prod_new(1.0);
+  LargeExponentFloat prod_old(1.0);
+  prod_diff_realrealvec(N, k, u, x[k], x, prod_new, prod_old);
+  return log_acceptance_ratio(prod_new, prod_old, beta, u, 0.0, x[k], 0.0, weight);
+}
+
+// Moving complex particle k to u+i*v.
+template<class OneBodyWeight>
+inline double log_acceptance_ratio_complexvec(
+        const long int N,
+        const long int k,
+        const double u,
+        const double v,
+        const double beta,
+        const double* x,
+        const double* y,
+        const OneBodyWeight& weight
+) {
+  LargeExponentFloat prod_new(1.0);
+  LargeExponentFloat prod_old(1.0);
+  prod_dist2_complexcomplexvec(N, k, u, x[k], v, y[k], x, y, prod_new, prod_old);
+  return log_acceptance_ratio(prod_new, prod_old, 0.5 * beta, u, v, x[k], y[k], weight);
+}
+
+// Moving the conjugate pair with representative k to u+i*v (see prod_dist2_conjpair_complexvec), for |det| of all 2N
+// points to the power beta. The pair factor |z-conj(z)| = 2|y| of the moved pair is included.
+template<class OneBodyWeight>
+inline double log_acceptance_ratio_conjpair_complexvec(
+        const long int N,
+        const long int k,
+        const double u,
+        const double v,
+        const double beta,
+        const double* x,
+        const double* y,
+        const OneBodyWeight& weight
+) {
+  LargeExponentFloat prod_new(1.0);
+  LargeExponentFloat prod_old(1.0);
+  // |w-z[j]|^2 |w-conj(z[j])|^2 is the factor of both members of the moved pair with pair j
+  prod_dist2_conjpair_complexvec(N, k, u, x[k], v, y[k], x, y, prod_new, prod_old);
+  prod_new.significand *= v;
+  prod_old.significand *= y[k];
+  return log_acceptance_ratio(prod_new, prod_old, beta, u, v, x[k], y[k], weight);
+}
+
+template<class OneBodyWeight>
+inline bool metropolis_accept_realvec(
+        const long int N,
+        const long int k,
+        const double u,
+        const double beta,
+        const double log_uniform,
+        const double* x,
+        const OneBodyWeight& weight
+) {
+  return log_uniform < log_acceptance_ratio_realvec(N, k, u, beta, x, weight);
+}
+
+template<class OneBodyWeight>
+inline bool metropolis_accept_complexvec(
+        const long int N,
+        const long int k,
+        const double u,
+        const double v,
+        const double beta,
+        const double log_uniform,
+        const double* x,
+        const double* y,
+        const OneBodyWeight& weight
+) {
+  return log_uniform < log_acceptance_ratio_complexvec(N, k, u, v, beta, x, y, weight);
+}
+
+template<class OneBodyWeight>
+inline bool metropolis_accept_conjpair_complexvec(
+        const long int N,
+        const long int k,
+        const double u,
+        const double v,
+        const double beta,
+        const double log_uniform,
+        const double* x,
+        const double* y,
+        const OneBodyWeight& weight
+) {
+  return log_uniform < log_acceptance_ratio_conjpair_complexvec(N, k, u, v, beta, x, y, weight);
+}
+
+#endif
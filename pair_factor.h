@@ -0,0 +1,133 @@
+#ifndef PAIR_FACTOR_H
+#define PAIR_FACTOR_H
+
+#include <cassert>
+#include <cmath>
+#include "large_product.h"
+
+/**
+ * Kernels for products of a pair factor f(position, particle j) over all particles j!=k, for ensembles where the
+ * factor is not |u-x| or |z-z[j]|^2.
+ *
+ * The particles are stored as COORDINATES arrays of coordinates (structure of arrays, each aligned to 32 bytes like the
+ * arrays of new_double_array). A pair factor functor defines the number of coordinates and the factor of 4 particles
+ * and a position:
+ *
+ *   struct PairFactor {
+ *     static constexpr int COORDINATES = ...;
+ *     static __m256d factor(const __m256d* particle, const __m256d* position);
+ *   };
+ *
+ * where particle[c] holds coordinate c of 4 particles and position[c] the broadcast coordinate c of the position.
+ */
+
+// |z-z[j]|^2 in D dimensions. The first two terms are added like in prod_dist2_complexcomplexvec, so that ComplexPlane
+// rounds the same way.
+template<int D>
+struct SquaredDistance {
+  static_assert(D >= 2, "use prod_diff_realrealvec for real particles");
+  static constexpr int COORDINATES = D;
+
+  static inline __m256d factor(const __m256d* particle, const __m256d* position) {
+    const __m256d d0 = _mm256_sub_pd(position[0], particle[0]);
+    const __m256d d1 = _mm256_sub_pd(position[1], particle[1]);
+    __m256d dist2 = _mm256_add_pd(_mm256_mul_pd(d0, d0), _mm256_mul_pd(d1, d1));
+    for (int c = 2; c < D; c++) {
+      const __m256d d = _mm256_sub_pd(position[c], particle[c]);
+      dist2 = _mm256_add_pd(dist2, _mm256_mul_pd(d, d));
+    }
+    return dist2;
+  }
+};
+
+// Complex particles z=x+i*y, the same factor as prod_dist2_complexcomplexvec.
+typedef SquaredDistance<2> ComplexPlane;
+
+// Particles e^{i*theta} on the unit circle (circular ensembles) with the squared chordal distance
+// |e^{i*theta}-e^{i*phi}|^2. The coordinates are cos(theta) and sin(theta); their rounding errors cancel badly in the
+// differences, so the relative error of the factor grows like eps/|theta-phi| for close angles.
+struct ChordalCircle {
+  static constexpr int COORDINATES = 2;
+
+  static inline void coordinates(const double theta, double& c0, double& c1) {
+    c0 = std::cos(theta);
+    c1 = std::sin(theta);
+  }
+
+  static inline __m256d factor(const __m256d* particle, const __m256d* position) {
+    return SquaredDistance<2>::factor(particle, position);
+  }
+};
+
+// Points on the unit sphere given by their stereographic projection z=x+i*y, with the squared chordal distance
+// 4|z-w|^2 / ((1+|z|^2)(1+|w|^2)). The coordinates are x, y and 2/(1+|z|^2).
+struct StereographicSphere {
+  static constexpr int COORDINATES = 3;
+
+  static inline void coordinates(const double x, const double y, double& c0, double& c1, double& c2) {
+    c0 = x;
+    c1 = y;
+    c2 = 2 / (1 + x * x + y * y);
+  }
+
+  static inline __m256d factor(const __m256d* particle, const __m256d* position) {
+    return _mm256_mul_pd(SquaredDistance<2>::factor(particle, position),
+                         _mm256_mul_pd(particle[2], position[2]));
+  }
+};
+
+/**
+ * Computes the products of PairFactor::factor(particle j, position1) and PairFactor::factor(particle j, position2)
+ * for all j!=k, like prod_dist2_complexcomplexvec (which is the same as PairFactor=ComplexPlane). particles[c] is the
+ * array of coordinate c, position1 and position2 hold PairFactor::COORDINATES coordinates each.
+ */
+template<class PairFactor>
+void prod_pair_factor_vec(
+        const long int N,
+        const long int k,
+        const double* position1,
+        const double* position2,
+        const double* const* particles,
+        LargeExponentFloat& prod1,
+        LargeExponentFloat& prod2
+) __attribute__((optimize("-fno-tree-pre")));
+
+template<class PairFactor>
+void prod_pair_factor_vec(
+        const long int N,
+        const long int k,
+        const double* position1,
+        const double* position2,
+        const double* const* particles,
+        LargeExponentFloat& prod1,
+        LargeExponentFloat& prod2
+) {
+  constexpr int C = PairFactor::COORDINATES;
+  for (int c = 0; c < C; c++) {
+    assert(reinterpret_cast<uintptr_t>(particles[c]) % 32 == 0);
+  }
+
+  LargeProduct vprod1(prod1);
+  LargeProduct vprod2(prod2);
+
+  __m256d p1[C];
+  __m256d p2[C];
+  for (int c = 0; c < C; c++) {
+    p1[c] = _mm256_set1_pd(position1[c]);
+    p2[c] = _mm256_set1_pd(position2[c]);
+  }
+
+  mul_pair_factors(N, k, vprod1, vprod2, [&](const int64_t j, __m256d& factor1, __m256d& factor2) {
+    __m256d q[C];
+    for (int c = 0; c < C; c++) {
+      q[c] = _mm256_load_pd(&particles[c][j]);
+    }
+    factor1 = PairFactor::factor(q, p1);
+    factor2 = PairFactor::factor(q, p2);
+  });
+
+  prod1 = vprod1.get();
+  prod2 = vprod2.get();
+}
+
+#endif
@@ -0,0 +1,86 @@
+#include "particle_set.h"
+#include "vandermonde_det.h"
+
+#include <algorithm>
+#include <cassert>
+
+namespace {
+
+// Copies the n values of old (nullptr for none) into a new zero padded array of capacity elements, frees old.
+double* reallocate(double* old, const long int n, const long int capacity) {
+  double* array = new_double_array(capacity);
+  if (old != nullptr) {
+    std::copy(old, old + n, array);
+    _mm_free(old);
+  }
+  std::fill(array + n, array + capacity, 0.0);
+  return array;
+}
+
+}
+
+ParticleSet::ParticleSet(const bool is_complex, const long int capacity) {
+  // allocates y, so that is_complex() holds before the first insert
+  allocated = 4;
+  x = reallocate(nullptr, 0, allocated);
+  y = is_complex ? reallocate(nullptr, 0, allocated) : nullptr;
+  reserve(capacity);
+}
+
+ParticleSet::ParticleSet(const bool is_complex, const long int N, const double* x, const double* y):
+  ParticleSet(is_complex, N)
+{
+  std::copy(x, x + N, this->x);
+  if (is_complex) {
+    std::copy(y, y + N, this->y);
+  }
+  this->N = N;
+}
+
+ParticleSet::~ParticleSet() {
+  _mm_free(x);
+  _mm_free(y);
+}
+
+void ParticleSet::reserve(const long int capacity) {
+  if (capacity <= allocated) {
+    return;
+  }
+  allocated = (capacity + 3) & ~3L;
+  x = reallocate(x, N, allocated);
+  if (y != nullptr) {
+    y = reallocate(y, N, allocated);
+  }
+}
+
+long int ParticleSet::insert(const double u, const double v) {
+  if (N == allocated) {
+    reserve(2 * allocated);
+  }
+  move(N, u, v);
+  return N++;
+}
+
+void ParticleSet::remove(const long int i) {
+  assert(i >= 0 && i < N);
+  const long int last = --N;
+  move(i, x[last], y != nullptr ? y[last] : 0.0);
+  move(last, 0.0, 0.0);
+}
+
+void ParticleSet::insertion_factor(const double u, const double v, LargeExponentFloat& prod) const {
+  if (y != nullptr) {
+    prod_dist2_complexvec(N, N, u, v, x, y, prod);
+  } else {
+    prod_diff_realvec(N, N, u, x, prod);
+  }
+}
+
+void ParticleSet::deletion_factor(const long int i, LargeExponentFloat& prod) const {
+  assert(i >= 0 && i < N);
+  if (y != nullptr) {
+    prod_dist2_complexvec(N, i, x[i], y[i], x, y, prod);
+  } else {
+    prod_diff_realvec(N, i, x[i], x, prod);
+  }
+}
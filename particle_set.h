@@ -0,0 +1,67 @@
+#ifndef PARTICLE_SET_H
+#define PARTICLE_SET_H
+
+#include "large_product.h"
+
+/**
+ * Particles of a grand-canonical or birth-death sampler, whose number changes with every accepted move. The positions
+ * are stored like arrays of new_double_array (64 byte aligned, padded to a multiple of 4), so they can be passed to the
+ * kernels directly. insert appends in amortized O(1) (the capacity doubles), remove moves the last particle into the
+ * gap in O(1), so particle indices are not stable across removals.
+ *
+ * The lanes beyond size() up to the capacity are always 0. The kernels mask them, but they are still loaded and
+ * computed with, and 0 avoids denormal or NaN garbage from freed particles and uninitialized memory.
+ *
+ * The ratio kernels give the factors of |det| (real particles) or |det|^2 (complex particles) that a birth or a death
+ * changes:
+ *   insertion_factor:  prod_j (u - x[j])  or  prod_j |u+i*v - z[j]|^2,  det_new / det_old = factor
+ *   deletion_factor:   prod_{j != i} (x[i] - x[j])  or  prod_{j != i} |z[i] - z[j]|^2,  det_new / det_old = 1 / factor
+ * The factors are multiplied into prod, like the kernels of vandermonde_det.h do.
+ */
+class ParticleSet {
+  public:
+    long int N = 0;
+    // Positions, only changed by the functions below. y is nullptr for real particles.
+    double* x = nullptr;
+    double* y = nullptr;
+
+    explicit ParticleSet(const bool is_complex, const long int capacity = 0);
+    ParticleSet(const bool is_complex, const long int N, const double* x, const double* y);
+    ~ParticleSet();
+    ParticleSet(const ParticleSet&) = delete;
+    ParticleSet& operator=(const ParticleSet&) = delete;
+
+    bool is_complex() const {
+      return y != nullptr;
+    }
+
+    long int capacity() const {
+      return allocated;
+    }
+
+    // Makes room for capacity particles.
+    void reserve(const long int capacity);
+
+    // Appends a particle and returns its index.
+    long int insert(const double u, const double v = 0);
+
+    // Replaces particle i by the last particle.
+    void remove(const long int i);
+
+    void move(const long int i, const double u, const double v = 0) {
+      x[i] = u;
+      if (y != nullptr) {
+        y[i] = v;
+      }
+    }
+
+    void insertion_factor(const double u, const double v, LargeExponentFloat& prod) const;
+
+    void deletion_factor(const long int i, LargeExponentFloat& prod) const;
+
+  private:
+    // a multiple of 4, at least 4
+    long int allocated = 0;
+};
+
+#endif
@@ -0,0 +1,203 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <cstdint>
+#include <cstring>
+#include <sstream>
+#include <string>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/**
+ * Hardware performance counters of the calling thread, and of the threads it creates while the counters exist, via
+ * Linux perf_event_open.
+ *
+ * Each event is opened on its own, so events that are not available (no permission, e.g. in containers or with
+ * kernel.perf_event_paranoid > 2, not supported by the CPU or the virtual machine, or no Linux at all) are reported as
+ * unavailable while the others keep working. If the kernel multiplexes the events, the values are scaled up by the
+ * ratio of the enabled and the running time.
+ *
+ * There is no generic perf event for L2 misses, so the cache misses are reported for the L1 data cache and the last
+ * level cache.
+ */
+class PerfCounters {
+  public:
+    enum Event { CYCLES, INSTRUCTIONS, L1D_MISSES, LLC_MISSES, DTLB_MISSES, BRANCH_MISSES, EVENT_COUNT };
+
+    PerfCounters() {
+      for (int e = 0; e < EVENT_COUNT; e++) {
+        fd[e] = open_event(static_cast<Event>(e));
+      }
+      reset();
+    }
+
+    ~PerfCounters() {
+#ifdef __linux__
+      for (int e = 0; e < EVENT_COUNT; e++) {
+        if (fd[e] >= 0) {
+          close(fd[e]);
+        }
+      }
+#endif
+    }
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    void start() {
+#ifdef __linux__
+      for (int e = 0; e < EVENT_COUNT; e++) {
+        if (fd[e] >= 0) {
+          ioctl(fd[e], PERF_EVENT_IOC_ENABLE, 0);
+        }
+      }
+#endif
+    }
+
+    void stop() {
+#ifdef __linux__
+      for (int e = 0; e < EVENT_COUNT; e++) {
+        if (fd[e] >= 0) {
+          ioctl(fd[e], PERF_EVENT_IOC_DISABLE, 0);
+        }
+      }
+#endif
+    }
+
+    // Sets all values to zero.
+    void reset() {
+      for (int e = 0; e < EVENT_COUNT; e++) {
+        read_event(static_cast<Event>(e), baseline[e]);
+      }
+    }
+
+    bool available(const Event e) const {
+      return fd[e] >= 0;
+    }
+
+    bool any_available() const {
+      for (int e = 0; e < EVENT_COUNT; e++) {
+        if (available(static_cast<Event>(e))) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    // Count of the event since the last reset, only valid if the event is available.
+    double value(const Event e) const {
+      Reading current;
+      read_event(e, current);
+      const double count = static_cast<double>(current.value - baseline[e].value);
+      const double enabled = static_cast<double>(current.time_enabled - baseline[e].time_enabled);
+      const double running = static_cast<double>(current.time_running - baseline[e].time_running);
+      return running > 0 ? count * (enabled / running) : count;
+    }
+
+    // The rates per element (and the instructions per cycle) as text, n/a for unavailable events.
+    std::string report(const double elements) const {
+      std::ostringstream os;
+      if (!any_available()) {
+        os << " counters=n/a";
+        return os.str();
+      }
+      auto per_element = [&](const char* name, const Event e) {
+        os << " " << name << "/element=";
+        if (available(e)) {
+          os << value(e) / elements;
+        } else {
+          os << "n/a";
+        }
+      };
+      per_element("cycles", CYCLES);
+      os << " IPC=";
+      if (available(CYCLES) && available(INSTRUCTIONS) && value(CYCLES) > 0) {
+        os << value(INSTRUCTIONS) / value(CYCLES);
+      } else {
+        os << "n/a";
+      }
+      per_element("L1D_misses", L1D_MISSES);
+      per_element("LLC_misses", LLC_MISSES);
+      per_element("dTLB_misses", DTLB_MISSES);
+      per_element("branch_misses", BRANCH_MISSES);
+      return os.str();
+    }
+
+  private:
+    struct Reading {
+      uint64_t value = 0;
+      uint64_t time_enabled = 0;
+      uint64_t time_running = 0;
+    };
+
+    int fd[EVENT_COUNT];
+    Reading baseline[EVENT_COUNT];
+
+    void read_event(const Event e, Reading& reading) const {
+      reading = Reading();
+#ifdef __linux__
+      if (fd[e] >= 0 && read(fd[e], &reading, sizeof(reading)) != sizeof(reading)) {
+        reading = Reading();
+      }
+#endif
+    }
+
+    static int open_event(const Event e) {
+#ifdef __linux__
+      perf_event_attr attr;
+      std::memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.disabled = 1;
+      attr.inherit = 1;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+      auto cache_event = [](uint64_t cache, uint64_t op, uint64_t result) {
+        return cache | (op << 8) | (result << 16);
+      };
+      switch (e) {
+        case CYCLES:
+          attr.type = PERF_TYPE_HARDWARE;
+          attr.config = PERF_COUNT_HW_CPU_CYCLES;
+          break;
+        case INSTRUCTIONS:
+          attr.type = PERF_TYPE_HARDWARE;
+          attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+          break;
+        case L1D_MISSES:
+          attr.type = PERF_TYPE_HW_CACHE;
+          attr.config = cache_event(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ,
+                                    PERF_COUNT_HW_CACHE_RESULT_MISS);
+          break;
+        case LLC_MISSES:
+          attr.type = PERF_TYPE_HW_CACHE;
+          attr.config = cache_event(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_OP_READ,
+                                    PERF_COUNT_HW_CACHE_RESULT_MISS);
+          break;
+        case DTLB_MISSES:
+          attr.type = PERF_TYPE_HW_CACHE;
+          attr.config = cache_event(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_OP_READ,
+                                    PERF_COUNT_HW_CACHE_RESULT_MISS);
+          break;
+        case BRANCH_MISSES:
+          attr.type = PERF_TYPE_HARDWARE;
+          attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+          break;
+        default:
+          return -1;
+      }
+      return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+#else
+      (void) e;
+      return -1;
+#endif
+    }
+};
+
+#endif
@@ -0,0 +1,186 @@
+#include "random_proposals.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+namespace {
+  constexpr uint64_t JUMP[4] = {0x180ec6d33cfd0abaULL, 0xd5a61266f0c9392cULL, 0xa9582618e03fc9aaULL,
+                                0x39abdc4529b1661cULL};
+  constexpr uint64_t LONG_JUMP[4] = {0x76e15d3efefdcbbfULL, 0xc5004e441c522fb3ULL, 0x77710069854ee241ULL,
+                                     0x39109bb02acbe635ULL};
+}
+
+static uint64_t splitmix64(uint64_t& x) {
+  uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+static void xoshiro256_next(uint64_t s[4]) {
+  const uint64_t t = s[1] << 17;
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = (s[3] << 45) | (s[3] >> 19);
+}
+
+// Advances the state s by the polynomial given by jump, i.e. by 2^128 (JUMP) or 2^192 (LONG_JUMP) outputs.
+static void xoshiro256_jump(uint64_t s[4], const uint64_t jump[4]) {
+  uint64_t t[4] = {0, 0, 0, 0};
+  for (int i = 0; i < 4; i++) {
+    for (int b = 0; b < 64; b++) {
+      if (jump[i] & (1ULL << b)) {
+        for (int j = 0; j < 4; j++) {
+          t[j] ^= s[j];
+        }
+      }
+      xoshiro256_next(s);
+    }
+  }
+  std::copy(t, t + 4, s);
+}
+
+Xoshiro256x4::Xoshiro256x4(const uint64_t seed, const uint64_t chain) {
+  uint64_t x = seed;
+  uint64_t state[4];
+  for (int j = 0; j < 4; j++) {
+    state[j] = splitmix64(x);
+  }
+  for (uint64_t c = 0; c < chain; c++) {
+    xoshiro256_jump(state, LONG_JUMP);
+  }
+
+  alignas(32) uint64_t lanes[4][4];
+  for (int lane = 0; lane < 4; lane++) {
+    for (int j = 0; j < 4; j++) {
+      lanes[j][lane] = state[j];
+    }
+    xoshiro256_jump(state, JUMP);
+  }
+#ifdef __AVX2__
+  s0 = _mm256_load_si256(reinterpret_cast<const __m256i*>(lanes[0]));
+  s1 = _mm256_load_si256(reinterpret_cast<const __m256i*>(lanes[1]));
+  s2 = _mm256_load_si256(reinterpret_cast<const __m256i*>(lanes[2]));
+  s3 = _mm256_load_si256(reinterpret_cast<const __m256i*>(lanes[3]));
+#else // __AVX__
+  std::copy(&lanes[0][0], &lanes[0][0] + 16, &s[0][0]);
+#endif
+}
+
+void Xoshiro256x4::get_state(const int lane, uint64_t state[4]) const {
+  alignas(32) uint64_t lanes[4][4];
+#ifdef __AVX2__
+  _mm256_store_si256(reinterpret_cast<__m256i*>(lanes[0]), s0);
+  _mm256_store_si256(reinterpret_cast<__m256i*>(lanes[1]), s1);
+  _mm256_store_si256(reinterpret_cast<__m256i*>(lanes[2]), s2);
+  _mm256_store_si256(reinterpret_cast<__m256i*>(lanes[3]), s3);
+#else // __AVX__
+  std::copy(&s[0][0], &s[0][0] + 16, &lanes[0][0]);
+#endif
+  for (int j = 0; j < 4; j++) {
+    state[j] = lanes[j][lane];
+  }
+}
+
+void Xoshiro256x4::fill_uniform(double* u, const long int n) {
+  assert(n % 4 == 0);
+  assert(reinterpret_cast<uintptr_t>(u) % 32 == 0);
+  for (long int i = 0; i < n; i += 4) {
+    _mm256_store_pd(&u[i], next_double());
+  }
+}
+
+ProposalPipeline::ProposalPipeline(const long int N, const double step, const uint64_t seed, const uint64_t chain,
+                                   const long int block_size, const bool background):
+  N(N),
+  step(step),
+  block_size((block_size + 3) & ~3),
+  generator(seed, chain),
+  background(background)
+{
+  uniform = static_cast<double*>(_mm_malloc(4 * this->block_size * sizeof(double), 64));
+  for (auto& block : blocks) {
+    block.size = this->block_size;
+    block.k = static_cast<long int*>(_mm_malloc(this->block_size * sizeof(long int), 64));
+    block.du = static_cast<double*>(_mm_malloc(this->block_size * sizeof(double), 64));
+    block.dv = static_cast<double*>(_mm_malloc(this->block_size * sizeof(double), 64));
+    block.log_uniform = static_cast<double*>(_mm_malloc(this->block_size * sizeof(double), 64));
+  }
+  if (background) {
+    producer = std::thread(&ProposalPipeline::produce, this);
+  }
+}
+
+ProposalPipeline::~ProposalPipeline() {
+  if (background) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop = true;
+    }
+    changed.notify_all();
+    producer.join();
+  }
+  _mm_free(uniform);
+  for (auto& block : blocks) {
+    _mm_free(block.k);
+    _mm_free(block.du);
+    _mm_free(block.dv);
+    _mm_free(block.log_uniform);
+  }
+}
+
+void ProposalPipeline::fill(ProposalBlock& block) {
+  generator.fill_uniform(uniform, 4 * block_size);
+  const double* uniform_k = uniform;
+  const double* uniform_u = uniform + block_size;
+  const double* uniform_v = uniform + 2 * block_size;
+  const double* uniform_accept = uniform + 3 * block_size;
+  for (long int i = 0; i < block_size; i++) {
+    block.k[i] = std::min(static_cast<long int>(uniform_k[i] * N), N - 1);
+    block.du[i] = (2 * uniform_u[i] - 1) * step;
+    block.dv[i] = (2 * uniform_v[i] - 1) * step;
+    // 1 - u is in (0, 1], so the log is finite
+    block.log_uniform[i] = std::log(1 - uniform_accept[i]);
+  }
+}
+
+void ProposalPipeline::produce() {
+  for (int i = 0; ; i ^= 1) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      changed.wait(lock, [&]() { return stop || state[i] == FREE; });
+      if (stop) {
+        return;
+      }
+    }
+    fill(blocks[i]);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      state[i] = FILLED;
+    }
+    changed.notify_all();
+  }
+}
+
+const ProposalBlock& ProposalPipeline::next() {
+  const int i = next_block;
+  next_block ^= 1;
+  if (!background) {
+    fill(blocks[i]);
+    return blocks[i];
+  }
+
+  std::unique_lock<std::mutex> lock(mutex);
+  // the block returned by the previous call can be refilled now
+  if (state[i ^ 1] == IN_USE) {
+    state[i ^ 1] = FREE;
+    changed.notify_all();
+  }
+  changed.wait(lock, [&]() { return state[i] == FILLED; });
+  state[i] = IN_USE;
+  return blocks[i];
+}
@@ -0,0 +1,134 @@
+#ifndef RANDOM_PROPOSALS_H
+#define RANDOM_PROPOSALS_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <immintrin.h>
+#include <mutex>
+#include <thread>
+
+/**
+ * xoshiro256+ with 4 independent lanes in one AVX2 register (scalar fallback without AVX2).
+ *
+ * The lanes are streams of the same generator that are 2^128 outputs apart (jump), and each chain starts 2^192
+ * outputs after the previous one (long_jump), so the streams of all lanes and chains never overlap. The output only
+ * depends on the seed and the chain, which makes every chain reproducible on its own.
+ */
+class Xoshiro256x4 {
+  public:
+    Xoshiro256x4(const uint64_t seed, const uint64_t chain = 0);
+
+    // Returns the next 64 bit output of each lane.
+#ifdef __AVX2__
+    inline __m256i next() {
+      const __m256i result = _mm256_add_epi64(s0, s3);
+      const __m256i t = _mm256_slli_epi64(s1, 17);
+      s2 = _mm256_xor_si256(s2, s0);
+      s3 = _mm256_xor_si256(s3, s1);
+      s1 = _mm256_xor_si256(s1, s2);
+      s0 = _mm256_xor_si256(s0, s3);
+      s2 = _mm256_xor_si256(s2, t);
+      s3 = _mm256_or_si256(_mm256_slli_epi64(s3, 45), _mm256_srli_epi64(s3, 19));
+      return result;
+    }
+#else // __AVX__
+    inline __m256i next() {
+      alignas(32) uint64_t result[4];
+      for (int lane = 0; lane < 4; lane++) {
+        result[lane] = s[0][lane] + s[3][lane];
+        const uint64_t t = s[1][lane] << 17;
+        s[2][lane] ^= s[0][lane];
+        s[3][lane] ^= s[1][lane];
+        s[1][lane] ^= s[2][lane];
+        s[0][lane] ^= s[3][lane];
+        s[2][lane] ^= t;
+        s[3][lane] = (s[3][lane] << 45) | (s[3][lane] >> 19);
+      }
+      return _mm256_load_si256(reinterpret_cast<const __m256i*>(result));
+    }
+#endif
+
+    // Returns 4 uniform doubles in [0,1) from the upper 52 bits of the outputs (the lower bits of xoshiro256+ are
+    // weak).
+    inline __m256d next_double() {
+      const __m256i bits = next();
+      const __m256i one = _mm256_set1_epi64x(0x3ff0000000000000ULL);
+#ifdef __AVX2__
+      const __m256d one_to_two = _mm256_castsi256_pd(_mm256_or_si256(_mm256_srli_epi64(bits, 12), one));
+#else // __AVX__
+      const __m128i low = _mm_srli_epi64(_mm256_castsi256_si128(bits), 12);
+      const __m128i high = _mm_srli_epi64(_mm256_extractf128_si256(bits, 1), 12);
+      const __m256d one_to_two = _mm256_or_pd(
+              _mm256_castsi256_pd(_mm256_insertf128_si256(_mm256_castsi128_si256(low), high, 1)),
+              _mm256_castsi256_pd(one));
+#endif
+      return _mm256_sub_pd(one_to_two, _mm256_set1_pd(1.0));
+    }
+
+    // Fills u with n uniform doubles in [0,1), n must be a multiple of 4 and u aligned to 32 bytes.
+    void fill_uniform(double* u, const long int n);
+
+    // The state of lane (0..3) as in the reference implementation.
+    void get_state(const int lane, uint64_t state[4]) const;
+
+  private:
+#ifdef __AVX2__
+    __m256i s0, s1, s2, s3;
+#else // __AVX__
+    alignas(32) uint64_t s[4][4];
+#endif
+};
+
+/**
+ * A block of random single particle moves: particle k[i] is moved by (du[i], dv[i]) and the move is accepted if
+ * log_uniform[i] < beta * log acceptance ratio. du and dv are uniform in [-step, step), log_uniform is the log of a
+ * uniform number in (0, 1].
+ */
+struct ProposalBlock {
+  long int size;
+  long int* k;
+  double* du;
+  double* dv;
+  double* log_uniform;
+};
+
+/**
+ * Generates blocks of proposals with Xoshiro256x4 ahead of time in a background thread. While the sampler works on
+ * one block, the other one of the two buffers is filled. The sequence of blocks only depends on the parameters (and
+ * is the same with and without the background thread).
+ *
+ * next() returns the next block, which stays valid until the following call of next().
+ */
+class ProposalPipeline {
+  public:
+    ProposalPipeline(const long int N, const double step, const uint64_t seed, const uint64_t chain = 0,
+                     const long int block_size = 4096, const bool background = true);
+    ~ProposalPipeline();
+    ProposalPipeline(const ProposalPipeline&) = delete;
+    ProposalPipeline& operator=(const ProposalPipeline&) = delete;
+
+    const ProposalBlock& next();
+
+  private:
+    const long int N;
+    const double step;
+    const long int block_size;
+    Xoshiro256x4 generator;
+    double* uniform;
+    ProposalBlock blocks[2];
+
+    // blocks[i] is FREE until the producer filled it, and IN_USE from next() until the following call of next()
+    enum BlockState { FREE, FILLED, IN_USE };
+    BlockState state[2] = {FREE, FREE};
+    int next_block = 0;
+    bool background;
+    bool stop = false;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::thread producer;
+
+    void fill(ProposalBlock& block);
+    void produce();
+};
+
+#endif
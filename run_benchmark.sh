@@ -2,4 +2,4 @@ set -e
 cd build
 cmake ..
 make
-./benchmark $1 $2
\ No newline at end of file
+./benchmark $1 $2 $3
\ No newline at end of file
@@ -2,4 +2,11 @@ set -e
 cd build
 cmake ..
 make
-./tests
\ No newline at end of file
+./tests
+# the results must not depend on the instruction set (no AVX2, no FMA)
+cd ..
+mkdir -p build_avx
+cd build_avx
+cmake -DVANDERMONDE_ARCH_FLAGS="-mavx" ..
+make tests
+./tests
@@ -0,0 +1,178 @@
+#include "shm_evaluation.h"
+#include "vandermonde_det.h"
+
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <thread>
+#include <vector>
+
+/*
+ * Command line front end of the shared memory evaluation service:
+ *
+ *   vandermonde_service serve real|complex <positions | random:N> <name>
+ *   vandermonde_service load <name> [clients] [batches per client] [batch size]
+ *   vandermonde_service stop <name>
+ *
+ * serve creates the shared memory object name (e.g. /vandermonde) with the particles and evaluates requests until
+ * SIGINT, SIGTERM or stop. The positions file has one particle per line, "x" for real and "x y" for complex particles.
+ * load runs client threads that evaluate batches of random positions (pairs of entries with the same k, as for
+ * Metropolis moves) and prints the throughput and the round trip latency of the batches.
+ */
+
+static EvaluationServer* running_server = nullptr;
+
+static void stop_server(int) {
+  // a lock-free atomic store, safe in a signal handler
+  running_server->stop();
+}
+
+static int usage() {
+  std::cerr << "usage: vandermonde_service serve real|complex <positions | random:N> <name>\n"
+            << "       vandermonde_service load <name> [clients] [batches per client] [batch size]\n"
+            << "       vandermonde_service stop <name>" << std::endl;
+  return 2;
+}
+
+static bool read_positions(const bool complex, const char* positions, std::vector<double>& xs,
+                           std::vector<double>& ys) {
+  if (std::strncmp(positions, "random:", 7) == 0) {
+    const long int N = std::atol(positions + 7);
+    std::mt19937_64 gen(N);
+    std::uniform_real_distribution<double> uniform(-1, 1);
+    for (long int i = 0; i < N; i++) {
+      xs.push_back(uniform(gen));
+      if (complex) {
+        ys.push_back(uniform(gen));
+      }
+    }
+    return N > 0;
+  }
+  std::ifstream in(positions);
+  double value;
+  while (in >> value) {
+    xs.push_back(value);
+    if (complex) {
+      if (!(in >> value)) {
+        return false;
+      }
+      ys.push_back(value);
+    }
+  }
+  return !xs.empty();
+}
+
+static int serve(const bool complex, const char* positions, const char* name) {
+  std::vector<double> xs, ys;
+  if (!read_positions(complex, positions, xs, ys)) {
+    std::cerr << "cannot read positions from " << positions << std::endl;
+    return 1;
+  }
+  const long int N = xs.size();
+  EvaluationServer server;
+  if (!server.create(name, N, xs.data(), complex ? ys.data() : nullptr)) {
+    std::cerr << "cannot create shared memory object " << name << std::endl;
+    return 1;
+  }
+  running_server = &server;
+  std::signal(SIGINT, stop_server);
+  std::signal(SIGTERM, stop_server);
+  std::cerr << "serving " << N << (complex ? " complex" : " real") << " particles as " << name << std::endl;
+  server.run();
+  running_server = nullptr;
+  return 0;
+}
+
+static int load(const char* name, const int num_clients, const long int batches, const int64_t batch_size) {
+  {
+    EvaluationClient probe;
+    if (!probe.open(name)) {
+      std::cerr << "no evaluation service " << name << std::endl;
+      return 1;
+    }
+  }
+  std::vector<std::vector<double>> latencies(num_clients);
+  const auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> clients;
+  for (int c = 0; c < num_clients; c++) {
+    clients.emplace_back([&, c]() {
+      EvaluationClient client;
+      client.open(name);
+      const long int N = client.N();
+      std::mt19937_64 gen(c);
+      std::uniform_real_distribution<double> uniform(-1, 1);
+      std::uniform_int_distribution<long int> particle(0, N - 1);
+      std::vector<EvaluationEntry> entries(batch_size);
+      latencies[c].reserve(batches);
+      for (long int batch = 0; batch < batches; batch++) {
+        for (int64_t e = 0; e < batch_size; e += 2) {
+          const long int k = particle(gen);
+          const double v = client.is_complex() ? uniform(gen) : 0.0;
+          entries[e] = {k, uniform(gen), v, 0.0, 0};
+          if (e + 1 < batch_size) {
+            entries[e + 1] = {k, uniform(gen), v, 0.0, 0};
+          }
+        }
+        const auto sent = std::chrono::steady_clock::now();
+        client.evaluate(entries.data(), batch_size);
+        latencies[c].push_back(std::chrono::duration<double, std::micro>(
+                std::chrono::steady_clock::now() - sent).count());
+      }
+    });
+  }
+  for (std::thread& client : clients) {
+    client.join();
+  }
+  const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  std::vector<double> all;
+  for (const std::vector<double>& client_latencies : latencies) {
+    all.insert(all.end(), client_latencies.begin(), client_latencies.end());
+  }
+  std::sort(all.begin(), all.end());
+  const auto percentile = [&](const double p) {
+    return all[std::min(all.size() - 1, size_t(p * all.size()))];
+  };
+  std::cout << num_clients << " clients, " << all.size() << " batches of " << batch_size << ": "
+            << all.size() * batch_size / seconds << " entries/s, latency p50 " << percentile(0.5) << " us, p99 "
+            << percentile(0.99) << " us" << std::endl;
+  return 0;
+}
+
+static int stop(const char* name) {
+  EvaluationClient client;
+  if (!client.open(name)) {
+    std::cerr << "no evaluation service " << name << std::endl;
+    return 1;
+  }
+  client.request_stop();
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  if (argc >= 5 && std::strcmp(argv[1], "serve") == 0) {
+    const bool complex = std::strcmp(argv[2], "complex") == 0;
+    if (!complex && std::strcmp(argv[2], "real") != 0) {
+      return usage();
+    }
+    return serve(complex, argv[3], argv[4]);
+  }
+  if (argc >= 3 && std::strcmp(argv[1], "load") == 0) {
+    const int num_clients = argc >= 4 ? std::atoi(argv[3]) : 1;
+    const long int batches = argc >= 5 ? std::atol(argv[4]) : 10000;
+    const int64_t batch_size = argc >= 6 ? std::atol(argv[5]) : EVALUATION_BATCH_SIZE;
+    if (num_clients < 1 || batches < 1 || batch_size < 1 || batch_size > EVALUATION_BATCH_SIZE) {
+      return usage();
+    }
+    return load(argv[2], num_clients, batches, batch_size);
+  }
+  if (argc >= 3 && std::strcmp(argv[1], "stop") == 0) {
+    return stop(argv[2]);
+  }
+  return usage();
+}
@@ -0,0 +1,108 @@
+#include "vandermonde_det.h"
+#include "vandermonde_parallel.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+/*
+ * Command line front end of the sharded determinant computation:
+ *
+ *   vandermonde_shard compute real|complex <positions> <shard> <num_shards> [threads] > shard.txt
+ *   vandermonde_shard merge <shard files...>
+ *
+ * The positions file has one particle per line, "x" for real and "x y" for complex particles. compute writes the
+ * partial products of one shard to stdout, merge prints the determinant (|det|^2 for complex particles) as
+ * significand (hex float), exponent and log2. merge refuses shards of different kinds or positions.
+ */
+
+static int usage() {
+  std::cerr << "usage: vandermonde_shard compute real|complex <positions> <shard> <num_shards> [threads]\n"
+            << "       vandermonde_shard merge <shard files...>" << std::endl;
+  return 2;
+}
+
+static int compute(const bool complex, const char* positions, const int shard, const int num_shards,
+                   const int num_threads) {
+  std::ifstream in(positions);
+  if (!in) {
+    std::cerr << "cannot open " << positions << std::endl;
+    return 1;
+  }
+  std::vector<double> xs, ys;
+  double value;
+  while (in >> value) {
+    xs.push_back(value);
+    if (complex) {
+      if (!(in >> value)) {
+        std::cerr << "missing y coordinate in " << positions << std::endl;
+        return 1;
+      }
+      ys.push_back(value);
+    }
+  }
+
+  const long int N = xs.size();
+  double* x = new_double_array(N);
+  double* y = new_double_array(N);
+  std::copy(xs.begin(), xs.end(), x);
+  std::copy(ys.begin(), ys.end(), y);
+
+  const ShardResult result = complex
+          ? vandermonde_abs2_complex_shard(N, x, y, shard, num_shards, num_threads)
+          : vandermonde_real_shard(N, x, shard, num_shards, num_threads);
+  write_shard(std::cout, result);
+
+  _mm_free(x);
+  _mm_free(y);
+  return std::cout ? 0 : 1;
+}
+
+static int merge(const int num_files, char** files) {
+  std::vector<ShardResult> shards(num_files);
+  for (int i = 0; i < num_files; i++) {
+    std::ifstream in(files[i]);
+    if (!in || !read_shard(in, shards[i])) {
+      std::cerr << "cannot read shard " << files[i] << std::endl;
+      return 1;
+    }
+  }
+  for (int i = 1; i < num_files; i++) {
+    if (shards[i].is_complex != shards[0].is_complex || shards[i].positions_checksum != shards[0].positions_checksum
+        || shards[i].N != shards[0].N) {
+      std::cerr << "shard " << files[i] << " was computed from other particles than " << files[0] << std::endl;
+      return 1;
+    }
+  }
+  LargeExponentFloat prod(1.0);
+  if (!merge_shards(shards, prod)) {
+    std::cerr << "the shards do not cover the determinant exactly once" << std::endl;
+    return 1;
+  }
+  std::cout.precision(17);
+  std::cout << serialize(prod) << " " << std::log2(std::abs(prod.significand)) + prod.exponent << std::endl;
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  if (argc >= 6 && std::strcmp(argv[1], "compute") == 0) {
+    const bool complex = std::strcmp(argv[2], "complex") == 0;
+    if (!complex && std::strcmp(argv[2], "real") != 0) {
+      return usage();
+    }
+    const int shard = std::atoi(argv[4]);
+    const int num_shards = std::atoi(argv[5]);
+    if (num_shards < 1 || shard < 0 || shard >= num_shards) {
+      return usage();
+    }
+    return compute(complex, argv[3], shard, num_shards, argc >= 7 ? std::atoi(argv[6]) : 0);
+  }
+  if (argc >= 3 && std::strcmp(argv[1], "merge") == 0) {
+    return merge(argc - 2, argv + 2);
+  }
+  return usage();
+}
@@ -0,0 +1,251 @@
+#include "shm_evaluation.h"
+#include "vandermonde_det.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+namespace {
+
+constexpr uint64_t RING_MASK = EVALUATION_RING_SIZE - 1;
+static_assert((EVALUATION_RING_SIZE & RING_MASK) == 0, "EVALUATION_RING_SIZE must be a power of two");
+
+// Spins before yielding the CPU while waiting, so that a waiting process does not starve the other side on few cores.
+constexpr int SPINS_BEFORE_YIELD = 100;
+
+inline size_t round_up_64(const size_t size) {
+  return (size + 63) & ~size_t(63);
+}
+
+// Padded to whole cache lines (and so to whole vectors for the kernels).
+inline size_t array_size(const long int N) {
+  return round_up_64(sizeof(double) * N);
+}
+
+inline void backoff(int& spins) {
+  if (++spins < SPINS_BEFORE_YIELD) {
+    _mm_pause();
+  } else {
+    std::this_thread::yield();
+  }
+}
+
+void* map_segment(const int fd, const size_t size) {
+  void* mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  return mapped == MAP_FAILED ? nullptr : mapped;
+}
+
+}
+
+size_t evaluation_segment_size(const long int N, const bool is_complex) {
+  return round_up_64(sizeof(EvaluationSegment)) + (is_complex ? 2 : 1) * array_size(N);
+}
+
+EvaluationServer::~EvaluationServer() {
+  if (segment != nullptr) {
+    munmap(segment, size);
+    shm_unlink(name);
+  }
+}
+
+bool EvaluationServer::create(const char* name, const long int N, const double* x, const double* y) {
+  if (segment != nullptr || std::strlen(name) >= sizeof(this->name)) {
+    return false;
+  }
+  const int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+  if (fd < 0) {
+    return false;
+  }
+  const bool is_complex = y != nullptr;
+  size = evaluation_segment_size(N, is_complex);
+  void* mapped = ftruncate(fd, size) == 0 ? map_segment(fd, size) : nullptr;
+  close(fd);
+  if (mapped == nullptr) {
+    shm_unlink(name);
+    return false;
+  }
+  std::strcpy(this->name, name);
+
+  // the new object is zero filled
+  segment = static_cast<EvaluationSegment*>(mapped);
+  segment->N = N;
+  segment->is_complex = is_complex;
+  segment->x_offset = round_up_64(sizeof(EvaluationSegment));
+  segment->y_offset = is_complex ? segment->x_offset + array_size(N) : 0;
+  char* base = static_cast<char*>(mapped);
+  std::memcpy(base + segment->x_offset, x, sizeof(double) * N);
+  if (is_complex) {
+    std::memcpy(base + segment->y_offset, y, sizeof(double) * N);
+  }
+  for (uint64_t i = 0; i < EVALUATION_RING_SIZE; i++) {
+    segment->ring[i].sequence.store(i, std::memory_order_relaxed);
+  }
+  head = 0;
+  std::atomic_thread_fence(std::memory_order_release);
+  segment->magic = EVALUATION_SEGMENT_MAGIC;
+  return true;
+}
+
+void EvaluationServer::process(EvaluationSlot& slot) const {
+  const char* base = reinterpret_cast<const char*>(segment);
+  const double* x = reinterpret_cast<const double*>(base + segment->x_offset);
+  const double* y = reinterpret_cast<const double*>(base + segment->y_offset);
+  const long int N = segment->N;
+  // written by a client, read once and checked, so that a malformed slot cannot make the server access other slots
+  const int64_t count = slot.count;
+  if (count < 0 || count > EVALUATION_BATCH_SIZE) {
+    return;
+  }
+
+  for (int64_t e = 0; e < count;) {
+    EvaluationEntry& a = slot.entries[e];
+    // entries with the same k share one kernel call, for a real set only if both are real or both are complex
+    const bool paired = e + 1 < count && slot.entries[e + 1].k == a.k
+                        && (segment->is_complex || (a.v == 0) == (slot.entries[e + 1].v == 0));
+    EvaluationEntry& b = paired ? slot.entries[e + 1] : a;
+    const long int k = (a.k < 0 || a.k >= N) ? N : a.k;
+
+    LargeExponentFloat prod1(1.0), prod2(1.0);
+    if (segment->is_complex) {
+      prod_dist2_complexcomplexvec(N, k, a.u, b.u, a.v, b.v, x, y, prod1, prod2);
+    } else if (a.v == 0 && b.v == 0) {
+      prod_diff_realrealvec(N, k, a.u, b.u, x, prod1, prod2);
+      prod1 = prod1 * prod1;
+      prod2 = prod2 * prod2;
+    } else {
+      prod_dist2_complexrealvec(N, a.u, b.u, a.v, b.v, x, prod1, prod2);
+      if (k < N) {
+        // v != 0 for both, so the excluded factors are not 0
+        prod1 = prod1 / LargeExponentFloat((a.u - x[k]) * (a.u - x[k]) + a.v * a.v);
+        prod2 = prod2 / LargeExponentFloat((b.u - x[k]) * (b.u - x[k]) + b.v * b.v);
+      }
+    }
+    prod1 = prod1.normalized_fast();
+    prod2 = prod2.normalized_fast();
+    a.significand = prod1.significand;
+    a.exponent = prod1.exponent;
+    b.significand = prod2.significand;
+    b.exponent = prod2.exponent;
+    e += paired ? 2 : 1;
+  }
+}
+
+long int EvaluationServer::poll() {
+  long int slots = 0;
+  for (;;) {
+    EvaluationSlot& slot = segment->ring[head & RING_MASK];
+    if (slot.sequence.load(std::memory_order_acquire) != head + 1) {
+      break;
+    }
+    process(slot);
+    slot.sequence.store(head + 2, std::memory_order_release);
+    head++;
+    slots++;
+  }
+  segment->processed.store(head, std::memory_order_relaxed);
+  return slots;
+}
+
+void EvaluationServer::run() {
+  int spins = 0;
+  while (segment->stop.load(std::memory_order_acquire) == 0) {
+    if (poll() > 0) {
+      spins = 0;
+    } else {
+      backoff(spins);
+    }
+  }
+}
+
+EvaluationClient::~EvaluationClient() {
+  if (segment != nullptr) {
+    munmap(segment, size);
+  }
+}
+
+bool EvaluationClient::open(const char* name) {
+  const int fd = shm_open(name, O_RDWR, 0);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat status;
+  void* mapped = nullptr;
+  if (fstat(fd, &status) == 0 && size_t(status.st_size) >= sizeof(EvaluationSegment)) {
+    size = status.st_size;
+    mapped = map_segment(fd, size);
+  }
+  close(fd);
+  if (mapped == nullptr) {
+    return false;
+  }
+  segment = static_cast<EvaluationSegment*>(mapped);
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (segment->magic != EVALUATION_SEGMENT_MAGIC || size != evaluation_segment_size(segment->N, segment->is_complex)) {
+    munmap(segment, size);
+    segment = nullptr;
+    return false;
+  }
+  return true;
+}
+
+EvaluationEntry* EvaluationClient::claim(uint64_t& ticket) {
+  uint64_t position = segment->tail.load(std::memory_order_relaxed);
+  for (;;) {
+    EvaluationSlot& slot = segment->ring[position & RING_MASK];
+    const int64_t difference = int64_t(slot.sequence.load(std::memory_order_acquire) - position);
+    if (difference == 0) {
+      if (segment->tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+        ticket = position;
+        return slot.entries;
+      }
+    } else if (difference < 0) {
+      // the slot of the previous round is not released yet
+      return nullptr;
+    } else {
+      position = segment->tail.load(std::memory_order_relaxed);
+    }
+  }
+}
+
+void EvaluationClient::submit(const uint64_t ticket, const int64_t count) {
+  assert(count >= 0 && count <= EVALUATION_BATCH_SIZE);
+  EvaluationSlot& slot = segment->ring[ticket & RING_MASK];
+  slot.count = count;
+  slot.sequence.store(ticket + 1, std::memory_order_release);
+}
+
+bool EvaluationClient::done(const uint64_t ticket) const {
+  return segment->ring[ticket & RING_MASK].sequence.load(std::memory_order_acquire) == ticket + 2;
+}
+
+const EvaluationEntry* EvaluationClient::wait(const uint64_t ticket) const {
+  int spins = 0;
+  while (!done(ticket)) {
+    backoff(spins);
+  }
+  return segment->ring[ticket & RING_MASK].entries;
+}
+
+void EvaluationClient::release(const uint64_t ticket) {
+  segment->ring[ticket & RING_MASK].sequence.store(ticket + EVALUATION_RING_SIZE, std::memory_order_release);
+}
+
+void EvaluationClient::evaluate(EvaluationEntry* entries, const int64_t count) {
+  assert(count >= 0 && count <= EVALUATION_BATCH_SIZE);
+  uint64_t ticket;
+  EvaluationEntry* slot_entries;
+  int spins = 0;
+  while ((slot_entries = claim(ticket)) == nullptr) {
+    backoff(spins);
+  }
+  std::copy(entries, entries + count, slot_entries);
+  submit(ticket, count);
+  const EvaluationEntry* results = wait(ticket);
+  std::copy(results, results + count, entries);
+  release(ticket);
+}
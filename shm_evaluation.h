@@ -0,0 +1,147 @@
+#ifndef SHM_EVALUATION_H
+#define SHM_EVALUATION_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include "large_product.h"
+
+/**
+ * Evaluation of kernel products against a fixed particle set that is owned by one server process and shared through
+ * POSIX shared memory, so that several sampler processes on one machine do not each keep a copy of the set.
+ *
+ * The shared segment holds the particles x (and y for a complex set) and a bounded multi-producer single-consumer
+ * ring of request slots (Vyukov's sequence numbers). A client claims a slot, writes a batch of (k, u, v) entries
+ * directly into it and publishes it; the server computes the results into the same entries and marks the slot done;
+ * the client reads them and releases the slot. Nothing is copied besides the entries themselves.
+ *
+ * The sequence number of the slot of ticket t (mod EVALUATION_RING_SIZE) is
+ *   t                           free for the producer of ticket t
+ *   t + 1                       submitted, the server may process it
+ *   t + 2                       done, the results are in place
+ *   t + EVALUATION_RING_SIZE    released, free for the producer of ticket t + EVALUATION_RING_SIZE
+ * A client that dies between claiming and releasing a slot blocks the ring when it gets back to that slot.
+ *
+ * The result of an entry is prod_{j != k} |u + i*v - z[j]|^2 over the particles z[j] = x[j] (+ i*y[j]), k < 0 or k >= N
+ * excludes nothing. Consecutive entries with the same k are evaluated with one kernel call, e.g. the new and the old
+ * position of a Metropolis move (for a real set if both have v == 0 or both v != 0).
+ */
+
+constexpr const int64_t EVALUATION_BATCH_SIZE = 64;
+// power of two
+constexpr const uint64_t EVALUATION_RING_SIZE = 256;
+constexpr const uint64_t EVALUATION_SEGMENT_MAGIC = 0x316c617665706c6cULL;
+
+struct EvaluationEntry {
+  int64_t k;
+  double u;
+  double v;
+  // written by the server
+  double significand;
+  int64_t exponent;
+
+  LargeExponentFloat result() const {
+    return LargeExponentFloat(significand, exponent);
+  }
+};
+
+struct alignas(64) EvaluationSlot {
+  std::atomic<uint64_t> sequence;
+  int64_t count;
+  EvaluationEntry entries[EVALUATION_BATCH_SIZE];
+};
+
+struct EvaluationSegment {
+  uint64_t magic;
+  int64_t N;
+  int64_t is_complex;
+  // offsets of the 64 byte aligned particle arrays from the start of the segment (y: 0 for a real set)
+  int64_t x_offset;
+  int64_t y_offset;
+  alignas(64) std::atomic<uint64_t> tail;
+  alignas(64) std::atomic<uint64_t> processed;
+  std::atomic<uint32_t> stop;
+  EvaluationSlot ring[EVALUATION_RING_SIZE];
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "the ring needs address-free atomics");
+
+// Size of the segment for N particles.
+size_t evaluation_segment_size(const long int N, const bool is_complex);
+
+class EvaluationServer {
+  public:
+    EvaluationServer() = default;
+    ~EvaluationServer();
+    EvaluationServer(const EvaluationServer&) = delete;
+    EvaluationServer& operator=(const EvaluationServer&) = delete;
+
+    // Creates the shared memory object name (e.g. "/vandermonde") with a copy of the particles (y nullptr for a real
+    // set). Returns false if it exists already or cannot be created. The object is removed by the destructor.
+    bool create(const char* name, const long int N, const double* x, const double* y);
+
+    // Processes the submitted slots in order, returns the number of slots.
+    long int poll();
+
+    // Polls until a client (or stop()) requests to stop. Spins for a while before yielding the CPU when idle.
+    void run();
+
+    void stop() {
+      segment->stop.store(1, std::memory_order_release);
+    }
+
+  private:
+    EvaluationSegment* segment = nullptr;
+    size_t size = 0;
+    char name[256] = {};
+    uint64_t head = 0;
+
+    void process(EvaluationSlot& slot) const;
+};
+
+class EvaluationClient {
+  public:
+    EvaluationClient() = default;
+    ~EvaluationClient();
+    EvaluationClient(const EvaluationClient&) = delete;
+    EvaluationClient& operator=(const EvaluationClient&) = delete;
+
+    // Maps the segment of a running server. Returns false if it does not exist or is not an evaluation segment.
+    bool open(const char* name);
+
+    long int N() const {
+      return segment->N;
+    }
+
+    bool is_complex() const {
+      return segment->is_complex != 0;
+    }
+
+    // Claims the next slot and returns its entries to be filled in place, with the ticket of the slot. Returns nullptr
+    // if the ring is full.
+    EvaluationEntry* claim(uint64_t& ticket);
+
+    // Publishes count (<= EVALUATION_BATCH_SIZE) entries of the claimed slot. The server leaves a slot with an invalid
+    // count unchanged.
+    void submit(const uint64_t ticket, const int64_t count);
+
+    bool done(const uint64_t ticket) const;
+
+    // Waits until the slot is done and returns the entries with the results in place. They stay valid until release.
+    const EvaluationEntry* wait(const uint64_t ticket) const;
+
+    void release(const uint64_t ticket);
+
+    // claim, copy, submit, wait, copy back and release. Spins while the ring is full.
+    void evaluate(EvaluationEntry* entries, const int64_t count);
+
+    void request_stop() {
+      segment->stop.store(1, std::memory_order_release);
+    }
+
+  private:
+    EvaluationSegment* segment = nullptr;
+    size_t size = 0;
+};
+
+#endif
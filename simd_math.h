@@ -0,0 +1,135 @@
+#ifndef SIMD_MATH_H
+#define SIMD_MATH_H
+
+#include <cmath>
+#include <immintrin.h>
+
+/**
+ * exp, log and log(erfc) of 4 doubles, so that acceptance ratios with one-body weights need no scalar libm calls. The
+ * error is at most a few ulp (for log_pd and log_erfc_pd relative to max(1, |result|)). Inputs must be finite, and the
+ * input of log_pd must be positive and normal.
+ */
+
+namespace simd_math_detail {
+
+  // 2^n for integer valued n in [-1022, 1023]
+  inline __m256d pow2_pd(const __m256d n) {
+    // the integer n+1023 in the low bits of the double 2^52+1023+n
+    const __m256d biased = _mm256_add_pd(n, _mm256_set1_pd(0x1p52 + 1023));
+#ifdef __AVX2__
+    return _mm256_castsi256_pd(_mm256_slli_epi64(_mm256_castpd_si256(biased), 52));
+#else // __AVX__
+    const __m256i bits = _mm256_castpd_si256(biased);
+    const __m128i low = _mm_slli_epi64(_mm256_castsi256_si128(bits), 52);
+    const __m128i high = _mm_slli_epi64(_mm256_extractf128_si256(bits, 1), 52);
+    return _mm256_castsi256_pd(_mm256_insertf128_si256(_mm256_castsi128_si256(low), high, 1));
+#endif
+  }
+
+  // The biased exponent of positive normal v as double
+  inline __m256d biased_exponent_pd(const __m256d v) {
+    const __m256i magic = _mm256_set1_epi64x(0x4330000000000000ULL);  // 2^52
+#ifdef __AVX2__
+    const __m256i exponent = _mm256_or_si256(_mm256_srli_epi64(_mm256_castpd_si256(v), 52), magic);
+#else // __AVX__
+    const __m256i bits = _mm256_castpd_si256(v);
+    const __m128i low = _mm_or_si128(_mm_srli_epi64(_mm256_castsi256_si128(bits), 52),
+                                     _mm256_castsi256_si128(magic));
+    const __m128i high = _mm_or_si128(_mm_srli_epi64(_mm256_extractf128_si256(bits, 1), 52),
+                                      _mm256_castsi256_si128(magic));
+    const __m256i exponent = _mm256_insertf128_si256(_mm256_castsi128_si256(low), high, 1);
+#endif
+    return _mm256_sub_pd(_mm256_castsi256_pd(exponent), _mm256_set1_pd(0x1p52));
+  }
+
+  inline __m256d polynomial(const __m256d x, const double* coefficients, const int degree) {
+    __m256d p = _mm256_set1_pd(coefficients[degree]);
+    for (int i = degree - 1; i >= 0; i--) {
+      p = _mm256_add_pd(_mm256_mul_pd(p, x), _mm256_set1_pd(coefficients[i]));
+    }
+    return p;
+  }
+
+  // Chebyshev coefficients of log(erfc(z)) + z^2 - log(t) with t=2/(2+z), z>=0 (Numerical Recipes, 3rd edition)
+  constexpr double ERFC_COEFFICIENTS[28] = {
+          -1.3026537197817094, 6.4196979235649026e-1, 1.9476473204185836e-2, -9.561514786808631e-3,
+          -9.46595344482036e-4, 3.66839497852761e-4, 4.2523324806907e-5, -2.0278578112534e-5, -1.624290004647e-6,
+          1.303655835580e-6, 1.5626441722e-8, -8.5238095915e-8, 6.529054439e-9, 5.059343495e-9, -9.91364156e-10,
+          -2.27365122e-10, 9.6467911e-11, 2.394038e-12, -6.886027e-12, 8.94487e-13, 3.13092e-13, -1.12708e-13,
+          3.81e-16, 7.106e-15, -1.523e-15, -9.4e-17, 1.21e-16, -2.8e-17
+  };
+}
+
+inline __m256d exp_pd(__m256d x) {
+  using namespace simd_math_detail;
+  // 1/k! for the polynomial of exp(r), |r| <= ln(2)/2
+  static constexpr double COEFFICIENTS[14] = {
+          1.0, 1.0, 1.0 / 2, 1.0 / 6, 1.0 / 24, 1.0 / 120, 1.0 / 720, 1.0 / 5040, 1.0 / 40320, 1.0 / 362880,
+          1.0 / 3628800, 1.0 / 39916800, 1.0 / 479001600, 1.0 / 6227020800
+  };
+  // results beyond these limits are inf or 0
+  x = _mm256_max_pd(_mm256_min_pd(x, _mm256_set1_pd(710.0)), _mm256_set1_pd(-746.0));
+  const __m256d n = _mm256_round_pd(_mm256_mul_pd(x, _mm256_set1_pd(M_LOG2E)),
+                                    _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+  // x - n*ln(2) with the upper bits of ln(2) (exact product) and the remaining bits
+  __m256d r = _mm256_sub_pd(x, _mm256_mul_pd(n, _mm256_set1_pd(6.93145751953125e-1)));
+  r = _mm256_sub_pd(r, _mm256_mul_pd(n, _mm256_set1_pd(1.42860682030941723212e-6)));
+  const __m256d p = polynomial(r, COEFFICIENTS, 13);
+  // 2^n in two factors, so that subnormal results and n=1024 work
+  const __m256d n1 = _mm256_floor_pd(_mm256_mul_pd(n, _mm256_set1_pd(0.5)));
+  return _mm256_mul_pd(_mm256_mul_pd(p, pow2_pd(n1)), pow2_pd(_mm256_sub_pd(n, n1)));
+}
+
+inline __m256d log_pd(const __m256d x) {
+  using namespace simd_math_detail;
+  // 2/(2k+1) for the series 2*atanh(s) = log((1+s)/(1-s)) in s^2, |s| <= 0.172
+  static constexpr double COEFFICIENTS[11] = {
+          2.0, 2.0 / 3, 2.0 / 5, 2.0 / 7, 2.0 / 9, 2.0 / 11, 2.0 / 13, 2.0 / 15, 2.0 / 17, 2.0 / 19, 2.0 / 21
+  };
+  const __m256d mantissa_mask = _mm256_castsi256_pd(_mm256_set1_epi64x(0x000fffffffffffffULL));
+  const __m256d one = _mm256_set1_pd(1.0);
+  __m256d e = _mm256_sub_pd(biased_exponent_pd(x), _mm256_set1_pd(1023));
+  // m in [1, 2), reduced to [sqrt(1/2), sqrt(2))
+  __m256d m = _mm256_or_pd(_mm256_and_pd(x, mantissa_mask), one);
+  const __m256d large = _mm256_cmp_pd(m, _mm256_set1_pd(M_SQRT2), _CMP_GT_OQ);
+  m = _mm256_blendv_pd(m, _mm256_mul_pd(m, _mm256_set1_pd(0.5)), large);
+  e = _mm256_add_pd(e, _mm256_and_pd(large, one));
+
+  const __m256d s = _mm256_div_pd(_mm256_sub_pd(m, one), _mm256_add_pd(m, one));
+  const __m256d log_m = _mm256_mul_pd(s, polynomial(_mm256_mul_pd(s, s), COEFFICIENTS, 10));
+  return _mm256_add_pd(_mm256_mul_pd(e, _mm256_set1_pd(M_LN2)), log_m);
+}
+
+// log(erfc(z)) without underflow for large z.
+inline __m256d log_erfc_pd(const __m256d z) {
+  using namespace simd_math_detail;
+  const __m256d abs_mask = _mm256_castsi256_pd(_mm256_set1_epi64x(0x7fffffffffffffffULL));
+  const __m256d a = _mm256_and_pd(z, abs_mask);
+
+  // Clenshaw recurrence of the Chebyshev series in ty = 4t-2
+  const __m256d t = _mm256_div_pd(_mm256_set1_pd(2.0), _mm256_add_pd(_mm256_set1_pd(2.0), a));
+  const __m256d ty = _mm256_sub_pd(_mm256_mul_pd(_mm256_set1_pd(4.0), t), _mm256_set1_pd(2.0));
+  __m256d d = _mm256_setzero_pd();
+  __m256d dd = _mm256_setzero_pd();
+  for (int j = 27; j > 0; j--) {
+    const __m256d tmp = d;
+    // coefficient - dd does not depend on the previous step, which keeps the dependency chain at one multiply-add
+    d = _mm256_add_pd(_mm256_mul_pd(ty, d), _mm256_sub_pd(_mm256_set1_pd(ERFC_COEFFICIENTS[j]), dd));
+    dd = tmp;
+  }
+  const __m256d series = _mm256_sub_pd(
+          _mm256_mul_pd(_mm256_set1_pd(0.5), _mm256_add_pd(_mm256_set1_pd(ERFC_COEFFICIENTS[0]),
+                                                           _mm256_mul_pd(ty, d))),
+          dd);
+  const __m256d log_erfc_a = _mm256_add_pd(_mm256_sub_pd(log_pd(t), _mm256_mul_pd(a, a)), series);
+
+  // erfc(z) = 2 - erfc(-z) for negative z
+  const __m256d negative = _mm256_cmp_pd(z, _mm256_setzero_pd(), _CMP_LT_OQ);
+  if (_mm256_movemask_pd(negative) == 0) [[likely]] {
+    return log_erfc_a;
+  }
+  const __m256d reflected = log_pd(_mm256_sub_pd(_mm256_set1_pd(2.0), exp_pd(log_erfc_a)));
+  return _mm256_blendv_pd(log_erfc_a, reflected, negative);
+}
+
+#endif
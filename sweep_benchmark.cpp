@@ -0,0 +1,197 @@
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+
+#include "metropolis.h"
+#include "one_body_weight.h"
+#include "random_proposals.h"
+#include "vandermonde_det.h"
+
+using namespace std;
+
+/*
+ * End-to-end benchmark of Metropolis sweeps: proposals from ProposalPipeline, the acceptance test, position updates and
+ * (for the early rejection test) the update of the block bounds, in the equilibrium of
+ *
+ *   real:    |det|^2 exp(-N sum x^2)                   (GUE, semicircle on [-sqrt(2), sqrt(2)])
+ *   complex: |det|^2 exp(-N sum |z|^2)                 (Ginibre, uniform on the unit disk)
+ *   mixed:   |det|^2 exp(-N sum |z|^2) with sqrt(2N/pi) real and the other particles complex, det as in
+ *            vandermonde_abs2_mixed
+ *
+ * The step size is tuned to the requested acceptance rate during warm-up sweeps and then kept fixed for the measured
+ * sweeps. A sweep is N proposals.
+ */
+
+constexpr double BETA = 2.0;
+constexpr int TUNING_SWEEPS = 10;
+
+enum Ensemble { REAL, COMPLEX, MIXED };
+
+class Sweeps {
+  public:
+    Sweeps(const Ensemble ensemble, const long int N, const bool early)
+            : ensemble(ensemble), N(N), early(early),
+              Nreal(ensemble == REAL ? N : ensemble == COMPLEX ? 0 : std::lround(std::sqrt(2 * N / M_PI))),
+              Ncomplex(N - Nreal), lambda(new_double_array(Nreal)), x(new_double_array(Ncomplex)),
+              y(new_double_array(Ncomplex)), confinement{double(N)}, proposals(N, 1.0, 1) {
+      std::mt19937_64 gen(1);
+      std::uniform_real_distribution<double> uniform(-1.0, 1.0);
+      for (long int j = 0; j < Nreal; j++) {
+        lambda[j] = uniform(gen);
+      }
+      for (long int j = 0; j < Ncomplex; j++) {
+        do {
+          x[j] = uniform(gen);
+          y[j] = uniform(gen);
+        } while (x[j] * x[j] + y[j] * y[j] > 1);
+        if (ensemble == MIXED) {
+          y[j] = std::abs(y[j]);
+        }
+      }
+      if (early) {
+        if (ensemble == REAL) {
+          spatial_sort(N, lambda);
+          bounds = new BlockBounds(N, lambda);
+        } else {
+          spatial_sort(N, x, y);
+          bounds = new BlockBounds(N, x, y);
+        }
+      }
+    }
+
+    ~Sweeps() {
+      delete bounds;
+      _mm_free(lambda);
+      _mm_free(x);
+      _mm_free(y);
+    }
+
+    // Runs the given number of sweeps and returns the number of accepted moves.
+    long int run(const long int sweeps, const double step) {
+      long int accepted = 0;
+      for (long int i = 0; i < sweeps * N; ) {
+        const ProposalBlock& block = proposals.next();
+        for (long int j = 0; j < block.size && i < sweeps * N; j++, i++) {
+          accepted += move(block.k[j], step * block.du[j], step * block.dv[j], block.log_uniform[j]);
+        }
+      }
+      return accepted;
+    }
+
+    // Mean of |z|^2 over all particles, about 0.5 in equilibrium for all ensembles (a sanity check of the chain, the real
+    // ensemble relaxes slowly from the uniform start).
+    double mean_abs2() const {
+      double sum = 0;
+      for (long int j = 0; j < Nreal; j++) {
+        sum += lambda[j] * lambda[j];
+      }
+      for (long int j = 0; j < Ncomplex; j++) {
+        sum += x[j] * x[j] + y[j] * y[j];
+      }
+      return sum / N;
+    }
+
+  private:
+    const Ensemble ensemble;
+    const long int N;
+    const bool early;
+    const long int Nreal;
+    const long int Ncomplex;
+    double* lambda;
+    double* x;
+    double* y;
+    BlockBounds* bounds = nullptr;
+    const GaussianConfinement confinement;
+    ProposalPipeline proposals;
+
+    bool move(const long int k, const double du, const double dv, const double log_uniform) {
+      if (k < Nreal) {
+        const double u = lambda[k] + du;
+        long int processed;
+        bool accept;
+        if (ensemble == REAL && !early) {
+          accept = metropolis_accept_realvec(N, k, u, BETA, log_uniform, lambda, confinement);
+        } else {
+          // the one-body weight moves the threshold of the acceptance test
+          const double threshold = log_uniform - one_body_log_ratio(confinement, u, 0.0, lambda[k], 0.0);
+          accept = early ? metropolis_accept_early_realvec(N, k, u, BETA, threshold, lambda, *bounds, processed)
+                         : metropolis_accept_mixed_realvec(Nreal, Ncomplex, k, u, BETA, threshold, lambda, x, y);
+        }
+        if (accept) {
+          lambda[k] = u;
+          if (early) {
+            bounds->update(k, lambda);
+          }
+        }
+        return accept;
+      }
+
+      const long int c = k - Nreal;
+      // complex particles stay in the upper half plane in the mixed ensemble, like eigenvalues of real matrices
+      const double u = x[c] + du;
+      const double v = ensemble == MIXED ? std::abs(y[c] + dv) : y[c] + dv;
+      long int processed;
+      bool accept;
+      if (ensemble == COMPLEX && !early) {
+        accept = metropolis_accept_complexvec(N, c, u, v, BETA, log_uniform, x, y, confinement);
+      } else {
+        const double threshold = log_uniform - one_body_log_ratio(confinement, u, v, x[c], y[c]);
+        accept = early ? metropolis_accept_early_complexvec(N, c, u, v, BETA, threshold, x, y, *bounds, processed)
+                       : metropolis_accept_mixed_complexvec(Nreal, Ncomplex, c, u, v, BETA, threshold, lambda, x, y);
+      }
+      if (accept) {
+        x[c] = u;
+        y[c] = v;
+        if (early) {
+          bounds->update(c, x, y);
+        }
+      }
+      return accept;
+    }
+};
+
+int main(int argc, char *argv[]) {
+  if (argc < 4 || argc > 6) {
+    cout << argv[0] << " real|complex|mixed N sweeps [acceptance] [early]\n";
+    cout << "N number of particles, sweeps number of measured sweeps of N proposals\n";
+    cout << "acceptance target acceptance rate (default 0.5), early uses the early rejection test (not for mixed)\n";
+    cout << "example: " << argv[0] << " complex 10000 10 0.3\n";
+    return 1;
+  }
+
+  const std::string name = argv[1];
+  const Ensemble ensemble = name == "real" ? REAL : name == "complex" ? COMPLEX : MIXED;
+  const long int N = atol(argv[2]);
+  const long int sweeps = atol(argv[3]);
+  const double acceptance = argc >= 5 ? atof(argv[4]) : 0.5;
+  const bool early = argc == 6 && std::string(argv[5]) == "early";
+  if ((ensemble == MIXED && name != "mixed") || N < 2 || sweeps < 1 || acceptance <= 0 || acceptance >= 1
+      || (argc == 6 && (!early || ensemble == MIXED))) {
+    cerr << "invalid arguments\n";
+    return 1;
+  }
+
+  Sweeps chain(ensemble, N, early);
+
+  // steps of the order of the particle spacing, adjusted after every warm-up sweep
+  double step = ensemble == REAL ? 1.0 / N : 1.0 / std::sqrt(N);
+  for (int i = 0; i < TUNING_SWEEPS; i++) {
+    const double measured = double(chain.run(1, step)) / N;
+    step *= std::exp(measured - acceptance);
+  }
+
+  auto wall_start = std::chrono::steady_clock::now();
+  const long int accepted = chain.run(sweeps, step);
+  std::chrono::duration<double> wall_time = std::chrono::steady_clock::now() - wall_start;
+
+  const double proposals = double(sweeps) * N;
+  cout << "sweeps " << name << (early ? " early" : "") << ": N=" << N << " acceptance=" << accepted / proposals
+       << " (target " << acceptance << ") step=" << step << " mean |z|^2=" << chain.mean_abs2()
+       << " wall time=" << wall_time.count() << " seconds, " << sweeps / wall_time.count() << " sweeps/s, "
+       << proposals / wall_time.count() << " proposals/s, " << 1e9 * wall_time.count() / proposals
+       << " ns/proposal\n";
+  return 0;
+}
@@ -1,7 +1,26 @@
+#include "grid_evaluation.h"
+#include "large_exponent_array.h"
 #include "large_product.h"
+#include "vandermonde_batch.h"
 #include "vandermonde_det.h"
-
+#include "vandermonde_det_reference.h"
+#include "vandermonde_det_small.h"
+#include "vandermonde_parallel.h"
+#include "metropolis.h"
+#include "mixed_ensemble.h"
+#include "one_body_weight.h"
+#include "pair_factor.h"
+#include "particle_set.h"
+#include "random_proposals.h"
+#include "shm_evaluation.h"
+#include "simd_math.h"
+
+#include <cfloat>
+#include <complex>
 #include <iostream>
+#include <sstream>
+#include <sys/wait.h>
+#include <unistd.h>
 #include "gtest/gtest.h"
 
 using namespace std;
@@ -130,6 +149,147 @@ void init_random_positions(std::mt19937_64& gen, const long int N, const double
   }
 }
 
+TEST(LargeExponentFloat, normalize_exponent_fast) {
+  for (double value : {1.0, -1.0, 0.75, 3.0, -1e300, 1e-300, 0x1p-1070, -0x1p-1050, 0.0, -0.0}) {
+    LargeExponentFloat f(value, 17);
+    f.normalize_exponent_fast();
+    ASSERT_EQ(LargeExponentFloat(value, 17), f);
+    if (value != 0) {
+      ASSERT_GE(std::abs(f.significand), 1.0);
+      ASSERT_LT(std::abs(f.significand), 2.0);
+    } else {
+      ASSERT_EQ(17, f.exponent);
+    }
+  }
+}
+
+TEST(LargeExponentFloat, arithmetic) {
+  const LargeExponentFloat a(-3.0, 1000000);
+  const LargeExponentFloat b(0.375, -2000000);
+  ASSERT_EQ(save_mul(a, b), a * b);
+  ASSERT_EQ(LargeExponentFloat(-8.0, 3000000), a / b);
+  ASSERT_EQ(0.0, (a * LargeExponentFloat(0.0)).significand);
+
+  ASSERT_NEAR(1000000 + std::log2(3.0), log2(a), 1e-9);
+  ASSERT_EQ(-INFINITY, log2(LargeExponentFloat(0.0, 5)));
+
+  // the relative error of pow does not depend on the exponent
+  const LargeExponentFloat p = pow(a, 2.5);
+  ASSERT_EQ(static_cast<int64_t>(2500000 + std::floor(2.5 * std::log2(3.0))), p.exponent);
+  ASSERT_NEAR(std::pow(3.0, 2.5) / std::exp2(std::floor(2.5 * std::log2(3.0))), p.significand, 1e-14);
+  ASSERT_EQ(LargeExponentFloat(1.0), pow(a, 0.0));
+  ASSERT_EQ(LargeExponentFloat(0.0), pow(LargeExponentFloat(0.0), 2.0));
+  const LargeExponentFloat root = pow(LargeExponentFloat(1.0, -3), 1.0 / 3);
+  ASSERT_NEAR(0.5, root.significand * std::exp2(root.exponent), 1e-15);
+}
+
+TEST(LargeExponentFloat, compare) {
+  const std::vector<LargeExponentFloat> ordered = {
+          LargeExponentFloat(-1.5, 100), LargeExponentFloat(-3.0, 98), LargeExponentFloat(-1.0, 0),
+          LargeExponentFloat(-1.0, -100), LargeExponentFloat(0.0, 50), LargeExponentFloat(0.25, -100),
+          LargeExponentFloat(1.0, -1), LargeExponentFloat(0.75, 0), LargeExponentFloat(1.0, 1000)};
+  for (size_t i = 0; i < ordered.size(); i++) {
+    for (size_t j = 0; j < ordered.size(); j++) {
+      ASSERT_EQ((i > j) - (i < j), compare(ordered[i], ordered[j])) << i << " " << j;
+    }
+  }
+  ASSERT_EQ(0, compare(LargeExponentFloat(0.5, 2), LargeExponentFloat(2.0, 0)));
+  ASSERT_EQ(0, compare(LargeExponentFloat(0.0, 2), LargeExponentFloat(-0.0, 0)));
+  ASSERT_TRUE(LargeExponentFloat(1.0, 10) < LargeExponentFloat(1.0, 11));
+  ASSERT_TRUE(LargeExponentFloat(-1.0, 10) > LargeExponentFloat(-1.0, 11));
+}
+
+TEST(LargeExponentFloatArray, elementwise) {
+  constexpr long int N = 1003;
+  LargeExponentFloatArray a(N);
+  LargeExponentFloatArray b(N);
+  std::mt19937_64 gen(16);
+  std::uniform_real_distribution<double> uniform(-1.0, 1.0);
+  std::vector<LargeExponentFloat> expected_a, expected_b;
+  for (long int i = 0; i < N; i++) {
+    const LargeExponentFloat x(uniform(gen) * 100, long(uniform(gen) * 1e6));
+    const LargeExponentFloat y(i % 100 == 7 ? 0.0 : uniform(gen) * 1e-5, long(uniform(gen) * 1e6));
+    a.set(i, x);
+    b.set(i, y);
+    expected_a.push_back(x);
+    expected_b.push_back(y);
+  }
+  a.mul(b);
+  for (long int i = 0; i < N; i++) {
+    const LargeExponentFloat expected = expected_a[i] * expected_b[i];
+    ASSERT_EQ(expected.significand, a.significand[i]) << i;
+    ASSERT_EQ(expected.significand == 0 ? 0 : expected.exponent, a.exponent[i]) << i;
+    // divide again by non-zero values
+    if (i % 100 == 7) {
+      b.set(i, LargeExponentFloat(1.0));
+    }
+  }
+  a.div(b);
+  for (long int i = 0; i < N; i++) {
+    if (i % 100 != 7) {
+      const LargeExponentFloat expected = (expected_a[i] * expected_b[i]) / expected_b[i];
+      ASSERT_EQ(expected.significand, a.significand[i]) << i;
+      ASSERT_EQ(expected.exponent, a.exponent[i]) << i;
+    } else {
+      ASSERT_EQ(0.0, a.get(i).significand);
+    }
+  }
+}
+
+TEST(LargeExponentFloatArray, reductions) {
+  constexpr long int N = 10001;
+  LargeExponentFloatArray w(N);
+  std::mt19937_64 gen(17);
+  std::uniform_real_distribution<double> uniform(0.0, 1.0);
+  std::vector<double> log2_w(N);
+  for (long int i = 0; i < N; i++) {
+    // log weights spread over 2^+-200000, a few zeros
+    const LargeExponentFloat x(i % 1000 == 3 ? 0.0 : 0.5 + uniform(gen), long(uniform(gen) * 400000) - 200000);
+    w.set(i, x);
+    log2_w[i] = log2(x);
+  }
+
+  LargeExponentFloat expected_product(1.0);
+  for (long int i = 0; i < N; i++) {
+    if (i % 1000 != 3) {
+      expected_product = expected_product * w.get(i);
+    }
+  }
+  ASSERT_EQ(0.0, w.product().significand);
+  LargeExponentFloatArray no_zeros(N);
+  for (long int i = 0; i < N; i++) {
+    no_zeros.set(i, i % 1000 == 3 ? LargeExponentFloat(1.0) : w.get(i));
+  }
+  ASSERT_NEAR(log2(expected_product), log2(no_zeros.product()), 1e-9);
+
+  const long int i_max = std::max_element(log2_w.begin(), log2_w.end()) - log2_w.begin();
+  ASSERT_EQ(w.get(i_max), w.max());
+
+  double sum = 0;
+  for (long int i = 0; i < N; i++) {
+    sum += std::exp2(log2_w[i] - log2_w[i_max]);
+  }
+  const double expected_log_sum_exp = (std::log2(sum) + log2_w[i_max]) * M_LN2;
+  ASSERT_NEAR(expected_log_sum_exp, w.log_sum_exp(), 1e-9 * std::abs(expected_log_sum_exp));
+
+  double* weights = new_double_array(N);
+  w.normalized_weights(weights);
+  double weight_sum = 0;
+  for (long int i = 0; i < N; i++) {
+    ASSERT_NEAR(std::exp2(log2_w[i] - log2_w[i_max]) / sum, weights[i], 1e-12);
+    weight_sum += weights[i];
+  }
+  ASSERT_NEAR(1.0, weight_sum, 1e-12);
+  _mm_free(weights);
+
+  LargeExponentFloatArray zeros(5);
+  for (long int i = 0; i < 5; i++) {
+    zeros.set(i, LargeExponentFloat(0.0, 3));
+  }
+  ASSERT_EQ(0.0, zeros.max().significand);
+  ASSERT_EQ(-INFINITY, zeros.log_sum_exp());
+}
+
 TEST(prod_diff_realrealvec, nice_N) {
   constexpr int64_t N = 16000;
   double* x = new_double_array(N);
@@ -248,6 +408,97 @@ TEST(prod_dist2_complexcomplexvec, odd_N) {
   delete[] y;
 }
 
+// log2 of the magnitude and phase of prod_j!=k (u+i*v - (x[j]+i*y[j])), computed with std::complex
+void prod_diff_complexcomplex_reference(const long int N, const long int k, const double u, const double v,
+                                        const double* x, const double* y, double& log2_abs, double& phase) {
+  log2_abs = 0;
+  std::complex<double> unit_prod(1.0);
+  for (long int j = 0; j < N; j++) {
+    if (j == k) continue;
+    std::complex<double> diff(u - x[j], v - y[j]);
+    log2_abs += std::log2(std::abs(diff));
+    unit_prod *= diff / std::abs(diff);
+  }
+  phase = std::arg(unit_prod);
+}
+
+TEST(prod_diff_complexcomplexvec, matches_reference) {
+  for (int64_t N : {7L, 16L, 999L, 16000L}) {
+    double* x = new_double_array(N);
+    double* y = new_double_array(N);
+    std::mt19937_64 gen(13);
+    init_random_positions(gen,N,-1,1,x);
+    init_random_positions(gen,N,-1,1,y);
+
+    const long int k = N / 3;
+    LargeExponentFloat prod1(1.0);
+    LargeExponentFloat prod2(1.0);
+    double phase1 = 0;
+    double phase2 = 0;
+    prod_diff_complexcomplexvec(N, k, 0.4434, -0.1234, 0.2, 1.7, x, y, prod1, phase1, prod2, phase2);
+
+    double expected_log2_abs1, expected_phase1, expected_log2_abs2, expected_phase2;
+    prod_diff_complexcomplex_reference(N, k, 0.4434, 0.2, x, y, expected_log2_abs1, expected_phase1);
+    prod_diff_complexcomplex_reference(N, k, -0.1234, 1.7, x, y, expected_log2_abs2, expected_phase2);
+
+    ASSERT_NEAR(expected_log2_abs1, log2(prod1), 1e-9 * N);
+    ASSERT_NEAR(expected_log2_abs2, log2(prod2), 1e-9 * N);
+    ASSERT_NEAR(0.0, std::remainder(expected_phase1 - phase1, 2 * M_PI), 1e-9 * N);
+    ASSERT_NEAR(0.0, std::remainder(expected_phase2 - phase2, 2 * M_PI), 1e-9 * N);
+
+    _mm_free(x);
+    _mm_free(y);
+  }
+}
+
+TEST(prod_diff_complexcomplexvec, initial_value) {
+  constexpr int64_t N = 100;
+  double* x = new_double_array(N);
+  double* y = new_double_array(N);
+  std::mt19937_64 gen(3);
+  init_random_positions(gen,N,-1,1,x);
+  init_random_positions(gen,N,-1,1,y);
+
+  LargeExponentFloat prod1(1.0);
+  LargeExponentFloat prod2(1.0);
+  double phase1 = 0;
+  double phase2 = 0;
+  prod_diff_complexcomplexvec(N, 5, 0.3, 0.1, 0.2, -0.4, x, y, prod1, phase1, prod2, phase2);
+
+  LargeExponentFloat chained1(3.0, 1000);
+  LargeExponentFloat chained2(0.5, -1000);
+  double chained_phase1 = 1.0;
+  double chained_phase2 = -2.5;
+  prod_diff_complexcomplexvec(N, 5, 0.3, 0.1, 0.2, -0.4, x, y, chained1, chained_phase1, chained2, chained_phase2);
+
+  ASSERT_NEAR(log2(prod1) + std::log2(3.0) + 1000, log2(chained1), 1e-12);
+  ASSERT_NEAR(log2(prod2) - 1 - 1000, log2(chained2), 1e-12);
+  ASSERT_NEAR(0.0, std::remainder(phase1 + 1.0 - chained_phase1, 2 * M_PI), 1e-12);
+  ASSERT_NEAR(0.0, std::remainder(phase2 - 2.5 - chained_phase2, 2 * M_PI), 1e-12);
+
+  _mm_free(x);
+  _mm_free(y);
+}
+
+// Lanes whose larger part is in [2^1023, DBL_MAX], where 2^-exponent is not a double.
+TEST(LargeComplexProduct, lane_near_dbl_max) {
+  for (double phase : {0.25, 1.5, -2.0, 3.0}) {
+    const LargeExponentFloat magnitude(0x1.fp1023, 10);
+    LargeComplexProduct prod(magnitude, phase);
+    prod.normalize_exponent1();
+    const __m256d half = _mm256_set1_pd(0.5);
+    const __m256d zero = _mm256_setzero_pd();
+    // 0.5 in all 16 lanes
+    prod.mul_no_overflow1234(half, zero, half, zero, half, zero, half, zero);
+    prod.normalize_exponent1234();
+
+    double actual_phase;
+    const LargeExponentFloat actual = prod.get(actual_phase);
+    ASSERT_NEAR(log2(magnitude) - 16, log2(actual), 1e-12);
+    ASSERT_NEAR(0.0, std::remainder(phase - actual_phase, 2 * M_PI), 1e-12);
+  }
+}
+
 TEST(prod_dist2_realcomplexvec, nice_N) {
   constexpr int64_t N = 1024;
   double* x = new_double_array(N);
@@ -340,6 +591,276 @@ TEST(prod_dist2_complexrealvec, odd_N) {
   delete[] x;
 }
 
+// The conjugate pair kernels give the same products as the complex kernels for all points and their conjugates.
+TEST(prod_dist2_conjpair_complexvec, same_as_expanded_points) {
+  for (int64_t N : {5L, 16L, 37L, 200L}) {
+    double* x = new_double_array(N);
+    double* y = new_double_array(N);
+    double* x2 = new_double_array(2 * N);
+    double* y2 = new_double_array(2 * N);
+    std::mt19937_64 gen(N);
+    init_random_positions(gen,N,-1,1,x);
+    init_random_positions(gen,N,0.01,1,y);
+    for (int64_t j = 0; j < N; j++) {
+      x2[2 * j] = x[j];
+      y2[2 * j] = y[j];
+      x2[2 * j + 1] = x[j];
+      y2[2 * j + 1] = -y[j];
+    }
+
+    for (int64_t k : {0L, N / 2, N - 1}) {
+      LargeExponentFloat prod1(1.0), prod2(1.0);
+      prod_dist2_conjpair_complexvec(N, k, 0.3, x[k], 0.4, y[k], x, y, prod1, prod2);
+      // the expanded kernel excludes only one member of pair k, the other one is multiplied back
+      LargeExponentFloat expected1(1.0), expected2(1.0);
+      prod_dist2_complexcomplexvec(2 * N, 2 * k, 0.3, x[k], 0.4, y[k], x2, y2, expected1, expected2);
+      expected1.significand /= (0.3 - x[k]) * (0.3 - x[k]) + (0.4 + y[k]) * (0.4 + y[k]);
+      expected2.significand /= 4 * y[k] * y[k];
+      ASSERT_NEAR(log2(expected1), log2(prod1), 1e-9);
+      ASSERT_NEAR(log2(expected2), log2(prod2), 1e-9);
+    }
+
+    LargeExponentFloat det(1.0), expected(1.0);
+    vandermonde_abs_conjpair(N, x, y, det);
+    vandermonde_abs2_complex(2 * N, x2, y2, expected);
+    ASSERT_NEAR(log2(expected) / 2, log2(det), 1e-9);
+
+    _mm_free(x);
+    _mm_free(y);
+    _mm_free(x2);
+    _mm_free(y2);
+  }
+}
+
+TEST(vandermonde_abs_real_ginibre, same_as_all_eigenvalues) {
+  constexpr int64_t Nreal = 11;
+  constexpr int64_t Ncomplex = 45;
+  constexpr int64_t N = Nreal + 2 * Ncomplex;
+  double* lambda = new_double_array(Nreal);
+  double* x = new_double_array(Ncomplex);
+  double* y = new_double_array(Ncomplex);
+  double* all_x = new_double_array(N);
+  double* all_y = new_double_array(N);
+  std::mt19937_64 gen(41);
+  init_random_positions(gen,Nreal,-1,1,lambda);
+  init_random_positions(gen,Ncomplex,-1,1,x);
+  init_random_positions(gen,Ncomplex,0.01,1,y);
+  for (int64_t j = 0; j < Nreal; j++) {
+    all_x[j] = lambda[j];
+    all_y[j] = 0;
+  }
+  for (int64_t j = 0; j < Ncomplex; j++) {
+    all_x[Nreal + 2 * j] = x[j];
+    all_y[Nreal + 2 * j] = y[j];
+    all_x[Nreal + 2 * j + 1] = x[j];
+    all_y[Nreal + 2 * j + 1] = -y[j];
+  }
+
+  LargeExponentFloat det(1.0), expected(1.0);
+  vandermonde_abs_real_ginibre(Nreal, Ncomplex, lambda, x, y, det);
+  vandermonde_abs2_complex(N, all_x, all_y, expected);
+  ASSERT_NEAR(log2(expected) / 2, log2(det), 1e-9);
+
+  _mm_free(lambda);
+  _mm_free(x);
+  _mm_free(y);
+  _mm_free(all_x);
+  _mm_free(all_y);
+}
+
+TEST(vandermonde_abs2_mixed, same_as_all_particles) {
+  constexpr int64_t Nreal = 13;
+  constexpr int64_t Ncomplex = 50;
+  constexpr int64_t N = Nreal + Ncomplex;
+  double* lambda = new_double_array(Nreal);
+  double* x = new_double_array(Ncomplex);
+  double* y = new_double_array(Ncomplex);
+  double* all_x = new_double_array(N);
+  double* all_y = new_double_array(N);
+  std::mt19937_64 gen(43);
+  init_random_positions(gen,Nreal,-1,1,lambda);
+  init_random_positions(gen,Ncomplex,-1,1,x);
+  init_random_positions(gen,Ncomplex,-1,1,y);
+  for (int64_t j = 0; j < Nreal; j++) {
+    all_x[j] = lambda[j];
+    all_y[j] = 0;
+  }
+  for (int64_t j = 0; j < Ncomplex; j++) {
+    all_x[Nreal + j] = x[j];
+    all_y[Nreal + j] = y[j];
+  }
+
+  LargeExponentFloat det(1.0), expected(1.0);
+  vandermonde_abs2_mixed(Nreal, Ncomplex, lambda, x, y, det);
+  vandermonde_abs2_complex(N, all_x, all_y, expected);
+  ASSERT_NEAR(log2(expected), log2(det), 1e-9);
+
+  _mm_free(lambda);
+  _mm_free(x);
+  _mm_free(y);
+  _mm_free(all_x);
+  _mm_free(all_y);
+}
+
+TEST(LargeProduct, streaming_kernel_calls) {
+  std::mt19937_64 gen(44);
+  constexpr int64_t N = 1003;
+  double* x = new_double_array(N);
+  double* y = new_double_array(N);
+  init_random_positions(gen,N,-0.1,0.1,x);
+  init_random_positions(gen,N,-0.1,0.1,y);
+
+  // hundreds of calls with tiny factors on the same accumulators, with scalar factors in between
+  LargeProduct real1, real2, complex1, complex2;
+  double expected_real1 = 0, expected_real2 = 0, expected_complex1 = 0, expected_complex2 = 0;
+  for (int64_t k = 0; k < 300; k++) {
+    const int64_t n = 1 + (k * 7) % N;
+    const double u1 = x[k] + 1e-3, u2 = x[k] - 1e-3, v1 = y[k], v2 = -y[k];
+    LargeExponentFloat p1(1.0), p2(1.0), q1(1.0), q2(1.0);
+    prod_diff_realrealvec(n, k, u1, u2, x, p1, p2);
+    prod_dist2_complexcomplexvec(n, k, u1, u2, v1, v2, x, y, q1, q2);
+    expected_real1 += log2(p1) + log2(1e-3);
+    expected_real2 += log2(p2);
+    expected_complex1 += log2(q1) + log2(1e-3);
+    expected_complex2 += log2(q2);
+
+    prod_diff_realrealvec(n, k, u1, u2, x, real1, real2);
+    prod_dist2_complexcomplexvec(n, k, u1, u2, v1, v2, x, y, complex1, complex2);
+    real1.mul_no_overflow(1e-3);
+    complex1.mul_no_overflow(1e-3);
+  }
+  ASSERT_NEAR(expected_real1, log2(real1.get()), 1e-9 * std::abs(expected_real1));
+  ASSERT_NEAR(expected_real2, log2(real2.get()), 1e-9 * std::abs(expected_real2));
+  ASSERT_NEAR(expected_complex1, log2(complex1.get()), 1e-9 * std::abs(expected_complex1));
+  ASSERT_NEAR(expected_complex2, log2(complex2.get()), 1e-9 * std::abs(expected_complex2));
+
+  _mm_free(x);
+  _mm_free(y);
+}
+
+TEST(LargeProduct, zero_order) {
+  std::mt19937_64 gen(45);
+  constexpr int64_t N = 1003;
+  double* x = new_double_array(N);
+  init_random_positions(gen,N,-1,1,x);
+  // four particles at the same position, x[5], x[9] and x[21] in the same lane (x[5] and x[9] in one pair of factors)
+  x[9] = x[21] = x[300] = x[5];
+
+  LargeProduct prod1, prod2;
+  prod_diff_realrealvec(N, 1, x[5], 0.5, x, prod1, prod2);
+  ASSERT_EQ(4, prod1.zero_order());
+  ASSERT_EQ(0, prod2.zero_order());
+  ASSERT_EQ(0.0, prod1.get().significand);
+  ASSERT_EQ(-INFINITY, log2(prod1.get()));
+
+  LargeExponentFloat p1(1.0), p2(1.0);
+  prod_diff_realrealvec(N, 1, 0.25, 0.5, x, p1, p2);
+  ASSERT_DOUBLE_EQ(log2(p2), log2(prod2.get()));
+
+  // zeros survive chaining and combining accumulators
+  prod2.mul(prod1);
+  ASSERT_EQ(4, prod2.zero_order());
+  prod_diff_realrealvec(N, 9, x[5], 0.5, x, prod1, prod2);
+  ASSERT_EQ(7, prod1.zero_order());
+
+  LargeProduct prod3;
+  prod3.mul_no_overflow(0.0);
+  prod3.mul_no_overflow(0.0);
+  ASSERT_EQ(2, prod3.zero_order());
+  // an initial value of 0 is a zero factor
+  LargeProduct prod4(0.0);
+  prod4.mul_no_overflow(0.0);
+  ASSERT_EQ(2, prod4.zero_order());
+
+  _mm_free(x);
+}
+
+TEST(LargeProduct, clustered_particles) {
+  // distinct particles with all distances far below FACTOR_MIN: the pair products underflow, the product does not
+  constexpr int64_t N = 1024;
+  double* x = new_double_array(N);
+  for (int64_t j = 0; j < N; j++) {
+    x[j] = (1 + j * 1e-3) * 1e-21;
+  }
+  for (const int64_t k : {0, 17, 1023}) {
+    LargeProduct prod1, prod2;
+    prod_diff_realrealvec(N, k, x[k], 0.5, x, prod1, prod2);
+    long double expected = 0;
+    for (int64_t j = 0; j < N; j++) {
+      if (j != k) {
+        expected += std::log2(std::abs(static_cast<long double>(x[k]) - x[j]));
+      }
+    }
+    ASSERT_EQ(0, prod1.zero_order());
+    ASSERT_LT(expected, -70000);
+    ASSERT_NEAR(static_cast<double>(expected), log2(prod1.get()), 1e-9 * std::abs(static_cast<double>(expected)));
+  }
+  _mm_free(x);
+}
+
+TEST(LargeProduct, denormals_and_large_exponents) {
+  // factors whose product would be denormal keep their value
+  LargeProduct prod;
+  prod.mul_no_overflow(1e-160);
+  prod.mul_no_overflow(1e-160);
+  ASSERT_EQ(0, prod.zero_order());
+  ASSERT_NEAR(-320 * std::log2(10.0), log2(prod.get()), 1e-3);
+  prod = LargeProduct();
+  prod.mul_no_overflow(-1e-160);
+  prod.mul_no_overflow(1e-140);
+  ASSERT_EQ(0, prod.zero_order());
+  ASSERT_NEAR(-300 * std::log2(10.0), log2(prod.get()), 1e-9);
+  ASSERT_LT(prod.get().significand, 0);
+  // factors that would underflow the lane are scaled
+  prod.mul_no_overflow(1e-200);
+  prod.mul_no_overflow(1e-200);
+  ASSERT_EQ(0, prod.zero_order());
+  ASSERT_NEAR(-700 * std::log2(10.0), log2(prod.get()), 1e-9);
+  prod.mul_no_overflow(1e300);
+  prod.mul_no_overflow(1e300);
+  prod.mul_no_overflow(1e300);
+  ASSERT_NEAR(200 * std::log2(10.0), log2(prod.get()), 1e-9);
+
+#ifdef __AVX2__
+  // the whole int64 exponent range (the AVX version stores 32 bit exponents)
+  for (const int64_t exponent : {-(int64_t(1) << 39) - 10, int64_t(1) << 40, -(int64_t(1) << 60)}) {
+    const LargeExponentFloat f = LargeProduct(LargeExponentFloat(1.5, exponent)).get();
+    ASSERT_EQ(1.5, f.significand);
+    ASSERT_EQ(exponent, f.exponent);
+    ASSERT_EQ(0, LargeProduct(LargeExponentFloat(1.5, exponent)).zero_order());
+  }
+#endif
+}
+
+TEST(prescale_positions, clustered_particles) {
+  std::mt19937_64 gen(45);
+  constexpr int64_t N = 301;
+  double* x = new_double_array(N);
+  double* scaled = new_double_array(N);
+  init_random_positions(gen, N, -1, 1, x);
+  LargeExponentFloat expected(1.0), unused(1.0);
+  prod_diff_realrealvec(N, 7, 0.25, 0.5, x, expected, unused);
+
+  // the same configuration shrunk to width 1e-20 gives the same factors up to the scale, with and without pre-scaling
+  const int shrink = -66;
+  prescale_positions(N, shrink, x, x);
+  LargeExponentFloat clustered(1.0);
+  prod_diff_realrealvec(N, 7, std::ldexp(0.25, shrink), std::ldexp(0.5, shrink), x, clustered, unused);
+  ASSERT_EQ(expected.normalized_fast().significand, clustered.normalized_fast().significand);
+  ASSERT_EQ(expected.normalized_fast().exponent, clustered.normalized_fast().exponent - int64_t(shrink) * (N - 1));
+
+  const int e = prescale_exponent(N, x);
+  prescale_positions(N, e, x, scaled);
+  LargeExponentFloat prescaled(1.0);
+  prod_diff_realrealvec(N, 7, std::ldexp(0.25, shrink + e), std::ldexp(0.5, shrink + e), scaled, prescaled, unused);
+  // exact powers of two, the same factors up to the scale
+  ASSERT_EQ(expected.normalized_fast().significand, prescaled.normalized_fast().significand);
+  ASSERT_EQ(expected.normalized_fast().exponent,
+            prescaled.normalized_fast().exponent - int64_t(shrink + e) * (N - 1));
+  _mm_free(x);
+  _mm_free(scaled);
+}
+
 TEST(prod_dist2_complexcomplexvec, small) {
   std::mt19937_64 gen = std::mt19937_64();
 
@@ -377,6 +898,1883 @@ TEST(prod_dist2_complexcomplexvec, small) {
   delete[] y;
 }
 
+template<long int N>
+void check_small_kernels(std::mt19937_64& gen) {
+  double* x = new_double_array(N);
+  double* y = new_double_array(N);
+  init_random_positions(gen,N,-1,1,x);
+  init_random_positions(gen,N,-1,1,y);
+
+  for (long int k : {0L, N / 2, N - 1, N}) {
+    LargeExponentFloat expected1(7.1, 42 * 511), expected2(0.02, -2 * 511);
+    LargeExponentFloat actual1(7.1, 42 * 511), actual2(0.02, -2 * 511);
+    prod_diff_realrealvec(N, k, 0.0521, 1.213, x, expected1, expected2);
+    prod_diff_realrealvec<N>(k, 0.0521, 1.213, x, actual1, actual2);
+    ASSERT_NEAR(log2(expected1), log2(actual1), 1e-12) << "N=" << N << " k=" << k;
+    ASSERT_NEAR(log2(expected2), log2(actual2), 1e-12) << "N=" << N << " k=" << k;
+    ASSERT_EQ(expected1.significand > 0, actual1.significand > 0);
+    ASSERT_EQ(expected2.significand > 0, actual2.significand > 0);
+
+    expected1 = expected2 = actual1 = actual2 = LargeExponentFloat(1.0);
+    prod_dist2_complexcomplexvec(N, k, 1.4334, 0.1233, -2.13, 0.111, x, y, expected1, expected2);
+    prod_dist2_complexcomplexvec<N>(k, 1.4334, 0.1233, -2.13, 0.111, x, y, actual1, actual2);
+    ASSERT_NEAR(log2(expected1), log2(actual1), 1e-12) << "N=" << N << " k=" << k;
+    ASSERT_NEAR(log2(expected2), log2(actual2), 1e-12) << "N=" << N << " k=" << k;
+  }
+
+  LargeExponentFloat expected1(5.6), expected2(0.23);
+  LargeExponentFloat actual1(5.6), actual2(0.23);
+  prod_dist2_realcomplexvec(N, 0.4434, -0.1234, x, y, expected1, expected2);
+  prod_dist2_realcomplexvec<N>(0.4434, -0.1234, x, y, actual1, actual2);
+  ASSERT_NEAR(log2(expected1), log2(actual1), 1e-12) << "N=" << N;
+  ASSERT_NEAR(log2(expected2), log2(actual2), 1e-12) << "N=" << N;
+
+  expected1 = expected2 = actual1 = actual2 = LargeExponentFloat(1.0);
+  prod_dist2_complexrealvec(N, 0.481, -1.22, 1.051, -10.00001, x, expected1, expected2);
+  prod_dist2_complexrealvec<N>(0.481, -1.22, 1.051, -10.00001, x, actual1, actual2);
+  ASSERT_NEAR(log2(expected1), log2(actual1), 1e-12) << "N=" << N;
+  ASSERT_NEAR(log2(expected2), log2(actual2), 1e-12) << "N=" << N;
+
+  _mm_free(x);
+  _mm_free(y);
+}
+
+TEST(small_kernels, match_generic_kernels) {
+  std::mt19937_64 gen(17);
+  check_small_kernels<1>(gen);
+  check_small_kernels<5>(gen);
+  check_small_kernels<8>(gen);
+  check_small_kernels<13>(gen);
+  check_small_kernels<16>(gen);
+  check_small_kernels<31>(gen);
+  check_small_kernels<48>(gen);
+  check_small_kernels<64>(gen);
+}
+
+TEST(small_kernels, coinciding_and_clustered_particles) {
+  constexpr int64_t N = 64;
+  double* x = new_double_array(N);
+  for (int64_t j = 0; j < N; j++) {
+    x[j] = (1 + j * 1e-3) * 1e-21;
+  }
+  // u at another particle: a zero factor, like for the generic kernel
+  LargeExponentFloat expected1(1.0), expected2(1.0), actual1(1.0), actual2(1.0);
+  prod_diff_realrealvec(N, 0, x[3], 0.5, x, expected1, expected2);
+  prod_diff_realrealvec<N>(0, x[3], 0.5, x, actual1, actual2);
+  ASSERT_EQ(0.0, expected1.significand);
+  ASSERT_EQ(0.0, actual1.significand);
+  ASSERT_NEAR(log2(expected2), log2(actual2), 1e-12);
+
+  // factors around 1e-24, 16 of them underflow a lane, and an initial value of 0
+  for (const int64_t k : {0L, 37L}) {
+    expected1 = expected2 = actual1 = LargeExponentFloat(1.0);
+    actual2 = LargeExponentFloat(0.0);
+    prod_diff_realrealvec(N, k, x[k], 0.5, x, expected1, expected2);
+    prod_diff_realrealvec<N>(k, x[k], 0.5, x, actual1, actual2);
+    ASSERT_LT(log2(expected1), -4000);
+    ASSERT_NEAR(log2(expected1), log2(actual1), 1e-9);
+    ASSERT_EQ(0.0, actual2.significand);
+  }
+  _mm_free(x);
+}
+
+TEST(prod_diff_realvec, matches_first_product_of_pair_kernels) {
+  for (int64_t N : {7L, 100L, 999L}) {
+    double* x = new_double_array(N);
+    double* y = new_double_array(N);
+    std::mt19937_64 gen(20);
+    init_random_positions(gen,N,-1,1,x);
+    init_random_positions(gen,N,-1,1,y);
+
+    for (long int k : {0L, N / 2, N}) {
+      const double u = 0.123;
+      const double v = -0.45;
+      LargeExponentFloat expected(2.5, 100), unused(1.0);
+      prod_diff_realrealvec(N, k, u, 0.5, x, expected, unused);
+      LargeExponentFloat prod(2.5, 100);
+      prod_diff_realvec(N, k, u, x, prod);
+      ASSERT_EQ(expected.significand, prod.significand);
+      ASSERT_EQ(expected.exponent, prod.exponent);
+
+      expected = LargeExponentFloat(2.5, 100);
+      prod_dist2_complexcomplexvec(N, k, u, 0.5, v, 0.5, x, y, expected, unused);
+      prod = LargeExponentFloat(2.5, 100);
+      prod_dist2_complexvec(N, k, u, v, x, y, prod);
+      ASSERT_EQ(expected.significand, prod.significand);
+      ASSERT_EQ(expected.exponent, prod.exponent);
+    }
+
+    _mm_free(x);
+    _mm_free(y);
+  }
+}
+
+TEST(prod_diff_force_realvec, matches_separate_passes) {
+  for (int64_t N : {7L, 100L, 999L}) {
+    double* x = new_double_array(N);
+    std::mt19937_64 gen(21);
+    init_random_positions(gen,N,-1,1,x);
+
+    for (long int k : {0L, N / 2, N}) {
+      const double u = 0.123;
+      LargeExponentFloat expected(2.5, 100), unused(1.0);
+      prod_diff_realrealvec(N, k, u, u, x, expected, unused);
+      double expected_force = 0;
+      for (long int j = 0; j < N; j++) {
+        if (j != k) expected_force += 1 / (u - x[j]);
+      }
+
+      LargeExponentFloat prod(2.5, 100);
+      double force;
+      prod_diff_force_realvec(N, k, u, x, prod, force);
+      ASSERT_NEAR(log2(expected), log2(prod), 1e-12);
+      ASSERT_EQ(expected.significand > 0, prod.significand > 0);
+      ASSERT_NEAR(expected_force, force, 1e-12 * N * std::abs(expected_force));
+    }
+
+    _mm_free(x);
+  }
+}
+
+TEST(prod_dist2_force_complexvec, matches_separate_passes) {
+  for (int64_t N : {7L, 100L, 999L}) {
+    double* x = new_double_array(N);
+    double* y = new_double_array(N);
+    std::mt19937_64 gen(22);
+    init_random_positions(gen,N,-1,1,x);
+    init_random_positions(gen,N,-1,1,y);
+
+    for (long int k : {0L, N / 2, N}) {
+      const double u = -0.3;
+      const double v = 0.77;
+      LargeExponentFloat expected(1.0), unused(1.0);
+      prod_dist2_complexcomplexvec(N, k, u, u, v, v, x, y, expected, unused);
+      double expected_force_x = 0;
+      double expected_force_y = 0;
+      for (long int j = 0; j < N; j++) {
+        if (j == k) continue;
+        double d2 = (u - x[j]) * (u - x[j]) + (v - y[j]) * (v - y[j]);
+        expected_force_x += (u - x[j]) / d2;
+        expected_force_y += (v - y[j]) / d2;
+      }
+
+      LargeExponentFloat prod(1.0);
+      double force_x, force_y;
+      prod_dist2_force_complexvec(N, k, u, v, x, y, prod, force_x, force_y);
+      ASSERT_NEAR(log2(expected), log2(prod), 1e-12);
+      ASSERT_NEAR(expected_force_x, force_x, 1e-12 * N * std::abs(expected_force_x));
+      ASSERT_NEAR(expected_force_y, force_y, 1e-12 * N * std::abs(expected_force_y));
+    }
+
+    _mm_free(x);
+    _mm_free(y);
+  }
+}
+
+TEST(prod_diff_force_realvec, clustered_and_distant_particles) {
+  // the product of 4 distances, which gives the 4 reciprocals with one division, under- or overflows at these scales
+  constexpr int64_t N = 101;
+  double* x = new_double_array(N);
+  double* y = new_double_array(N);
+  double* force_x = new_double_array(N);
+  double* force_y = new_double_array(N);
+  for (const double scale : {1e-80, 1e80}) {
+    std::mt19937_64 gen(25);
+    init_random_positions(gen,N,-scale,scale,x);
+    init_random_positions(gen,N,-scale,scale,y);
+    const double u = 0.123 * scale;
+    const double v = 0.77 * scale;
+    double expected_force = 0, abs_force = 0;
+    double expected_force_x = 0, expected_force_y = 0, abs_force_xy = 0;
+    for (long int j = 0; j < N; j++) {
+      expected_force += 1 / (u - x[j]);
+      abs_force += std::abs(1 / (u - x[j]));
+      const double dx = u - x[j], dy = v - y[j];
+      const double r = std::hypot(dx, dy);
+      expected_force_x += dx / r / r;
+      expected_force_y += dy / r / r;
+      abs_force_xy += 1 / r;
+    }
+
+    LargeExponentFloat prod(1.0);
+    double force;
+    prod_diff_force_realvec(N, N, u, x, prod, force);
+    ASSERT_NEAR(expected_force, force, 1e-13 * N * abs_force) << "scale=" << scale;
+
+    double force_x_u, force_y_u;
+    prod_dist2_force_complexvec(N, N, u, v, x, y, prod, force_x_u, force_y_u);
+    ASSERT_NEAR(expected_force_x, force_x_u, 1e-13 * N * abs_force_xy) << "scale=" << scale;
+    ASSERT_NEAR(expected_force_y, force_y_u, 1e-13 * N * abs_force_xy) << "scale=" << scale;
+
+    vandermonde_real_forces(N, x, prod, force_x);
+    for (long int i = 0; i < N; i++) {
+      double expected = 0, abs_sum = 0;
+      for (long int j = 0; j < N; j++) {
+        if (j == i) continue;
+        expected += 1 / (x[i] - x[j]);
+        abs_sum += std::abs(1 / (x[i] - x[j]));
+      }
+      ASSERT_NEAR(expected, force_x[i], 1e-13 * N * abs_sum) << "scale=" << scale << " i=" << i;
+    }
+
+    vandermonde_abs2_complex_forces(N, x, y, prod, force_x, force_y);
+    for (long int i = 0; i < N; i++) {
+      double expected_x = 0, expected_y = 0, abs_sum = 0;
+      for (long int j = 0; j < N; j++) {
+        if (j == i) continue;
+        const double dx = x[i] - x[j], dy = y[i] - y[j];
+        const double r = std::hypot(dx, dy);
+        expected_x += dx / r / r;
+        expected_y += dy / r / r;
+        abs_sum += 1 / r;
+      }
+      ASSERT_NEAR(expected_x, force_x[i], 1e-13 * N * abs_sum) << "scale=" << scale << " i=" << i;
+      ASSERT_NEAR(expected_y, force_y[i], 1e-13 * N * abs_sum) << "scale=" << scale << " i=" << i;
+    }
+  }
+  _mm_free(x);
+  _mm_free(y);
+  _mm_free(force_x);
+  _mm_free(force_y);
+}
+
+TEST(prod_diff_force_realvec, distant_particle_in_one_block) {
+  // Only the block of loops with the distant particle is recomputed with divisions, also if it holds particle k.
+  constexpr int64_t N = 1001;
+  double* x = new_double_array(N);
+  double* y = new_double_array(N);
+  double* force_x = new_double_array(N);
+  double* force_y = new_double_array(N);
+  std::mt19937_64 gen(26);
+  init_random_positions(gen,N,-1,1,x);
+  init_random_positions(gen,N,-1,1,y);
+  x[300] = 1e300;
+  const double u = 0.123;
+  const double v = 0.77;
+  for (const int64_t k : {400L, 900L}) {
+    double expected_force = 0, abs_force = 0;
+    for (long int j = 0; j < N; j++) {
+      if (j == k) continue;
+      expected_force += 1 / (u - x[j]);
+      abs_force += std::abs(1 / (u - x[j]));
+    }
+    LargeExponentFloat prod(1.0);
+    double force;
+    prod_diff_force_realvec(N, k, u, x, prod, force);
+    ASSERT_NEAR(expected_force, force, 1e-13 * N * abs_force) << "k=" << k;
+  }
+  LargeExponentFloat real_prod(1.0);
+  vandermonde_real_forces(N, x, real_prod, force_x);
+  for (long int i = 0; i < N; i++) {
+    double expected = 0, abs_sum = 0;
+    for (long int j = 0; j < N; j++) {
+      if (j == i) continue;
+      expected += 1 / (x[i] - x[j]);
+      abs_sum += std::abs(1 / (x[i] - x[j]));
+    }
+    ASSERT_NEAR(expected, force_x[i], 1e-13 * N * abs_sum) << "i=" << i;
+  }
+
+  // the squared distance of the complex kernels is 1e300
+  x[300] = 1e150;
+  for (const int64_t k : {400L, 900L}) {
+    double expected_x = 0, expected_y = 0, abs_sum = 0;
+    for (long int j = 0; j < N; j++) {
+      if (j == k) continue;
+      const double dx = u - x[j], dy = v - y[j];
+      const double r2 = dx * dx + dy * dy;
+      expected_x += dx / r2;
+      expected_y += dy / r2;
+      abs_sum += 1 / std::sqrt(r2);
+    }
+    LargeExponentFloat prod(1.0);
+    double force_x_u, force_y_u;
+    prod_dist2_force_complexvec(N, k, u, v, x, y, prod, force_x_u, force_y_u);
+    ASSERT_NEAR(expected_x, force_x_u, 1e-13 * N * abs_sum) << "k=" << k;
+    ASSERT_NEAR(expected_y, force_y_u, 1e-13 * N * abs_sum) << "k=" << k;
+  }
+  LargeExponentFloat complex_prod(1.0);
+  vandermonde_abs2_complex_forces(N, x, y, complex_prod, force_x, force_y);
+  for (long int i = 0; i < N; i++) {
+    double expected_x = 0, expected_y = 0, abs_sum = 0;
+    for (long int j = 0; j < N; j++) {
+      if (j == i) continue;
+      const double dx = x[i] - x[j], dy = y[i] - y[j];
+      const double r2 = dx * dx + dy * dy;
+      expected_x += dx / r2;
+      expected_y += dy / r2;
+      abs_sum += 1 / std::sqrt(r2);
+    }
+    ASSERT_NEAR(expected_x, force_x[i], 1e-13 * N * abs_sum) << "i=" << i;
+    ASSERT_NEAR(expected_y, force_y[i], 1e-13 * N * abs_sum) << "i=" << i;
+  }
+  _mm_free(x);
+  _mm_free(y);
+  _mm_free(force_x);
+  _mm_free(force_y);
+}
+
+TEST(vandermonde_real_forces, matches_reference) {
+  for (int64_t N : {1L, 2L, 5L, 17L, 100L, 1001L}) {
+    double* x = new_double_array(N);
+    double* force = new_double_array(N);
+    std::mt19937_64 gen(23);
+    init_random_positions(gen,N,-1,1,x);
+
+    LargeExponentFloat prod(1.0);
+    vandermonde_real_forces(N, x, prod, force);
+
+    double reference = 1.0;
+    long int reference_exponent = 0;
+    vandermonde_real_reference(N, x, reference, reference_exponent);
+    LargeExponentFloat reference_float(reference, reference_exponent * vandermonde_exponent_low_high);
+    ASSERT_NEAR(log2(reference_float), log2(prod), 1e-9);
+    ASSERT_EQ(reference > 0, prod.significand > 0);
+
+    for (long int i = 0; i < N; i++) {
+      double expected_force = 0;
+      double abs_sum = 0;
+      for (long int j = 0; j < N; j++) {
+        if (j == i) continue;
+        expected_force += 1 / (x[i] - x[j]);
+        abs_sum += std::abs(1 / (x[i] - x[j]));
+      }
+      ASSERT_NEAR(expected_force, force[i], 1e-13 * N * abs_sum) << "N=" << N << " i=" << i;
+    }
+
+    _mm_free(x);
+    _mm_free(force);
+  }
+}
+
+TEST(vandermonde_abs2_complex_forces, matches_reference) {
+  for (int64_t N : {1L, 2L, 5L, 17L, 100L, 1001L}) {
+    double* x = new_double_array(N);
+    double* y = new_double_array(N);
+    double* force_x = new_double_array(N);
+    double* force_y = new_double_array(N);
+    std::mt19937_64 gen(24);
+    init_random_positions(gen,N,-1,1,x);
+    init_random_positions(gen,N,-1,1,y);
+
+    LargeExponentFloat prod(1.0);
+    vandermonde_abs2_complex_forces(N, x, y, prod, force_x, force_y);
+
+    double reference = 1.0;
+    long int reference_exponent = 0;
+    vandermonde_abs2_complex_reference(N, x, y, reference, reference_exponent);
+    LargeExponentFloat reference_float(reference, reference_exponent * vandermonde_exponent_low_high);
+    ASSERT_NEAR(log2(reference_float), log2(prod), 1e-9);
+
+    for (long int i = 0; i < N; i++) {
+      double expected_force_x = 0;
+      double expected_force_y = 0;
+      double abs_sum = 0;
+      for (long int j = 0; j < N; j++) {
+        if (j == i) continue;
+        double d2 = (x[i] - x[j]) * (x[i] - x[j]) + (y[i] - y[j]) * (y[i] - y[j]);
+        expected_force_x += (x[i] - x[j]) / d2;
+        expected_force_y += (y[i] - y[j]) / d2;
+        abs_sum += 1 / std::sqrt(d2);
+      }
+      ASSERT_NEAR(expected_force_x, force_x[i], 1e-13 * N * abs_sum) << "N=" << N << " i=" << i;
+      ASSERT_NEAR(expected_force_y, force_y[i], 1e-13 * N * abs_sum) << "N=" << N << " i=" << i;
+    }
+
+    _mm_free(x);
+    _mm_free(y);
+    _mm_free(force_x);
+    _mm_free(force_y);
+  }
+}
+
+TEST(triangle_chunks, cover_all_rows) {
+  for (int64_t N : {0L, 1L, 2L, 3L, 1000L, 1001L, 5000L}) {
+    auto chunks = triangle_chunks(N);
+    int64_t expected_begin = 2;
+    for (auto& chunk: chunks) {
+      ASSERT_EQ(expected_begin, chunk.begin_row);
+      ASSERT_LT(chunk.begin_row, chunk.end_row);
+      expected_begin = chunk.end_row;
+    }
+    if (N >= 2) {
+      ASSERT_GE(expected_begin, N);
+      ASSERT_LE(expected_begin, N + 2);
+    } else {
+      ASSERT_TRUE(chunks.empty());
+    }
+  }
+  ASSERT_GT(triangle_chunks(5000).size(), 100UL);
+}
+
+TEST(merge_tree, fixed_order) {
+  std::vector<LargeExponentFloat> partials;
+  for (int i = 0; i < 7; i++) {
+    partials.push_back(LargeExponentFloat(1.0 + 0.1 * i, 1000 * i));
+  }
+  LargeExponentFloat expected = save_mul(
+          save_mul(save_mul(partials[0], partials[1]), save_mul(partials[2], partials[3])),
+          save_mul(save_mul(partials[4], partials[5]), partials[6]));
+  LargeExponentFloat actual = merge_tree(partials);
+  ASSERT_EQ(expected.significand, actual.significand);
+  ASSERT_EQ(expected.exponent, actual.exponent);
+}
+
+TEST(vandermonde_real_parallel, independent_of_thread_count) {
+  constexpr int64_t N = 3001;
+  double* x = new_double_array(N);
+  std::mt19937_64 gen(5);
+  init_random_positions(gen,N,-1,1,x);
+
+  LargeExponentFloat expected(0.5, 7);
+  vandermonde_real_parallel(N, x, expected, 1);
+  for (int threads : {2, 3, 8, 64}) {
+    LargeExponentFloat actual(0.5, 7);
+    vandermonde_real_parallel(N, x, actual, threads);
+    ASSERT_EQ(expected.significand, actual.significand);
+    ASSERT_EQ(expected.exponent, actual.exponent);
+  }
+
+  double reference = 0.5;
+  long int reference_exponent = 0;
+  vandermonde_real_reference(N, x, reference, reference_exponent);
+  LargeExponentFloat reference_float(reference, reference_exponent * vandermonde_exponent_low_high + 7);
+  ASSERT_NEAR(log2(reference_float), log2(expected), 1e-6);
+
+  _mm_free(x);
+}
+
+TEST(vandermonde_abs2_complex_parallel, independent_of_thread_count) {
+  constexpr int64_t N = 2000;
+  double* x = new_double_array(N);
+  double* y = new_double_array(N);
+  std::mt19937_64 gen(6);
+  init_random_positions(gen,N,-1,1,x);
+  init_random_positions(gen,N,-1,1,y);
+
+  LargeExponentFloat expected(1.0);
+  vandermonde_abs2_complex_parallel(N, x, y, expected, 1);
+  for (int threads : {2, 5, 16}) {
+    LargeExponentFloat actual(1.0);
+    vandermonde_abs2_complex_parallel(N, x, y, actual, threads);
+    ASSERT_EQ(expected.significand, actual.significand);
+    ASSERT_EQ(expected.exponent, actual.exponent);
+  }
+
+  double reference = 1.0;
+  long int reference_exponent = 0;
+  vandermonde_abs2_complex_reference(N, x, y, reference, reference_exponent);
+  LargeExponentFloat reference_float(reference, reference_exponent * vandermonde_exponent_low_high);
+  ASSERT_NEAR(log2(reference_float), log2(expected), 1e-6);
+
+  _mm_free(x);
+  _mm_free(y);
+}
+
+// the same bits for every instruction set: run_tests.sh runs this test in a -march=native and in an AVX only build
+TEST(vandermonde_parallel, independent_of_instruction_set) {
+  constexpr int64_t N = 3000;
+  double* x = new_double_array(N);
+  double* y = new_double_array(N);
+  std::mt19937_64 gen(6);
+  init_random_positions(gen,N,-1,1,x);
+  init_random_positions(gen,N,-1,1,y);
+
+  LargeExponentFloat complex_prod(1.0);
+  vandermonde_abs2_complex_parallel(N, x, y, complex_prod, 4);
+  ASSERT_EQ(0x1.87c68ea1a108dp-2, complex_prod.significand);
+  ASSERT_EQ(-1531285L, complex_prod.exponent);
+
+  LargeExponentFloat real_prod(1.0);
+  vandermonde_real_parallel(N, x, real_prod, 4);
+  ASSERT_EQ(-0x1.034a9f0780de6p-2, real_prod.significand);
+  ASSERT_EQ(-5283958L, real_prod.exponent);
+
+  _mm_free(x);
+  _mm_free(y);
+}
+
+TEST(shard_chunk_range, covers_all_chunks) {
+  for (size_t num_chunks : {0UL, 1UL, 7UL, 100UL}) {
+    for (int num_shards : {1, 3, 8}) {
+      size_t expected_first = 0;
+      for (int shard = 0; shard < num_shards; shard++) {
+        auto range = shard_chunk_range(num_chunks, shard, num_shards);
+        ASSERT_EQ(expected_first, range.first);
+        ASSERT_LE(range.first, range.second);
+        expected_first = range.second;
+      }
+      ASSERT_EQ(num_chunks, expected_first);
+    }
+  }
+}
+
+TEST(serialize, roundtrip) {
+  for (LargeExponentFloat f : {LargeExponentFloat(1.0), LargeExponentFloat(-0.1, 1L << 40),
+                               LargeExponentFloat(0.0), LargeExponentFloat(1.0 / 3, -123456789)}) {
+    LargeExponentFloat g(7.0);
+    ASSERT_TRUE(deserialize(serialize(f), g));
+    ASSERT_EQ(f.significand, g.significand);
+    ASSERT_EQ(f.exponent, g.exponent);
+  }
+  LargeExponentFloat g(7.0);
+  ASSERT_FALSE(deserialize("0x1.8p+0", g));
+  ASSERT_FALSE(deserialize("1.5x 3", g));
+}
+
+// Every shard is computed in its own process and sent as text through a pipe, like shards on different machines.
+TEST(vandermonde_real_shard, processes_same_as_parallel) {
+  constexpr int64_t N = 3001;
+  constexpr int NUM_SHARDS = 4;
+  double* x = new_double_array(N);
+  std::mt19937_64 gen(7);
+  init_random_positions(gen,N,-1,1,x);
+
+  std::vector<ShardResult> shards(NUM_SHARDS);
+  for (int shard = 0; shard < NUM_SHARDS; shard++) {
+    int fd[2];
+    ASSERT_EQ(0, pipe(fd));
+    const pid_t pid = fork();
+    ASSERT_GE(pid, 0);
+    if (pid == 0) {
+      close(fd[0]);
+      std::ostringstream os;
+      write_shard(os, vandermonde_real_shard(N, x, shard, NUM_SHARDS, 2));
+      const std::string text = os.str();
+      const bool written = write(fd[1], text.data(), text.size()) == ssize_t(text.size());
+      _exit(written ? 0 : 1);
+    }
+    close(fd[1]);
+    std::string text;
+    char buffer[4096];
+    ssize_t n;
+    while ((n = read(fd[0], buffer, sizeof(buffer))) > 0) {
+      text.append(buffer, n);
+    }
+    close(fd[0]);
+    int status;
+    ASSERT_EQ(pid, waitpid(pid, &status, 0));
+    ASSERT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    std::istringstream is(text);
+    ASSERT_TRUE(read_shard(is, shards[shard]));
+  }
+
+  LargeExponentFloat expected(0.5, 7);
+  vandermonde_real_parallel(N, x, expected, 1);
+  LargeExponentFloat actual(0.5, 7);
+  ASSERT_TRUE(merge_shards(shards, actual));
+  ASSERT_EQ(expected.significand, actual.significand);
+  ASSERT_EQ(expected.exponent, actual.exponent);
+
+  // a missing or duplicated shard is detected
+  LargeExponentFloat unchanged(1.0);
+  ASSERT_FALSE(merge_shards({shards[0], shards[1], shards[3]}, unchanged));
+  ASSERT_FALSE(merge_shards({shards[0], shards[1], shards[2], shards[3], shards[2]}, unchanged));
+
+  // so is a shard of other particles or of complex particles with the same N
+  x[1234] = std::nextafter(x[1234], 2.0);
+  ASSERT_NE(shards[2].positions_checksum, positions_checksum(N, x));
+  std::stringstream other_text;
+  write_shard(other_text, vandermonde_real_shard(N, x, 2, NUM_SHARDS, 2));
+  ShardResult other;
+  ASSERT_TRUE(read_shard(other_text, other));
+  ASSERT_FALSE(merge_shards({shards[0], shards[1], other, shards[3]}, unchanged));
+  double* y = new_double_array(N);
+  other = vandermonde_abs2_complex_shard(N, x, y, 2, NUM_SHARDS, 2);
+  other.positions_checksum = shards[2].positions_checksum;
+  ASSERT_FALSE(merge_shards({shards[0], shards[1], other, shards[3]}, unchanged));
+  ASSERT_EQ(1.0, unchanged.significand);
+  _mm_free(y);
+
+  _mm_free(x);
+}
+
+TEST(vandermonde_abs2_complex_shard, same_as_parallel) {
+  constexpr int64_t N = 2000;
+  double* x = new_double_array(N);
+  double* y = new_double_array(N);
+  std::mt19937_64 gen(8);
+  init_random_positions(gen,N,-1,1,x);
+  init_random_positions(gen,N,-1,1,y);
+
+  LargeExponentFloat expected(1.0);
+  vandermonde_abs2_complex_parallel(N, x, y, expected, 3);
+  for (int num_shards : {1, 3, 50}) {
+    std::vector<ShardResult> shards;
+    for (int shard = 0; shard < num_shards; shard++) {
+      std::stringstream text;
+      write_shard(text, vandermonde_abs2_complex_shard(N, x, y, shard, num_shards, 1));
+      shards.emplace_back();
+      ASSERT_TRUE(read_shard(text, shards.back()));
+      ASSERT_TRUE(shards.back().is_complex);
+      ASSERT_EQ(positions_checksum(N, x, y), shards.back().positions_checksum);
+    }
+    LargeExponentFloat actual(1.0);
+    ASSERT_TRUE(merge_shards(shards, actual));
+    ASSERT_EQ(expected.significand, actual.significand);
+    ASSERT_EQ(expected.exponent, actual.exponent);
+  }
+
+  _mm_free(x);
+  _mm_free(y);
+}
+
+TEST(ThreadPool, runs_every_task_once) {
+  for (int threads : {1, 3, 8}) {
+    ThreadPool pool(threads);
+    ASSERT_EQ(threads, pool.size());
+    for (int call = 0; call < 100; call++) {
+      std::vector<int> counts(threads, 0);
+      pool.run([&](int t) { counts[t]++; });
+      ASSERT_EQ(std::vector<int>(threads, 1), counts);
+    }
+  }
+}
+
+TEST(prod_dist2_complexcomplexvec_parallel, independent_of_pool_size) {
+  constexpr int64_t N = 5 * KERNEL_CHUNK_SIZE + 123;
+  ThreadPool pool4(4);
+  double* x = new_double_array_first_touch(pool4, N);
+  double* y = new_double_array_first_touch(pool4, N);
+  std::mt19937_64 gen(17);
+  init_random_positions(gen,N,-1,1,x);
+  init_random_positions(gen,N,-1,1,y);
+
+  for (int64_t k : {0L, 3 * KERNEL_CHUNK_SIZE + 7, N - 1}) {
+    // reference with the single threaded kernel
+    LargeExponentFloat serial1(1.0), serial2(1.0);
+    prod_dist2_complexcomplexvec(N, k, 0.3, x[k], -0.2, y[k], x, y, serial1, serial2);
+
+    LargeExponentFloat expected1(1.0), expected2(1.0);
+    prod_dist2_complexcomplexvec_parallel(pool4, N, k, 0.3, x[k], -0.2, y[k], x, y, expected1, expected2);
+    ASSERT_NEAR(log2(serial1), log2(expected1), 1e-6);
+    ASSERT_NEAR(log2(serial2), log2(expected2), 1e-6);
+
+    for (int threads : {1, 3, 7}) {
+      ThreadPool pool(threads);
+      LargeExponentFloat actual1(1.0), actual2(1.0);
+      prod_dist2_complexcomplexvec_parallel(pool, N, k, 0.3, x[k], -0.2, y[k], x, y, actual1, actual2);
+      ASSERT_EQ(expected1.significand, actual1.significand);
+      ASSERT_EQ(expected1.exponent, actual1.exponent);
+      ASSERT_EQ(expected2.significand, actual2.significand);
+      ASSERT_EQ(expected2.exponent, actual2.exponent);
+    }
+
+    LargeExponentFloat real1(1.0), real2(1.0), real_expected1(1.0), real_expected2(1.0);
+    prod_diff_realrealvec(N, k, 0.3, x[k], x, real_expected1, real_expected2);
+    prod_diff_realrealvec_parallel(pool4, N, k, 0.3, x[k], x, real1, real2);
+    ASSERT_NEAR(log2(real_expected1), log2(real1), 1e-6);
+    ASSERT_NEAR(log2(real_expected2), log2(real2), 1e-6);
+  }
+
+  // small N is computed by the kernel itself
+  LargeExponentFloat serial1(1.0), serial2(1.0), small1(1.0), small2(1.0);
+  prod_dist2_complexcomplexvec(1000, 10, 0.3, 0.1, -0.2, 0.5, x, y, serial1, serial2);
+  prod_dist2_complexcomplexvec_parallel(pool4, 1000, 10, 0.3, 0.1, -0.2, 0.5, x, y, small1, small2);
+  ASSERT_EQ(serial1.significand, small1.significand);
+  ASSERT_EQ(serial1.exponent, small1.exponent);
+
+  _mm_free(x);
+  _mm_free(y);
+}
+
+TEST(BlockBounds, update) {
+  constexpr int64_t N = 2 * BOUNDS_BLOCK_SIZE + 22;
+  double* x = new_double_array(N);
+  double* y = new_double_array(N);
+  std::mt19937_64 gen(7);
+  init_random_positions(gen,N,-1,1,x);
+  init_random_positions(gen,N,-1,1,y);
+
+  BlockBounds bounds(N, x, y);
+  ASSERT_EQ(3, bounds.blocks);
+  ASSERT_EQ(4UL, bounds.count.size());
+  ASSERT_EQ(22, bounds.count[2]);
+  ASSERT_EQ(0, bounds.count[3]);
+
+  x[BOUNDS_BLOCK_SIZE + 6] = 5;
+  y[BOUNDS_BLOCK_SIZE + 6] = -5;
+  bounds.update(BOUNDS_BLOCK_SIZE + 6, x, y);
+  ASSERT_EQ(5, bounds.x_max[1]);
+  ASSERT_EQ(-5, bounds.y_min[1]);
+  ASSERT_LE(bounds.x_max[0], 1);
+  ASSERT_LE(bounds.x_max[2], 1);
+
+  _mm_free(x);
+  _mm_free(y);
+}
+
+TEST(spatial_sort, keeps_particles) {
+  constexpr int64_t N = 500;
+  double* x = new_double_array(N);
+  double* y = new_double_array(N);
+  std::mt19937_64 gen(8);
+  init_random_positions(gen,N,-1,1,x);
+  init_random_positions(gen,N,-1,1,y);
+
+  std::vector<std::pair<double, double>> expected;
+  for (int64_t j = 0; j < N; j++) {
+    expected.emplace_back(x[j], y[j]);
+  }
+  spatial_sort(N, x, y);
+  std::vector<std::pair<double, double>> actual;
+  for (int64_t j = 0; j < N; j++) {
+    actual.emplace_back(x[j], y[j]);
+  }
+  std::sort(expected.begin(), expected.end());
+  std::sort(actual.begin(), actual.end());
+  ASSERT_EQ(expected, actual);
+
+  _mm_free(x);
+  _mm_free(y);
+}
+
+TEST(metropolis_accept_mixed, matches_log_ratio) {
+  constexpr int64_t Nreal = 37;
+  constexpr int64_t Ncomplex = 501;
+  double* lambda = new_double_array(Nreal);
+  double* x = new_double_array(Ncomplex);
+  double* y = new_double_array(Ncomplex);
+  std::mt19937_64 gen(31);
+  init_random_positions(gen,Nreal,-1,1,lambda);
+  init_random_positions(gen,Ncomplex,-1,1,x);
+  init_random_positions(gen,Ncomplex,-1,1,y);
+  std::normal_distribution<double> step(0, 0.05);
+
+  for (int i = 0; i < 100; i++) {
+    const bool real = i % 2 == 0;
+    const int64_t k = gen() % (real ? Nreal : Ncomplex);
+    const double u = (real ? lambda[k] : x[k]) + step(gen);
+    const double v = real ? 0.0 : y[k] + step(gen);
+    const double old_x = real ? lambda[k] : x[k];
+    const double old_y = real ? 0.0 : y[k];
+    double log_ratio = 0;
+    for (int64_t j = 0; j < Nreal; j++) {
+      if (!real || j != k) {
+        const double new_dist2 = (u - lambda[j]) * (u - lambda[j]) + v * v;
+        const double old_dist2 = (old_x - lambda[j]) * (old_x - lambda[j]) + old_y * old_y;
+        log_ratio += 0.5 * (std::log(new_dist2) - std::log(old_dist2));
+      }
+    }
+    for (int64_t j = 0; j < Ncomplex; j++) {
+      if (real || j != k) {
+        const double new_dist2 = (u - x[j]) * (u - x[j]) + (v - y[j]) * (v - y[j]);
+        const double old_dist2 = (old_x - x[j]) * (old_x - x[j]) + (old_y - y[j]) * (old_y - y[j]);
+        log_ratio += 0.5 * (std::log(new_dist2) - std::log(old_dist2));
+      }
+    }
+    const double beta = 2.0;
+    for (double delta : {-1e-6, 1e-6}) {
+      const double log_uniform = beta * log_ratio + delta;
+      const bool accept = real
+              ? metropolis_accept_mixed_realvec(Nreal, Ncomplex, k, u, beta, log_uniform, lambda, x, y)
+              : metropolis_accept_mixed_complexvec(Nreal, Ncomplex, k, u, v, beta, log_uniform, lambda, x, y);
+      ASSERT_EQ(delta < 0, accept);
+    }
+  }
+
+  _mm_free(lambda);
+  _mm_free(x);
+  _mm_free(y);
+}
+
+TEST(simd_math, matches_libm) {
+  std::mt19937_64 gen(51);
+  for (int i = 0; i < 10000; i++) {
+    const double x = std::uniform_real_distribution<double>(-745, 709)(gen);
+    const double e = extract_double(exp_pd(_mm256_set1_pd(x)), i % 4);
+    if (std::exp(x) > DBL_MIN) {
+      ASSERT_NEAR(std::exp(x), e, 4 * DBL_EPSILON * std::exp(x)) << x;
+    }
+
+    const double y = std::exp(std::uniform_real_distribution<double>(-700, 700)(gen));
+    const double l = extract_double(log_pd(_mm256_set1_pd(y)), i % 4);
+    ASSERT_NEAR(std::log(y), l, 4 * DBL_EPSILON * std::max(1.0, std::abs(std::log(y)))) << y;
+
+    const double z = std::uniform_real_distribution<double>(-6, 26)(gen);
+    const double f = extract_double(log_erfc_pd(_mm256_set_pd(z, 1.0, -z, 0.0)), 3);
+    const double expected = std::log(std::erfc(z));
+    ASSERT_NEAR(expected, f, 8 * DBL_EPSILON * std::max(1.0, std::abs(expected))) << z;
+  }
+  ASSERT_EQ(INFINITY, extract_double(exp_pd(_mm256_set1_pd(800)), 0));
+  ASSERT_EQ(0.0, extract_double(exp_pd(_mm256_set1_pd(-800)), 0));
+  ASSERT_EQ(std::exp(-744.0), extract_double(exp_pd(_mm256_set1_pd(-744.0)), 0));
+  ASSERT_EQ(0.0, extract_double(log_pd(_mm256_set1_pd(1.0)), 0));
+  // erfc(30) underflows, its log does not
+  ASSERT_NEAR(-903.974117110, extract_double(log_erfc_pd(_mm256_set1_pd(30)), 0), 1e-8);
+}
+
+TEST(log_acceptance_ratio, one_body_weights) {
+  constexpr int64_t N = 301;
+  double* x = new_double_array(N);
+  double* y = new_double_array(N);
+  std::mt19937_64 gen(52);
+  init_random_positions(gen,N,-1,1,x);
+  init_random_positions(gen,N,0.01,1,y);
+  const GaussianConfinement gaussian{N / 2.0};
+  const RealGinibreComplexWeight ginibre{std::sqrt(N)};
+  auto log_ginibre = [&](double u, double v) {
+    return N * (v * v - u * u) + std::log(std::erfc(std::sqrt(2.0 * N) * v));
+  };
+
+  for (int i = 0; i < 50; i++) {
+    const int64_t k = gen() % N;
+    const double u = x[k] + 0.01 * (i % 7 - 3);
+    const double v = y[k] + 0.003 * (i % 5 - 2);
+    const double beta = 1.0 + i % 3;
+
+    LargeExponentFloat prod_new(1.0), prod_old(1.0);
+    prod_diff_realrealvec(N, k, u, x[k], x, prod_new, prod_old);
+    double expected = beta * M_LN2 * (log2(prod_new) - log2(prod_old)) - N / 2.0 * (u * u - x[k] * x[k]);
+    ASSERT_NEAR(expected, log_acceptance_ratio_realvec(N, k, u, beta, x, gaussian), 1e-9);
+    ASSERT_TRUE(metropolis_accept_realvec(N, k, u, beta, expected - 1e-6, x, gaussian));
+    ASSERT_FALSE(metropolis_accept_realvec(N, k, u, beta, expected + 1e-6, x, gaussian));
+
+    prod_new = LargeExponentFloat(1.0);
+    prod_old = LargeExponentFloat(1.0);
+    prod_dist2_complexcomplexvec(N, k, u, x[k], v, y[k], x, y, prod_new, prod_old);
+    expected = beta * 0.5 * M_LN2 * (log2(prod_new) - log2(prod_old))
+               - N / 2.0 * (u * u + v * v - x[k] * x[k] - y[k] * y[k]);
+    ASSERT_NEAR(expected, log_acceptance_ratio_complexvec(N, k, u, v, beta, x, y, gaussian), 1e-9);
+
+    // conjugate pairs: the ratio of |det|^beta * prod w of all pairs
+    LargeExponentFloat det_old(1.0), det_new(1.0);
+    vandermonde_abs_conjpair(N, x, y, det_old);
+    const double old_x = x[k], old_y = y[k];
+    x[k] = u;
+    y[k] = v;
+    vandermonde_abs_conjpair(N, x, y, det_new);
+    x[k] = old_x;
+    y[k] = old_y;
+    expected = beta * M_LN2 * (log2(det_new) - log2(det_old)) + log_ginibre(u, v) - log_ginibre(old_x, old_y);
+    ASSERT_NEAR(expected, log_acceptance_ratio_conjpair_complexvec(N, k, u, v, beta, x, y, ginibre), 1e-7);
+  }
+
+  // a pair on the real axis coincides with its conjugate
+  ASSERT_EQ(-INFINITY, log_acceptance_ratio_conjpair_complexvec(N, 0, 0.5, 0.0, 2.0, x, y, ginibre));
+
+  _mm_free(x);
+  _mm_free(y);
+}
+
+TEST(metropolis_accept_early_realvec, same_decision_as_full) {
+  constexpr int64_t N = 10001;
+  double* x = new_double_array(N);
+  std::mt19937_64 gen(9);
+  init_random_positions(gen,N,-1,1,x);
+  spatial_sort(N, x);
+  BlockBounds bounds(N, x);
+
+  std::uniform_real_distribution<double> uniform(0, 1);
+  std::normal_distribution<double> step(0, 0.01);
+  long int total_processed = 0;
+  for (int i = 0; i < 4000; i++) {
+    const int64_t k = gen() % N;
+    const double u = x[k] + step(gen);
+    const double beta = i % 2 == 0 ? 1.0 : 2.0;
+    double log_uniform = std::log(uniform(gen));
+    if (i % 4 == 3) {
+      // thresholds close to the exact log ratio
+      LargeExponentFloat prod_new(1.0), prod_old(1.0);
+      prod_diff_realrealvec(N, k, u, x[k], x, prod_new, prod_old);
+      log_uniform = beta * M_LN2 * (log2(prod_new) - log2(prod_old)) + (uniform(gen) - 0.5) * 1e-9;
+    }
+
+    long int processed = 0;
+    const bool expected = metropolis_accept_realvec(N, k, u, beta, log_uniform, x);
+    ASSERT_EQ(expected, metropolis_accept_early_realvec(N, k, u, beta, log_uniform, x, bounds, processed));
+    ASSERT_GT(processed, 0);
+    ASSERT_LE(processed, 2 * N);
+    if (i % 4 != 3) {
+      total_processed += processed;
+    }
+
+    if (expected && i % 4 != 3) {
+      x[k] = u;
+      bounds.update(k, x);
+    }
+  }
+  // most decisions for random thresholds only need a small part of the particles
+  ASSERT_LT(total_processed, 3000 * N / 2);
+
+  _mm_free(x);
+}
+
+TEST(metropolis_accept_early_realvec, clustered_and_distant_particles) {
+  // 16 factors of a lane underflow or overflow for these scales
+  constexpr int64_t N = 2001;
+  double* x = new_double_array(N);
+  for (const double scale : {0x1p-60, 0x1p60}) {
+    std::mt19937_64 gen(11);
+    init_random_positions(gen,N,-scale,scale,x);
+    spatial_sort(N, x);
+    BlockBounds bounds(N, x);
+
+    std::uniform_real_distribution<double> uniform(0, 1);
+    std::normal_distribution<double> step(0, 0.01 * scale);
+    for (int i = 0; i < 200; i++) {
+      const int64_t k = gen() % N;
+      const double u = x[k] + step(gen);
+      LargeExponentFloat prod_new(1.0), prod_old(1.0);
+      prod_diff_realrealvec(N, k, u, x[k], x, prod_new, prod_old);
+      const double log_ratio = M_LN2 * (log2(prod_new) - log2(prod_old));
+      const double log_uniform = log_ratio + (i % 2 == 0 ? -1e-6 : 1e-6);
+
+      long int processed = 0;
+      ASSERT_EQ(i % 2 == 0, metropolis_accept_realvec(N, k, u, 1.0, log_uniform, x));
+      ASSERT_EQ(i % 2 == 0, metropolis_accept_early_realvec(N, k, u, 1.0, log_uniform, x, bounds, processed));
+    }
+  }
+  _mm_free(x);
+}
+
+TEST(metropolis_accept_early, huge_and_tiny_coordinates) {
+  // The logs of the products are about N * 700 here, the thresholds are 1e-11 away from the exact log ratio. The
+  // squared distances of the complex kernels only stay in range for the smaller scales.
+  constexpr int64_t N = 2001;
+  double* x = new_double_array(N);
+  double* y = new_double_array(N);
+  for (const double scale : {0x1p1000, 0x1p-1000, 0x1p480, 0x1p-480}) {
+    const bool complex_in_range = scale <= 0x1p480 && scale >= 0x1p-480;
+    std::mt19937_64 gen(13);
+    init_random_positions(gen,N,-scale,scale,x);
+    init_random_positions(gen,N,-scale,scale,y);
+    spatial_sort(N, x, y);
+    BlockBounds real_bounds(N, x);
+    BlockBounds complex_bounds(N, x, y);
+
+    std::normal_distribution<double> step(0, 0.01 * scale);
+    for (int i = 0; i < 100; i++) {
+      const int64_t k = gen() % N;
+      const double u = x[k] + step(gen);
+      const double v = y[k] + step(gen);
+      long double real_ratio = 0;
+      long double complex_ratio = 0;
+      for (int64_t j = 0; j < N; j++) {
+        if (j != k) {
+          const long double dx_new = u - (long double) x[j], dx_old = x[k] - (long double) x[j];
+          const long double dy_new = v - (long double) y[j], dy_old = y[k] - (long double) y[j];
+          real_ratio += std::log(std::abs(dx_new)) - std::log(std::abs(dx_old));
+          complex_ratio += std::log(std::hypot(dx_new, dy_new)) - std::log(std::hypot(dx_old, dy_old));
+        }
+      }
+      const double offset = i % 2 == 0 ? -1e-11 : 1e-11;
+
+      long int processed = 0;
+      ASSERT_EQ(i % 2 == 0, metropolis_accept_realvec(N, k, u, 1.0, real_ratio + offset, x));
+      ASSERT_EQ(i % 2 == 0, metropolis_accept_early_realvec(N, k, u, 1.0, real_ratio + offset, x, real_bounds,
+                                                             processed));
+      if (complex_in_range) {
+        ASSERT_EQ(i % 2 == 0, metropolis_accept_complexvec(N, k, u, v, 1.0, complex_ratio + offset, x, y));
+        ASSERT_EQ(i % 2 == 0, metropolis_accept_early_complexvec(N, k, u, v, 1.0, complex_ratio + offset, x, y,
+                                                                 complex_bounds, processed));
+      }
+    }
+  }
+  _mm_free(x);
+  _mm_free(y);
+}
+
+TEST(metropolis_accept_early_complexvec, same_decision_as_full) {
+  constexpr int64_t N = 10001;
+  double* x = new_double_array(N);
+  double* y = new_double_array(N);
+  std::mt19937_64 gen(10);
+  init_random_positions(gen,N,-1,1,x);
+  init_random_positions(gen,N,-1,1,y);
+  spatial_sort(N, x, y);
+  BlockBounds bounds(N, x, y);
+
+  std::uniform_real_distribution<double> uniform(0, 1);
+  std::normal_distribution<double> step(0, 0.01);
+  long int total_processed = 0;
+  for (int i = 0; i < 4000; i++) {
+    const int64_t k = gen() % N;
+    const double u = x[k] + step(gen);
+    const double v = y[k] + step(gen);
+    const double beta = i % 2 == 0 ? 1.0 : 2.0;
+    double log_uniform = std::log(uniform(gen));
+    if (i % 4 == 3) {
+      LargeExponentFloat prod_new(1.0), prod_old(1.0);
+      prod_dist2_complexcomplexvec(N, k, u, x[k], v, y[k], x, y, prod_new, prod_old);
+      log_uniform = beta * 0.5 * M_LN2 * (log2(prod_new) - log2(prod_old)) + (uniform(gen) - 0.5) * 1e-9;
+    }
+
+    long int processed = 0;
+    const bool expected = metropolis_accept_complexvec(N, k, u, v, beta, log_uniform, x, y);
+    ASSERT_EQ(expected, metropolis_accept_early_complexvec(N, k, u, v, beta, log_uniform, x, y, bounds, processed));
+    ASSERT_GT(processed, 0);
+    ASSERT_LE(processed, 2 * N);
+    if (i % 4 != 3) {
+      total_processed += processed;
+    }
+
+    if (expected && i % 4 != 3) {
+      x[k] = u;
+      y[k] = v;
+      bounds.update(k, x, y);
+    }
+  }
+  ASSERT_LT(total_processed, 3000 * N * 3 / 4);
+
+  _mm_free(x);
+  _mm_free(y);
+}
+
+TEST(metropolis_accept_cascade_complexvec, same_decision_as_full) {
+  for (int64_t N : {2L, 45L, 2000L}) {
+    double* x = new_double_array(N);
+    double* y = new_double_array(N);
+    std::mt19937_64 gen(11);
+    init_random_positions(gen,N,-1,1,x);
+    init_random_positions(gen,N,-1,1,y);
+    FloatPositions float_positions(N, x, y);
+
+    std::uniform_real_distribution<double> uniform(0, 1);
+    long int exact_evaluations = 0;
+    for (int i = 0; i < 4000; i++) {
+      const int64_t k = gen() % N;
+      const double step_size = i % 3 == 0 ? 1e-5 : 0.05;
+      std::normal_distribution<double> step(0, step_size);
+      const double u = x[k] + step(gen);
+      const double v = y[k] + step(gen);
+      const double beta = i % 2 == 0 ? 1.0 : 2.0;
+      double log_uniform = std::log(uniform(gen));
+      if (i % 4 == 3) {
+        // thresholds close to the exact log ratio
+        LargeExponentFloat prod_new(1.0), prod_old(1.0);
+        prod_dist2_complexcomplexvec(N, k, u, x[k], v, y[k], x, y, prod_new, prod_old);
+        log_uniform = beta * 0.5 * M_LN2 * (log2(prod_new) - log2(prod_old)) + (uniform(gen) - 0.5) * 1e-4;
+      }
+
+      bool exact_evaluation;
+      const bool expected = metropolis_accept_complexvec(N, k, u, v, beta, log_uniform, x, y);
+      ASSERT_EQ(expected, metropolis_accept_cascade_complexvec(N, k, u, v, beta, log_uniform, x, y, float_positions,
+                                                               exact_evaluation));
+      exact_evaluations += exact_evaluation;
+
+      if (expected && i % 4 != 3) {
+        x[k] = u;
+        y[k] = v;
+        float_positions.update(k, x, y);
+      }
+    }
+    // the near threshold cases and most of the tiny steps need the exact evaluation
+    ASSERT_GT(exact_evaluations, 100);
+    ASSERT_LT(exact_evaluations, 2500);
+
+    _mm_free(x);
+    _mm_free(y);
+  }
+}
+
+TEST(metropolis_accept_cascade_complexvec, out_of_range) {
+  constexpr int64_t N = 100;
+  double* x = new_double_array(N);
+  double* y = new_double_array(N);
+  std::mt19937_64 gen(12);
+  init_random_positions(gen,N,-1,1,x);
+  init_random_positions(gen,N,-1,1,y);
+  FloatPositions float_positions(N, x, y);
+
+  bool exact_evaluation;
+  metropolis_accept_cascade_complexvec(N, 3, x[3] + 0.1, y[3], 1.0, -1.0, x, y, float_positions, exact_evaluation);
+  ASSERT_FALSE(exact_evaluation);
+  // squared distances too large for the screening pass
+  metropolis_accept_cascade_complexvec(N, 3, 1e6, y[3], 1.0, -1.0, x, y, float_positions, exact_evaluation);
+  ASSERT_TRUE(exact_evaluation);
+  // new position equal to another particle
+  const bool accept = metropolis_accept_cascade_complexvec(N, 3, x[4], y[4], 1.0, -1.0, x, y, float_positions,
+                                                           exact_evaluation);
+  ASSERT_TRUE(exact_evaluation);
+  ASSERT_FALSE(accept);
+
+  _mm_free(x);
+  _mm_free(y);
+}
+
+static uint64_t rotl(const uint64_t x, const int k) {
+  return (x << k) | (x >> (64 - k));
+}
+
+// Reference implementation of xoshiro256+.
+static uint64_t xoshiro256plus_next(uint64_t s[4]) {
+  const uint64_t result = s[0] + s[3];
+  const uint64_t t = s[1] << 17;
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = rotl(s[3], 45);
+  return result;
+}
+
+TEST(Xoshiro256x4, matches_reference) {
+  Xoshiro256x4 gen(42);
+  uint64_t state[4][4];
+  for (int lane = 0; lane < 4; lane++) {
+    gen.get_state(lane, state[lane]);
+  }
+  // lanes are different streams
+  ASSERT_NE(state[0][0], state[1][0]);
+  ASSERT_NE(state[1][0], state[2][0]);
+  ASSERT_NE(state[2][0], state[3][0]);
+
+  alignas(32) uint64_t out[4];
+  for (int i = 0; i < 1000; i++) {
+    _mm256_store_si256(reinterpret_cast<__m256i*>(out), gen.next());
+    for (int lane = 0; lane < 4; lane++) {
+      ASSERT_EQ(xoshiro256plus_next(state[lane]), out[lane]);
+    }
+  }
+  alignas(32) double u[4];
+  _mm256_store_pd(u, gen.next_double());
+  for (int lane = 0; lane < 4; lane++) {
+    ASSERT_EQ((xoshiro256plus_next(state[lane]) >> 12) * 0x1.0p-52, u[lane]);
+  }
+}
+
+TEST(Xoshiro256x4, chains) {
+  constexpr int64_t n = 256;
+  double* u0 = new_double_array(n);
+  double* u1 = new_double_array(n);
+  double* u2 = new_double_array(n);
+  Xoshiro256x4(7, 0).fill_uniform(u0, n);
+  Xoshiro256x4(7, 1).fill_uniform(u1, n);
+  Xoshiro256x4(7, 1).fill_uniform(u2, n);
+  for (int i = 0; i < n; i++) {
+    ASSERT_GE(u1[i], 0.0);
+    ASSERT_LT(u1[i], 1.0);
+    ASSERT_NE(u0[i], u1[i]);
+    ASSERT_EQ(u1[i], u2[i]);
+  }
+  _mm_free(u0);
+  _mm_free(u1);
+  _mm_free(u2);
+}
+
+TEST(ProposalPipeline, background_same_as_synchronous) {
+  constexpr int64_t N = 1000;
+  constexpr double step = 0.25;
+  // block size is rounded up to a multiple of 4
+  ProposalPipeline background(N, step, 3, 2, 1001, true);
+  ProposalPipeline synchronous(N, step, 3, 2, 1001, false);
+  for (int b = 0; b < 10; b++) {
+    const ProposalBlock& p = background.next();
+    const ProposalBlock& q = synchronous.next();
+    ASSERT_EQ(1004, p.size);
+    ASSERT_EQ(p.size, q.size);
+    for (int i = 0; i < p.size; i++) {
+      ASSERT_EQ(p.k[i], q.k[i]);
+      ASSERT_EQ(p.du[i], q.du[i]);
+      ASSERT_EQ(p.dv[i], q.dv[i]);
+      ASSERT_EQ(p.log_uniform[i], q.log_uniform[i]);
+      ASSERT_GE(p.k[i], 0);
+      ASSERT_LT(p.k[i], N);
+      ASSERT_LE(std::abs(p.du[i]), step);
+      ASSERT_LE(std::abs(p.dv[i]), step);
+      ASSERT_LE(p.log_uniform[i], 0.0);
+    }
+  }
+}
+
+// Reference log ratio of moving particles k to (u,v) as sum of the logs of all changed factors, with squared distances
+// for complex particles.
+static double cluster_log_ratio_reference(const long int N, const std::vector<long int>& k, const double* u,
+                                          const double* v, const double* x, const double* y) {
+  std::vector<double> new_x(x, x + N);
+  std::vector<double> new_y(N, 0.0);
+  if (y != nullptr) {
+    std::copy(y, y + N, new_y.begin());
+  }
+  for (size_t m = 0; m < k.size(); m++) {
+    new_x[k[m]] = u[m];
+    if (y != nullptr) {
+      new_y[k[m]] = v[m];
+    }
+  }
+  double log_ratio = 0;
+  for (long int i = 0; i < N; i++) {
+    for (long int j = i + 1; j < N; j++) {
+      const double old_dy = y != nullptr ? y[i] - y[j] : 0.0;
+      const double old_dist2 = (x[i] - x[j]) * (x[i] - x[j]) + old_dy * old_dy;
+      const double new_dist2 = (new_x[i] - new_x[j]) * (new_x[i] - new_x[j])
+                               + (new_y[i] - new_y[j]) * (new_y[i] - new_y[j]);
+      log_ratio += std::log(new_dist2) - std::log(old_dist2);
+    }
+  }
+  return y != nullptr ? log_ratio : 0.5 * log_ratio;
+}
+
+TEST(prod_cluster, matches_reference) {
+  constexpr int64_t N = 203;
+  double* x = new_double_array(N);
+  double* y = new_double_array(N);
+  std::mt19937_64 gen(13);
+  init_random_positions(gen,N,-1,1,x);
+  init_random_positions(gen,N,-1,1,y);
+
+  // excluded particles in the same block, in different blocks and in the remaining elements
+  const std::vector<std::vector<long int>> clusters = {{5}, {0, 1}, {3, 17, 18, 120}, {15, 16, 200, 202},
+                                                       {2, 4, 6, 8, 10, 12, 14, 33, 40, 50, 60, 70, 80, 90, 100, 110,
+                                                        199}};
+  std::uniform_real_distribution<double> step(-0.05, 0.05);
+  for (const auto& k : clusters) {
+    const long int M = k.size();
+    std::vector<double> u(M), v(M);
+    for (long int m = 0; m < M; m++) {
+      u[m] = x[k[m]] + step(gen);
+      v[m] = y[k[m]] + step(gen);
+    }
+
+    LargeExponentFloat prod_new(1.0);
+    LargeExponentFloat prod_old(1.0);
+    prod_diff_cluster_realvec(N, M, k.data(), u.data(), x, prod_new, prod_old);
+    ASSERT_NEAR(cluster_log_ratio_reference(N, k, u.data(), nullptr, x, nullptr),
+                (log2(prod_new) - log2(prod_old)) * M_LN2, 1e-8);
+
+    prod_new = LargeExponentFloat(1.0);
+    prod_old = LargeExponentFloat(1.0);
+    prod_dist2_cluster_complexvec(N, M, k.data(), u.data(), v.data(), x, y, prod_new, prod_old);
+    ASSERT_NEAR(cluster_log_ratio_reference(N, k, u.data(), v.data(), x, y),
+                (log2(prod_new) - log2(prod_old)) * M_LN2, 1e-8);
+  }
+
+  // a single particle gives the same products as the single particle kernel
+  const long int k = 37;
+  const double u = 0.3;
+  const double v = -0.2;
+  LargeExponentFloat prod_new(1.0), prod_old(1.0), prod1(1.0), prod2(1.0);
+  prod_dist2_cluster_complexvec(N, 1, &k, &u, &v, x, y, prod_new, prod_old);
+  prod_dist2_complexcomplexvec(N, k, u, x[k], v, y[k], x, y, prod1, prod2);
+  ASSERT_NEAR(log2(prod1), log2(prod_new), 1e-12);
+  ASSERT_NEAR(log2(prod2), log2(prod_old), 1e-12);
+
+  _mm_free(x);
+  _mm_free(y);
+}
+
+TEST(prod_pair_factor_vec, complex_plane_same_as_builtin_kernel) {
+  for (const int64_t N : {1001, 1024, 7}) {
+    double* x = new_double_array(N);
+    double* y = new_double_array(N);
+    std::mt19937_64 gen(14);
+    init_random_positions(gen,N,-1,1,x);
+    init_random_positions(gen,N,-1,1,y);
+    const double* particles[2] = {x, y};
+
+    for (const long int k : {0L, 17L, N - 1}) {
+      const double position1[2] = {0.3, -0.4};
+      const double position2[2] = {x[k], y[k]};
+      LargeExponentFloat prod1(1.0), prod2(1.0), expected1(1.0), expected2(1.0);
+      prod_pair_factor_vec<ComplexPlane>(N, k, position1, position2, particles, prod1, prod2);
+      prod_dist2_complexcomplexvec(N, k, position1[0], position2[0], position1[1], position2[1], x, y, expected1,
+                                   expected2);
+      ASSERT_EQ(expected1.significand, prod1.significand);
+      ASSERT_EQ(expected1.exponent, prod1.exponent);
+      ASSERT_EQ(expected2.significand, prod2.significand);
+      ASSERT_EQ(expected2.exponent, prod2.exponent);
+    }
+    _mm_free(x);
+    _mm_free(y);
+  }
+}
+
+TEST(prod_pair_factor_vec, circle_and_sphere) {
+  constexpr int64_t N = 501;
+  constexpr long int k = 123;
+  double* theta = new_double_array(N);
+  double* c0 = new_double_array(N);
+  double* c1 = new_double_array(N);
+  double* c2 = new_double_array(N);
+  std::mt19937_64 gen(15);
+  init_random_positions(gen,N,-M_PI,M_PI,theta);
+
+  // circle: |e^{i*theta}-e^{i*phi}|^2 = 4 sin^2((theta-phi)/2)
+  for (long int j = 0; j < N; j++) {
+    ChordalCircle::coordinates(theta[j], c0[j], c1[j]);
+  }
+  const double phi = 0.5;
+  double expected = 0;
+  for (long int j = 0; j < N; j++) {
+    if (j != k) {
+      expected += std::log2(4 * std::pow(std::sin((phi - theta[j]) / 2), 2));
+    }
+  }
+  const double* circle[2] = {c0, c1};
+  double position[3];
+  ChordalCircle::coordinates(phi, position[0], position[1]);
+  LargeExponentFloat prod1(1.0), prod2(1.0);
+  prod_pair_factor_vec<ChordalCircle>(N, k, position, position, circle, prod1, prod2);
+  ASSERT_NEAR(expected, log2(prod1), 1e-9);
+
+  // sphere: the same as the squared distances of the points on the unit sphere in 3 dimensions
+  double* x = new_double_array(N);
+  double* y = new_double_array(N);
+  double* z = new_double_array(N);
+  init_random_positions(gen,N,-3,3,c0);
+  init_random_positions(gen,N,-3,3,c1);
+  for (long int j = 0; j < N; j++) {
+    StereographicSphere::coordinates(c0[j], c1[j], c0[j], c1[j], c2[j]);
+    // inverse stereographic projection
+    const double r2 = c0[j] * c0[j] + c1[j] * c1[j];
+    x[j] = 2 * c0[j] / (1 + r2);
+    y[j] = 2 * c1[j] / (1 + r2);
+    z[j] = (r2 - 1) / (1 + r2);
+  }
+  const double* sphere[3] = {c0, c1, c2};
+  const double* embedding[3] = {x, y, z};
+  const double embedded_position[3] = {x[k], y[k], z[k]};
+  const double sphere_position[3] = {c0[k], c1[k], c2[k]};
+  LargeExponentFloat expected1(1.0), expected2(1.0);
+  prod1 = LargeExponentFloat(1.0);
+  prod2 = LargeExponentFloat(1.0);
+  prod_pair_factor_vec<StereographicSphere>(N, k, sphere_position, sphere_position, sphere, prod1, prod2);
+  prod_pair_factor_vec<SquaredDistance<3>>(N, k, embedded_position, embedded_position, embedding, expected1,
+                                           expected2);
+  ASSERT_NEAR(log2(expected1), log2(prod1), 1e-9);
+
+  _mm_free(theta);
+  _mm_free(c0);
+  _mm_free(c1);
+  _mm_free(c2);
+  _mm_free(x);
+  _mm_free(y);
+  _mm_free(z);
+}
+
+TEST(prod_diff_grid_realvec, matches_kernel) {
+  std::mt19937_64 gen(45);
+  constexpr int64_t N = 999;
+  constexpr int64_t G = 101;
+  constexpr int64_t k = 17;
+  double* x = new_double_array(N);
+  double* y = new_double_array(N);
+  double* u = new_double_array(G);
+  double* v = new_double_array(G);
+  init_random_positions(gen,N,-1,1,x);
+  init_random_positions(gen,N,-1,1,y);
+  init_random_positions(gen,G,-1.2,1.2,u);
+  init_random_positions(gen,G,-1.2,1.2,v);
+  // a grid point on a particle, and one on the excluded particle
+  u[5] = x[3];
+  v[5] = y[3];
+  u[6] = x[k];
+  v[6] = y[k];
+
+  LargeExponentFloatArray real(G), complex(G);
+  prod_diff_grid_realvec(N, k, G, u, x, real);
+  prod_dist2_grid_complexvec(N, k, G, u, v, x, y, complex);
+  for (int64_t g = 0; g < G; g++) {
+    LargeExponentFloat expected_real(1.0), expected_complex(1.0), unused(1.0);
+    prod_diff_realrealvec(N, k, u[g], u[g], x, expected_real, unused);
+    prod_dist2_complexcomplexvec(N, k, u[g], u[g], v[g], v[g], x, y, expected_complex, unused);
+    if (g == 5) {
+      ASSERT_EQ(0.0, real.get(g).significand);
+      ASSERT_EQ(0.0, complex.get(g).significand);
+      continue;
+    }
+    ASSERT_NEAR(log2(expected_real), log2(real.get(g)), 1e-9);
+    ASSERT_NEAR(log2(expected_complex), log2(complex.get(g)), 1e-9);
+    ASSERT_GT(real.get(g).significand, 0);
+  }
+
+  _mm_free(x);
+  _mm_free(y);
+  _mm_free(u);
+  _mm_free(v);
+}
+
+TEST(ProductTree, matches_direct_grid) {
+  std::mt19937_64 gen(46);
+  constexpr int64_t N = 3001;
+  constexpr int64_t G = 500;
+  double* x = new_double_array(N);
+  double* u = new_double_array(G);
+  init_random_positions(gen,N,-1,1,x);
+  init_random_positions(gen,G,-1.5,1.5,u);
+
+  for (int64_t k : {int64_t(0), int64_t(1234), N}) {
+    LargeExponentFloatArray direct(G), tree(G);
+    prod_diff_grid_realvec(N, k, G, u, x, direct);
+    ProductTree product_tree(N, k, x);
+    product_tree.evaluate(G, u, tree);
+    for (int64_t g = 0; g < G; g++) {
+      ASSERT_NEAR(log2(direct.get(g)), log2(tree.get(g)), 1e-9);
+    }
+  }
+
+  _mm_free(x);
+  _mm_free(u);
+}
+
+TEST(ProductTree, at_particle_positions) {
+  std::mt19937_64 gen(47);
+  constexpr int64_t N = 1001;
+  constexpr int64_t G = 8;
+  double* x = new_double_array(N);
+  double* u = new_double_array(G);
+  init_random_positions(gen,N,-1,1,x);
+  // a cluster of coinciding particles gives nodes of radius 0
+  std::fill(x + 500, x + 700, 0.25);
+
+  const int64_t k = 3;
+  for (int64_t g = 0; g < G; g++) {
+    u[g] = x[g * 100];
+  }
+  u[7] = 0.75;
+  LargeExponentFloatArray tree(G);
+  ProductTree product_tree(N, k, x);
+  product_tree.evaluate(G, u, tree);
+  for (int64_t g = 0; g < 7; g++) {
+    ASSERT_EQ(-INFINITY, log2(tree.get(g)));
+  }
+  LargeExponentFloatArray direct(G);
+  prod_diff_grid_realvec(N, k, G, u, x, direct);
+  ASSERT_NEAR(log2(direct.get(7)), log2(tree.get(7)), 1e-9);
+
+  // a single leaf of radius 0 at distance 0
+  std::fill(x, x + ProductTree::LEAF_SIZE, 0.25);
+  LargeExponentFloatArray leaf(G);
+  ProductTree single_leaf(ProductTree::LEAF_SIZE, ProductTree::LEAF_SIZE, x);
+  single_leaf.evaluate(G, u, leaf);
+  ASSERT_EQ(-INFINITY, log2(leaf.get(5)));
+  ASSERT_NEAR(ProductTree::LEAF_SIZE * std::log2(0.5), log2(leaf.get(7)), 1e-9);
+
+  _mm_free(x);
+  _mm_free(u);
+}
+
+TEST(sample_inverse_cdf, picks_by_weight) {
+  LargeExponentFloatArray weights(4);
+  weights.set(0, LargeExponentFloat(0.0));
+  weights.set(1, LargeExponentFloat(1.0, 1000));
+  weights.set(2, LargeExponentFloat(3.0, 1000));
+  weights.set(3, LargeExponentFloat(1.0, 900));
+  double cdf[4];
+  ASSERT_EQ(1, sample_inverse_cdf(weights, 0.0, cdf));
+  ASSERT_EQ(1, sample_inverse_cdf(weights, 0.24, cdf));
+  ASSERT_EQ(2, sample_inverse_cdf(weights, 0.26, cdf));
+  ASSERT_EQ(2, sample_inverse_cdf(weights, 0.999, cdf));
+  LargeExponentFloatArray zeros(2);
+  zeros.set(0, LargeExponentFloat(0.0));
+  zeros.set(1, LargeExponentFloat(0.0));
+  ASSERT_EQ(-1, sample_inverse_cdf(zeros, 0.5, cdf));
+}
+
+TEST(vandermonde_batch, same_as_single_systems) {
+  std::mt19937_64 gen(46);
+  // not a multiple of BATCH_TILE_SYSTEMS, with a gap between the systems
+  constexpr int64_t S = 2 * BATCH_TILE_SYSTEMS + 5;
+  for (const int64_t N : {1, 2, 7, 33}) {
+    const int64_t stride = N + 3;
+    double* x = new_double_array(S * stride);
+    double* y = new_double_array(S * stride);
+    init_random_positions(gen, S * stride, -1, 1, x);
+    init_random_positions(gen, S * stride, -1, 1, y);
+    if (N > 1) {
+      // coincident particles
+      x[5 * stride + N - 1] = x[5 * stride];
+      y[5 * stride + N - 1] = y[5 * stride];
+    }
+
+    ThreadPool pool(3);
+    LargeExponentFloatArray real(S), complex(S), real_parallel(S);
+    vandermonde_real_batch(N, S, stride, x, real);
+    vandermonde_abs2_complex_batch(N, S, stride, x, y, complex);
+    vandermonde_real_batch(pool, N, S, stride, x, real_parallel);
+    double* xs = new_double_array(N);
+    double* ys = new_double_array(N);
+    for (int64_t s = 0; s < S; s++) {
+      // the single system kernels need aligned positions
+      std::copy(x + s * stride, x + s * stride + N, xs);
+      std::copy(y + s * stride, y + s * stride + N, ys);
+      LargeExponentFloat expected_real(1.0), expected_complex(1.0);
+      vandermonde_real(N, xs, expected_real);
+      vandermonde_abs2_complex(N, xs, ys, expected_complex);
+      if (expected_real.significand == 0) {
+        ASSERT_EQ(0.0, real.get(s).significand);
+        ASSERT_EQ(0.0, complex.get(s).significand);
+        continue;
+      }
+      ASSERT_EQ(expected_real.significand > 0, real.get(s).significand > 0);
+      ASSERT_NEAR(log2(expected_real), log2(real.get(s)), 1e-12 * N * N);
+      ASSERT_NEAR(log2(expected_complex), log2(complex.get(s)), 1e-12 * N * N);
+      ASSERT_EQ(real.get(s).significand, real_parallel.get(s).significand);
+      ASSERT_EQ(real.get(s).exponent, real_parallel.get(s).exponent);
+    }
+    _mm_free(xs);
+    _mm_free(ys);
+    _mm_free(x);
+    _mm_free(y);
+  }
+}
+
+TEST(vandermonde_batch, clustered_spectra) {
+  std::mt19937_64 gen(47);
+  std::uniform_real_distribution<double> jitter(0.5, 1.5);
+  // gaps around 1e-20: 16 differences per normalization underflow without the scaling of the factors
+  constexpr int64_t N = 8;
+  constexpr int64_t S = 4;
+  double* x = new_double_array(S * N);
+  double* y = new_double_array(S * N);
+  for (int64_t s = 0; s < S; s++) {
+    double position = s * 1e-19;
+    for (int64_t j = 0; j < N; j++) {
+      position += jitter(gen) * 1e-20;
+      x[s * N + j] = position;
+      y[s * N + j] = -position;
+    }
+  }
+  // a coinciding pair in the last system
+  x[(S - 1) * N + 5] = x[(S - 1) * N + 2];
+  y[(S - 1) * N + 5] = y[(S - 1) * N + 2];
+
+  LargeExponentFloatArray real(S), complex(S);
+  vandermonde_real_batch(N, S, N, x, real);
+  vandermonde_abs2_complex_batch(N, S, N, x, y, complex);
+  for (int64_t s = 0; s < S - 1; s++) {
+    LargeExponentFloat expected(1.0);
+    vandermonde_real(N, x + s * N, expected);
+    long double expected_log2 = 0;
+    for (int64_t j = 0; j < N; j++) {
+      for (int64_t i = 0; i < j; i++) {
+        expected_log2 += std::log2(static_cast<long double>(x[s * N + j]) - x[s * N + i]);
+      }
+    }
+    ASSERT_NEAR(static_cast<double>(expected_log2), log2(expected), 1e-9);
+    ASSERT_NEAR(log2(expected), log2(real.get(s)), 1e-9);
+    // |z_j - z_i|^2 = 2 (x_j - x_i)^2
+    ASSERT_NEAR(2 * log2(expected) + N * (N - 1) / 2, log2(complex.get(s)), 1e-9);
+  }
+  ASSERT_EQ(0.0, real.get(S - 1).significand);
+  ASSERT_EQ(0.0, complex.get(S - 1).significand);
+  _mm_free(x);
+  _mm_free(y);
+}
+
+TEST(vandermonde_batch, mapped_spectra_file) {
+  std::mt19937_64 gen(47);
+  constexpr int64_t N = 20, S = 50;
+  double* x = new_double_array(S * N);
+  double* y = new_double_array(S * N);
+  init_random_positions(gen, S * N, -1, 1, x);
+  init_random_positions(gen, S * N, -1, 1, y);
+  char path[] = "/tmp/spectra_XXXXXX";
+  close(mkstemp(path));
+  ASSERT_TRUE(write_spectra_file(path, N, S, x, y));
+
+  MappedSpectraFile spectra;
+  ASSERT_TRUE(spectra.open(path));
+  ASSERT_EQ(N, spectra.N());
+  ASSERT_EQ(S, spectra.num_systems());
+  ASSERT_TRUE(spectra.is_complex());
+  ThreadPool pool(2);
+  LargeExponentFloatArray mapped(S), direct(S);
+  vandermonde_batch(pool, spectra, mapped);
+  vandermonde_abs2_complex_batch(N, S, N, x, y, direct);
+  for (int64_t s = 0; s < S; s++) {
+    ASSERT_EQ(direct.get(s).significand, mapped.get(s).significand);
+    ASSERT_EQ(direct.get(s).exponent, mapped.get(s).exponent);
+  }
+
+  // truncated file
+  ASSERT_EQ(0, truncate(path, 100));
+  ASSERT_FALSE(spectra.open(path));
+  unlink(path);
+  _mm_free(x);
+  _mm_free(y);
+}
+
+// log|det| of vandermonde_abs_real_ginibre, for arrays that need not be aligned
+double log_abs_real_ginibre(const long int Nreal, const long int Ncomplex, const double* lambda, const double* x,
+                            const double* y) {
+  double* l = new_double_array(Nreal);
+  double* xs = new_double_array(Ncomplex);
+  double* ys = new_double_array(Ncomplex);
+  std::copy(lambda, lambda + Nreal, l);
+  std::copy(x, x + Ncomplex, xs);
+  std::copy(y, y + Ncomplex, ys);
+  LargeExponentFloat prod(1.0);
+  vandermonde_abs_real_ginibre(Nreal, Ncomplex, l, xs, ys, prod);
+  _mm_free(l);
+  _mm_free(xs);
+  _mm_free(ys);
+  return log2(prod) * M_LN2;
+}
+
+TEST(MixedEnsembleState, species_change_ratios) {
+  std::mt19937_64 gen(47);
+  constexpr int64_t Nreal = 13, Ncomplex = 6;
+  double lambda[Nreal], x[Ncomplex], y[Ncomplex];
+  init_random_positions(gen, Nreal, -1, 1, lambda);
+  init_random_positions(gen, Ncomplex, -1, 1, x);
+  init_random_positions(gen, Ncomplex, 0.1, 1, y);
+  MixedEnsembleState state(Nreal, Ncomplex, lambda, x, y);
+  ASSERT_NEAR(log_abs_real_ginibre(Nreal, Ncomplex, lambda, x, y), state.log_abs_det(), 1e-10);
+
+  std::uniform_real_distribution<double> uniform(0, 1);
+  for (int move = 0; move < 200; move++) {
+    const double before = log_abs_real_ginibre(state.Nreal, state.Ncomplex, state.lambda, state.x, state.y);
+    double ratio;
+    if (state.Ncomplex == 0 || (state.Nreal >= 2 && uniform(gen) < 0.5)) {
+      const long int a = uniform(gen) * state.Nreal;
+      const long int b = (a + 1 + long(uniform(gen) * (state.Nreal - 1))) % state.Nreal;
+      const double u = 0.5 * (state.lambda[a] + state.lambda[b]), v = 0.01 + uniform(gen);
+      ratio = state.log_ratio_merge(a, b, u, v);
+      state.accept_merge(a, b, u, v);
+    } else {
+      const long int p = uniform(gen) * state.Ncomplex;
+      const double u1 = state.x[p] - uniform(gen), u2 = state.x[p] + uniform(gen);
+      ratio = state.log_ratio_split(p, u1, u2);
+      state.accept_split(p, u1, u2);
+    }
+    ASSERT_EQ(Nreal + 2 * Ncomplex, state.Nreal + 2 * state.Ncomplex);
+    const double after = log_abs_real_ginibre(state.Nreal, state.Ncomplex, state.lambda, state.x, state.y);
+    ASSERT_NEAR(after - before, ratio, 1e-9);
+    // the updated caches
+    ASSERT_NEAR(after, state.log_abs_det(), 1e-9);
+  }
+  state.recompute();
+  ASSERT_NEAR(log_abs_real_ginibre(state.Nreal, state.Ncomplex, state.lambda, state.x, state.y),
+              state.log_abs_det(), 1e-10);
+}
+
+TEST(MixedEnsembleState, error_bounds_and_background_recompute) {
+  std::mt19937_64 gen(49);
+  constexpr int64_t Nreal = 40, Ncomplex = 30;
+  double lambda[Nreal], x[Ncomplex], y[Ncomplex];
+  init_random_positions(gen, Nreal, -1, 1, lambda);
+  init_random_positions(gen, Ncomplex, -1, 1, x);
+  init_random_positions(gen, Ncomplex, 0.1, 1, y);
+  MixedEnsembleState state(Nreal, Ncomplex, lambda, x, y);
+  MixedEnsembleState recomputed(Nreal, Ncomplex, lambda, x, y);
+
+  // both caches approximate the same |det|, the one of the positions
+  const auto assert_within_bounds = [](const MixedEnsembleState& s) {
+    MixedEnsembleState fresh(s.Nreal, s.Ncomplex, s.lambda, s.x, s.y);
+    ASSERT_LE(std::abs(s.log_abs_det() - fresh.log_abs_det()), s.error_bound() + fresh.error_bound() + 1e-12);
+  };
+
+  std::uniform_real_distribution<double> uniform(0, 1);
+  for (int move = 0; move < 300; move++) {
+    // a recompute starts after moves 100 and 299, the moves after 100 are replayed when it finishes
+    if (move == 299) {
+      recomputed.finish_recompute();
+    }
+    recomputed.set_recompute_threshold((move == 100 || move == 299) ? 0 : INFINITY);
+    if (state.Ncomplex == 0 || (state.Nreal >= 2 && uniform(gen) < 0.5)) {
+      const long int a = uniform(gen) * state.Nreal;
+      const long int b = (a + 1 + long(uniform(gen) * (state.Nreal - 1))) % state.Nreal;
+      const double u = 0.5 * (state.lambda[a] + state.lambda[b]), v = 0.01 + uniform(gen);
+      state.accept_merge(a, b, u, v);
+      recomputed.accept_merge(a, b, u, v);
+    } else {
+      const long int p = uniform(gen) * state.Ncomplex;
+      const double u1 = state.x[p] - uniform(gen), u2 = state.x[p] + uniform(gen);
+      state.accept_split(p, u1, u2);
+      recomputed.accept_split(p, u1, u2);
+    }
+    if (move == 100) {
+      ASSERT_TRUE(recomputed.recompute_pending());
+    }
+    // the replayed moves give the same positions
+    ASSERT_EQ(state.Nreal, recomputed.Nreal);
+    for (long int i = 0; i < state.Nreal; i++) {
+      ASSERT_EQ(state.lambda[i], recomputed.lambda[i]);
+    }
+    for (long int p = 0; p < state.Ncomplex; p++) {
+      ASSERT_EQ(state.x[p], recomputed.x[p]);
+      ASSERT_EQ(state.y[p], recomputed.y[p]);
+    }
+    if (move % 50 == 0) {
+      assert_within_bounds(state);
+      assert_within_bounds(recomputed);
+    }
+  }
+  ASSERT_LT(state.error_bound(), 1e-9);
+  for (long int i = 0; i < state.Nreal; i++) {
+    ASSERT_LE(state.real_error_bound(i), state.max_error_bound());
+  }
+
+  // nothing to replay after the last move
+  recomputed.finish_recompute();
+  ASSERT_FALSE(recomputed.recompute_pending());
+  MixedEnsembleState fresh(state.Nreal, state.Ncomplex, state.lambda, state.x, state.y);
+  ASSERT_EQ(fresh.log_abs_det(), recomputed.log_abs_det());
+  ASSERT_EQ(fresh.error_bound(), recomputed.error_bound());
+  ASSERT_LT(recomputed.error_bound(), state.error_bound());
+  assert_within_bounds(state);
+}
+
+TEST(ParticleSet, insert_remove_and_ratios) {
+  std::mt19937_64 gen(50);
+  std::uniform_real_distribution<double> uniform(-1, 1);
+  for (const bool complex : {false, true}) {
+    ParticleSet set(complex);
+    std::vector<double> xs, ys;
+    for (int step = 0; step < 400; step++) {
+      // more births than deaths, so that the set grows through several reallocations
+      if (xs.empty() || uniform(gen) < 0.3) {
+        const double u = uniform(gen), v = uniform(gen);
+        LargeExponentFloat factor(1.0);
+        set.insertion_factor(u, v, factor);
+        LargeExponentFloat expected(1.0);
+        for (size_t j = 0; j < xs.size(); j++) {
+          expected = expected * LargeExponentFloat(complex ? (u - xs[j]) * (u - xs[j]) + (v - ys[j]) * (v - ys[j])
+                                                           : u - xs[j]);
+        }
+        ASSERT_NEAR(log2(expected), log2(factor), 1e-10);
+        ASSERT_EQ(expected.significand > 0, factor.significand > 0);
+        ASSERT_EQ(long(xs.size()), set.insert(u, v));
+        xs.push_back(u);
+        ys.push_back(v);
+      } else {
+        const long int i = (uniform(gen) + 1) / 2 * xs.size();
+        LargeExponentFloat factor(1.0);
+        set.deletion_factor(i, factor);
+        LargeExponentFloat expected(1.0);
+        for (size_t j = 0; j < xs.size(); j++) {
+          if (long(j) != i) {
+            expected = expected * LargeExponentFloat(complex ? (xs[i] - xs[j]) * (xs[i] - xs[j])
+                                                               + (ys[i] - ys[j]) * (ys[i] - ys[j])
+                                                             : xs[i] - xs[j]);
+          }
+        }
+        ASSERT_NEAR(log2(expected), log2(factor), 1e-10);
+        ASSERT_EQ(expected.significand > 0, factor.significand > 0);
+        set.remove(i);
+        xs[i] = xs.back();
+        ys[i] = ys.back();
+        xs.pop_back();
+        ys.pop_back();
+      }
+      ASSERT_EQ(long(xs.size()), set.N);
+      ASSERT_EQ(0, set.capacity() % 4);
+      for (long int j = 0; j < set.N; j++) {
+        ASSERT_EQ(xs[j], set.x[j]);
+        if (complex) {
+          ASSERT_EQ(ys[j], set.y[j]);
+        }
+      }
+      // the padding
+      for (long int j = set.N; j < set.capacity(); j++) {
+        ASSERT_EQ(0.0, set.x[j]);
+        if (complex) {
+          ASSERT_EQ(0.0, set.y[j]);
+        }
+      }
+    }
+    ASSERT_EQ(complex, set.is_complex());
+    ASSERT_GT(set.N, 100);
+    // the set can be passed to the kernels directly: the insertion factor is the ratio of the determinants
+    const auto det = [&]() {
+      LargeExponentFloat prod(1.0);
+      if (complex) {
+        vandermonde_abs2_complex(set.N, set.x, set.y, prod);
+      } else {
+        vandermonde_real(set.N, set.x, prod);
+      }
+      return prod;
+    };
+    const LargeExponentFloat before = det();
+    LargeExponentFloat factor(1.0);
+    set.insertion_factor(0.5, 0.25, factor);
+    set.insert(0.5, 0.25);
+    const LargeExponentFloat ratio = det() / before;
+    ASSERT_NEAR(log2(ratio), log2(factor), 1e-9);
+    ASSERT_EQ(ratio.significand > 0, factor.significand > 0);
+  }
+}
+
+TEST(EvaluationServer, ring_with_several_clients) {
+  std::mt19937_64 gen(48);
+  constexpr int64_t N = 301;
+  double* x = new_double_array(N);
+  double* y = new_double_array(N);
+  init_random_positions(gen, N, -1, 1, x);
+  init_random_positions(gen, N, -1, 1, y);
+
+  for (const bool complex : {false, true}) {
+    const std::string name = "/large_product_test_" + std::to_string(getpid());
+    EvaluationServer server;
+    ASSERT_TRUE(server.create(name.c_str(), N, x, complex ? y : nullptr));
+    EvaluationServer duplicate;
+    ASSERT_FALSE(duplicate.create(name.c_str(), N, x, nullptr));
+    std::thread serving([&]() { server.run(); });
+
+    // more batches than slots, so that the ring wraps around
+    constexpr int CLIENTS = 3, BATCHES = 200;
+    std::vector<int> mismatches(CLIENTS, 0);
+    std::vector<std::thread> clients;
+    for (int c = 0; c < CLIENTS; c++) {
+      clients.emplace_back([&, c]() {
+        EvaluationClient client;
+        if (!client.open(name.c_str())) {
+          mismatches[c]++;
+          return;
+        }
+        std::mt19937_64 client_gen(c);
+        std::uniform_real_distribution<double> uniform(-1, 1);
+        for (int batch = 0; batch < BATCHES; batch++) {
+          EvaluationEntry entries[EVALUATION_BATCH_SIZE];
+          const int64_t count = 1 + batch % EVALUATION_BATCH_SIZE;
+          for (int64_t e = 0; e < count; e++) {
+            // pairs of the same k, real sets with both real and complex entries
+            const int64_t k = (batch + e / 2) % (N + 1);
+            entries[e] = {k, uniform(client_gen), (e % 4 < 2) ? 0.0 : uniform(client_gen), 0.0, 0};
+          }
+          client.evaluate(entries, count);
+          for (int64_t e = 0; e < count; e++) {
+            const int64_t k = entries[e].k;
+            const double u = entries[e].u, v = entries[e].v;
+            double expected = 0;
+            for (int64_t j = 0; j < N; j++) {
+              if (j != k) {
+                expected += std::log2((u - x[j]) * (u - x[j]) + (v - (complex ? y[j] : 0)) * (v - (complex ? y[j] : 0)));
+              }
+            }
+            if (std::abs(expected - log2(entries[e].result())) > 1e-9 * N) {
+              mismatches[c]++;
+            }
+          }
+        }
+      });
+    }
+    for (std::thread& client : clients) {
+      client.join();
+    }
+    EvaluationClient client;
+    ASSERT_TRUE(client.open(name.c_str()));
+    ASSERT_EQ(N, client.N());
+    ASSERT_EQ(complex, client.is_complex());
+    client.request_stop();
+    serving.join();
+    for (int c = 0; c < CLIENTS; c++) {
+      ASSERT_EQ(0, mismatches[c]);
+    }
+
+    // slots with a count out of range (bypassing the checks of submit) are passed back unchanged
+    for (const int64_t count : {EVALUATION_BATCH_SIZE + 1, int64_t(-1)}) {
+      uint64_t ticket;
+      EvaluationEntry* entries = client.claim(ticket);
+      ASSERT_NE(nullptr, entries);
+      entries[0] = {1, 0.5, 0.0, -1.0, -1};
+      EvaluationSlot* slot = reinterpret_cast<EvaluationSlot*>(
+              reinterpret_cast<char*>(entries) - offsetof(EvaluationSlot, entries));
+      slot->count = count;
+      slot->sequence.store(ticket + 1, std::memory_order_release);
+      ASSERT_EQ(1, server.poll());
+      ASSERT_TRUE(client.done(ticket));
+      ASSERT_EQ(-1.0, client.wait(ticket)[0].significand);
+      client.release(ticket);
+    }
+  }
+  _mm_free(x);
+  _mm_free(y);
+}
+
 int main(int argc, char **argv) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
@@ -0,0 +1,83 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+ThreadPool::ThreadPool(int num_threads, const bool pin) {
+  const int cpus = std::max(1u, std::thread::hardware_concurrency());
+  if (num_threads <= 0) {
+    num_threads = cpus;
+  }
+  this->num_threads = num_threads;
+  for (int t = 1; t < num_threads; t++) {
+    workers.emplace_back(&ThreadPool::work, this, t);
+#ifdef __linux__
+    if (pin) {
+      cpu_set_t cpu_set;
+      CPU_ZERO(&cpu_set);
+      CPU_SET(t % cpus, &cpu_set);
+      // failures (e.g. restricted affinity in containers) only cost locality
+      pthread_setaffinity_np(workers.back().native_handle(), sizeof(cpu_set), &cpu_set);
+    }
+#else
+    (void) pin;
+#endif
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stop = true;
+  }
+  start.notify_all();
+  for (auto& worker: workers) {
+    worker.join();
+  }
+}
+
+void ThreadPool::run(const std::function<void(int)>& task) {
+  if (num_threads == 1) {
+    task(0);
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    this->task = &task;
+    pending = num_threads - 1;
+    generation++;
+  }
+  start.notify_all();
+  task(0);
+  std::unique_lock<std::mutex> lock(mutex);
+  done.wait(lock, [&]() { return pending == 0; });
+  this->task = nullptr;
+}
+
+void ThreadPool::work(const int t) {
+  uint64_t seen = 0;
+  while (true) {
+    const std::function<void(int)>* current;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      start.wait(lock, [&]() { return stop || generation != seen; });
+      if (stop) {
+        return;
+      }
+      seen = generation;
+      current = task;
+    }
+    (*current)(t);
+    bool last;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      last = --pending == 0;
+    }
+    if (last) {
+      done.notify_one();
+    }
+  }
+}
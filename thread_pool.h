@@ -0,0 +1,47 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * A fixed set of worker threads that is created once and reused for every call, so that splitting a single kernel
+ * call across cores does not pay for starting threads. run() executes one task per thread: task(0) in the calling
+ * thread and task(t) in worker t. With pin (Linux only), worker t is bound to CPU t modulo the number of CPUs, so that
+ * a worker always touches the same memory and the pages it first touched stay on its NUMA node.
+ */
+class ThreadPool {
+  public:
+    // num_threads <= 0 uses all hardware threads.
+    explicit ThreadPool(int num_threads = 0, const bool pin = true);
+    ~ThreadPool();
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int size() const {
+      return num_threads;
+    }
+
+    // Calls task(t) for t = 0..size()-1 in parallel and returns when all calls are done. Must not be called from a
+    // task or concurrently from several threads.
+    void run(const std::function<void(int)>& task);
+
+  private:
+    int num_threads;
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable start;
+    std::condition_variable done;
+    const std::function<void(int)>* task = nullptr;
+    uint64_t generation = 0;
+    int pending = 0;
+    bool stop = false;
+
+    void work(const int t);
+};
+
+#endif
@@ -0,0 +1,244 @@
+#include "vandermonde_batch.h"
+#include "vandermonde_det.h"
+#include "vandermonde_parallel.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "lane_products.h"
+
+namespace {
+
+constexpr long int TILE_VECTORS = BATCH_TILE_SYSTEMS / 4;
+
+// Transposes the positions of the tile of systems starting at s into lane order: xt[j*TILE_VECTORS + t] holds the
+// positions j of the systems s+4t, ..., s+4t+3. Systems beyond num_systems repeat the last one.
+inline void transpose_tile(const long int N, const long int s, const long int num_systems, const long int stride,
+                           const double* x, double* xt) {
+  for (long int t = 0; t < TILE_VECTORS; t++) {
+    for (int lane = 0; lane < 4; lane++) {
+      const double* system = x + std::min(s + 4 * t + lane, num_systems - 1) * stride;
+      for (long int j = 0; j < N; j++) {
+        xt[(j * TILE_VECTORS + t) * 4 + lane] = system[j];
+      }
+    }
+  }
+}
+
+// Multiplies the lanes with the factors pair(i, j) for all i < j < N, two pairs per mul, normalizing the products every
+// MULS_PER_EXPONENT_EXTRACTION pairs (and not after every row, which would dominate for small N).
+template<class Pair>
+inline void for_pairs(const long int N, LaneProducts<TILE_VECTORS>& lanes, const Pair& pair) {
+  long int pending = 0;
+  for (long int j = 1; j < N; j++) {
+    for (long int i = 0; i < j;) {
+      const long int last = std::min(j, i + MULS_PER_EXPONENT_EXTRACTION - pending);
+      pending += last - i;
+      for (; i + 1 < last; i += 2) {
+        lanes.mul(pair(i, j), pair(i + 1, j));
+      }
+      if (i < last) {
+        lanes.mul(pair(i, j));
+        i++;
+      }
+      if (pending == MULS_PER_EXPONENT_EXTRACTION) {
+        lanes.normalize();
+        pending = 0;
+      }
+    }
+  }
+}
+
+// Calls tile(s, scratch) for the tiles of [first_tile, last_tile), with scratch space for the transposed positions.
+template<class Tile>
+inline void for_tiles(const long int N, const long int first_tile, const long int last_tile, const int arrays,
+                      const Tile& tile) {
+  double* scratch = new_double_array(std::max(arrays * N * BATCH_TILE_SYSTEMS, 4L));
+  for (long int i = first_tile; i < last_tile; i++) {
+    tile(i * BATCH_TILE_SYSTEMS, scratch);
+  }
+  _mm_free(scratch);
+}
+
+void real_tiles(const long int N, const long int first_tile, const long int last_tile, const long int num_systems,
+                const long int stride, const double* x, LargeExponentFloatArray& prod) {
+  for_tiles(N, first_tile, last_tile, 1, [&](const long int s, double* xt) {
+    transpose_tile(N, s, num_systems, stride, x, xt);
+    LaneProducts<TILE_VECTORS> lanes;
+    for_pairs(N, lanes, [&](const long int i, const long int j) {
+      LaneProducts<TILE_VECTORS>::Factors diff;
+      for (long int t = 0; t < TILE_VECTORS; t++) {
+        diff.factor[t] = _mm256_sub_pd(_mm256_load_pd(&xt[(j * TILE_VECTORS + t) * 4]),
+                                       _mm256_load_pd(&xt[(i * TILE_VECTORS + t) * 4]));
+      }
+      return diff;
+    });
+    lanes.store(s, num_systems, prod, false);
+  });
+}
+
+void complex_tiles(const long int N, const long int first_tile, const long int last_tile, const long int num_systems,
+                   const long int stride, const double* x, const double* y, LargeExponentFloatArray& prod) {
+  for_tiles(N, first_tile, last_tile, 2, [&](const long int s, double* xt) {
+    double* yt = xt + N * BATCH_TILE_SYSTEMS;
+    transpose_tile(N, s, num_systems, stride, x, xt);
+    transpose_tile(N, s, num_systems, stride, y, yt);
+    LaneProducts<TILE_VECTORS> lanes;
+    for_pairs(N, lanes, [&](const long int i, const long int j) {
+      LaneProducts<TILE_VECTORS>::Factors dist2;
+      for (long int t = 0; t < TILE_VECTORS; t++) {
+        const __m256d dx = _mm256_sub_pd(_mm256_load_pd(&xt[(j * TILE_VECTORS + t) * 4]),
+                                         _mm256_load_pd(&xt[(i * TILE_VECTORS + t) * 4]));
+        const __m256d dy = _mm256_sub_pd(_mm256_load_pd(&yt[(j * TILE_VECTORS + t) * 4]),
+                                         _mm256_load_pd(&yt[(i * TILE_VECTORS + t) * 4]));
+        dist2.factor[t] = _mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy));
+      }
+      return dist2;
+    });
+    lanes.store(s, num_systems, prod, false);
+  });
+}
+
+long int num_tiles(const long int num_systems) {
+  return (num_systems + BATCH_TILE_SYSTEMS - 1) / BATCH_TILE_SYSTEMS;
+}
+
+}
+
+void vandermonde_real_batch(
+        const long int N,
+        const long int num_systems,
+        const long int stride,
+        const double* x,
+        LargeExponentFloatArray& prod
+) {
+  assert(prod.size == num_systems);
+  real_tiles(N, 0, num_tiles(num_systems), num_systems, stride, x, prod);
+}
+
+void vandermonde_abs2_complex_batch(
+        const long int N,
+        const long int num_systems,
+        const long int stride,
+        const double* x,
+        const double* y,
+        LargeExponentFloatArray& prod
+) {
+  assert(prod.size == num_systems);
+  complex_tiles(N, 0, num_tiles(num_systems), num_systems, stride, x, y, prod);
+}
+
+void vandermonde_real_batch(
+        ThreadPool& pool,
+        const long int N,
+        const long int num_systems,
+        const long int stride,
+        const double* x,
+        LargeExponentFloatArray& prod
+) {
+  assert(prod.size == num_systems);
+  pool.run([&](int t) {
+    const auto tiles = shard_chunk_range(num_tiles(num_systems), t, pool.size());
+    real_tiles(N, tiles.first, tiles.second, num_systems, stride, x, prod);
+  });
+}
+
+void vandermonde_abs2_complex_batch(
+        ThreadPool& pool,
+        const long int N,
+        const long int num_systems,
+        const long int stride,
+        const double* x,
+        const double* y,
+        LargeExponentFloatArray& prod
+) {
+  assert(prod.size == num_systems);
+  pool.run([&](int t) {
+    const auto tiles = shard_chunk_range(num_tiles(num_systems), t, pool.size());
+    complex_tiles(N, tiles.first, tiles.second, num_systems, stride, x, y, prod);
+  });
+}
+
+bool write_spectra_file(
+        const char* path,
+        const long int N,
+        const long int num_systems,
+        const double* x,
+        const double* y
+) {
+  FILE* file = fopen(path, "wb");
+  if (file == nullptr) {
+    return false;
+  }
+  SpectraFileHeader header;
+  std::memcpy(header.magic, SPECTRA_MAGIC, sizeof(header.magic));
+  header.N = N;
+  header.num_systems = num_systems;
+  header.is_complex = y != nullptr;
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+  for (long int s = 0; s < num_systems && ok; s++) {
+    ok = fwrite(x + s * N, sizeof(double), N, file) == size_t(N);
+    if (y != nullptr && ok) {
+      ok = fwrite(y + s * N, sizeof(double), N, file) == size_t(N);
+    }
+  }
+  return fclose(file) == 0 && ok;
+}
+
+MappedSpectraFile::~MappedSpectraFile() {
+  close();
+}
+
+void MappedSpectraFile::close() {
+  if (header != nullptr) {
+    munmap(const_cast<SpectraFileHeader*>(header), mapped_size);
+    header = nullptr;
+    mapped_size = 0;
+  }
+}
+
+bool MappedSpectraFile::open(const char* path) {
+  close();
+  const int fd = ::open(path, O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat status;
+  if (fstat(fd, &status) != 0 || size_t(status.st_size) < sizeof(SpectraFileHeader)) {
+    ::close(fd);
+    return false;
+  }
+  void* mapped = mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  // the mapping stays valid after closing the file
+  ::close(fd);
+  if (mapped == MAP_FAILED) {
+    return false;
+  }
+  // the records are read sequentially, one tile of systems after the other
+  madvise(mapped, status.st_size, MADV_SEQUENTIAL);
+  header = static_cast<const SpectraFileHeader*>(mapped);
+  mapped_size = status.st_size;
+
+  const bool valid = std::memcmp(header->magic, SPECTRA_MAGIC, sizeof(SPECTRA_MAGIC)) == 0 && header->N >= 0
+          && header->num_systems >= 0 && (header->is_complex == 0 || header->is_complex == 1)
+          && mapped_size == sizeof(SpectraFileHeader)
+                            + sizeof(double) * size_t(header->num_systems) * size_t(stride());
+  if (!valid) {
+    close();
+  }
+  return valid;
+}
+
+void vandermonde_batch(ThreadPool& pool, const MappedSpectraFile& spectra, LargeExponentFloatArray& prod) {
+  if (spectra.is_complex()) {
+    vandermonde_abs2_complex_batch(pool, spectra.N(), spectra.num_systems(), spectra.stride(), spectra.x(),
+                                   spectra.y(), prod);
+  } else {
+    vandermonde_real_batch(pool, spectra.N(), spectra.num_systems(), spectra.stride(), spectra.x(), prod);
+  }
+}
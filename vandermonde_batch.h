@@ -0,0 +1,129 @@
+#ifndef VANDERMONDE_BATCH_H
+#define VANDERMONDE_BATCH_H
+
+#include <cstdint>
+#include "large_exponent_array.h"
+#include "thread_pool.h"
+
+/**
+ * Vandermonde determinants of many small independent systems of N particles each, e.g. 10^6 sampled spectra with
+ * N = 10..200. Vectorizing within one system wastes most lanes at these sizes, so the batch functions put different
+ * systems in different lanes instead: a tile of BATCH_TILE_SYSTEMS systems is transposed into lane order and all its
+ * systems share one loop over the pairs of particles.
+ *
+ * System s has the positions x[s*stride + j] (and y[s*stride + j]), j < N. prod must have num_systems elements, which
+ * are overwritten with the same values as vandermonde_real / vandermonde_abs2_complex (up to rounding) of each system.
+ * The versions with a pool distribute contiguous ranges of tiles over its threads.
+ */
+
+constexpr const long int BATCH_TILE_SYSTEMS = 16;
+
+void vandermonde_real_batch(
+        const long int N,
+        const long int num_systems,
+        const long int stride,
+        const double* x,
+        LargeExponentFloatArray& prod
+);
+
+void vandermonde_abs2_complex_batch(
+        const long int N,
+        const long int num_systems,
+        const long int stride,
+        const double* x,
+        const double* y,
+        LargeExponentFloatArray& prod
+);
+
+void vandermonde_real_batch(
+        ThreadPool& pool,
+        const long int N,
+        const long int num_systems,
+        const long int stride,
+        const double* x,
+        LargeExponentFloatArray& prod
+);
+
+void vandermonde_abs2_complex_batch(
+        ThreadPool& pool,
+        const long int N,
+        const long int num_systems,
+        const long int stride,
+        const double* x,
+        const double* y,
+        LargeExponentFloatArray& prod
+);
+
+/*
+ * Binary files of spectra, which are read with mmap, so that a batch streams its input from the page cache without
+ * copying it:
+ *   SpectraFileHeader (32 bytes)
+ *   one record per system: N doubles x, followed by N doubles y for complex spectra
+ * in native byte order. Records are read with stride N (real) or 2N (complex).
+ */
+
+struct SpectraFileHeader {
+  char magic[8];
+  int64_t N;
+  int64_t num_systems;
+  int64_t is_complex;
+};
+
+constexpr const char SPECTRA_MAGIC[8] = {'L', 'P', 'S', 'P', 'E', 'C', '1', '\0'};
+
+// Writes num_systems spectra of N particles, which are stored contiguously in x (and y, nullptr for real spectra).
+// Returns false if the file cannot be written.
+bool write_spectra_file(
+        const char* path,
+        const long int N,
+        const long int num_systems,
+        const double* x,
+        const double* y
+);
+
+class MappedSpectraFile {
+  public:
+    MappedSpectraFile() = default;
+    ~MappedSpectraFile();
+    MappedSpectraFile(const MappedSpectraFile&) = delete;
+    MappedSpectraFile& operator=(const MappedSpectraFile&) = delete;
+
+    // Returns false if the file cannot be mapped or is not a valid spectra file.
+    bool open(const char* path);
+
+    long int N() const {
+      return header->N;
+    }
+
+    long int num_systems() const {
+      return header->num_systems;
+    }
+
+    bool is_complex() const {
+      return header->is_complex != 0;
+    }
+
+    long int stride() const {
+      return is_complex() ? 2 * N() : N();
+    }
+
+    const double* x() const {
+      return reinterpret_cast<const double*>(header + 1);
+    }
+
+    // Only for complex spectra.
+    const double* y() const {
+      return x() + N();
+    }
+
+  private:
+    const SpectraFileHeader* header = nullptr;
+    size_t mapped_size = 0;
+
+    void close();
+};
+
+// vandermonde_real_batch or vandermonde_abs2_complex_batch of all systems of the file.
+void vandermonde_batch(ThreadPool& pool, const MappedSpectraFile& spectra, LargeExponentFloatArray& prod);
+
+#endif
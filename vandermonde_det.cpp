@@ -1,6 +1,8 @@
 #include "vandermonde_det.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cmath>
 
 inline double sqr(const double x) {
   return x*x;
@@ -10,21 +12,20 @@ __m256d sqr(__m256d v) {
   return _mm256_mul_pd(v,v);
 }
 
-constexpr const int64_t MULS_PER_EXPONENT_EXTRACTION = 16;
-
 void prod_diff_realrealvec(
         const long int N,
         const long int k,
         const double u1,
         const double u2,
         const double* x,
-        LargeExponentFloat& prod1,
-        LargeExponentFloat& prod2
+        LargeProduct& prod1,
+        LargeProduct& prod2
 ) {
   const int64_t ELEMENTS_PER_LOOP = 4 * 4;
   assert(k >= 0);
   assert(reinterpret_cast<uintptr_t>(x) % 32 == 0);
 
+  // local copies, so that the accumulators stay in registers
   LargeProduct vprod1(prod1);
   LargeProduct vprod2(prod2);
 
@@ -96,10 +97,43 @@ void prod_diff_realrealvec(
     vj = _mm256_add_pd(vj, four);
   }
 
+  prod1 = vprod1;
+  prod2 = vprod2;
+}
+
+void prod_diff_realrealvec(
+        const long int N,
+        const long int k,
+        const double u1,
+        const double u2,
+        const double* x,
+        LargeExponentFloat& prod1,
+        LargeExponentFloat& prod2
+) {
+  LargeProduct vprod1(prod1);
+  LargeProduct vprod2(prod2);
+  prod_diff_realrealvec(N, k, u1, u2, x, vprod1, vprod2);
   prod1 = vprod1.get();
   prod2 = vprod2.get();
 }
 
+void prod_diff_realvec(
+        const long int N,
+        const long int k,
+        const double u,
+        const double* x,
+        LargeExponentFloat& prod
+) {
+  assert(reinterpret_cast<uintptr_t>(x) % 32 == 0);
+
+  LargeProduct vprod(prod);
+  const __m256d u_vec = _mm256_set1_pd(u);
+  mul_factors(N, k, vprod, [&](const int64_t j) {
+    return _mm256_sub_pd(u_vec, _mm256_load_pd(&x[j]));
+  });
+  prod = vprod.get();
+}
+
 __m256d sqr_diff1(__m256d x, __m256d y_sqr, __m256d u) {
   return _mm256_add_pd(
           sqr(_mm256_sub_pd(u, x)),
@@ -113,13 +147,14 @@ void prod_dist2_realcomplexvec(
         const double u2,
         const double* x,
         const double* y,
-        LargeExponentFloat& prod1,
-        LargeExponentFloat& prod2
+        LargeProduct& prod1,
+        LargeProduct& prod2
 ) {
 
   const int64_t ELEMENTS_PER_LOOP = 4 * 4;
   assert(reinterpret_cast<uintptr_t>(x) % 32 == 0);
 
+  // local copies, so that the accumulators stay in registers
   LargeProduct vprod1(prod1);
   LargeProduct vprod2(prod2);
 
@@ -181,6 +216,22 @@ void prod_dist2_realcomplexvec(
     vj = _mm256_add_pd(vj, four);
   }
 
+  prod1 = vprod1;
+  prod2 = vprod2;
+}
+
+void prod_dist2_realcomplexvec(
+        const long int N,
+        const double u1,
+        const double u2,
+        const double* x,
+        const double* y,
+        LargeExponentFloat& prod1,
+        LargeExponentFloat& prod2
+) {
+  LargeProduct vprod1(prod1);
+  LargeProduct vprod2(prod2);
+  prod_dist2_realcomplexvec(N, u1, u2, x, y, vprod1, vprod2);
   prod1 = vprod1.get();
   prod2 = vprod2.get();
 }
@@ -192,8 +243,8 @@ void prod_dist2_complexrealvec(
         const double v1,
         const double v2,
         const double* x,
-        LargeExponentFloat& prod1,
-        LargeExponentFloat& prod2
+        LargeProduct& prod1,
+        LargeProduct& prod2
 ) {
 
 //  const double v1_sqr=sqr(v1);
@@ -208,6 +259,7 @@ void prod_dist2_complexrealvec(
   const int64_t ELEMENTS_PER_LOOP = 4 * 4;
   assert(reinterpret_cast<uintptr_t>(x) % 32 == 0);
 
+  // local copies, so that the accumulators stay in registers
   LargeProduct vprod1(prod1);
   LargeProduct vprod2(prod2);
 
@@ -264,6 +316,23 @@ void prod_dist2_complexrealvec(
     vj = _mm256_add_pd(vj, four);
   }
 
+  prod1 = vprod1;
+  prod2 = vprod2;
+}
+
+void prod_dist2_complexrealvec(
+        const long int N,
+        const double u1,
+        const double u2,
+        const double v1,
+        const double v2,
+        const double* x,
+        LargeExponentFloat& prod1,
+        LargeExponentFloat& prod2
+) {
+  LargeProduct vprod1(prod1);
+  LargeProduct vprod2(prod2);
+  prod_dist2_complexrealvec(N, u1, u2, v1, v2, x, vprod1, vprod2);
   prod1 = vprod1.get();
   prod2 = vprod2.get();
 }
@@ -275,6 +344,41 @@ __m256d sqr_diff2(__m256d x, __m256d y, __m256d u, __m256d v) {
   );
 }
 
+void prod_dist2_complexcomplexvec(
+        const long int N,
+        const long int k,
+        const double u1,
+        const double u2,
+        const double v1,
+        const double v2,
+        const double* x,
+        const double* y,
+        LargeProduct& prod1,
+        LargeProduct& prod2
+) {
+
+  assert(reinterpret_cast<uintptr_t>(x) % 32 == 0);
+
+  // local copies, so that the accumulators stay in registers
+  LargeProduct vprod1(prod1);
+  LargeProduct vprod2(prod2);
+
+  const __m256d u1_vec = _mm256_set1_pd(u1);
+  const __m256d u2_vec = _mm256_set1_pd(u2);
+  const __m256d v1_vec = _mm256_set1_pd(v1);
+  const __m256d v2_vec = _mm256_set1_pd(v2);
+
+  mul_pair_factors(N, k, vprod1, vprod2, [&](const int64_t j, __m256d& factor1, __m256d& factor2) {
+    const __m256d x0 = _mm256_load_pd(&x[j]);
+    const __m256d y0 = _mm256_load_pd(&y[j]);
+    factor1 = sqr_diff2(x0, y0, u1_vec, v1_vec);
+    factor2 = sqr_diff2(x0, y0, u2_vec, v2_vec);
+  });
+
+  prod1 = vprod1;
+  prod2 = vprod2;
+}
+
 void prod_dist2_complexcomplexvec(
         const long int N,
         const long int k,
@@ -287,11 +391,58 @@ void prod_dist2_complexcomplexvec(
         LargeExponentFloat& prod1,
         LargeExponentFloat& prod2
 ) {
+  LargeProduct vprod1(prod1);
+  LargeProduct vprod2(prod2);
+  prod_dist2_complexcomplexvec(N, k, u1, u2, v1, v2, x, y, vprod1, vprod2);
+  prod1 = vprod1.get();
+  prod2 = vprod2.get();
+}
 
-  const int64_t ELEMENTS_PER_LOOP = 4 * 4;
-  assert(k >=0);
+void prod_dist2_complexvec(
+        const long int N,
+        const long int k,
+        const double u,
+        const double v,
+        const double* x,
+        const double* y,
+        LargeExponentFloat& prod
+) {
   assert(reinterpret_cast<uintptr_t>(x) % 32 == 0);
 
+  LargeProduct vprod(prod);
+  const __m256d u_vec = _mm256_set1_pd(u);
+  const __m256d v_vec = _mm256_set1_pd(v);
+  mul_factors(N, k, vprod, [&](const int64_t j) {
+    return sqr_diff2(_mm256_load_pd(&x[j]), _mm256_load_pd(&y[j]), u_vec, v_vec);
+  });
+  prod = vprod.get();
+}
+
+// |w-z|^2 * |w-conj(z)|^2, each factor is accurate for close points
+__m256d sqr_diff2_conjpair(__m256d x, __m256d y, __m256d u, __m256d v) {
+  const __m256d dx2 = sqr(_mm256_sub_pd(u, x));
+  return _mm256_mul_pd(
+          _mm256_add_pd(dx2, sqr(_mm256_sub_pd(v, y))),
+          _mm256_add_pd(dx2, sqr(_mm256_add_pd(v, y)))
+  );
+}
+
+void prod_dist2_conjpair_complexvec(
+        const long int N,
+        const long int k,
+        const double u1,
+        const double u2,
+        const double v1,
+        const double v2,
+        const double* x,
+        const double* y,
+        LargeProduct& prod1,
+        LargeProduct& prod2
+) {
+
+  assert(reinterpret_cast<uintptr_t>(x) % 32 == 0);
+
+  // local copies, so that the accumulators stay in registers
   LargeProduct vprod1(prod1);
   LargeProduct vprod2(prod2);
 
@@ -300,79 +451,613 @@ void prod_dist2_complexcomplexvec(
   const __m256d v1_vec = _mm256_set1_pd(v1);
   const __m256d v2_vec = _mm256_set1_pd(v2);
 
+  // The factors are products of two squared distances. The pair products of the factors are kept in the range of
+  // mul_no_overflow1234 like any other, so the exponents are extracted as often as for single squared distances.
+  mul_pair_factors(N, k, vprod1, vprod2, [&](const int64_t j, __m256d& factor1, __m256d& factor2) {
+    const __m256d x0 = _mm256_load_pd(&x[j]);
+    const __m256d y0 = _mm256_load_pd(&y[j]);
+    factor1 = sqr_diff2_conjpair(x0, y0, u1_vec, v1_vec);
+    factor2 = sqr_diff2_conjpair(x0, y0, u2_vec, v2_vec);
+  });
+
+  prod1 = vprod1;
+  prod2 = vprod2;
+}
+
+void prod_dist2_conjpair_complexvec(
+        const long int N,
+        const long int k,
+        const double u1,
+        const double u2,
+        const double v1,
+        const double v2,
+        const double* x,
+        const double* y,
+        LargeExponentFloat& prod1,
+        LargeExponentFloat& prod2
+) {
+  LargeProduct vprod1(prod1);
+  LargeProduct vprod2(prod2);
+  prod_dist2_conjpair_complexvec(N, k, u1, u2, v1, v2, x, y, vprod1, vprod2);
+  prod1 = vprod1.get();
+  prod2 = vprod2.get();
+}
+
+// Computes the complex products of (u1+i*v1)-(x[j]+i*y[j]) and (u2+i*v2)-(x[j]+i*y[j]) for all j!=k.
+// The products are passed in and returned as magnitude and phase.
+void prod_diff_complexcomplexvec(
+        const long int N,
+        const long int k,
+        const double u1,
+        const double u2,
+        const double v1,
+        const double v2,
+        const double* x,
+        const double* y,
+        LargeExponentFloat& prod1,
+        double& phase1,
+        LargeExponentFloat& prod2,
+        double& phase2
+) {
+
+  assert(reinterpret_cast<uintptr_t>(x) % 32 == 0);
+
+  LargeComplexProduct vprod1(prod1, phase1);
+  LargeComplexProduct vprod2(prod2, phase2);
+
+  const __m256d u1_vec = _mm256_set1_pd(u1);
+  const __m256d u2_vec = _mm256_set1_pd(u2);
+  const __m256d v1_vec = _mm256_set1_pd(v1);
+  const __m256d v2_vec = _mm256_set1_pd(v2);
+
+  typedef LargeComplexProduct::Factor Factor;
+  mul_pair_factors(N, k, vprod1, vprod2, [&](const int64_t j, Factor& factor1, Factor& factor2) {
+    const __m256d x0 = _mm256_load_pd(&x[j]);
+    const __m256d y0 = _mm256_load_pd(&y[j]);
+    factor1 = {_mm256_sub_pd(u1_vec, x0), _mm256_sub_pd(v1_vec, y0)};
+    factor2 = {_mm256_sub_pd(u2_vec, x0), _mm256_sub_pd(v2_vec, y0)};
+  });
+
+  prod1 = vprod1.get(phase1);
+  prod2 = vprod2.get(phase2);
+}
+
+struct Reciprocals {
+  __m256d inv0, inv1, inv2, inv3;
+};
+
+// Computes 1/d0, 1/d1, 1/d2 and 1/d3 with a single division. Returns the lanes where d0*d1 or d2*d3 is outside
+// [2^-510, 2^510] or NaN, e.g. for clustered or distant particles or a zero distance; then the product of all four or
+// one of the reciprocals may leave the normal range, and the reciprocals of the lane are wrong. The kernels collect the
+// lanes and recompute a block of loops with divisions if there was one, so that the hot loops have no branch.
+inline __m256d reciprocal4(
+        const __m256d d0, const __m256d d1, const __m256d d2, const __m256d d3,
+        __m256d& inv0, __m256d& inv1, __m256d& inv2, __m256d& inv3
+) {
+  const __m256d d01 = _mm256_mul_pd(d0, d1);
+  const __m256d d23 = _mm256_mul_pd(d2, d3);
+  const __m256d inv = _mm256_div_pd(M256D_ONE, _mm256_mul_pd(d01, d23));
+  const __m256d inv01 = _mm256_mul_pd(inv, d23);
+  const __m256d inv23 = _mm256_mul_pd(inv, d01);
+  inv0 = _mm256_mul_pd(inv01, d1);
+  inv1 = _mm256_mul_pd(inv01, d0);
+  inv2 = _mm256_mul_pd(inv23, d3);
+  inv3 = _mm256_mul_pd(inv23, d2);
+
+  const __m256d min_abs = _mm256_min_pd(abs(d01), abs(d23));
+  const __m256d max_abs = _mm256_max_pd(abs(d01), abs(d23));
+  // the comparisons are also true for NaN
+  return _mm256_or_pd(_mm256_cmp_pd(min_abs, _mm256_set1_pd(0x1p-510), _CMP_NGE_UQ),
+                      _mm256_cmp_pd(max_abs, _mm256_set1_pd(0x1p510), _CMP_NLE_UQ));
+}
+
+// The force sums 1/(u-x[j]) of the loops of 16 particles from begin to end except the skipped one, with divisions.
+__attribute__((noinline, cold)) static Reciprocals force_divisions_real(
+        const double u, const double* x, const int64_t begin, const int64_t end, const int64_t skipj
+) {
+  const __m256d u_vec = _mm256_set1_pd(u);
+  __m256d sum[4] = {_mm256_setzero_pd(), _mm256_setzero_pd(), _mm256_setzero_pd(), _mm256_setzero_pd()};
+  for (int64_t j = begin; j < end; j += 16) {
+    if (j != skipj) {
+      for (int l = 0; l < 4; l++) {
+        const __m256d d = _mm256_sub_pd(u_vec, _mm256_load_pd(&x[j + 4 * l]));
+        sum[l] = _mm256_add_pd(sum[l], _mm256_div_pd(M256D_ONE, d));
+      }
+    }
+  }
+  return {sum[0], sum[1], sum[2], sum[3]};
+}
+
+struct ComplexForces {
+  __m256d force_x0, force_x1, force_y0, force_y1;
+};
+
+// The force sums (z-z[j])/|z-z[j]|^2 of the loops of 16 particles from begin to end except the skipped one, with
+// divisions.
+__attribute__((noinline, cold)) static ComplexForces force_divisions_complex(
+        const double u, const double v, const double* x, const double* y,
+        const int64_t begin, const int64_t end, const int64_t skipj
+) {
+  const __m256d u_vec = _mm256_set1_pd(u);
+  const __m256d v_vec = _mm256_set1_pd(v);
+  __m256d sum_x[2] = {_mm256_setzero_pd(), _mm256_setzero_pd()};
+  __m256d sum_y[2] = {_mm256_setzero_pd(), _mm256_setzero_pd()};
+  for (int64_t j = begin; j < end; j += 16) {
+    if (j != skipj) {
+      for (int l = 0; l < 4; l++) {
+        const __m256d dx = _mm256_sub_pd(u_vec, _mm256_load_pd(&x[j + 4 * l]));
+        const __m256d dy = _mm256_sub_pd(v_vec, _mm256_load_pd(&y[j + 4 * l]));
+        const __m256d inv = _mm256_div_pd(M256D_ONE, _mm256_add_pd(sqr(dx), sqr(dy)));
+        sum_x[l / 2] = _mm256_add_pd(sum_x[l / 2], _mm256_mul_pd(dx, inv));
+        sum_y[l / 2] = _mm256_add_pd(sum_y[l / 2], _mm256_mul_pd(dy, inv));
+      }
+    }
+  }
+  return {sum_x[0], sum_x[1], sum_y[0], sum_y[1]};
+}
+
+// The kernels of all pairs store the reciprocals of each row, so the lanes that reciprocal4 got wrong are cleared
+// and their reciprocals added with divisions after the row. Returns the sum of the contributions to force[i] and
+// subtracts them from force[j].
+__attribute__((noinline, cold)) static __m256d forces_out_of_range_real(
+        const double xi, const double* x, const int64_t lastj, double* force
+) {
+  const __m256d xi_vec = _mm256_set1_pd(xi);
+  __m256d sum = _mm256_setzero_pd();
+  for (int64_t j = 0; j < lastj; j += 16) {
+    __m256d d[4], inv[4];
+    for (int l = 0; l < 4; l++) {
+      d[l] = _mm256_sub_pd(xi_vec, _mm256_load_pd(&x[j + 4 * l]));
+    }
+    const __m256d lanes = reciprocal4(d[0], d[1], d[2], d[3], inv[0], inv[1], inv[2], inv[3]);
+    for (int l = 0; l < 4; l++) {
+      const __m256d f = _mm256_and_pd(lanes, _mm256_div_pd(M256D_ONE, d[l]));
+      sum = _mm256_add_pd(sum, f);
+      _mm256_store_pd(&force[j + 4 * l], _mm256_sub_pd(_mm256_load_pd(&force[j + 4 * l]), f));
+    }
+  }
+  return sum;
+}
+
+__attribute__((noinline, cold)) static ComplexForces forces_out_of_range_complex(
+        const double xi, const double yi, const double* x, const double* y, const int64_t lastj,
+        double* force_x, double* force_y
+) {
+  const __m256d xi_vec = _mm256_set1_pd(xi);
+  const __m256d yi_vec = _mm256_set1_pd(yi);
+  __m256d sum_x = _mm256_setzero_pd();
+  __m256d sum_y = _mm256_setzero_pd();
+  for (int64_t j = 0; j < lastj; j += 16) {
+    __m256d dx[4], dy[4], d[4], inv[4];
+    for (int l = 0; l < 4; l++) {
+      dx[l] = _mm256_sub_pd(xi_vec, _mm256_load_pd(&x[j + 4 * l]));
+      dy[l] = _mm256_sub_pd(yi_vec, _mm256_load_pd(&y[j + 4 * l]));
+      d[l] = _mm256_add_pd(sqr(dx[l]), sqr(dy[l]));
+    }
+    const __m256d lanes = reciprocal4(d[0], d[1], d[2], d[3], inv[0], inv[1], inv[2], inv[3]);
+    for (int l = 0; l < 4; l++) {
+      const __m256d exact = _mm256_and_pd(lanes, _mm256_div_pd(M256D_ONE, d[l]));
+      const __m256d fx = _mm256_mul_pd(dx[l], exact);
+      const __m256d fy = _mm256_mul_pd(dy[l], exact);
+      sum_x = _mm256_add_pd(sum_x, fx);
+      sum_y = _mm256_add_pd(sum_y, fy);
+      _mm256_store_pd(&force_x[j + 4 * l], _mm256_sub_pd(_mm256_load_pd(&force_x[j + 4 * l]), fx));
+      _mm256_store_pd(&force_y[j + 4 * l], _mm256_sub_pd(_mm256_load_pd(&force_y[j + 4 * l]), fy));
+    }
+  }
+  const __m256d zero = _mm256_setzero_pd();
+  return {sum_x, zero, sum_y, zero};
+}
+
+/**
+ * The loop of the force kernels: mul_pair_factors with one product and the force sums as extra accumulators.
+ * force.factor(l, j) computes the factors d of the particles j, ..., j+3 as the vector l (0..3) of a loop and
+ * force.add(l, inv) adds their force terms with inv = 1/d to the current block. The reciprocals of 16 particles are
+ * computed with reciprocal4, and the force sums of a block of loops between two exponent extractions are recomputed
+ * with force.add_divisions(begin, end, skipj) if it got a lane wrong; force.finish_block() adds them to the total. The
+ * skipped block of k and the tail use l = 0 and add with force.add_masked(mask), which computes 1/d itself.
+ * It is always inlined so that the accumulators of the policy stay in registers.
+ */
+template<class Force>
+__attribute__((always_inline)) inline void mul_force_factors(
+        const int64_t N,
+        const int64_t k,
+        LargeProduct& vprod,
+        Force& force
+) {
+  const int64_t ELEMENTS_PER_LOOP = 4 * 4;
+  assert(k >= 0);
+
   const int64_t skipj = k & (-ELEMENTS_PER_LOOP);
   const int64_t lastj = N & (-ELEMENTS_PER_LOOP);
 
+  __m256d out_of_range = _mm256_setzero_pd();
+  int64_t block_begin = 0;
+  const auto finish_block = [&](const int64_t block_end) {
+    if (_mm256_movemask_pd(out_of_range) != 0) [[unlikely]] {
+      force.add_divisions(block_begin, block_end, skipj);
+      out_of_range = _mm256_setzero_pd();
+    }
+    force.finish_block();
+    block_begin = block_end;
+  };
+
   for (int64_t j=0; j<lastj; j += ELEMENTS_PER_LOOP) [[likely]] {
     if (j != skipj) [[likely]] {
-      const __m256d x0 = _mm256_load_pd(&x[j +  0]);
-      const __m256d x1 = _mm256_load_pd(&x[j +  4]);
-      const __m256d x2 = _mm256_load_pd(&x[j +  8]);
-      const __m256d x3 = _mm256_load_pd(&x[j + 12]);
-
-      const __m256d y0 = _mm256_load_pd(&y[j +  0]);
-      const __m256d y1 = _mm256_load_pd(&y[j +  4]);
-      const __m256d y2 = _mm256_load_pd(&y[j +  8]);
-      const __m256d y3 = _mm256_load_pd(&y[j + 12]);
-
-      vprod1.mul_no_overflow1234(
-              sqr_diff2(x0, y0, u1_vec, v1_vec),
-              sqr_diff2(x1, y1, u1_vec, v1_vec),
-              sqr_diff2(x2, y2, u1_vec, v1_vec),
-              sqr_diff2(x3, y3, u1_vec, v1_vec)
-      );
-      vprod2.mul_no_overflow1234(
-              sqr_diff2(x0, y0, u2_vec, v2_vec),
-              sqr_diff2(x1, y1, u2_vec, v2_vec),
-              sqr_diff2(x2, y2, u2_vec, v2_vec),
-              sqr_diff2(x3, y3, u2_vec, v2_vec)
-      );
+      const __m256d d0 = force.factor(0, j +  0);
+      const __m256d d1 = force.factor(1, j +  4);
+      const __m256d d2 = force.factor(2, j +  8);
+      const __m256d d3 = force.factor(3, j + 12);
+
+      vprod.mul_no_overflow1234(d0, d1, d2, d3);
+
+      __m256d inv0, inv1, inv2, inv3;
+      out_of_range = _mm256_or_pd(out_of_range, reciprocal4(d0, d1, d2, d3, inv0, inv1, inv2, inv3));
+      force.add(0, inv0);
+      force.add(1, inv1);
+      force.add(2, inv2);
+      force.add(3, inv3);
     }
 
-    if ((j / ELEMENTS_PER_LOOP) % MULS_PER_EXPONENT_EXTRACTION == 0) {
-      vprod1.normalize_exponent1234();
-      vprod2.normalize_exponent1234();
+    if ((j / ELEMENTS_PER_LOOP) % MULS_PER_EXPONENT_EXTRACTION == 0)  {
+      vprod.normalize_exponent1234();
+      finish_block(j + ELEMENTS_PER_LOOP);
     }
   }
+  finish_block(lastj);
 
-  const __m256d vk = _mm256_set1_pd(k);
   const __m256d four = _mm256_set1_pd(4);
+  const __m256d vk = _mm256_set1_pd(k);
 
   // Process the skipped block
-  if (skipj < lastj) [[likely]] {
-    vprod1.normalize_exponent1();
-    vprod2.normalize_exponent1();
+  if (skipj < lastj) {
+    vprod.normalize_exponent1();
 
     __m256d vj = _mm256_set1_pd(skipj);
     vj = _mm256_add_pd(vj, _mm256_set_pd(3, 2, 1, 0));
-    for (int j = skipj; j < skipj + ELEMENTS_PER_LOOP; j += 4) {
-      const __m256d x0 = _mm256_load_pd(&x[j]);
-      const __m256d y0 = _mm256_load_pd(&y[j]);
+    for (int64_t j = skipj; j < skipj + ELEMENTS_PER_LOOP; j += 4) {
+      const __m256d d = force.factor(0, j);
       __m256d mask = _mm256_cmp_pd(vj, vk, _CMP_EQ_OQ);
-      vprod1.mul_mask_no_overflow(sqr_diff2(x0, y0, u1_vec, v1_vec), mask);
-      vprod2.mul_mask_no_overflow(sqr_diff2(x0, y0, u2_vec, v2_vec), mask);
+      vprod.mul_mask_no_overflow(d, mask);
+      force.add_masked(mask);
       vj = _mm256_add_pd(vj, four);
     }
   }
 
-  vprod1.normalize_exponent1();
-  vprod2.normalize_exponent1();
+  vprod.normalize_exponent1();
 
   // Process the remaining elements
   __m256d vn = _mm256_set1_pd(N);
   __m256d vj = _mm256_set1_pd(lastj);
   vj = _mm256_add_pd(vj, _mm256_set_pd(3,2,1,0));
-  for (int j=lastj; j<N; j += 4) {
-    const __m256d x0 = _mm256_load_pd(&x[j]);
-    const __m256d y0 = _mm256_load_pd(&y[j]);
+  for (int64_t j=lastj; j<N; j += 4) {
+    const __m256d d = force.factor(0, j);
     __m256d mask = _mm256_or_pd(_mm256_cmp_pd(vj, vn, _CMP_GE_OQ), _mm256_cmp_pd(vj, vk, _CMP_EQ_OQ));
-    vprod1.mul_mask_no_overflow(sqr_diff2(x0, y0, u1_vec, v1_vec), mask);
-    vprod2.mul_mask_no_overflow(sqr_diff2(x0, y0, u2_vec, v2_vec), mask);
+    vprod.mul_mask_no_overflow(d, mask);
+    force.add_masked(mask);
     vj = _mm256_add_pd(vj, four);
   }
+  force.finish_block();
+}
 
-  prod1 = vprod1.get();
-  prod2 = vprod2.get();
+// The force sum of 1/(u-x[j]) for mul_force_factors.
+struct RealForce {
+  const double u;
+  const double* x;
+  const __m256d u_vec = _mm256_set1_pd(u);
+  __m256d d[4];
+  __m256d block[4] = {_mm256_setzero_pd(), _mm256_setzero_pd(), _mm256_setzero_pd(), _mm256_setzero_pd()};
+  __m256d total = _mm256_setzero_pd();
+
+  __m256d factor(const int l, const int64_t j) {
+    d[l] = _mm256_sub_pd(u_vec, _mm256_load_pd(&x[j]));
+    return d[l];
+  }
+
+  void add(const int l, const __m256d inv) {
+    block[l] = _mm256_add_pd(block[l], inv);
+  }
+
+  void add_masked(const __m256d mask) {
+    block[0] = _mm256_add_pd(block[0], _mm256_blendv_pd(_mm256_div_pd(M256D_ONE, d[0]), _mm256_setzero_pd(), mask));
+  }
+
+  void add_divisions(const int64_t begin, const int64_t end, const int64_t skipj) {
+    const Reciprocals r = force_divisions_real(u, x, begin, end, skipj);
+    block[0] = r.inv0;
+    block[1] = r.inv1;
+    block[2] = r.inv2;
+    block[3] = r.inv3;
+  }
+
+  void finish_block() {
+    total = _mm256_add_pd(total, _mm256_add_pd(_mm256_add_pd(block[0], block[1]), _mm256_add_pd(block[2], block[3])));
+    block[0] = block[1] = block[2] = block[3] = _mm256_setzero_pd();
+  }
+};
+
+// Computes the product of u-x[j] and the force sum of 1/(u-x[j]) for all j!=k in one pass.
+void prod_diff_force_realvec(
+        const long int N,
+        const long int k,
+        const double u,
+        const double* x,
+        LargeExponentFloat& prod,
+        double& force
+) {
+  assert(reinterpret_cast<uintptr_t>(x) % 32 == 0);
+
+  LargeProduct vprod(prod);
+  RealForce real_force{u, x};
+  mul_force_factors(N, k, vprod, real_force);
+
+  force = horizontal_sum(real_force.total);
+  prod = vprod.get();
+}
+
+// The force sums of (z-z[j])/|z-z[j]|^2 for mul_force_factors, with two accumulators per coordinate.
+struct ComplexForce {
+  const double u;
+  const double v;
+  const double* x;
+  const double* y;
+  const __m256d u_vec = _mm256_set1_pd(u);
+  const __m256d v_vec = _mm256_set1_pd(v);
+  __m256d dx[4], dy[4], d[4];
+  __m256d fx, fy;
+  __m256d block_x[2] = {_mm256_setzero_pd(), _mm256_setzero_pd()};
+  __m256d block_y[2] = {_mm256_setzero_pd(), _mm256_setzero_pd()};
+  __m256d total_x = _mm256_setzero_pd();
+  __m256d total_y = _mm256_setzero_pd();
+
+  __m256d factor(const int l, const int64_t j) {
+    dx[l] = _mm256_sub_pd(u_vec, _mm256_load_pd(&x[j]));
+    dy[l] = _mm256_sub_pd(v_vec, _mm256_load_pd(&y[j]));
+    d[l] = _mm256_add_pd(sqr(dx[l]), sqr(dy[l]));
+    return d[l];
+  }
+
+  // the terms of the vectors 0 and 1 (2 and 3) are added before they are accumulated
+  void add(const int l, const __m256d inv) {
+    if (l % 2 == 0) {
+      fx = _mm256_mul_pd(dx[l], inv);
+      fy = _mm256_mul_pd(dy[l], inv);
+    } else {
+      block_x[l / 2] = _mm256_add_pd(block_x[l / 2], _mm256_add_pd(fx, _mm256_mul_pd(dx[l], inv)));
+      block_y[l / 2] = _mm256_add_pd(block_y[l / 2], _mm256_add_pd(fy, _mm256_mul_pd(dy[l], inv)));
+    }
+  }
+
+  void add_masked(const __m256d mask) {
+    const __m256d inv = _mm256_div_pd(M256D_ONE, d[0]);
+    block_x[0] = _mm256_add_pd(block_x[0], _mm256_blendv_pd(_mm256_mul_pd(dx[0], inv), _mm256_setzero_pd(), mask));
+    block_y[0] = _mm256_add_pd(block_y[0], _mm256_blendv_pd(_mm256_mul_pd(dy[0], inv), _mm256_setzero_pd(), mask));
+  }
+
+  void add_divisions(const int64_t begin, const int64_t end, const int64_t skipj) {
+    const ComplexForces f = force_divisions_complex(u, v, x, y, begin, end, skipj);
+    block_x[0] = f.force_x0;
+    block_x[1] = f.force_x1;
+    block_y[0] = f.force_y0;
+    block_y[1] = f.force_y1;
+  }
+
+  void finish_block() {
+    total_x = _mm256_add_pd(total_x, _mm256_add_pd(block_x[0], block_x[1]));
+    total_y = _mm256_add_pd(total_y, _mm256_add_pd(block_y[0], block_y[1]));
+    block_x[0] = block_x[1] = block_y[0] = block_y[1] = _mm256_setzero_pd();
+  }
+};
+
+// Computes the product of |z-z[j]|^2 and the force sum of (z-z[j])/|z-z[j]|^2 for all j!=k in one pass, where
+// z=u+i*v and z[j]=x[j]+i*y[j].
+void prod_dist2_force_complexvec(
+        const long int N,
+        const long int k,
+        const double u,
+        const double v,
+        const double* x,
+        const double* y,
+        LargeExponentFloat& prod,
+        double& force_x,
+        double& force_y
+) {
+  assert(reinterpret_cast<uintptr_t>(x) % 32 == 0);
+
+  LargeProduct vprod(prod);
+  ComplexForce complex_force{u, v, x, y};
+  mul_force_factors(N, k, vprod, complex_force);
+
+  force_x = horizontal_sum(complex_force.total_x);
+  force_y = horizontal_sum(complex_force.total_y);
+  prod = vprod.get();
+}
+
+// Factor of the particles at x, y with the position u, v: u-x for real particles, |u-x|^2+|v-y|^2 for complex ones.
+template<bool COMPLEX>
+inline __m256d cluster_factor(__m256d x, __m256d y, __m256d u, __m256d v) {
+  return COMPLEX ? sqr_diff2(x, y, u, v) : _mm256_sub_pd(u, x);
+}
+
+template<bool COMPLEX>
+inline double cluster_factor(double x, double y, double u, double v) {
+  return COMPLEX ? sqr(u - x) + sqr(v - y) : u - x;
+}
+
+// Multiplies the factors of the particles j..j+3 that are not excluded into prod_new and prod_old. The excluded
+// particles are the ones with index N or larger and k[e_begin..e_end).
+template<bool COMPLEX>
+__attribute__((optimize("-fno-tree-pre"))) static void prod_cluster_masked4(
+        const int64_t j,
+        const long int N,
+        const long int M,
+        const long int* k,
+        const long int e_begin,
+        const long int e_end,
+        const double* u,
+        const double* v,
+        const double* x,
+        const double* y,
+        LargeProduct& vprod_new,
+        LargeProduct& vprod_old,
+        int64_t& muls
+) {
+  const __m256d vj = _mm256_add_pd(_mm256_set1_pd(j), _mm256_set_pd(3, 2, 1, 0));
+  __m256d mask = _mm256_cmp_pd(vj, _mm256_set1_pd(N), _CMP_GE_OQ);
+  for (long int e = e_begin; e < e_end; e++) {
+    mask = _mm256_or_pd(mask, _mm256_cmp_pd(vj, _mm256_set1_pd(k[e]), _CMP_EQ_OQ));
+  }
+  const __m256d x0 = _mm256_load_pd(&x[j]);
+  const __m256d y0 = COMPLEX ? _mm256_load_pd(&y[j]) : x0;
+  for (long int m = 0; m < M; m++) {
+    vprod_new.mul_mask_no_overflow(
+            cluster_factor<COMPLEX>(x0, y0, _mm256_set1_pd(u[m]), _mm256_set1_pd(COMPLEX ? v[m] : 0)), mask);
+    vprod_old.mul_mask_no_overflow(
+            cluster_factor<COMPLEX>(x0, y0, _mm256_set1_pd(x[k[m]]), _mm256_set1_pd(COMPLEX ? y[k[m]] : 0)), mask);
+    if (++muls == MULS_PER_EXPONENT_EXTRACTION) {
+      vprod_new.normalize_exponent1234();
+      vprod_old.normalize_exponent1234();
+      muls = 0;
+    }
+  }
+}
+
+template<bool COMPLEX>
+__attribute__((optimize("-fno-tree-pre"))) static void prod_cluster(
+        const long int N,
+        const long int M,
+        const long int* k,
+        const double* u,
+        const double* v,
+        const double* x,
+        const double* y,
+        LargeExponentFloat& prod_new,
+        LargeExponentFloat& prod_old
+) {
+  const int64_t ELEMENTS_PER_LOOP = 4 * 4;
+  assert(M >= 1);
+  assert(reinterpret_cast<uintptr_t>(x) % 32 == 0);
+  assert(!COMPLEX || reinterpret_cast<uintptr_t>(y) % 32 == 0);
+  for (long int m = 0; m < M; m++) {
+    assert(k[m] >= 0 && k[m] < N);
+    assert(m == 0 || k[m - 1] < k[m]);
+  }
+
+  LargeProduct vprod_new(prod_new);
+  LargeProduct vprod_old(prod_old);
+
+  const int64_t lastj = N & (-ELEMENTS_PER_LOOP);
+  // multiplications into each register of the accumulators since the last normalization
+  int64_t muls = 0;
+  // k[e] is the first excluded particle that was not passed yet, its block is skipj
+  long int e = 0;
+  int64_t skipj = k[0] & (-ELEMENTS_PER_LOOP);
+
+  for (int64_t j = 0; j < lastj; j += ELEMENTS_PER_LOOP) [[likely]] {
+    if (j != skipj) [[likely]] {
+      const __m256d x0 = _mm256_load_pd(&x[j +  0]);
+      const __m256d x1 = _mm256_load_pd(&x[j +  4]);
+      const __m256d x2 = _mm256_load_pd(&x[j +  8]);
+      const __m256d x3 = _mm256_load_pd(&x[j + 12]);
+      const __m256d y0 = COMPLEX ? _mm256_load_pd(&y[j +  0]) : x0;
+      const __m256d y1 = COMPLEX ? _mm256_load_pd(&y[j +  4]) : x1;
+      const __m256d y2 = COMPLEX ? _mm256_load_pd(&y[j +  8]) : x2;
+      const __m256d y3 = COMPLEX ? _mm256_load_pd(&y[j + 12]) : x3;
+
+      for (long int m = 0; m < M; m++) {
+        const __m256d u_vec = _mm256_set1_pd(u[m]);
+        const __m256d v_vec = _mm256_set1_pd(COMPLEX ? v[m] : 0);
+        // the old positions are read in place, x[k[m]] is not changed before the move is accepted
+        const __m256d old_u_vec = _mm256_set1_pd(x[k[m]]);
+        const __m256d old_v_vec = _mm256_set1_pd(COMPLEX ? y[k[m]] : 0);
+        vprod_new.mul_no_overflow1234(
+                cluster_factor<COMPLEX>(x0, y0, u_vec, v_vec),
+                cluster_factor<COMPLEX>(x1, y1, u_vec, v_vec),
+                cluster_factor<COMPLEX>(x2, y2, u_vec, v_vec),
+                cluster_factor<COMPLEX>(x3, y3, u_vec, v_vec)
+        );
+        vprod_old.mul_no_overflow1234(
+                cluster_factor<COMPLEX>(x0, y0, old_u_vec, old_v_vec),
+                cluster_factor<COMPLEX>(x1, y1, old_u_vec, old_v_vec),
+                cluster_factor<COMPLEX>(x2, y2, old_u_vec, old_v_vec),
+                cluster_factor<COMPLEX>(x3, y3, old_u_vec, old_v_vec)
+        );
+        if (++muls == MULS_PER_EXPONENT_EXTRACTION) {
+          vprod_new.normalize_exponent1234();
+          vprod_old.normalize_exponent1234();
+          muls = 0;
+        }
+      }
+    } else {
+      // block with excluded particles
+      long int e_end = e;
+      while (e_end < M && k[e_end] < j + ELEMENTS_PER_LOOP) {
+        e_end++;
+      }
+      for (int64_t i = j; i < j + ELEMENTS_PER_LOOP; i += 4) {
+        prod_cluster_masked4<COMPLEX>(i, N, M, k, e, e_end, u, v, x, y, vprod_new, vprod_old, muls);
+      }
+      e = e_end;
+      skipj = e < M ? k[e] & (-ELEMENTS_PER_LOOP) : -1;
+    }
+  }
+
+  // Process the remaining elements
+  for (int64_t j = lastj; j < N; j += 4) {
+    prod_cluster_masked4<COMPLEX>(j, N, M, k, e, M, u, v, x, y, vprod_new, vprod_old, muls);
+  }
+
+  // Factors between the moved particles
+  alignas(32) double pair_new[4];
+  alignas(32) double pair_old[4];
+  int pairs = 0;
+  for (long int m = 0; m < M; m++) {
+    for (long int n = m + 1; n < M; n++) {
+      pair_new[pairs] = cluster_factor<COMPLEX>(u[m], COMPLEX ? v[m] : 0, u[n], COMPLEX ? v[n] : 0);
+      pair_old[pairs] = cluster_factor<COMPLEX>(x[k[m]], COMPLEX ? y[k[m]] : 0, x[k[n]], COMPLEX ? y[k[n]] : 0);
+      if (++pairs == 4 || (m == M - 2 && n == M - 1)) {
+        std::fill(pair_new + pairs, pair_new + 4, 1.0);
+        std::fill(pair_old + pairs, pair_old + 4, 1.0);
+        vprod_new.mul_mask_no_overflow(_mm256_load_pd(pair_new), _mm256_setzero_pd());
+        vprod_old.mul_mask_no_overflow(_mm256_load_pd(pair_old), _mm256_setzero_pd());
+        pairs = 0;
+        if (++muls == MULS_PER_EXPONENT_EXTRACTION) {
+          vprod_new.normalize_exponent1234();
+          vprod_old.normalize_exponent1234();
+          muls = 0;
+        }
+      }
+    }
+  }
+
+  prod_new = vprod_new.get();
+  prod_old = vprod_old.get();
+}
+
+void prod_diff_cluster_realvec(
+        const long int N,
+        const long int M,
+        const long int* k,
+        const double* u,
+        const double* x,
+        LargeExponentFloat& prod_new,
+        LargeExponentFloat& prod_old
+) {
+  prod_cluster<false>(N, M, k, u, nullptr, x, nullptr, prod_new, prod_old);
+}
+
+void prod_dist2_cluster_complexvec(
+        const long int N,
+        const long int M,
+        const long int* k,
+        const double* u,
+        const double* v,
+        const double* x,
+        const double* y,
+        LargeExponentFloat& prod_new,
+        LargeExponentFloat& prod_old
+) {
+  prod_cluster<true>(N, M, k, u, v, x, y, prod_new, prod_old);
 }
 
 // Computes real Vandermonde determinant
@@ -381,20 +1066,23 @@ void vandermonde_real(
         const double* x,
         LargeExponentFloat& prod
 ) {
-  LargeExponentFloat prod2(1.0);
+  // The accumulators are kept across all kernel calls and reduced once at the end.
+  LargeProduct prod1(prod);
+  LargeProduct prod2;
 
   for (int64_t j=2; j<N; j+=2) [[likely]] {
     // Multiplication of x[j] and x[j-1] with all diff2 to x[k] where k<j-1
-    prod_diff_realrealvec(j-1,N,x[j-1],x[j],x,prod,prod2);
-    prod.significand*=x[j]-x[j-1]; 
+    prod_diff_realrealvec(j-1,N,x[j-1],x[j],x,prod1,prod2);
+    prod1.mul_no_overflow(x[j]-x[j-1]);
   }
-  prod.significand*=prod2.significand;
-  prod.exponent+=prod2.exponent;
   if (N % 2==0 && N>0 ) [[likely]] {
     // Multiplication of last element with diff2 to all other elements in case when N is even (as it was not contained
-    // in the previous loop). prod2 in this call is disregardedas as there is only one element left.
-    prod_diff_realrealvec(N-1,N,x[N-1],x[N-1],x,prod,prod2);
-  }  
+    // in the previous loop). The second product of this call is disregarded as there is only one element left.
+    LargeProduct unused;
+    prod_diff_realrealvec(N-1,N,x[N-1],x[N-1],x,prod1,unused);
+  }
+  prod1.mul(prod2);
+  prod = prod1.get();
 }
 
 
@@ -406,23 +1094,227 @@ void vandermonde_abs2_complex(
         const double* y,
         LargeExponentFloat& prod
 ) {
-  LargeExponentFloat prod2(1.0);
+  LargeProduct prod1(prod);
+  LargeProduct prod2;
 
   for (int64_t j=2; j<N; j+=2) [[likely]] {
     // Multiplication of x[j] and x[j-1] with all diff2 to x[k] where k<j-1
-    prod_dist2_complexcomplexvec(j-1,N,x[j-1],x[j],y[j-1],y[j],x,y,prod,prod2);
-    prod.significand*=sqr(x[j]-x[j-1])+sqr(y[j]-y[j-1]);
+    prod_dist2_complexcomplexvec(j-1,N,x[j-1],x[j],y[j-1],y[j],x,y,prod1,prod2);
+    prod1.mul_no_overflow(sqr(x[j]-x[j-1])+sqr(y[j]-y[j-1]));
   }
-  prod.significand*=prod2.significand;
-  prod.exponent+=prod2.exponent;
   if (N % 2==0 && N>0) [[likely]] {
     // Multiplication of last element with diff2 to all other elements in case when N is even (as it was not contained
-    // in the previous loop). prod2 in this call is disregarded as there is only one element left.
-    prod_dist2_complexcomplexvec(N-1,N,x[N-1],x[N-1],y[N-1],y[N-1],x,y,prod,prod2);
-  }  
+    // in the previous loop). The second product of this call is disregarded as there is only one element left.
+    LargeProduct unused;
+    prod_dist2_complexcomplexvec(N-1,N,x[N-1],x[N-1],y[N-1],y[N-1],x,y,prod1,unused);
+  }
+  prod1.mul(prod2);
+  prod = prod1.get();
 }
 
 
+// Computes the real Vandermonde determinant and the forces force[i] = sum_{j!=i} 1/(x[i]-x[j]) in one pass. Every
+// pair is visited once: the contribution 1/(x[i]-x[j]) is added to force[i] and subtracted from force[j].
+void vandermonde_real_forces(
+        const long int N,
+        const double* x,
+        LargeExponentFloat& prod,
+        double* force
+) {
+  const int64_t ELEMENTS_PER_LOOP = 4 * 4;
+  assert(reinterpret_cast<uintptr_t>(x) % 32 == 0);
+  assert(reinterpret_cast<uintptr_t>(force) % 32 == 0);
+
+  LargeProduct vprod(prod);
+  const __m256d zero = _mm256_setzero_pd();
+  const __m256d four = _mm256_set1_pd(4);
+
+  for (int64_t j=0; j<N; j++) {
+    force[j] = 0;
+  }
+
+  int64_t blocks = 0;
+  for (int64_t i=1; i<N; i++) {
+    const __m256d xi = _mm256_set1_pd(x[i]);
+    __m256d force0 = zero;
+    __m256d force1 = zero;
+    __m256d force2 = zero;
+    __m256d force3 = zero;
+    // the lanes that reciprocal4 got wrong are cleared and added with divisions after the row
+    __m256d out_of_range = zero;
+
+    // prod of x[i]-x[j] for all j<i
+    const int64_t lastj = i & (-ELEMENTS_PER_LOOP);
+    for (int64_t j=0; j<lastj; j += ELEMENTS_PER_LOOP) [[likely]] {
+      const __m256d d0 = _mm256_sub_pd(xi, _mm256_load_pd(&x[j +  0]));
+      const __m256d d1 = _mm256_sub_pd(xi, _mm256_load_pd(&x[j +  4]));
+      const __m256d d2 = _mm256_sub_pd(xi, _mm256_load_pd(&x[j +  8]));
+      const __m256d d3 = _mm256_sub_pd(xi, _mm256_load_pd(&x[j + 12]));
+
+      vprod.mul_no_overflow1234(d0, d1, d2, d3);
+
+      __m256d inv0, inv1, inv2, inv3;
+      const __m256d lanes = reciprocal4(d0, d1, d2, d3, inv0, inv1, inv2, inv3);
+      out_of_range = _mm256_or_pd(out_of_range, lanes);
+      inv0 = _mm256_andnot_pd(lanes, inv0);
+      inv1 = _mm256_andnot_pd(lanes, inv1);
+      inv2 = _mm256_andnot_pd(lanes, inv2);
+      inv3 = _mm256_andnot_pd(lanes, inv3);
+      force0 = _mm256_add_pd(force0, inv0);
+      force1 = _mm256_add_pd(force1, inv1);
+      force2 = _mm256_add_pd(force2, inv2);
+      force3 = _mm256_add_pd(force3, inv3);
+      _mm256_store_pd(&force[j +  0], _mm256_sub_pd(_mm256_load_pd(&force[j +  0]), inv0));
+      _mm256_store_pd(&force[j +  4], _mm256_sub_pd(_mm256_load_pd(&force[j +  4]), inv1));
+      _mm256_store_pd(&force[j +  8], _mm256_sub_pd(_mm256_load_pd(&force[j +  8]), inv2));
+      _mm256_store_pd(&force[j + 12], _mm256_sub_pd(_mm256_load_pd(&force[j + 12]), inv3));
+
+      if (++blocks % MULS_PER_EXPONENT_EXTRACTION == 0) {
+        vprod.normalize_exponent1234();
+      }
+    }
+    if (_mm256_movemask_pd(out_of_range) != 0) [[unlikely]] {
+      force0 = _mm256_add_pd(force0, forces_out_of_range_real(x[i], x, lastj, force));
+    }
+
+    // Process the remaining elements of the row. The lanes j>=i are masked, their force is stored unchanged.
+    vprod.normalize_exponent1();
+    const __m256d vi = _mm256_set1_pd(i);
+    __m256d vj = _mm256_set1_pd(lastj);
+    vj = _mm256_add_pd(vj, _mm256_set_pd(3,2,1,0));
+    for (int64_t j=lastj; j<i; j += 4) {
+      const __m256d d = _mm256_sub_pd(xi, _mm256_load_pd(&x[j]));
+      const __m256d mask = _mm256_cmp_pd(vj, vi, _CMP_GE_OQ);
+      vprod.mul_mask_no_overflow(d, mask);
+      const __m256d inv = _mm256_blendv_pd(_mm256_div_pd(M256D_ONE, d), zero, mask);
+      force0 = _mm256_add_pd(force0, inv);
+      _mm256_store_pd(&force[j], _mm256_sub_pd(_mm256_load_pd(&force[j]), inv));
+      vj = _mm256_add_pd(vj, four);
+    }
+    vprod.normalize_exponent1();
+
+    force[i] += horizontal_sum(_mm256_add_pd(_mm256_add_pd(force0, force1), _mm256_add_pd(force2, force3)));
+  }
+
+  prod = vprod.get();
+}
+
+// Computes the absolute value squared of the complex Vandermonde determinant and the forces
+// force[i] = sum_{j!=i} (z[i]-z[j])/|z[i]-z[j]|^2 in one pass (z[j]=x[j]+i*y[j]). Every pair is visited once.
+void vandermonde_abs2_complex_forces(
+        const long int N,
+        const double* x,
+        const double* y,
+        LargeExponentFloat& prod,
+        double* force_x,
+        double* force_y
+) {
+  const int64_t ELEMENTS_PER_LOOP = 4 * 4;
+  assert(reinterpret_cast<uintptr_t>(x) % 32 == 0);
+  assert(reinterpret_cast<uintptr_t>(force_x) % 32 == 0);
+  assert(reinterpret_cast<uintptr_t>(force_y) % 32 == 0);
+
+  LargeProduct vprod(prod);
+  const __m256d zero = _mm256_setzero_pd();
+  const __m256d four = _mm256_set1_pd(4);
+
+  for (int64_t j=0; j<N; j++) {
+    force_x[j] = 0;
+    force_y[j] = 0;
+  }
+
+  int64_t blocks = 0;
+  for (int64_t i=1; i<N; i++) {
+    const __m256d xi = _mm256_set1_pd(x[i]);
+    const __m256d yi = _mm256_set1_pd(y[i]);
+    __m256d force_x0 = zero;
+    __m256d force_y0 = zero;
+    // the lanes that reciprocal4 got wrong are cleared and added with divisions after the row
+    __m256d out_of_range = zero;
+
+    const int64_t lastj = i & (-ELEMENTS_PER_LOOP);
+    for (int64_t j=0; j<lastj; j += ELEMENTS_PER_LOOP) [[likely]] {
+      const __m256d dx0 = _mm256_sub_pd(xi, _mm256_load_pd(&x[j +  0]));
+      const __m256d dx1 = _mm256_sub_pd(xi, _mm256_load_pd(&x[j +  4]));
+      const __m256d dx2 = _mm256_sub_pd(xi, _mm256_load_pd(&x[j +  8]));
+      const __m256d dx3 = _mm256_sub_pd(xi, _mm256_load_pd(&x[j + 12]));
+      const __m256d dy0 = _mm256_sub_pd(yi, _mm256_load_pd(&y[j +  0]));
+      const __m256d dy1 = _mm256_sub_pd(yi, _mm256_load_pd(&y[j +  4]));
+      const __m256d dy2 = _mm256_sub_pd(yi, _mm256_load_pd(&y[j +  8]));
+      const __m256d dy3 = _mm256_sub_pd(yi, _mm256_load_pd(&y[j + 12]));
+
+      const __m256d d0 = _mm256_add_pd(sqr(dx0), sqr(dy0));
+      const __m256d d1 = _mm256_add_pd(sqr(dx1), sqr(dy1));
+      const __m256d d2 = _mm256_add_pd(sqr(dx2), sqr(dy2));
+      const __m256d d3 = _mm256_add_pd(sqr(dx3), sqr(dy3));
+
+      vprod.mul_no_overflow1234(d0, d1, d2, d3);
+
+      __m256d inv0, inv1, inv2, inv3;
+      const __m256d lanes = reciprocal4(d0, d1, d2, d3, inv0, inv1, inv2, inv3);
+      out_of_range = _mm256_or_pd(out_of_range, lanes);
+      inv0 = _mm256_andnot_pd(lanes, inv0);
+      inv1 = _mm256_andnot_pd(lanes, inv1);
+      inv2 = _mm256_andnot_pd(lanes, inv2);
+      inv3 = _mm256_andnot_pd(lanes, inv3);
+      const __m256d fx0 = _mm256_mul_pd(dx0, inv0);
+      const __m256d fx1 = _mm256_mul_pd(dx1, inv1);
+      const __m256d fx2 = _mm256_mul_pd(dx2, inv2);
+      const __m256d fx3 = _mm256_mul_pd(dx3, inv3);
+      const __m256d fy0 = _mm256_mul_pd(dy0, inv0);
+      const __m256d fy1 = _mm256_mul_pd(dy1, inv1);
+      const __m256d fy2 = _mm256_mul_pd(dy2, inv2);
+      const __m256d fy3 = _mm256_mul_pd(dy3, inv3);
+      force_x0 = _mm256_add_pd(force_x0, _mm256_add_pd(_mm256_add_pd(fx0, fx1), _mm256_add_pd(fx2, fx3)));
+      force_y0 = _mm256_add_pd(force_y0, _mm256_add_pd(_mm256_add_pd(fy0, fy1), _mm256_add_pd(fy2, fy3)));
+      _mm256_store_pd(&force_x[j +  0], _mm256_sub_pd(_mm256_load_pd(&force_x[j +  0]), fx0));
+      _mm256_store_pd(&force_x[j +  4], _mm256_sub_pd(_mm256_load_pd(&force_x[j +  4]), fx1));
+      _mm256_store_pd(&force_x[j +  8], _mm256_sub_pd(_mm256_load_pd(&force_x[j +  8]), fx2));
+      _mm256_store_pd(&force_x[j + 12], _mm256_sub_pd(_mm256_load_pd(&force_x[j + 12]), fx3));
+      _mm256_store_pd(&force_y[j +  0], _mm256_sub_pd(_mm256_load_pd(&force_y[j +  0]), fy0));
+      _mm256_store_pd(&force_y[j +  4], _mm256_sub_pd(_mm256_load_pd(&force_y[j +  4]), fy1));
+      _mm256_store_pd(&force_y[j +  8], _mm256_sub_pd(_mm256_load_pd(&force_y[j +  8]), fy2));
+      _mm256_store_pd(&force_y[j + 12], _mm256_sub_pd(_mm256_load_pd(&force_y[j + 12]), fy3));
+
+      if (++blocks % MULS_PER_EXPONENT_EXTRACTION == 0) {
+        vprod.normalize_exponent1234();
+      }
+    }
+    if (_mm256_movemask_pd(out_of_range) != 0) [[unlikely]] {
+      const ComplexForces f = forces_out_of_range_complex(x[i], y[i], x, y, lastj, force_x, force_y);
+      force_x0 = _mm256_add_pd(force_x0, f.force_x0);
+      force_y0 = _mm256_add_pd(force_y0, f.force_y0);
+    }
+
+    // Process the remaining elements of the row. The lanes j>=i are masked, their force is stored unchanged.
+    vprod.normalize_exponent1();
+    const __m256d vi = _mm256_set1_pd(i);
+    __m256d vj = _mm256_set1_pd(lastj);
+    vj = _mm256_add_pd(vj, _mm256_set_pd(3,2,1,0));
+    for (int64_t j=lastj; j<i; j += 4) {
+      const __m256d dx = _mm256_sub_pd(xi, _mm256_load_pd(&x[j]));
+      const __m256d dy = _mm256_sub_pd(yi, _mm256_load_pd(&y[j]));
+      const __m256d d = _mm256_add_pd(sqr(dx), sqr(dy));
+      const __m256d mask = _mm256_cmp_pd(vj, vi, _CMP_GE_OQ);
+      vprod.mul_mask_no_overflow(d, mask);
+      const __m256d inv = _mm256_div_pd(M256D_ONE, d);
+      const __m256d fx = _mm256_blendv_pd(_mm256_mul_pd(dx, inv), zero, mask);
+      const __m256d fy = _mm256_blendv_pd(_mm256_mul_pd(dy, inv), zero, mask);
+      force_x0 = _mm256_add_pd(force_x0, fx);
+      force_y0 = _mm256_add_pd(force_y0, fy);
+      _mm256_store_pd(&force_x[j], _mm256_sub_pd(_mm256_load_pd(&force_x[j]), fx));
+      _mm256_store_pd(&force_y[j], _mm256_sub_pd(_mm256_load_pd(&force_y[j]), fy));
+      vj = _mm256_add_pd(vj, four);
+    }
+    vprod.normalize_exponent1();
+
+    force_x[i] += horizontal_sum(force_x0);
+    force_y[i] += horizontal_sum(force_y0);
+  }
+
+  prod = vprod.get();
+}
+
 // Computes the absolute value squared of mixed terms for the Vandermonde determinant
 void vandermonde_abs2_mixed_terms(
         const long int Nreal,
@@ -432,19 +1324,21 @@ void vandermonde_abs2_mixed_terms(
         const double* y,
         LargeExponentFloat& prod
 ) {
-  LargeExponentFloat prod2(1.0);
+  LargeProduct prod1(prod);
+  LargeProduct prod2;
 
   for (int64_t j=1; j<Ncomplex; j+=2) [[likely]] {
     // Multiplication of x[j] and x[j-1] with all diff2 to lambda[k]
-    prod_dist2_complexrealvec(Nreal,x[j-1],x[j],y[j-1],y[j],lambda,prod,prod2);
+    prod_dist2_complexrealvec(Nreal,x[j-1],x[j],y[j-1],y[j],lambda,prod1,prod2);
   }
-  prod.significand*=prod2.significand;
-  prod.exponent+=prod2.exponent;
   if (Ncomplex % 2==1) [[unlikely]] {
     // Multiplication of last element with diff2 to all other elements in case when N is odd (as it was not contained
-    // in the previous loop). prod2 in this call is disregarded as there is only one element left.
-    prod_dist2_complexrealvec(Nreal,x[Ncomplex-1],x[Ncomplex-1],y[Ncomplex-1],y[Ncomplex-1],lambda,prod,prod2);
-  }  
+    // in the previous loop). The second product of this call is disregarded as there is only one element left.
+    LargeProduct unused;
+    prod_dist2_complexrealvec(Nreal,x[Ncomplex-1],x[Ncomplex-1],y[Ncomplex-1],y[Ncomplex-1],lambda,prod1,unused);
+  }
+  prod1.mul(prod2);
+  prod = prod1.get();
 }
 
 // if Nreal is much smaller than Ncomplex, this version might be faster
@@ -456,19 +1350,21 @@ void vandermonde_abs2_mixed_terms_small_Nreal(
         const double* y,
         LargeExponentFloat& prod
 ) {
-  LargeExponentFloat prod2(1.0);
+  LargeProduct prod1(prod);
+  LargeProduct prod2;
 
   for (int64_t j=1; j<Nreal; j+=2) [[likely]] {
     // Multiplication of lambda[j] and lambda[j-1] with all diff2 to x[k]
-    prod_dist2_realcomplexvec(Ncomplex,lambda[j-1],lambda[j],x,y,prod,prod2);
+    prod_dist2_realcomplexvec(Ncomplex,lambda[j-1],lambda[j],x,y,prod1,prod2);
   }
-  prod.significand*=prod2.significand;
-  prod.exponent+=prod2.exponent;
   if (Nreal % 2==1) [[unlikely]] {
     // Multiplication of last element with diff2 to all other elements in case when N is odd (as it was not contained
-    // in the previous loop). prod2 in this call is disregardedas as there is only one element left.
-    prod_dist2_realcomplexvec(Ncomplex,lambda[Nreal-1],lambda[Nreal-1],x,y,prod,prod2);
+    // in the previous loop). The second product of this call is disregarded as there is only one element left.
+    LargeProduct unused;
+    prod_dist2_realcomplexvec(Ncomplex,lambda[Nreal-1],lambda[Nreal-1],x,y,prod1,unused);
   }
+  prod1.mul(prod2);
+  prod = prod1.get();
 }
 
 
@@ -486,8 +1382,54 @@ void vandermonde_abs2_mixed(
   prod.significand*=prod.significand;
   prod.exponent*=2;
   // multiplication by mixed and complex Vandermonde terms (which are already squared)
-  vandermonde_abs2_mixed(Nreal,Ncomplex,lambda,x,y,prod);
+  vandermonde_abs2_mixed_terms(Nreal,Ncomplex,lambda,x,y,prod);
   vandermonde_abs2_complex(Ncomplex,x,y,prod);
 }
 
+void vandermonde_abs_conjpair(
+        const long int N,
+        const double* x,
+        const double* y,
+        LargeExponentFloat& prod
+) {
+  LargeProduct prod1(prod);
+  LargeProduct prod2;
+
+  for (int64_t j=2; j<N; j+=2) [[likely]] {
+    // Multiplication of the pairs j and j-1 with all pairs k<j-1
+    prod_dist2_conjpair_complexvec(j-1,N,x[j-1],x[j],y[j-1],y[j],x,y,prod1,prod2);
+    prod1.mul_no_overflow((sqr(x[j]-x[j-1])+sqr(y[j]-y[j-1]))*(sqr(x[j]-x[j-1])+sqr(y[j]+y[j-1])));
+  }
+  if (N % 2==0 && N>0) [[likely]] {
+    // Multiplication of the last pair with all other pairs in case when N is even (as it was not contained in the
+    // previous loop). The second product of this call is disregarded as there is only one element left.
+    LargeProduct unused;
+    prod_dist2_conjpair_complexvec(N-1,N,x[N-1],x[N-1],y[N-1],y[N-1],x,y,prod1,unused);
+  }
+
+  // the factors within the pairs
+  prod2.normalize_exponent1();
+  for (int64_t j=0; j<N; j++) {
+    prod2.mul_no_overflow(2*std::abs(y[j]));
+    if (j % MULS_PER_EXPONENT_EXTRACTION == MULS_PER_EXPONENT_EXTRACTION - 1) {
+      prod2.normalize_exponent1();
+    }
+  }
+  prod1.mul(prod2);
+  prod = prod1.get();
+}
+
+void vandermonde_abs_real_ginibre(
+        const long int Nreal,
+        const long int Ncomplex,
+        const double* lambda,
+        const double* x,
+        const double* y,
+        LargeExponentFloat& prod
+) {
+  vandermonde_real(Nreal,lambda,prod);
+  vandermonde_abs2_mixed_terms(Nreal,Ncomplex,lambda,x,y,prod);
+  vandermonde_abs_conjpair(Ncomplex,x,y,prod);
+}
+
 
@@ -1,6 +1,8 @@
 #ifndef VANDERMONDE_DET_H
 #define VANDERMONDE_DET_H
 
+#include <algorithm>
+#include <cmath>
 #include <mm_malloc.h>
 #include "large_product.h"
 
@@ -10,6 +12,29 @@ inline double* new_double_array(int64_t size) {
   return static_cast<double*>(_mm_malloc(sizeof(double) * rounded_size, 64));
 }
 
+/**
+ * Pre-scaling of tightly clustered particles. LargeProduct scales factors below 2^-63 (particles within ~1e-19 of each
+ * other) out of the hot path, which is exact but about 6 times slower. Such clusters lie near 0 (elsewhere doubles are
+ * not that dense), and multiplying all positions (and u, v) by 2^e is exact and multiplies every factor u - x[j] by
+ * 2^e (squared distances by 2^(2e)). The caller divides the product by 2^e per factor.
+ *
+ * prescale_exponent returns e such that the largest |x[j]| times 2^e is in [1, 2), 0 if all are 0. Use the smaller e of
+ * x and y for complex particles.
+ */
+inline int prescale_exponent(const long int N, const double* x) {
+  double max_abs = 0;
+  for (long int j = 0; j < N; j++) {
+    max_abs = std::max(max_abs, std::abs(x[j]));
+  }
+  return max_abs == 0 ? 0 : -std::ilogb(max_abs);
+}
+
+inline void prescale_positions(const long int N, const int e, const double* x, double* scaled) {
+  for (long int j = 0; j < N; j++) {
+    scaled[j] = std::ldexp(x[j], e);
+  }
+}
+
 
 void prod_diff_realrealvec(
         const long int N,
@@ -65,6 +90,177 @@ void prod_dist2_complexcomplexvec(
         LargeExponentFloat& prod2
 ) __attribute__((optimize("-fno-tree-pre")));
 
+void prod_diff_complexcomplexvec(
+        const long int N,
+        const long int k,
+        const double u1,
+        const double u2,
+        const double v1,
+        const double v2,
+        const double* x,
+        const double* y,
+        LargeExponentFloat& prod1,
+        double& phase1,
+        LargeExponentFloat& prod2,
+        double& phase2
+) __attribute__((optimize("-fno-tree-pre")));
+
+void prod_diff_force_realvec(
+        const long int N,
+        const long int k,
+        const double u,
+        const double* x,
+        LargeExponentFloat& prod,
+        double& force
+) __attribute__((optimize("-fno-tree-pre")));
+
+void prod_dist2_force_complexvec(
+        const long int N,
+        const long int k,
+        const double u,
+        const double v,
+        const double* x,
+        const double* y,
+        LargeExponentFloat& prod,
+        double& force_x,
+        double& force_y
+) __attribute__((optimize("-fno-tree-pre")));
+
+// Single product versions of prod_diff_realrealvec and prod_dist2_complexcomplexvec, for one position u (+i*v).
+void prod_diff_realvec(
+        const long int N,
+        const long int k,
+        const double u,
+        const double* x,
+        LargeExponentFloat& prod
+) __attribute__((optimize("-fno-tree-pre")));
+
+void prod_dist2_complexvec(
+        const long int N,
+        const long int k,
+        const double u,
+        const double v,
+        const double* x,
+        const double* y,
+        LargeExponentFloat& prod
+) __attribute__((optimize("-fno-tree-pre")));
+
+/*
+ * Kernels for complex particles that come in conjugate pairs (complex eigenvalues of real matrices). Only one
+ * representative z[j]=x[j]+i*y[j] of every pair is stored, and every factor covers both members of the pair:
+ * |w-z[j]|^2 * |w-conj(z[j])|^2. The products are the same as prod_dist2_complexcomplexvec over the 2N points z[j] and
+ * conj(z[j]) (except for j=k), with half the memory traffic and half the multiplications.
+ *
+ * Between a real particle u and a pair, |u-z[j]| * |u-conj(z[j])| = |u-z[j]|^2, so prod_dist2_realcomplexvec and
+ * prod_dist2_complexrealvec already are the mixed terms for conjugate pairs.
+ */
+void prod_dist2_conjpair_complexvec(
+        const long int N,
+        const long int k,
+        const double u1,
+        const double u2,
+        const double v1,
+        const double v2,
+        const double* x,
+        const double* y,
+        LargeExponentFloat& prod1,
+        LargeExponentFloat& prod2
+) __attribute__((optimize("-fno-tree-pre")));
+
+/*
+ * Streaming versions of the kernels above: the products are multiplied into LargeProduct accumulators, which are not
+ * reduced. A caller can chain many kernel calls on the same accumulators and pay for a single get() at the end, e.g.
+ * in the triangular loops of the Vandermonde determinants or over the blocks of a sweep.
+ *
+ * Every call leaves at most 15 multiplications (the conjugate pair kernel: 7) since the last normalization in the
+ * accumulators, and the next call normalizes after its first block. Between two calls, a caller may add a few scalar
+ * factors of the magnitude of the kernel factors with LargeProduct::mul_no_overflow(double); more must be followed by
+ * normalize_exponent1(). Different kernels must not share accumulators.
+ */
+void prod_diff_realrealvec(
+        const long int N,
+        const long int k,
+        const double u1,
+        const double u2,
+        const double* x,
+        LargeProduct& prod1,
+        LargeProduct& prod2
+) __attribute__((optimize("-fno-tree-pre")));
+
+void prod_dist2_realcomplexvec(
+        const long int N,
+        const double u1,
+        const double u2,
+        const double* x,
+        const double* y,
+        LargeProduct& prod1,
+        LargeProduct& prod2
+) __attribute__((optimize("-fno-tree-pre")));
+
+void prod_dist2_complexrealvec(
+        const long int N,
+        const double u1,
+        const double u2,
+        const double v1,
+        const double v2,
+        const double* x,
+        LargeProduct& prod1,
+        LargeProduct& prod2
+) __attribute__((optimize("-fno-tree-pre")));
+
+void prod_dist2_complexcomplexvec(
+        const long int N,
+        const long int k,
+        const double u1,
+        const double u2,
+        const double v1,
+        const double v2,
+        const double* x,
+        const double* y,
+        LargeProduct& prod1,
+        LargeProduct& prod2
+) __attribute__((optimize("-fno-tree-pre")));
+
+void prod_dist2_conjpair_complexvec(
+        const long int N,
+        const long int k,
+        const double u1,
+        const double u2,
+        const double v1,
+        const double v2,
+        const double* x,
+        const double* y,
+        LargeProduct& prod1,
+        LargeProduct& prod2
+) __attribute__((optimize("-fno-tree-pre")));
+
+// Products for moving the M particles k[0] < k[1] < ... < k[M-1] at once to the new positions u[m] (+i*v[m]):
+//   prod_new = prod_m prod_{j not in k} (u[m]-x[j]) * prod_{m<n} (u[n]-u[m])
+//   prod_old = prod_m prod_{j not in k} (x[k[m]]-x[j]) * prod_{m<n} (x[k[n]]-x[k[m]])
+// for real particles, and the same with squared distances for complex particles. The ratio prod_new / prod_old is the
+// change of the (squared absolute) Vandermonde determinant. x and y are read in a single pass.
+void prod_diff_cluster_realvec(
+        const long int N,
+        const long int M,
+        const long int* k,
+        const double* u,
+        const double* x,
+        LargeExponentFloat& prod_new,
+        LargeExponentFloat& prod_old
+) __attribute__((optimize("-fno-tree-pre")));
+
+void prod_dist2_cluster_complexvec(
+        const long int N,
+        const long int M,
+        const long int* k,
+        const double* u,
+        const double* v,
+        const double* x,
+        const double* y,
+        LargeExponentFloat& prod_new,
+        LargeExponentFloat& prod_old
+) __attribute__((optimize("-fno-tree-pre")));
+
 
 void vandermonde_real(
         const long int N,
@@ -79,6 +275,24 @@ void vandermonde_abs2_complex(
         LargeExponentFloat& prod
 );
 
+// force must be an array allocated with new_double_array(N)
+void vandermonde_real_forces(
+        const long int N,
+        const double* x,
+        LargeExponentFloat& prod,
+        double* force
+);
+
+// force_x and force_y must be arrays allocated with new_double_array(N)
+void vandermonde_abs2_complex_forces(
+        const long int N,
+        const double* x,
+        const double* y,
+        LargeExponentFloat& prod,
+        double* force_x,
+        double* force_y
+);
+
 void vandermonde_abs2_mixed_terms(
         const long int Nreal,
 	const long int Ncomplex,
@@ -106,4 +320,24 @@ void vandermonde_abs2_mixed(
         LargeExponentFloat& prod
 );
 
+// Multiplies prod with |det| of the Vandermonde matrix of the 2N points z[j], conj(z[j]) given by their representatives
+// z[j]=x[j]+i*y[j] (see prod_dist2_conjpair_complexvec), including the factors |z[j]-conj(z[j])| = 2|y[j]|.
+void vandermonde_abs_conjpair(
+        const long int N,
+        const double* x,
+        const double* y,
+        LargeExponentFloat& prod
+);
+
+// Multiplies prod with |det| of the Vandermonde matrix of the eigenvalues of a real matrix: the Nreal real eigenvalues
+// lambda and the Ncomplex conjugate pairs with representatives x+i*y.
+void vandermonde_abs_real_ginibre(
+        const long int Nreal,
+        const long int Ncomplex,
+        const double* lambda,
+        const double* x,
+        const double* y,
+        LargeExponentFloat& prod
+);
+
 #endif
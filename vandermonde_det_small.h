@@ -0,0 +1,201 @@
+#ifndef VANDERMONDE_DET_SMALL_H
+#define VANDERMONDE_DET_SMALL_H
+
+#include "large_product.h"
+
+/**
+ * Versions of the prod_*vec kernels for a small number of particles N known at compile time.
+ *
+ * The loops are fully unrolled and the tail mask is known at compile time. Each lane of the four accumulators gets at
+ * most 4 multiplicands (N <= 64), so no normalization is needed before the final reduction and there is only one
+ * exponent extraction per product instead of the 4 normalizations of LargeProduct::get().
+ *
+ * The accuracy is the same as for the generic kernels, but the rounding can differ as the factors are multiplied in
+ * a different order.
+ */
+
+constexpr const long int MAX_SMALL_N = 64;
+
+// Multiplies the 4 lanes of prod with initial and returns the result as LargeExponentFloat. The lanes of prod must
+// not be normalized, but the product of the 4 lanes must not over- or underflow after the exponents were extracted.
+// An initial value of 0 gives 0, like for LargeProduct.
+inline LargeExponentFloat horizontal_large_product(__m256d prod, const LargeExponentFloat& initial) {
+  LargeExponentFloat normalized = initial;
+  // a branch instead of always normalizing, which would lengthen the dependency chain of repeated calls
+  if (!(std::abs(initial.significand) >= FACTOR_MIN && std::abs(initial.significand) <= FACTOR_MAX)) [[unlikely]] {
+    normalized = initial.normalized_fast();
+    if (normalized.significand == 0) {
+      return LargeExponentFloat(0.0);
+    }
+  }
+  prod = _mm256_mul_pd(prod, _mm256_set_pd(1, 1, 1, normalized.significand));
+  int64_t exponent = horizontal_sum(extract_and_clear_exponent(prod)) + normalized.exponent;
+#ifdef __AVX2__
+  exponent -= 4 * EXPONENT_BIAS;
+#endif
+  return LargeExponentFloat(horizontal_product(prod), exponent);
+}
+
+// prod_small_vec with LargeProduct, which checks the factors against [FACTOR_MIN, FACTOR_MAX]. Each lane of prod1 gets
+// at most 16 factors, so there is no normalization before get().
+template<long int N, class Factor>
+__attribute__((noinline, cold)) void prod_small_vec_scaled(const long int k, Factor factor, LargeExponentFloat& prod1,
+                                                           LargeExponentFloat& prod2) {
+  constexpr long int VECTORS = (N + 3) / 4;
+  static_assert(VECTORS <= MULS_PER_EXPONENT_EXTRACTION, "no normalization between the multiplications");
+  LargeProduct vprod1(prod1);
+  LargeProduct vprod2(prod2);
+  const __m256d vk = _mm256_set1_pd(k);
+  for (long int i = 0; i < VECTORS; i++) {
+    const long int j = 4 * i;
+    __m256d factor1, factor2;
+    factor(j, factor1, factor2);
+    const __m256d vj = _mm256_set_pd(j + 3, j + 2, j + 1, j);
+    const __m256d mask = _mm256_or_pd(_mm256_cmp_pd(vj, vk, _CMP_EQ_OQ),
+                                      _mm256_cmp_pd(vj, _mm256_set1_pd(N), _CMP_GE_OQ));
+    vprod1.mul_mask_no_overflow(factor1, mask);
+    vprod2.mul_mask_no_overflow(factor2, mask);
+  }
+  prod1 = vprod1.get();
+  prod2 = vprod2.get();
+}
+
+// Computes the two products over all j!=k (and j<N) of the factors returned by factor(j, factor1, factor2) for the
+// 4 elements starting at j. Instantiated by the kernels below. If a lane of the products is 0, denormal or infinite
+// (a zero factor, clustered or very distant particles), the products are computed again with prod_small_vec_scaled,
+// which has the zero semantics of LargeProduct.
+template<long int N, class Factor>
+inline void prod_small_vec(const long int k, Factor factor, LargeExponentFloat& prod1, LargeExponentFloat& prod2) {
+  static_assert(N > 0 && N <= MAX_SMALL_N, "only for small N, use the generic kernels otherwise");
+  constexpr long int VECTORS = (N + 3) / 4;
+
+  __m256d acc1[4] = {M256D_ONE, M256D_ONE, M256D_ONE, M256D_ONE};
+  __m256d acc2[4] = {M256D_ONE, M256D_ONE, M256D_ONE, M256D_ONE};
+  const __m256d vk = _mm256_set1_pd(k);
+
+#pragma GCC unroll 16
+  for (long int i = 0; i < VECTORS; i++) {
+    const long int j = 4 * i;
+    __m256d factor1, factor2;
+    factor(j, factor1, factor2);
+
+    const __m256d vj = _mm256_set_pd(j + 3, j + 2, j + 1, j);
+    __m256d mask = _mm256_cmp_pd(vj, vk, _CMP_EQ_OQ);
+    if (j + 4 > N) {
+      mask = _mm256_or_pd(mask, _mm256_cmp_pd(vj, _mm256_set1_pd(N), _CMP_GE_OQ));
+    }
+    acc1[i % 4] = _mm256_mul_pd(acc1[i % 4], _mm256_blendv_pd(factor1, M256D_ONE, mask));
+    acc2[i % 4] = _mm256_mul_pd(acc2[i % 4], _mm256_blendv_pd(factor2, M256D_ONE, mask));
+  }
+
+  const __m256d lanes1 = _mm256_mul_pd(_mm256_mul_pd(acc1[0], acc1[1]), _mm256_mul_pd(acc1[2], acc1[3]));
+  const __m256d lanes2 = _mm256_mul_pd(_mm256_mul_pd(acc2[0], acc2[1]), _mm256_mul_pd(acc2[2], acc2[3]));
+  const __m256d abs1 = abs(lanes1);
+  const __m256d abs2 = abs(lanes2);
+  const __m256d not_normal = _mm256_or_pd(
+          _mm256_cmp_pd(_mm256_min_pd(abs1, abs2), _mm256_set1_pd(DBL_MIN), _CMP_LT_OQ),
+          _mm256_cmp_pd(_mm256_max_pd(abs1, abs2), _mm256_set1_pd(DBL_MAX), _CMP_GT_OQ));
+  if (__builtin_expect(!_mm256_testz_pd(not_normal, not_normal), 0)) {
+    prod_small_vec_scaled<N>(k, factor, prod1, prod2);
+    return;
+  }
+  prod1 = horizontal_large_product(lanes1, prod1);
+  prod2 = horizontal_large_product(lanes2, prod2);
+}
+
+// Same as prod_diff_realrealvec(N, k, u1, u2, x, prod1, prod2) for compile time N.
+template<long int N>
+inline void prod_diff_realrealvec(
+        const long int k,
+        const double u1,
+        const double u2,
+        const double* x,
+        LargeExponentFloat& prod1,
+        LargeExponentFloat& prod2
+) {
+  const __m256d u1_vec = _mm256_set1_pd(u1);
+  const __m256d u2_vec = _mm256_set1_pd(u2);
+  prod_small_vec<N>(k, [&](long int j, __m256d& factor1, __m256d& factor2) {
+    const __m256d x0 = _mm256_load_pd(&x[j]);
+    factor1 = _mm256_sub_pd(u1_vec, x0);
+    factor2 = _mm256_sub_pd(u2_vec, x0);
+  }, prod1, prod2);
+}
+
+// Same as prod_dist2_realcomplexvec(N, u1, u2, x, y, prod1, prod2) for compile time N.
+template<long int N>
+inline void prod_dist2_realcomplexvec(
+        const double u1,
+        const double u2,
+        const double* x,
+        const double* y,
+        LargeExponentFloat& prod1,
+        LargeExponentFloat& prod2
+) {
+  const __m256d u1_vec = _mm256_set1_pd(u1);
+  const __m256d u2_vec = _mm256_set1_pd(u2);
+  prod_small_vec<N>(N, [&](long int j, __m256d& factor1, __m256d& factor2) {
+    const __m256d x0 = _mm256_load_pd(&x[j]);
+    const __m256d y0 = _mm256_load_pd(&y[j]);
+    const __m256d y0_sqr = _mm256_mul_pd(y0, y0);
+    const __m256d d1 = _mm256_sub_pd(u1_vec, x0);
+    const __m256d d2 = _mm256_sub_pd(u2_vec, x0);
+    factor1 = _mm256_add_pd(_mm256_mul_pd(d1, d1), y0_sqr);
+    factor2 = _mm256_add_pd(_mm256_mul_pd(d2, d2), y0_sqr);
+  }, prod1, prod2);
+}
+
+// Same as prod_dist2_complexrealvec(N, u1, u2, v1, v2, x, prod1, prod2) for compile time N.
+template<long int N>
+inline void prod_dist2_complexrealvec(
+        const double u1,
+        const double u2,
+        const double v1,
+        const double v2,
+        const double* x,
+        LargeExponentFloat& prod1,
+        LargeExponentFloat& prod2
+) {
+  const __m256d u1_vec = _mm256_set1_pd(u1);
+  const __m256d u2_vec = _mm256_set1_pd(u2);
+  const __m256d v1_sqr = _mm256_set1_pd(v1 * v1);
+  const __m256d v2_sqr = _mm256_set1_pd(v2 * v2);
+  prod_small_vec<N>(N, [&](long int j, __m256d& factor1, __m256d& factor2) {
+    const __m256d x0 = _mm256_load_pd(&x[j]);
+    const __m256d d1 = _mm256_sub_pd(u1_vec, x0);
+    const __m256d d2 = _mm256_sub_pd(u2_vec, x0);
+    factor1 = _mm256_add_pd(_mm256_mul_pd(d1, d1), v1_sqr);
+    factor2 = _mm256_add_pd(_mm256_mul_pd(d2, d2), v2_sqr);
+  }, prod1, prod2);
+}
+
+// Same as prod_dist2_complexcomplexvec(N, k, u1, u2, v1, v2, x, y, prod1, prod2) for compile time N.
+template<long int N>
+inline void prod_dist2_complexcomplexvec(
+        const long int k,
+        const double u1,
+        const double u2,
+        const double v1,
+        const double v2,
+        const double* x,
+        const double* y,
+        LargeExponentFloat& prod1,
+        LargeExponentFloat& prod2
+) {
+  const __m256d u1_vec = _mm256_set1_pd(u1);
+  const __m256d u2_vec = _mm256_set1_pd(u2);
+  const __m256d v1_vec = _mm256_set1_pd(v1);
+  const __m256d v2_vec = _mm256_set1_pd(v2);
+  prod_small_vec<N>(k, [&](long int j, __m256d& factor1, __m256d& factor2) {
+    const __m256d x0 = _mm256_load_pd(&x[j]);
+    const __m256d y0 = _mm256_load_pd(&y[j]);
+    const __m256d dx1 = _mm256_sub_pd(u1_vec, x0);
+    const __m256d dy1 = _mm256_sub_pd(v1_vec, y0);
+    const __m256d dx2 = _mm256_sub_pd(u2_vec, x0);
+    const __m256d dy2 = _mm256_sub_pd(v2_vec, y0);
+    factor1 = _mm256_add_pd(_mm256_mul_pd(dx1, dx1), _mm256_mul_pd(dy1, dy1));
+    factor2 = _mm256_add_pd(_mm256_mul_pd(dx2, dx2), _mm256_mul_pd(dy2, dy2));
+  }, prod1, prod2);
+}
+
+#endif
@@ -0,0 +1,398 @@
+#include "vandermonde_parallel.h"
+#include "vandermonde_det.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <thread>
+
+// The triangle is processed in steps of two rows like in vandermonde_real: step j (even) multiplies the rows j-1 and j
+// with all columns k<j-1. If N is even, the last step j=N only contains the single row N-1.
+std::vector<TriangleChunk> triangle_chunks(const long int N) {
+  std::vector<TriangleChunk> chunks;
+  int64_t begin_row = 2;
+  int64_t pairs = 0;
+  for (int64_t j = 2; j <= N; j += 2) {
+    pairs += 2 * (j - 1);
+    if (pairs >= PAIRS_PER_CHUNK) {
+      chunks.push_back({begin_row, j + 2});
+      begin_row = j + 2;
+      pairs = 0;
+    }
+  }
+  if (begin_row <= N) {
+    chunks.push_back({begin_row, N + 1});
+  }
+  return chunks;
+}
+
+LargeExponentFloat merge_tree(std::vector<LargeExponentFloat> partials) {
+  if (partials.empty()) {
+    return LargeExponentFloat(1.0);
+  }
+  while (partials.size() > 1) {
+    size_t half = partials.size() / 2;
+    for (size_t i = 0; i < half; i++) {
+      partials[i] = save_mul(partials[2 * i], partials[2 * i + 1]);
+    }
+    if (partials.size() % 2 == 1) {
+      partials[half] = partials.back();
+      half++;
+    }
+    partials.resize(half, LargeExponentFloat(1.0));
+  }
+  return partials[0];
+}
+
+// Calls compute(i) for all chunks i. The chunks are handed out dynamically, the result of each chunk is stored by the
+// caller at index i, so the assignment of chunks to threads does not influence the result.
+template<class ComputeChunk>
+static void for_each_chunk(const size_t num_chunks, int num_threads, ComputeChunk compute) {
+  if (num_threads <= 0) {
+    num_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  num_threads = std::min<size_t>(num_threads, num_chunks);
+
+  std::atomic<size_t> next_chunk(0);
+  auto worker = [&]() {
+    for (size_t i = next_chunk++; i < num_chunks; i = next_chunk++) {
+      compute(i);
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (int t = 1; t < num_threads; t++) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto& thread: threads) {
+    thread.join();
+  }
+}
+
+LargeExponentFloat vandermonde_real_chunk(const long int N, const double* x, const TriangleChunk& chunk) {
+  LargeProduct prod1;
+  LargeProduct prod2;
+  for (int64_t j = chunk.begin_row; j < chunk.end_row; j += 2) {
+    if (j < N) [[likely]] {
+      prod_diff_realrealvec(j-1,N,x[j-1],x[j],x,prod1,prod2);
+      prod1.mul_no_overflow(x[j]-x[j-1]);
+    } else {
+      // single last row, the second product is not needed
+      LargeProduct unused;
+      prod_diff_realrealvec(j-1,N,x[j-1],x[j-1],x,prod1,unused);
+    }
+  }
+  prod1.mul(prod2);
+  return prod1.get();
+}
+
+LargeExponentFloat vandermonde_abs2_complex_chunk(
+        const long int N,
+        const double* x,
+        const double* y,
+        const TriangleChunk& chunk
+) {
+  LargeProduct prod1;
+  LargeProduct prod2;
+  for (int64_t j = chunk.begin_row; j < chunk.end_row; j += 2) {
+    if (j < N) [[likely]] {
+      prod_dist2_complexcomplexvec(j-1,N,x[j-1],x[j],y[j-1],y[j],x,y,prod1,prod2);
+      prod1.mul_no_overflow((x[j]-x[j-1])*(x[j]-x[j-1])+(y[j]-y[j-1])*(y[j]-y[j-1]));
+    } else {
+      // single last row, the second product is not needed
+      LargeProduct unused;
+      prod_dist2_complexcomplexvec(j-1,N,x[j-1],x[j-1],y[j-1],y[j-1],x,y,prod1,unused);
+    }
+  }
+  prod1.mul(prod2);
+  return prod1.get();
+}
+
+void vandermonde_real_parallel(
+        const long int N,
+        const double* x,
+        LargeExponentFloat& prod,
+        const int num_threads
+) {
+  const std::vector<TriangleChunk> chunks = triangle_chunks(N);
+  std::vector<LargeExponentFloat> partials(chunks.size(), LargeExponentFloat(1.0));
+
+  for_each_chunk(chunks.size(), num_threads, [&](size_t i) {
+    partials[i] = vandermonde_real_chunk(N, x, chunks[i]);
+  });
+
+  prod = save_mul(prod, merge_tree(partials));
+}
+
+void vandermonde_abs2_complex_parallel(
+        const long int N,
+        const double* x,
+        const double* y,
+        LargeExponentFloat& prod,
+        const int num_threads
+) {
+  const std::vector<TriangleChunk> chunks = triangle_chunks(N);
+  std::vector<LargeExponentFloat> partials(chunks.size(), LargeExponentFloat(1.0));
+
+  for_each_chunk(chunks.size(), num_threads, [&](size_t i) {
+    partials[i] = vandermonde_abs2_complex_chunk(N, x, y, chunks[i]);
+  });
+
+  prod = save_mul(prod, merge_tree(partials));
+}
+
+std::pair<size_t, size_t> shard_chunk_range(const size_t num_chunks, const int shard, const int num_shards) {
+  assert(shard >= 0 && shard < num_shards);
+  return {num_chunks * shard / num_shards, num_chunks * (shard + 1) / num_shards};
+}
+
+uint64_t positions_checksum(const long int N, const double* x, const double* y) {
+  uint64_t hash = 0xcbf29ce484222325;
+  const auto add = [&](const double* values) {
+    for (long int j = 0; j < N; j++) {
+      uint64_t bits;
+      std::memcpy(&bits, &values[j], sizeof(bits));
+      for (int byte = 0; byte < 8; byte++) {
+        hash = (hash ^ ((bits >> (8 * byte)) & 0xff)) * 0x100000001b3;
+      }
+    }
+  };
+  add(x);
+  if (y != nullptr) {
+    add(y);
+  }
+  return hash;
+}
+
+template<class ComputeChunk>
+static ShardResult compute_shard(
+        const long int N,
+        const double* x,
+        const double* y,
+        const int shard,
+        const int num_shards,
+        const int num_threads,
+        ComputeChunk compute
+) {
+  const std::vector<TriangleChunk> chunks = triangle_chunks(N);
+  const auto range = shard_chunk_range(chunks.size(), shard, num_shards);
+  ShardResult result;
+  result.is_complex = y != nullptr;
+  result.positions_checksum = positions_checksum(N, x, y);
+  result.N = N;
+  result.num_chunks = chunks.size();
+  result.partials.assign(range.second - range.first, {0, LargeExponentFloat(1.0)});
+
+  for_each_chunk(range.second - range.first, num_threads, [&](size_t i) {
+    result.partials[i] = {range.first + i, compute(chunks[range.first + i])};
+  });
+  return result;
+}
+
+ShardResult vandermonde_real_shard(
+        const long int N,
+        const double* x,
+        const int shard,
+        const int num_shards,
+        const int num_threads
+) {
+  return compute_shard(N, x, nullptr, shard, num_shards, num_threads, [&](const TriangleChunk& chunk) {
+    return vandermonde_real_chunk(N, x, chunk);
+  });
+}
+
+ShardResult vandermonde_abs2_complex_shard(
+        const long int N,
+        const double* x,
+        const double* y,
+        const int shard,
+        const int num_shards,
+        const int num_threads
+) {
+  return compute_shard(N, x, y, shard, num_shards, num_threads, [&](const TriangleChunk& chunk) {
+    return vandermonde_abs2_complex_chunk(N, x, y, chunk);
+  });
+}
+
+std::string serialize(const LargeExponentFloat& f) {
+  char significand[64];
+  std::snprintf(significand, sizeof(significand), "%a", f.significand);
+  return std::string(significand) + " " + std::to_string(f.exponent);
+}
+
+bool deserialize(const std::string& text, LargeExponentFloat& f) {
+  std::istringstream is(text);
+  std::string significand;
+  int64_t exponent;
+  if (!(is >> significand >> exponent)) {
+    return false;
+  }
+  char* end;
+  const double value = std::strtod(significand.c_str(), &end);
+  if (*end != '\0') {
+    return false;
+  }
+  f = LargeExponentFloat(value, exponent);
+  return true;
+}
+
+void write_shard(std::ostream& os, const ShardResult& shard) {
+  char checksum[32];
+  std::snprintf(checksum, sizeof(checksum), "%016" PRIx64, shard.positions_checksum);
+  os << SHARD_FORMAT << "\n" << (shard.is_complex ? "complex" : "real") << " " << checksum << " " << shard.N << " "
+     << shard.num_chunks << " " << shard.partials.size() << "\n";
+  for (const auto& partial : shard.partials) {
+    os << partial.first << " " << serialize(partial.second) << "\n";
+  }
+}
+
+bool read_shard(std::istream& is, ShardResult& shard) {
+  std::string format, kind, checksum;
+  size_t count;
+  if (!std::getline(is, format) || format != SHARD_FORMAT
+      || !(is >> kind >> checksum >> shard.N >> shard.num_chunks >> count)
+      || (kind != "real" && kind != "complex") || checksum.size() != 16
+      || checksum.find_first_not_of("0123456789abcdef") != std::string::npos) {
+    return false;
+  }
+  shard.is_complex = kind == "complex";
+  shard.positions_checksum = std::strtoull(checksum.c_str(), nullptr, 16);
+  is >> std::ws;
+  shard.partials.clear();
+  for (size_t i = 0; i < count; i++) {
+    std::string line;
+    size_t index;
+    LargeExponentFloat partial(1.0);
+    if (!std::getline(is, line)) {
+      return false;
+    }
+    std::istringstream line_stream(line);
+    std::string rest;
+    if (!(line_stream >> index) || !std::getline(line_stream, rest) || !deserialize(rest, partial)
+        || index >= shard.num_chunks) {
+      return false;
+    }
+    shard.partials.emplace_back(index, partial);
+  }
+  return true;
+}
+
+bool merge_shards(const std::vector<ShardResult>& shards, LargeExponentFloat& prod) {
+  if (shards.empty()) {
+    return false;
+  }
+  const bool is_complex = shards[0].is_complex;
+  const uint64_t checksum = shards[0].positions_checksum;
+  const long int N = shards[0].N;
+  const size_t num_chunks = shards[0].num_chunks;
+  std::vector<LargeExponentFloat> partials(num_chunks, LargeExponentFloat(1.0));
+  std::vector<bool> present(num_chunks, false);
+  for (const auto& shard : shards) {
+    if (shard.is_complex != is_complex || shard.positions_checksum != checksum || shard.N != N
+        || shard.num_chunks != num_chunks) {
+      return false;
+    }
+    for (const auto& partial : shard.partials) {
+      if (present[partial.first]) {
+        return false;
+      }
+      present[partial.first] = true;
+      partials[partial.first] = partial.second;
+    }
+  }
+  if (std::find(present.begin(), present.end(), false) != present.end()) {
+    return false;
+  }
+  prod = save_mul(prod, merge_tree(partials));
+  return true;
+}
+
+std::pair<int64_t, int64_t> kernel_worker_range(const int64_t N, const int t, const int num_threads) {
+  const size_t num_chunks = (N + KERNEL_CHUNK_SIZE - 1) / KERNEL_CHUNK_SIZE;
+  const auto chunks = shard_chunk_range(num_chunks, t, num_threads);
+  return {std::min<int64_t>(chunks.first * KERNEL_CHUNK_SIZE, N),
+          std::min<int64_t>(chunks.second * KERNEL_CHUNK_SIZE, N)};
+}
+
+double* new_double_array_first_touch(ThreadPool& pool, const int64_t size) {
+  const int64_t rounded_size = (size + 3) & ~3;
+  double* array = static_cast<double*>(_mm_malloc(sizeof(double) * rounded_size, 64));
+  pool.run([&](int t) {
+    auto range = kernel_worker_range(rounded_size, t, pool.size());
+    std::fill(array + range.first, array + range.second, 0.0);
+  });
+  return array;
+}
+
+// Calls kernel(begin, size, k, prod1, prod2) for the chunks of particles [begin, begin+size), with k=size if the
+// excluded particle is not in the chunk.
+template<class Kernel>
+static void kernel_parallel(
+        ThreadPool& pool,
+        const long int N,
+        const long int k,
+        LargeExponentFloat& prod1,
+        LargeExponentFloat& prod2,
+        Kernel kernel
+) {
+  if (N < PARALLEL_KERNEL_MIN_N) {
+    kernel(0, N, k, prod1, prod2);
+    return;
+  }
+
+  const size_t num_chunks = (N + KERNEL_CHUNK_SIZE - 1) / KERNEL_CHUNK_SIZE;
+  std::vector<LargeExponentFloat> partials1(num_chunks, LargeExponentFloat(1.0));
+  std::vector<LargeExponentFloat> partials2(num_chunks, LargeExponentFloat(1.0));
+  pool.run([&](int t) {
+    const auto chunks = shard_chunk_range(num_chunks, t, pool.size());
+    for (size_t i = chunks.first; i < chunks.second; i++) {
+      const int64_t begin = i * KERNEL_CHUNK_SIZE;
+      const int64_t size = std::min(KERNEL_CHUNK_SIZE, N - begin);
+      const int64_t chunk_k = k >= begin && k < begin + size ? k - begin : size;
+      kernel(begin, size, chunk_k, partials1[i], partials2[i]);
+    }
+  });
+  prod1 = save_mul(prod1, merge_tree(partials1));
+  prod2 = save_mul(prod2, merge_tree(partials2));
+}
+
+void prod_diff_realrealvec_parallel(
+        ThreadPool& pool,
+        const long int N,
+        const long int k,
+        const double u1,
+        const double u2,
+        const double* x,
+        LargeExponentFloat& prod1,
+        LargeExponentFloat& prod2
+) {
+  kernel_parallel(pool, N, k, prod1, prod2, [&](int64_t begin, int64_t size, int64_t chunk_k,
+                                                LargeExponentFloat& chunk_prod1, LargeExponentFloat& chunk_prod2) {
+    prod_diff_realrealvec(size, chunk_k, u1, u2, x + begin, chunk_prod1, chunk_prod2);
+  });
+}
+
+void prod_dist2_complexcomplexvec_parallel(
+        ThreadPool& pool,
+        const long int N,
+        const long int k,
+        const double u1,
+        const double u2,
+        const double v1,
+        const double v2,
+        const double* x,
+        const double* y,
+        LargeExponentFloat& prod1,
+        LargeExponentFloat& prod2
+) {
+  kernel_parallel(pool, N, k, prod1, prod2, [&](int64_t begin, int64_t size, int64_t chunk_k,
+                                                LargeExponentFloat& chunk_prod1, LargeExponentFloat& chunk_prod2) {
+    prod_dist2_complexcomplexvec(size, chunk_k, u1, u2, v1, v2, x + begin, y + begin, chunk_prod1, chunk_prod2);
+  });
+}
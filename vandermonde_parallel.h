@@ -0,0 +1,169 @@
+#ifndef VANDERMONDE_PARALLEL_H
+#define VANDERMONDE_PARALLEL_H
+
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+#include "large_product.h"
+#include "thread_pool.h"
+
+// Number of differences that are multiplied into one chunk. The decomposition into chunks only depends on N (and not
+// on the number of threads), so the rounding of the final result is independent of how the chunks are scheduled.
+constexpr const int64_t PAIRS_PER_CHUNK = 1 << 16;
+
+// Range of rows [begin_row, end_row) of the triangle j>k that is computed as one chunk. Rows are processed in steps of
+// two (the same way as in vandermonde_real), so begin_row is always even (except for the last single row).
+struct TriangleChunk {
+  int64_t begin_row;
+  int64_t end_row;
+};
+
+// Splits the triangle of N particles into chunks of approximately PAIRS_PER_CHUNK differences each.
+std::vector<TriangleChunk> triangle_chunks(const long int N);
+
+// Multiplies the partial products in a fixed binary tree order: ((p0*p1)*(p2*p3))*... The result only depends on the
+// order of the partial products.
+LargeExponentFloat merge_tree(std::vector<LargeExponentFloat> partials);
+
+// Same as vandermonde_real but computed in parallel with num_threads threads (0 uses all hardware threads).
+// The result is bitwise identical for any number of threads.
+void vandermonde_real_parallel(
+        const long int N,
+        const double* x,
+        LargeExponentFloat& prod,
+        const int num_threads = 0
+);
+
+// Same as vandermonde_abs2_complex but computed in parallel with num_threads threads (0 uses all hardware threads).
+// The result is bitwise identical for any number of threads.
+void vandermonde_abs2_complex_parallel(
+        const long int N,
+        const double* x,
+        const double* y,
+        LargeExponentFloat& prod,
+        const int num_threads = 0
+);
+
+// The product of the differences of one chunk of vandermonde_real / vandermonde_abs2_complex.
+LargeExponentFloat vandermonde_real_chunk(const long int N, const double* x, const TriangleChunk& chunk);
+
+LargeExponentFloat vandermonde_abs2_complex_chunk(
+        const long int N,
+        const double* x,
+        const double* y,
+        const TriangleChunk& chunk
+);
+
+/*
+ * Sharding of one determinant across processes or machines.
+ *
+ * Shard s of S computes the contiguous range shard_chunk_range(chunks, s, S) of the chunks of triangle_chunks(N), and
+ * keeps the partial product of each chunk with its index. merge_shards puts the partials of all shards back in chunk
+ * order and multiplies them with merge_tree, so the result is bitwise identical to vandermonde_real_parallel or
+ * vandermonde_abs2_complex_parallel for any number of shards and threads.
+ *
+ * Shards are written as text with the significands as hex floats, so they are exact and portable:
+ *   large-product-shard 2
+ *   <real|complex> <positions checksum as 16 hex digits> <N> <number of chunks> <number of partials>
+ *   <chunk index> <significand as %a> <exponent>     (one line per partial)
+ * The kind and the checksum let merge_shards reject shards of different particles of the same N.
+ */
+
+constexpr const char* SHARD_FORMAT = "large-product-shard 2";
+
+struct ShardResult {
+  bool is_complex = false;
+  uint64_t positions_checksum = 0;
+  long int N = 0;
+  size_t num_chunks = 0;
+  std::vector<std::pair<size_t, LargeExponentFloat>> partials;
+};
+
+// 64 bit FNV-1a hash of the bit patterns of x[0..N) (and y[0..N) if y is not nullptr), the same on every machine.
+uint64_t positions_checksum(const long int N, const double* x, const double* y = nullptr);
+
+// Chunks [first, second) of shard (0 <= shard < num_shards). The ranges of all shards cover all chunks once.
+std::pair<size_t, size_t> shard_chunk_range(const size_t num_chunks, const int shard, const int num_shards);
+
+ShardResult vandermonde_real_shard(
+        const long int N,
+        const double* x,
+        const int shard,
+        const int num_shards,
+        const int num_threads = 0
+);
+
+ShardResult vandermonde_abs2_complex_shard(
+        const long int N,
+        const double* x,
+        const double* y,
+        const int shard,
+        const int num_shards,
+        const int num_threads = 0
+);
+
+// Exact text form of f: the significand as hex float and the exponent.
+std::string serialize(const LargeExponentFloat& f);
+
+// Parses the output of serialize, returns false if the text is malformed.
+bool deserialize(const std::string& text, LargeExponentFloat& f);
+
+void write_shard(std::ostream& os, const ShardResult& shard);
+
+// Returns false if the input is not a valid shard.
+bool read_shard(std::istream& is, ShardResult& shard);
+
+// Multiplies prod with the merged product of the shards. Returns false (and leaves prod unchanged) if the shards do
+// not belong to the same determinant (kind, positions checksum, N) or do not contain every chunk exactly once.
+bool merge_shards(const std::vector<ShardResult>& shards, LargeExponentFloat& prod);
+
+
+/*
+ * Parallel versions of single kernel calls for large N. The particles are split into chunks of KERNEL_CHUNK_SIZE
+ * elements, worker t of the pool always processes the chunks kernel_worker_range(N, t, pool.size()), and the partial
+ * products of the chunks are merged with merge_tree. The result only depends on N, not on the size of the pool. Below
+ * PARALLEL_KERNEL_MIN_N particles the kernel is called directly in the calling thread, as waking up the workers costs
+ * more than the kernel saves.
+ *
+ * Arrays allocated with new_double_array_first_touch are first written by the worker that later reads them, so on
+ * NUMA systems each chunk is stored on the node of its worker (with the default first touch policy and a pinned pool).
+ */
+
+constexpr const int64_t KERNEL_CHUNK_SIZE = 1 << 14;
+constexpr const int64_t PARALLEL_KERNEL_MIN_N = 1 << 16;
+
+// Range of particles [first, second) of worker t (0 <= t < num_threads) in the parallel kernels.
+std::pair<int64_t, int64_t> kernel_worker_range(const int64_t N, const int t, const int num_threads);
+
+// Like new_double_array (but initialized to 0), with the pages of each worker range first touched by its worker.
+double* new_double_array_first_touch(ThreadPool& pool, const int64_t size);
+
+void prod_diff_realrealvec_parallel(
+        ThreadPool& pool,
+        const long int N,
+        const long int k,
+        const double u1,
+        const double u2,
+        const double* x,
+        LargeExponentFloat& prod1,
+        LargeExponentFloat& prod2
+);
+
+void prod_dist2_complexcomplexvec_parallel(
+        ThreadPool& pool,
+        const long int N,
+        const long int k,
+        const double u1,
+        const double u2,
+        const double v1,
+        const double v2,
+        const double* x,
+        const double* y,
+        LargeExponentFloat& prod1,
+        LargeExponentFloat& prod2
+);
+
+#endif